@@ -2,6 +2,7 @@
 
 #include "Base/Base.h"
 #include "Math/Math.h"
+#include "Common/Log.h"
 
 static int32 s_InstanceID = 0;
 
@@ -13,6 +14,27 @@ Object3D::Object3D()
 
 // -----------------------------------------------------
 
+bool ValidateTexelCapacity(const char* table, int64 count, IndexAddressing& addressing)
+{
+    int64 capacity = (int64)kMaxPackedTexWidth * kMaxPackedTexWidth;
+
+    if (count > MAX_int32)
+    {
+        LOGE("%s: %lld entries do not fit 32 bit indices.\n", table, (long long)count);
+        return false;
+    }
+
+    if (addressing == IndexAddressing::EPackedXY && count > capacity)
+    {
+        LOGW("%s: %lld entries exceed the packed texture capacity of %lld, using linear addressing.\n", table, (long long)count, (long long)capacity);
+        addressing = IndexAddressing::ELinear;
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------
+
 void Cross(const float* a, const float* b, float* r)
 {
     r[0] = a[1] * b[2] - a[2] * b[1];
@@ -9,6 +9,8 @@
 #include "Math/Bounds3D.h"
 #include "Math/Matrix4x4.h"
 #include "Bvh/SplitBvh.h"
+#include "Bvh/LBvh.h"
+#include "Misc/ScratchVector.h"
 
 struct Light;
 struct Image;
@@ -20,6 +22,7 @@ struct Object3D;
 struct Scene3D;
 
 class  Camera;
+class  MeshCache;
 
 typedef std::shared_ptr<Scene3D>    Scene3DPtr;
 typedef std::vector<Scene3DPtr>     Scene3DArray;
@@ -56,6 +59,110 @@ enum class DebugMode
     ERayDir    = 11
 };
 
+// Bottom level acceleration structure builder of a mesh
+enum class BvhBuilder
+{
+    ESplitBvh  = 0,     // SAH with spatial splits, best trace performance
+    ELinearBvh = 1      // Morton code LBVH, fastest build for interactive edits
+};
+
+// Named trade-offs between build time and trace performance of the bottom level builders
+enum class BvhQuality
+{
+    EFast        = 0,   // Coarse binning and large leaves, for meshes that are rebuilt often
+    EBalanced    = 1,   // Default settings
+    EHighQuality = 2    // Spatial splits near the root, for final renders
+};
+
+// Parameters of the bottom level builders, stored with cached BVHs to detect stale ones
+struct BvhBuildSettings
+{
+    float                   traversalCost = 2.0f;
+    int32                   numBins = 64;
+    int32                   maxSplitDepth = 0;
+    // Spatial splits are tried when the object split children overlap by more than this part of the root area
+    float                   minOverlap = 0.001f;
+    float                   extraRefsBudget = 2.5f;
+    // Leaves up to this size are kept when they are cheaper than a split, see Bvh::SetMaxLeafSize
+    int32                   maxLeafSize = 4;
+
+    static BvhBuildSettings FromQuality(BvhQuality quality)
+    {
+        BvhBuildSettings settings;
+
+        switch (quality)
+        {
+            case BvhQuality::EFast:
+            {
+                settings.numBins     = 16;
+                settings.maxLeafSize = 8;
+                break;
+            }
+            case BvhQuality::EHighQuality:
+            {
+                settings.maxSplitDepth = 16;
+                settings.minOverlap    = 0.00001f;
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+
+        return settings;
+    }
+
+    bool operator == (const BvhBuildSettings& other) const
+    {
+        return traversalCost == other.traversalCost && numBins == other.numBins && maxSplitDepth == other.maxSplitDepth &&
+               minOverlap == other.minOverlap && extraRefsBudget == other.extraRefsBudget && maxLeafSize == other.maxLeafSize;
+    }
+};
+
+// How the flattened scene tables refer to each other.
+// EPackedXY stores texel coordinates as (x << 12) | y, which limits a table to 4096 * 4096 entries.
+// ELinear stores plain indices for buffer textures or storage buffers and is only limited by memory.
+enum class IndexAddressing
+{
+    EPackedXY = 0,
+    ELinear   = 1
+};
+
+// Rows of a square texture EPackedXY can address
+static const int32 kMaxPackedTexWidth = 1 << 12;
+
+FORCEINLINE int32 PackTexelIndex(int32 index, int32 texWidth, IndexAddressing addressing)
+{
+    if (addressing == IndexAddressing::ELinear)
+    {
+        return index;
+    }
+
+    return ((index % texWidth) << 12) | (index / texWidth);
+}
+
+// Inverse of PackTexelIndex
+FORCEINLINE int32 UnpackTexelIndex(int32 packed, int32 texWidth, IndexAddressing addressing)
+{
+    if (addressing == IndexAddressing::ELinear)
+    {
+        return packed;
+    }
+
+    return (packed & 0xFFF) * texWidth + (packed >> 12);
+}
+
+// Side of the square texture holding count texels
+FORCEINLINE int32 GetSquareTexWidth(int64 count)
+{
+    return (int32)(MMath::Sqrt((float)count) + 1);
+}
+
+// Checks that a table of count texels is addressable, switches EPackedXY to ELinear when it is not.
+// False when no addressing reaches every texel, the indices would wrap past 32 bits.
+bool ValidateTexelCapacity(const char* table, int64 count, IndexAddressing& addressing);
+
 struct RendererNode
 {
     int32                   nodeID = -1;
@@ -188,6 +295,10 @@ struct Mesh
     std::string             name;
     Object3DPtr             node = nullptr;
     std::shared_ptr<Bvh>    bvh = nullptr;
+    BvhBuilder              bvhBuilder = BvhBuilder::ESplitBvh;
+    BvhBuildSettings        bvhSettings;
+    // Set after positions changed, the next BLAS update refits the bvh
+    bool                    bvhDirty = false;
     int32                   material = -1;
     Bounds3D                aabb = Bounds3D(Vector3(0.0f, 0.0f, 0.0f), Vector3(0.0f, 0.0f, 0.0f));
     std::vector<uint32>     indices;
@@ -196,11 +307,29 @@ struct Mesh
     std::vector<Vector2>    uvs;
     std::vector<Vector4>    tangents;
     std::vector<Vector4>    colors;
+    // Out-of-core meshes keep their streams in store and only page them in while they are used,
+    // see MeshCache::PageIn. The bvh and the bounds stay resident.
+    std::shared_ptr<MeshCache> store = nullptr;
+    int32                   storeIndex = -1;
+    bool                    resident = true;
+    int32                   numVertices = 0;
+    int32                   numIndices = 0;
+
+    // Stream sizes, also valid while the streams are paged out
+    FORCEINLINE int32 NumVertices() const
+    {
+        return resident ? (int32)positions.size() : numVertices;
+    }
 
-    void BuildBVH()
+    FORCEINLINE int32 NumIndices() const
+    {
+        return resident ? (int32)indices.size() : numIndices;
+    }
+
+    void CalcTriangleBounds(std::vector<Bounds3D>& bounds) const
     {
         const int32 numTris = (int32)indices.size() / 3;
-        std::vector<Bounds3D> bounds(numTris);
+        bounds.resize(numTris);
 
         for (int32 i = 0; i < numTris; ++i)
         {
@@ -209,16 +338,81 @@ struct Mesh
             uint32 idx2 = indices[i * 3 + 2];
 
             const auto& p0 = positions[idx0];
-            const auto& p1 = positions[idx0];
-            const auto& p2 = positions[idx0];
+            const auto& p1 = positions[idx1];
+            const auto& p2 = positions[idx2];
 
-            bounds[i].Expand(p0);
+            bounds[i] = Bounds3D(p0);
             bounds[i].Expand(p1);
             bounds[i].Expand(p2);
         }
+    }
 
-        bvh = std::make_shared<SplitBvh>(2.0f, 64, 0, 0.001f, 2.5f);
+    // Takes effect with the next BuildBVH
+    void SetBvhQuality(BvhQuality quality)
+    {
+        bvhBuilder  = BvhBuilder::ESplitBvh;
+        bvhSettings = BvhBuildSettings::FromQuality(quality);
+    }
+
+    // With a pool the build is split into tasks, the resulting tree is the same.
+    // A cancelled build leaves a valid but poor bvh, see Bvh::SetCancellationToken
+    void BuildBVH(TaskThreadPool* pool = nullptr, const CancellationToken* cancellation = nullptr)
+    {
+        ScratchVector<Bounds3D> bounds;
+        CalcTriangleBounds(*bounds);
+
+        const int32 numTris = (int32)bounds->size();
+
+        std::shared_ptr<SplitBvh> splitBvh = nullptr;
+        if (bvhBuilder == BvhBuilder::ELinearBvh)
+        {
+            bvh = std::make_shared<LBvh>(bvhSettings.traversalCost);
+        }
+        else
+        {
+            // Spatial splits clip the triangles, not their bounds
+            splitBvh = std::make_shared<SplitBvh>(bvhSettings.traversalCost, bvhSettings.numBins, bvhSettings.maxSplitDepth, bvhSettings.minOverlap, bvhSettings.extraRefsBudget);
+            splitBvh->SetTriangles(&positions[0], &indices[0]);
+            bvh = splitBvh;
+        }
+
+        bvh->SetMaxLeafSize(bvhSettings.maxLeafSize);
+
+        bvh->SetTaskPool(pool);
+        bvh->SetCancellationToken(cancellation);
         bvh->Build(&bounds[0], numTris);
+        bvh->SetCancellationToken(nullptr);
+
+        if (splitBvh)
+        {
+            splitBvh->SetTriangles(nullptr, nullptr);
+        }
+
+        bvhDirty = false;
+    }
+
+    // Refits the bvh to the current positions, cheaper than a build for deforming meshes.
+    // Falls back to a full build once the SAH cost grew by more than maxCostRatio.
+    void RefitBVH(TaskThreadPool* pool = nullptr, float maxCostRatio = 2.0f)
+    {
+        if (bvh == nullptr)
+        {
+            BuildBVH(pool);
+            return;
+        }
+
+        ScratchVector<Bounds3D> bounds;
+        CalcTriangleBounds(*bounds);
+
+        bvh->SetTaskPool(pool);
+        bvh->Refit(&bounds[0]);
+
+        if (bvh->GetCostRatio() > maxCostRatio)
+        {
+            BuildBVH(pool);
+        }
+
+        bvhDirty = false;
     }
 };
 
@@ -372,6 +566,8 @@ struct Object3D
 
     Matrix4x4               globalTransform;
     bool                    globalTransformDirty = true;
+    // Set with globalTransformDirty, cleared once GLScene picked up the new instance bounds
+    bool                    instanceDirty = true;
    
     const Matrix4x4& GetGlobalTransform()
     {
@@ -414,6 +610,7 @@ struct Object3D
     void InvalidTransform()
     {
         globalTransformDirty = true;
+        instanceDirty = true;
         for (size_t i = 0; i < children.size(); ++i)
         {
             children[i]->InvalidTransform();
@@ -25,9 +25,15 @@ THE SOFTWARE.
 #include <numeric>
 
 #include "Bvh/Bvh.h"
+#include "Job/TaskGroup.h"
+#include "Job/TaskThreadPool.h"
+#include "Job/CancellationToken.h"
 #include "Math/Vector3.h"
+#include "Misc/ScratchVector.h"
 
-static const int32 kMaxPrimitivesPerLeaf = 1;
+static const int32 kMinPrimsPerBinningTask = 16 * 1024;
+// Levels of the tree refitted as separate tasks
+static const int32 kParallelRefitLevels = 4;
 
 static bool IsNaN(float v)
 {
@@ -36,6 +42,8 @@ static bool IsNaN(float v)
 
 void Bvh::Build(const Bounds3D* bounds, int32 numbounds)
 {
+    m_Bounds = Bounds3D();
+
     for (int32 i = 0; i < numbounds; ++i)
     {
         // Calc bbox
@@ -43,6 +51,409 @@ void Bvh::Build(const Bounds3D* bounds, int32 numbounds)
     }
 
     BuildImpl(bounds, numbounds);
+
+    // Builders reserve 2 * n - 1 nodes per subtree, multi primitive leaves leave holes
+    CompactNodes();
+
+    // New topology, links are rebuilt on demand
+    m_RefitNodes.clear();
+
+    m_BuildCost = m_Cost = m_Root ? CalcCost(m_Root) / m_Root->bounds.Area() : 0.f;
+}
+
+void Bvh::Refit(const Bounds3D* bounds)
+{
+    if (m_Root == nullptr)
+    {
+        return;
+    }
+
+    float cost = RefitNode(m_Root, bounds, 0);
+
+    m_Bounds = m_Root->bounds;
+    m_Cost   = cost / m_Root->bounds.Area();
+}
+
+void Bvh::RefitPrimitives(const Bounds3D* bounds, const int32* prims, int32 numprims, std::vector<int32>* changednodes)
+{
+    if (m_Root == nullptr || numprims == 0)
+    {
+        return;
+    }
+
+    if (m_RefitNodes.empty())
+    {
+        InitRefitLinks();
+    }
+
+    if (++m_RefitStamp == std::numeric_limits<int32>::max())
+    {
+        std::fill(m_RefitStamps.begin(), m_RefitStamps.end(), 0);
+        m_RefitStamp = 1;
+    }
+
+    // Queue the leaves and every ancestor once, stop at the first ancestor already queued
+    std::vector<int32> dirty;
+    for (int32 i = 0; i < numprims; ++i)
+    {
+        int32 prim = prims[i];
+        for (int32 j = m_RefitLeafStarts[prim]; j < m_RefitLeafStarts[prim + 1]; ++j)
+        {
+            for (int32 id = m_RefitLeaves[j]; id >= 0 && m_RefitStamps[id] != m_RefitStamp; id = m_RefitParents[id])
+            {
+                m_RefitStamps[id] = m_RefitStamp;
+                dirty.push_back(id);
+            }
+        }
+    }
+
+    // Children have larger preorder ids than their parents
+    std::sort(dirty.begin(), dirty.end(), std::greater<int32>());
+
+    float cost = m_Cost * m_Root->bounds.Area();
+
+    for (size_t i = 0; i < dirty.size(); ++i)
+    {
+        Node* node = m_RefitNodes[dirty[i]];
+
+        cost -= CalcNodeCost(node);
+
+        if (node->type == kLeaf)
+        {
+            node->bounds = Bounds3D();
+
+            for (int32 j = 0; j < node->numprims; ++j)
+            {
+                node->bounds.Expand(bounds[m_PackedIndices[node->startidx + j]]);
+            }
+        }
+        else
+        {
+            node->bounds = Bounds3D::Union(node->lc->bounds, node->rc->bounds);
+        }
+
+        cost += CalcNodeCost(node);
+    }
+
+    m_Bounds = m_Root->bounds;
+    m_Cost   = cost / m_Root->bounds.Area();
+
+    if (changednodes)
+    {
+        changednodes->swap(dirty);
+    }
+}
+
+void Bvh::InitRefitLinks()
+{
+    m_RefitNodes.clear();
+    m_RefitParents.clear();
+
+    // Same numbering as BvhTranslator, the node itself, then its left and right subtrees
+    std::vector<std::pair<Node*, int32>> stack;
+    stack.push_back(std::make_pair(m_Root, -1));
+
+    while (!stack.empty())
+    {
+        Node* node   = stack.back().first;
+        int32 parent = stack.back().second;
+        int32 id     = (int32)m_RefitNodes.size();
+        stack.pop_back();
+
+        m_RefitNodes.push_back(node);
+        m_RefitParents.push_back(parent);
+
+        if (node->type == kInternal)
+        {
+            stack.push_back(std::make_pair(node->rc, id));
+            stack.push_back(std::make_pair(node->lc, id));
+        }
+    }
+
+    int32 numprims = 0;
+    for (size_t i = 0; i < m_PackedIndices.size(); ++i)
+    {
+        numprims = std::max(numprims, m_PackedIndices[i] + 1);
+    }
+
+    // Split references can put a primitive in several leaves
+    m_RefitLeafStarts.assign(numprims + 1, 0);
+    for (size_t id = 0; id < m_RefitNodes.size(); ++id)
+    {
+        const Node* node = m_RefitNodes[id];
+        if (node->type == kLeaf)
+        {
+            for (int32 i = 0; i < node->numprims; ++i)
+            {
+                m_RefitLeafStarts[m_PackedIndices[node->startidx + i] + 1] += 1;
+            }
+        }
+    }
+
+    std::partial_sum(m_RefitLeafStarts.begin(), m_RefitLeafStarts.end(), m_RefitLeafStarts.begin());
+
+    std::vector<int32> offsets(m_RefitLeafStarts.begin(), m_RefitLeafStarts.end() - 1);
+    m_RefitLeaves.resize(m_RefitLeafStarts[numprims]);
+    for (size_t id = 0; id < m_RefitNodes.size(); ++id)
+    {
+        const Node* node = m_RefitNodes[id];
+        if (node->type == kLeaf)
+        {
+            for (int32 i = 0; i < node->numprims; ++i)
+            {
+                m_RefitLeaves[offsets[m_PackedIndices[node->startidx + i]]++] = (int32)id;
+            }
+        }
+    }
+
+    m_RefitStamps.assign(m_RefitNodes.size(), 0);
+    m_RefitStamp = 0;
+}
+
+void Bvh::Export(std::vector<FlatNode>& nodes) const
+{
+    nodes.clear();
+
+    if (m_Root == nullptr)
+    {
+        return;
+    }
+
+    struct StackEntry
+    {
+        const Node* node;
+        int32 parent;
+        bool right;
+    };
+
+    std::vector<StackEntry> stack;
+    stack.push_back({ m_Root, -1, false });
+
+    while (!stack.empty())
+    {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+
+        int32 id = (int32)nodes.size();
+        if (entry.parent >= 0)
+        {
+            (entry.right ? nodes[entry.parent].right : nodes[entry.parent].left) = id;
+        }
+
+        FlatNode flat;
+        flat.bmin = entry.node->bounds.min;
+        flat.bmax = entry.node->bounds.max;
+
+        if (entry.node->type == kLeaf)
+        {
+            flat.leaf  = 1;
+            flat.left  = entry.node->startidx;
+            flat.right = entry.node->numprims;
+        }
+        else
+        {
+            flat.leaf  = 0;
+            flat.left  = -1;
+            flat.right = -1;
+            stack.push_back({ entry.node->rc, id, true });
+            stack.push_back({ entry.node->lc, id, false });
+        }
+
+        nodes.push_back(flat);
+    }
+}
+
+bool Bvh::Import(const FlatNode* nodes, int32 numnodes, const int32* indices, int32 numindices, int32 numprims)
+{
+    if (numnodes < 0 || numindices < 0)
+    {
+        return false;
+    }
+
+    // Children follow their parent in preorder, which also rules out cycles
+    for (int32 i = 0; i < numnodes; ++i)
+    {
+        const FlatNode& node = nodes[i];
+        bool valid = node.leaf ?
+            node.left >= 0 && node.right >= 0 && node.left <= numindices - node.right :
+            node.left > i && node.left < numnodes && node.right > i && node.right < numnodes;
+
+        if (!valid)
+        {
+            return false;
+        }
+    }
+
+    for (int32 i = 0; i < numindices; ++i)
+    {
+        if (indices[i] < 0 || indices[i] >= numprims)
+        {
+            return false;
+        }
+    }
+
+    m_Nodes.resize(numnodes);
+    m_Nodecnt = numnodes;
+    m_PackedIndices.assign(indices, indices + numindices);
+    m_RefitNodes.clear();
+
+    std::vector<int32> levels(numnodes, 0);
+    m_Height = 0;
+
+    // Parents come before their children in preorder
+    for (int32 i = 0; i < numnodes; ++i)
+    {
+        Node& node  = m_Nodes[i];
+        // Assigned directly, the Bounds3D constructor would sort the corners of empty boxes
+        node.bounds.min = nodes[i].bmin;
+        node.bounds.max = nodes[i].bmax;
+        node.index      = 0;
+
+        m_Height = std::max(m_Height, levels[i]);
+
+        if (nodes[i].leaf)
+        {
+            node.type     = kLeaf;
+            node.startidx = nodes[i].left;
+            node.numprims = nodes[i].right;
+        }
+        else
+        {
+            node.type = kInternal;
+            node.lc   = &m_Nodes[nodes[i].left];
+            node.rc   = &m_Nodes[nodes[i].right];
+            levels[nodes[i].left]  = levels[i] + 1;
+            levels[nodes[i].right] = levels[i] + 1;
+        }
+    }
+
+    m_Root   = numnodes > 0 ? &m_Nodes[0] : nullptr;
+    m_Bounds = m_Root ? m_Root->bounds : Bounds3D();
+
+    m_BuildCost = m_Cost = m_Root ? CalcCost(m_Root) / m_Root->bounds.Area() : 0.f;
+
+    return true;
+}
+
+float Bvh::RefitNode(Node* node, const Bounds3D* bounds, int32 level)
+{
+    if (node->type == kLeaf)
+    {
+        node->bounds = Bounds3D();
+
+        for (int32 i = 0; i < node->numprims; ++i)
+        {
+            node->bounds.Expand(bounds[m_PackedIndices[node->startidx + i]]);
+        }
+
+        return node->bounds.Area() * node->numprims;
+    }
+
+    float leftcost  = 0.f;
+    float rightcost = 0.f;
+
+    // Only the top levels of large trees are worth splitting into tasks
+    if (m_TaskPool && level < kParallelRefitLevels && (int32)m_PackedIndices.size() >= 2 * m_MinParallelPrims)
+    {
+        TaskGroup group(m_TaskPool);
+        group.Run([&]() {
+            rightcost = RefitNode(node->rc, bounds, level + 1);
+        });
+
+        leftcost = RefitNode(node->lc, bounds, level + 1);
+        group.Wait();
+    }
+    else
+    {
+        leftcost  = RefitNode(node->lc, bounds, level + 1);
+        rightcost = RefitNode(node->rc, bounds, level + 1);
+    }
+
+    node->bounds = Bounds3D::Union(node->lc->bounds, node->rc->bounds);
+
+    return m_TraversalCost * node->bounds.Area() + leftcost + rightcost;
+}
+
+float Bvh::CalcCost(const Node* node) const
+{
+    if (node->type == kLeaf)
+    {
+        return CalcNodeCost(node);
+    }
+
+    return CalcNodeCost(node) + CalcCost(node->lc) + CalcCost(node->rc);
+}
+
+float Bvh::CalcNodeCost(const Node* node) const
+{
+    if (node->type == kLeaf)
+    {
+        return node->bounds.Area() * node->numprims;
+    }
+
+    return m_TraversalCost * node->bounds.Area();
+}
+
+void Bvh::CompactNodes()
+{
+    if (m_Root == nullptr)
+    {
+        return;
+    }
+
+    struct StackEntry
+    {
+        Node* node;
+        int32 parent;
+        bool right;
+    };
+
+    // Reachable nodes in preorder, the order Export writes
+    std::vector<StackEntry> preorder;
+    preorder.reserve(m_Nodecnt);
+
+    std::vector<StackEntry> stack;
+    stack.push_back({ m_Root, -1, false });
+
+    while (!stack.empty())
+    {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+
+        int32 id = (int32)preorder.size();
+        preorder.push_back(entry);
+
+        if (entry.node->type != kLeaf)
+        {
+            stack.push_back({ entry.node->rc, id, true });
+            stack.push_back({ entry.node->lc, id, false });
+        }
+    }
+
+    const int32 numnodes = (int32)preorder.size();
+    if (numnodes == m_Nodecnt)
+    {
+        return;
+    }
+
+    std::vector<Node> nodes(numnodes);
+    for (int32 i = 0; i < numnodes; ++i)
+    {
+        nodes[i] = *preorder[i].node;
+
+        if (preorder[i].parent >= 0)
+        {
+            Node& parent = nodes[preorder[i].parent];
+            (preorder[i].right ? parent.rc : parent.lc) = &nodes[i];
+        }
+    }
+
+    // Frees the storage of the builder, the nodes live in m_Nodes from now on
+    InitNodeAllocator(0);
+
+    m_Nodes.swap(nodes);
+    m_Nodecnt = numnodes;
+    m_Root    = &m_Nodes[0];
 }
 
 void Bvh::InitNodeAllocator(size_t maxnum)
@@ -51,29 +462,36 @@ void Bvh::InitNodeAllocator(size_t maxnum)
     m_Nodes.resize(maxnum);
 }
 
-Bvh::Node* Bvh::AllocateNode()
+Bvh::Node* Bvh::AllocateNodes(int32 count)
 {
-    return &m_Nodes[m_Nodecnt++];
+    Node* node = &m_Nodes[m_Nodecnt];
+    m_Nodecnt += count;
+    return node;
 }
 
-void Bvh::BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int32* primindices)
+bool Bvh::IsCancelled() const
 {
-    m_Height = std::max(m_Height, req.level);
+    return m_Cancellation && m_Cancellation->IsCancelled();
+}
+
+int32 Bvh::BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int32* primindices, Node* node)
+{
+    int32 height = req.level;
 
-    Node* node   = AllocateNode();
     node->bounds = req.bounds;
     node->index  = req.index;
 
     // Create leaf node if we have enough prims
-    if (req.numprims < 2)
+    // Leaves are emitted left to right, so a leaf's packed indices start at its request's startidx
+    if (req.numprims < 2 || IsCancelled())
     {
         node->type = kLeaf;
-        node->startidx = static_cast<int32>(m_PackedIndices.size());
+        node->startidx = req.startidx;
         node->numprims = req.numprims;
 
         for (auto i = 0; i < req.numprims; ++i)
         {
-            m_PackedIndices.push_back(primindices[req.startidx + i]);
+            m_PackedIndices[req.startidx + i] = primindices[req.startidx + i];
         }
     }
     else
@@ -91,15 +509,16 @@ void Bvh::BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vecto
                 axis   = ss.dim;
                 border = ss.split;
 
-                if (req.numprims < ss.sah && req.numprims < kMaxPrimitivesPerLeaf)
+                // Intersecting the primitives costs 1 each, same units as the SAH of the split
+                if (req.numprims <= m_MaxLeafSize && req.numprims <= ss.sah)
                 {
                     node->type     = kLeaf;
-                    node->startidx = static_cast<int32>(m_PackedIndices.size());
+                    node->startidx = req.startidx;
                     node->numprims = req.numprims;
 
                     for (auto i = 0; i < req.numprims; ++i)
                     {
-                        m_PackedIndices.push_back(primindices[req.startidx + i]);
+                        m_PackedIndices[req.startidx + i] = primindices[req.startidx + i];
                     }
 
                     if (req.ptr)
@@ -107,7 +526,7 @@ void Bvh::BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vecto
                         *req.ptr = node;
                     }
 
-                    return;
+                    return height;
                 }
             }
         }
@@ -229,9 +648,30 @@ void Bvh::BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vecto
         // Right request
         SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightCentroidBounds, req.level + 1, (req.index << 1) + 1 };
 
-        // Put those to stack
-        BuildNode(leftrequest, bounds, centroids, primindices);
-        BuildNode(rightrequest, bounds, centroids, primindices);
+        // Nodes are laid out depth first: left subtree follows its parent and needs at most
+        // 2 * leftprims - 1 nodes, right subtree starts right after that
+        Node* leftnode  = node + 1;
+        Node* rightnode = node + 2 * leftrequest.numprims;
+
+        if (m_TaskPool && leftrequest.numprims >= m_MinParallelPrims && rightrequest.numprims >= m_MinParallelPrims)
+        {
+            int32 rightheight = 0;
+
+            TaskGroup group(m_TaskPool);
+            group.Run([&]() {
+                rightheight = BuildNode(rightrequest, bounds, centroids, primindices, rightnode);
+            });
+
+            height = BuildNode(leftrequest, bounds, centroids, primindices, leftnode);
+            group.Wait();
+
+            height = std::max(height, rightheight);
+        }
+        else
+        {
+            height = BuildNode(leftrequest, bounds, centroids, primindices, leftnode);
+            height = std::max(height, BuildNode(rightrequest, bounds, centroids, primindices, rightnode));
+        }
     }
 
     // Set parent ptr if any
@@ -239,6 +679,8 @@ void Bvh::BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vecto
     {
         *req.ptr = node;
     }
+
+    return height;
 }
 
 Bvh::SahSplit Bvh::FindSahSplit(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int32* primindices) const
@@ -265,98 +707,204 @@ Bvh::SahSplit Bvh::FindSahSplit(const SplitRequest& req, const Bounds3D* bounds,
         return split;
     }
 
-    // Bin has bbox and occurence count
-    struct Bin
-    {
-        Bounds3D bounds;
-        int32 count;
-    };
-
     // Keep bins for each dimension
-    std::vector<Bin> bins[3];
-    bins[0].resize(m_NumBins);
-    bins[1].resize(m_NumBins);
-    bins[2].resize(m_NumBins);
+    Bin bins[3 * kMaxBins];
+
+    // Initialize bins
+    for (int32 i = 0; i < 3 * m_NumBins; ++i)
+    {
+        bins[i].count  = 0;
+        bins[i].bounds = SIMDBounds3D();
+    }
 
     // Precompute inverse parent area
     float invarea = 1.f / req.bounds.Area();
     // Precompute min point
     Vector3 rootmin = req.centroidBounds.min;
 
+    // Calc primitive refs histogram for all dimensions in a single pass.
+    // Degenerate dimensions are skipped.
+    auto binfunc = [&](Bin* axisbins, int32 first, int32 last)
+    {
+        for (int32 i = first; i < last; ++i)
+        {
+            int32 idx = primindices[i];
+
+            for (int32 axis = 0; axis < 3; ++axis)
+            {
+                float centroidRNG = centroidExtents[axis];
+                if (centroidRNG == 0.f)
+                {
+                    continue;
+                }
+
+                float invcentroidRNG = 1.f / centroidRNG;
+                int32 binidx = (int32)std::min<float>(static_cast<float>(m_NumBins) * ((centroids[idx][axis] - rootmin[axis]) * invcentroidRNG), static_cast<float>(m_NumBins - 1));
+
+                Bin& bin = axisbins[axis * m_NumBins + binidx];
+                ++bin.count;
+                bin.bounds.Expand(bounds[idx]);
+            }
+        }
+    };
+
+    int32 numtasks = GetNumBinningTasks(req.numprims);
+    if (numtasks > 1)
+    {
+        BinPrimitivesParallel(req, numtasks, &bins[0], binfunc);
+    }
+    else
+    {
+        binfunc(&bins[0], req.startidx, req.startidx + req.numprims);
+    }
+
     // Evaluate all dimensions
     for (int32 axis = 0; axis < 3; ++axis)
     {
-        float rootminc = rootmin[axis];
-        // Range for histogram
-        float centroidRNG = centroidExtents[axis];
-        float invcentroidRNG = 1.f / centroidRNG;
-
         // If the box is degenerate in that dimension skip it
-        if (centroidRNG == 0.f)
+        if (centroidExtents[axis] == 0.f)
         {
             continue;
         }
 
-        // Initialize bins
-        for (int32 i = 0; i < m_NumBins; ++i)
+        // Check if it is better than what we found so far
+        int32 binidx = FindBestSplitBin(&bins[axis * m_NumBins], req.numprims, invarea, sah);
+        if (binidx != -1)
         {
-            bins[axis][i].count = 0;
-            bins[axis][i].bounds = Bounds3D();
+            split.dim = axis;
+            splitidx = binidx;
+            split.sah = sah;
         }
+    }
 
-        // Calc primitive refs histogram
-        for (int32 i = req.startidx; i < req.startidx + req.numprims; ++i)
-        {
-            int32 idx = primindices[i];
-            int32 binidx = (int32)std::min<float>(static_cast<float>(m_NumBins) * ((centroids[idx][axis] - rootminc) * invcentroidRNG), static_cast<float>(m_NumBins - 1));
+    // Choose split plane
+    if (splitidx != -1)
+    {
+        split.split = rootmin[split.dim] + (splitidx + 1) * (centroidExtents[split.dim] / m_NumBins);
+    }
 
-            ++bins[axis][binidx].count;
-            bins[axis][binidx].bounds.Expand(bounds[idx]);
-        }
+    return split;
+}
+
+int32 Bvh::FindBestSplitBin(const Bin* bins, int32 numprims, float invarea, float& sah) const
+{
+    const int32 numsplits = m_NumBins - 1;
+    // Sweep results are kept as SoA padded to the vector width
+    const int32 stride = (numsplits + 3) & ~3;
+
+    float sweep[4 * kMaxBins];
+    std::fill(sweep, sweep + 4 * stride, 0.f);
+    float* leftarea   = &sweep[0];
+    float* rightarea  = &sweep[stride];
+    float* leftcount  = &sweep[2 * stride];
+    float* rightcount = &sweep[3 * stride];
+
+    // Start with 1-bin right box
+    SIMDBounds3D rightbox;
+    for (int32 i = m_NumBins - 1; i > 0; --i)
+    {
+        rightbox.Expand(bins[i].bounds);
+        rightarea[i - 1] = rightbox.Area();
+    }
 
-        std::vector<Bounds3D> rightbounds(m_NumBins - 1);
+    SIMDBounds3D leftbox;
+    int32 count = 0;
+    for (int32 i = 0; i < numsplits; ++i)
+    {
+        leftbox.Expand(bins[i].bounds);
+        count += bins[i].count;
 
-        // Start with 1-bin right box
-        Bounds3D rightbox;
-        for (int32 i = m_NumBins - 1; i > 0; --i)
+        leftarea[i]   = leftbox.Area();
+        leftcount[i]  = (float)count;
+        rightcount[i] = (float)(numprims - count);
+    }
+
+    // Compute SAH of all candidates, costs overwrite the left areas
+    float* cost = leftarea;
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+    const __m128 traversalCost = _mm_set1_ps(m_TraversalCost);
+    const __m128 scale         = _mm_set1_ps(invarea);
+
+    for (int32 i = 0; i < stride; i += 4)
+    {
+        __m128 left  = _mm_mul_ps(_mm_loadu_ps(leftcount + i),  _mm_loadu_ps(leftarea + i));
+        __m128 right = _mm_mul_ps(_mm_loadu_ps(rightcount + i), _mm_loadu_ps(rightarea + i));
+        _mm_storeu_ps(cost + i, _mm_add_ps(traversalCost, _mm_mul_ps(_mm_add_ps(left, right), scale)));
+    }
+#else
+    for (int32 i = 0; i < numsplits; ++i)
+    {
+        cost[i] = m_TraversalCost + (leftcount[i] * leftarea[i] + rightcount[i] * rightarea[i]) * invarea;
+    }
+#endif
+
+    // First cheapest candidate wins, same as a running comparison
+    int32 splitidx = -1;
+    for (int32 i = 0; i < numsplits; ++i)
+    {
+        if (cost[i] < sah)
         {
-            rightbox.Expand(bins[axis][i].bounds);
-            rightbounds[i - 1] = rightbox;
+            sah = cost[i];
+            splitidx = i;
         }
+    }
 
-        Bounds3D leftbox;
-        int32 leftcount = 0;
-        int32 rightcount = req.numprims;
+    return splitidx;
+}
 
-        // Start best SAH search
-        // i is current split candidate (split between i and i + 1)
-        float sahtmp = 0.f;
-        for (int32 i = 0; i < m_NumBins - 1; ++i)
-        {
-            leftbox.Expand(bins[axis][i].bounds);
-            leftcount  += bins[axis][i].count;
-            rightcount -= bins[axis][i].count;
+int32 Bvh::GetNumBinningTasks(int32 numprims) const
+{
+    if (m_TaskPool == nullptr)
+    {
+        return 1;
+    }
 
-            // Compute SAH
-            sahtmp = m_TraversalCost + (leftcount * leftbox.Area() + rightcount * rightbounds[i].Area()) * invarea;
+    // One chunk per worker and one for the calling thread at most
+    int32 numtasks = std::min(numprims / kMinPrimsPerBinningTask, m_TaskPool->GetNumThreads() + 1);
+    return std::max(numtasks, 1);
+}
 
-            // Check if it is better than what we found so far
-            if (sahtmp < sah)
-            {
-                split.dim = axis;
-                splitidx = i;
-                split.sah = sah = sahtmp;
-            }
-        }
+void Bvh::BinPrimitivesParallel(const SplitRequest& req, int32 numtasks, Bin* bins, const BinFunc& binfunc) const
+{
+    const int32 numbins = 3 * m_NumBins;
+
+    // Every chunk gets its own histograms
+    ScratchVector<Bin> taskbins(numtasks * numbins);
+    for (size_t i = 0; i < taskbins->size(); ++i)
+    {
+        taskbins[i].count  = 0;
+        taskbins[i].bounds = SIMDBounds3D();
     }
 
-    // Choose split plane
-    if (splitidx != -1)
     {
-        split.split = rootmin[split.dim] + (splitidx + 1) * (centroidExtents[split.dim] / m_NumBins);
+        TaskGroup group(m_TaskPool);
+
+        for (int32 task = 0; task < numtasks; ++task)
+        {
+            int32 first = req.startidx + (int32)((int64)req.numprims * task / numtasks);
+            int32 last  = req.startidx + (int32)((int64)req.numprims * (task + 1) / numtasks);
+            Bin*  chunk = &taskbins[task * numbins];
+
+            group.Run([&binfunc, chunk, first, last]() {
+                binfunc(chunk, first, last);
+            });
+        }
+
+        group.Wait();
     }
 
-    return split;
+    // Merge
+    for (int32 task = 0; task < numtasks; ++task)
+    {
+        const Bin* chunk = &taskbins[task * numbins];
+
+        for (int32 i = 0; i < numbins; ++i)
+        {
+            bins[i].count += chunk[i].count;
+            bins[i].bounds.Expand(chunk[i].bounds);
+        }
+    }
 }
 
 void Bvh::BuildImpl(const Bounds3D* bounds, int32 numbounds)
@@ -365,10 +913,13 @@ void Bvh::BuildImpl(const Bounds3D* bounds, int32 numbounds)
     InitNodeAllocator(2 * numbounds - 1);
 
     // Cache some stuff to have faster partitioning
-    std::vector<Vector3> centroids(numbounds);
+    ScratchVector<Vector3> centroids(numbounds);
     m_Indices.resize(numbounds);
     std::iota(m_Indices.begin(), m_Indices.end(), 0);
 
+    // Leaves write their indices in place, which lets subtrees be built concurrently
+    m_PackedIndices.resize(numbounds);
+
     // Calc bbox
     Bounds3D centroidBounds;
     for (size_t i = 0; i < static_cast<size_t>(numbounds); ++i)
@@ -380,8 +931,10 @@ void Bvh::BuildImpl(const Bounds3D* bounds, int32 numbounds)
 
     SplitRequest init = { 0, numbounds, nullptr, m_Bounds, centroidBounds, 0, 1 };
 
-    BuildNode(init, bounds, &centroids[0], &m_Indices[0]);
+    Node* root = AllocateNodes(2 * numbounds - 1);
+
+    m_Height = BuildNode(init, bounds, &centroids[0], &m_Indices[0], root);
 
     // Set root_ pointer
-    m_Root = &m_Nodes[0];
+    m_Root = root;
 }
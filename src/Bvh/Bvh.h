@@ -22,18 +22,50 @@ THE SOFTWARE.
 #pragma once
 
 #include <vector>
+#include <functional>
 
 #include "Math/Bounds3D.h"
+#include "Math/SIMDBounds3D.h"
+
+class TaskThreadPool;
+class CancellationToken;
 
 class Bvh
 {
+public:
+
+    // Pointer free node for serialization, stored in preorder
+    struct FlatNode
+    {
+        Vector3 bmin;
+        Vector3 bmax;
+        int32 leaf;
+        // Child node indices for internal nodes, startidx and numprims for leaves
+        int32 left;
+        int32 right;
+    };
+
+    // Largest leaf SetMaxLeafSize accepts. Wide nodes store the primitives of a leaf child
+    // in a uint8 below the markers 0xFE and 0xFF, see BvhTranslator::WideNode::childPrims.
+    static const int32 kMaxLeafSize = 0xFD;
+
+    // SAH bins live on the stack of the split search, larger numBins are clamped
+    static const int32 kMaxBins = 128;
+
 public:
     Bvh(float traversalCost, int32 numBins = 64, bool usesah = false)
         : m_Root(nullptr)
         , m_Usesah(usesah)
         , m_Height(0)
         , m_TraversalCost(traversalCost)
-        , m_NumBins(numBins)
+        , m_NumBins(MMath::Clamp(numBins, 2, kMaxBins))
+        , m_MaxLeafSize(1)
+        , m_TaskPool(nullptr)
+        , m_MinParallelPrims(0)
+        , m_Cancellation(nullptr)
+        , m_BuildCost(0.f)
+        , m_Cost(0.f)
+        , m_RefitStamp(0)
     {
             
     }
@@ -47,18 +79,79 @@ public:
     // bounds is an array of bounding boxes
     void Build(const Bounds3D* bounds, int32 numbounds);
 
+    // Updates node bounds bottom-up for moved primitives, the topology stays the same.
+    // bounds must describe the same primitives in the same order as passed to Build.
+    // Leaves get the whole primitive bounds, so split references of a SplitBvh lose their clipping.
+    void Refit(const Bounds3D* bounds);
+
+    // Refits only the leaves holding the numprims primitives listed in prims and their ancestors.
+    // Cost is O(numprims * height), use Refit when a large part of the primitives moved.
+    // changednodes receives the preorder ids of all updated nodes, parents after their children.
+    void RefitPrimitives(const Bounds3D* bounds, const int32* prims, int32 numprims, std::vector<int32>* changednodes = nullptr);
+
+    // Writes the tree to nodes, see Import
+    void Export(std::vector<FlatNode>& nodes) const;
+
+    // Replaces the tree with an exported one, only the child pointers are fixed up.
+    // Works for any builder, the node layout is the same for all of them.
+    // numprims is the number of primitives the tree was built over. False and the tree is left
+    // as it was when a child, a leaf range or an index is out of range.
+    bool Import(const FlatNode* nodes, int32 numnodes, const int32* indices, int32 numindices, int32 numprims);
+
+    // Parallel build mode
+    // Subtrees with at least minParallelPrims primitives on both sides of a split
+    // are built as tasks on pool. The resulting tree is identical to the serial build.
+    void SetTaskPool(TaskThreadPool* pool, int32 minParallelPrims = 4096)
+    {
+        m_TaskPool         = pool;
+        m_MinParallelPrims = minParallelPrims;
+    }
+
+    // SAH builds keep nodes with up to maxLeafSize primitives as leaves when intersecting them
+    // is cheaper than their best split. 1 gives single primitive leaves, top level trees need them.
+    void SetMaxLeafSize(int32 maxLeafSize)
+    {
+        m_MaxLeafSize = MMath::Clamp(maxLeafSize, 1, kMaxLeafSize);
+    }
+
+    // A cancelled build stops splitting and turns the remaining nodes into leaves.
+    // The tree stays valid but is slow to traverse, it is meant to be thrown away.
+    void SetCancellationToken(const CancellationToken* token)
+    {
+        m_Cancellation = token;
+    }
+
     // World space bounding box
     const Bounds3D& Bounds() const
     {
         return m_Bounds;
     }
 
+    // Get number of nodes, the size of the flattened tree
+    int32 GetNumNodes() const
+    {
+        return m_Nodecnt;
+    }
+
     // Get tree height
     int32 GetHeight() const
     {
         return m_Height;
     }
 
+    // SAH cost of the tree relative to the root area, updated by Build and Refit
+    float GetCost() const
+    {
+        return m_Cost;
+    }
+
+    // Growth of the SAH cost since the last full build, 1 means no degradation.
+    // Refitted trees get worse as primitives move, rebuild once this gets too large.
+    float GetCostRatio() const
+    {
+        return m_BuildCost > 0.f ? m_Cost / m_BuildCost : 1.f;
+    }
+
     // Get reordered prim indices Nodes are pointing to
     virtual const int32* GetIndices() const
     {
@@ -136,25 +229,65 @@ protected:
         float overlap;
     };
 
+    // Bin has bbox and occurence count
+    struct Bin
+    {
+        SIMDBounds3D bounds;
+        int32 count;
+    };
+
+    // Fills 3 * m_NumBins bins (one histogram per axis) for primitives [first, last) of a request
+    typedef std::function<void(Bin*, int32, int32)> BinFunc;
+
 protected:
 
     // Build function
     virtual void BuildImpl(const Bounds3D* bounds, int32 numbounds);
 
     // Node allocation
-    virtual Node* AllocateNode();
+    // Reserves count consecutive nodes, a subtree over n primitives never needs more than 2 * n - 1
+    virtual Node* AllocateNodes(int32 count);
 
     virtual void InitNodeAllocator(size_t maxnum);
 
-    void BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int32* primindices);
+    // Moves the reachable nodes to m_Nodes in preorder when the build left reserved nodes unused
+    void CompactNodes();
+
+    // Builds the subtree for req into node and the nodes following it, returns the subtree height
+    int32 BuildNode(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int32* primindices, Node* node);
 
     SahSplit FindSahSplit(const SplitRequest& req, const Bounds3D* bounds, const Vector3* centroids, int32* primindices) const;
 
+    // Evaluates the split candidates of one axis histogram, candidate i splits between bins i and i + 1.
+    // Returns the first candidate cheaper than sah and lowers sah to its cost, -1 if there is none.
+    int32 FindBestSplitBin(const Bin* bins, int32 numprims, float invarea, float& sah) const;
+
+    // Number of chunks a request is binned in, 1 if it is too small to bother the task pool
+    int32 GetNumBinningTasks(int32 numprims) const;
+
+    // Bins the request in numtasks chunks on the task pool and merges the chunk histograms into bins.
+    // Bins only hold min/max bounds and counts so the result does not depend on the chunking.
+    void BinPrimitivesParallel(const SplitRequest& req, int32 numtasks, Bin* bins, const BinFunc& binfunc) const;
+
+    // Refits the subtree below node and returns its unnormalized SAH cost
+    float RefitNode(Node* node, const Bounds3D* bounds, int32 level);
+
+    // Unnormalized SAH cost of the subtree below node
+    float CalcCost(const Node* node) const;
+
+    // Unnormalized SAH cost of node alone
+    float CalcNodeCost(const Node* node) const;
+
+    // Builds the preorder node table, parent links and primitive to leaf map used by RefitPrimitives
+    void InitRefitLinks();
+
+    bool IsCancelled() const;
+
     // Bvh nodes
     std::vector<Node> m_Nodes;
     // Identifiers of leaf primitives
     std::vector<int32> m_Indices;
-    // Node allocator counter, atomic for thread safety
+    // Number of nodes, reserved ones are only counted until the build compacts them
     int32 m_Nodecnt;
     // Identifiers of leaf primitives
     std::vector<int32> m_PackedIndices;
@@ -170,6 +303,28 @@ protected:
     float m_TraversalCost;
     // Number of spatial bins to use for SAH
     int32 m_NumBins;
+    // Maximum primitives per leaf of SAH builds
+    int32 m_MaxLeafSize;
+    // Pool for parallel builds, nullptr builds on the calling thread
+    TaskThreadPool* m_TaskPool;
+    // Minimum primitives per child to build it as a separate task
+    int32 m_MinParallelPrims;
+    // Polled while building, may be nullptr
+    const CancellationToken* m_Cancellation;
+    // SAH cost after the last full build
+    float m_BuildCost;
+    // Current SAH cost
+    float m_Cost;
+    // Nodes by preorder id, left child first, empty until the first RefitPrimitives call
+    std::vector<Node*> m_RefitNodes;
+    // Parent preorder id of each node, -1 for the root
+    std::vector<int32> m_RefitParents;
+    // Leaves holding primitive i are m_RefitLeaves[m_RefitLeafStarts[i] .. m_RefitLeafStarts[i + 1])
+    std::vector<int32> m_RefitLeafStarts;
+    std::vector<int32> m_RefitLeaves;
+    // Marks nodes already queued by the current RefitPrimitives call
+    std::vector<int32> m_RefitStamps;
+    int32 m_RefitStamp;
 
 private:
 
@@ -28,120 +28,442 @@ THE SOFTWARE.
 #include "Math/Math.h"
 #include "Math/Bounds3D.h"
 #include "Bvh/BvhTranslator.h"
+#include "Job/TaskGroup.h"
 
 #include <cassert>
+#include <cmath>
 #include <stack>
 #include <iostream>
+#include <algorithm>
 
-int32 BvhTranslator::ProcessBLASNodes(const Bvh::Node* node)
+// Van Emde Boas order: the top half of the levels first, then every subtree hanging below it,
+// each laid out the same way. Unbalanced subtrees are split on their own height.
+static void ComputeVanEmdeBoasSlots(const std::vector<int32>& lefts, const std::vector<int32>& rights, std::vector<int32>& slots)
 {
-    Bounds3D bbox = node->bounds;
+    const int32 numNodes = (int32)lefts.size();
 
-    bboxmin[curNode] = bbox.min;
-    bboxmax[curNode] = bbox.max;
-    nodes[curNode].leaf = 0;
+    // Children follow their parent in preorder
+    std::vector<int32> heights(numNodes, 1);
+    for (int32 id = numNodes - 1; id >= 0; --id)
+    {
+        if (lefts[id] >= 0)
+        {
+            heights[id] = 1 + std::max(heights[lefts[id]], heights[rights[id]]);
+        }
+    }
+
+    struct Block
+    {
+        int32 root;
+        int32 levels;
+    };
+
+    std::vector<Block> blocks;
+    std::vector<Block> frontier;
+    std::vector<Block> walk;
+    int32 nextSlot = 0;
+
+    blocks.push_back({ 0, heights[0] });
+
+    while (!blocks.empty())
+    {
+        Block block = blocks.back();
+        blocks.pop_back();
+
+        int32 levels = std::min(block.levels, heights[block.root]);
+        if (levels == 1)
+        {
+            slots[block.root] = nextSlot++;
+            continue;
+        }
+
+        int32 topLevels    = levels / 2;
+        int32 bottomLevels = levels - topLevels;
+
+        // Roots of the bottom blocks, left to right
+        frontier.clear();
+        walk.push_back({ block.root, 0 });
+        while (!walk.empty())
+        {
+            Block node = walk.back();
+            walk.pop_back();
 
-    int32 index = curNode;
+            if (node.levels == topLevels)
+            {
+                frontier.push_back({ node.root, bottomLevels });
+            }
+            else if (lefts[node.root] >= 0)
+            {
+                walk.push_back({ rights[node.root], node.levels + 1 });
+                walk.push_back({ lefts[node.root], node.levels + 1 });
+            }
+        }
 
-    if (node->type == Bvh::NodeType::kLeaf)
+        // Stack order, the top block is laid out first
+        blocks.insert(blocks.end(), frontier.rbegin(), frontier.rend());
+        blocks.push_back({ block.root, topLevels });
+    }
+}
+
+void BvhTranslator::FlattenTree(const Bvh::Node* root, int32 baseIndex, int32 firstPrim, bool topLevel, std::vector<int32>& slots)
+{
+    // Preorder ids with the left child first, the numbering Bvh::RefitPrimitives uses
+    std::vector<const Bvh::Node*> preorder;
+    std::vector<int32> lefts;
+    std::vector<int32> rights;
+
+    struct StackEntry
     {
-        nodes[curNode].leftIndex  = curTriIndex + node->startidx;
-        nodes[curNode].rightIndex = node->numprims;
-        nodes[curNode].leaf       = 1;
+        const Bvh::Node* node;
+        int32 parent;
+        bool right;
+    };
+
+    std::vector<StackEntry> stack;
+    stack.push_back({ root, -1, false });
+
+    while (!stack.empty())
+    {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+
+        int32 id = (int32)preorder.size();
+        preorder.push_back(entry.node);
+        lefts.push_back(-1);
+        rights.push_back(-1);
+
+        if (entry.parent >= 0)
+        {
+            (entry.right ? rights : lefts)[entry.parent] = id;
+        }
+
+        if (entry.node->type != Bvh::NodeType::kLeaf)
+        {
+            stack.push_back({ entry.node->rc, id, true });
+            stack.push_back({ entry.node->lc, id, false });
+        }
+    }
+
+    const int32 numNodes = (int32)preorder.size();
+
+    slots.resize(numNodes);
+    if (layout == BvhLayout::EVanEmdeBoas)
+    {
+        ComputeVanEmdeBoasSlots(lefts, rights, slots);
     }
     else
     {
-        curNode++;
-        nodes[index].leftIndex = ProcessBLASNodes(node->lc);
-        nodes[index].leftIndex = ((nodes[index].leftIndex % nodeTexWidth) << 12) | (nodes[index].leftIndex / nodeTexWidth);
-        curNode++;
-        nodes[index].rightIndex = ProcessBLASNodes(node->rc);
-        nodes[index].rightIndex = ((nodes[index].rightIndex % nodeTexWidth) << 12) | (nodes[index].rightIndex / nodeTexWidth);
+        for (int32 id = 0; id < numNodes; ++id)
+        {
+            slots[id] = id;
+        }
     }
 
-    return index;
+    for (int32 id = 0; id < numNodes; ++id)
+    {
+        const Bvh::Node* node = preorder[id];
+        const int32 index     = baseIndex + slots[id];
+
+        bboxmin[index] = node->bounds.min;
+        bboxmax[index] = node->bounds.max;
+
+        if (node->type != Bvh::NodeType::kLeaf)
+        {
+            nodes[index].leftIndex  = PackTexelIndex(baseIndex + slots[lefts[id]], nodeTexWidth, addressing);
+            nodes[index].rightIndex = PackTexelIndex(baseIndex + slots[rights[id]], nodeTexWidth, addressing);
+            nodes[index].leaf       = 0;
+        }
+        else if (topLevel)
+        {
+            int32 instanceIndex = TLBvh->m_PackedIndices[node->startidx];
+            int32 meshIndex     = meshInstances[instanceIndex].meshID;
+            int32 materialID    = meshInstances[instanceIndex].materialID;
+
+            nodes[index].leftIndex  = PackTexelIndex(bvhRootStartIndices[meshIndex], nodeTexWidth, addressing);
+            nodes[index].rightIndex = materialID;
+            nodes[index].leaf       = -instanceIndex - 1;
+        }
+        else
+        {
+            nodes[index].leftIndex  = firstPrim + node->startidx;
+            nodes[index].rightIndex = node->numprims;
+            nodes[index].leaf       = 1;
+        }
+    }
 }
 
-int32 BvhTranslator::ProcessTLASNodes(const Bvh::Node* node)
+template <int32 N>
+int32 BvhTranslator::CollapseNodes(const Bvh::Node* root, std::vector<WideNode<N>>& wideNodes, int32 firstPrim, bool topLevel)
 {
-    Bounds3D bbox = node->bounds;
+    struct StackEntry
+    {
+        const Bvh::Node* node;
+        int32 parent;
+        int32 slot;
+    };
 
-    bboxmin[curNode] = bbox.min;
-    bboxmax[curNode] = bbox.max;
-    nodes[curNode].leaf = 0;
+    const int32 rootIndex = (int32)wideNodes.size();
 
-    int32 index = curNode;
+    std::vector<StackEntry> stack;
+    stack.push_back({ root, -1, 0 });
 
-    if (node->type == Bvh::NodeType::kLeaf)
+    while (!stack.empty())
     {
-        int32 instanceIndex = TLBvh->m_PackedIndices[node->startidx];
-        int32 meshIndex     = meshInstances[instanceIndex].meshID;
-        int32 materialID    = meshInstances[instanceIndex].materialID;
+        StackEntry entry = stack.back();
+        stack.pop_back();
+
+        const Bvh::Node* node = entry.node;
+
+        // Open the internal child with the largest surface area until all N slots are used
+        const Bvh::Node* children[N];
+        int32 numChildren = 0;
+
+        if (node->type == Bvh::NodeType::kLeaf)
+        {
+            children[numChildren++] = node;
+        }
+        else
+        {
+            children[numChildren++] = node->lc;
+            children[numChildren++] = node->rc;
+
+            while (numChildren < N)
+            {
+                int32 best     = -1;
+                float bestArea = -1.0f;
+
+                for (int32 i = 0; i < numChildren; ++i)
+                {
+                    if (children[i]->type != Bvh::NodeType::kLeaf && children[i]->bounds.Area() > bestArea)
+                    {
+                        best     = i;
+                        bestArea = children[i]->bounds.Area();
+                    }
+                }
+
+                if (best < 0)
+                {
+                    break;
+                }
+
+                const Bvh::Node* child = children[best];
+                children[best]          = child->lc;
+                children[numChildren++] = child->rc;
+            }
+        }
+
+        Bounds3D bounds;
+        for (int32 i = 0; i < numChildren; ++i)
+        {
+            bounds.Expand(children[i]->bounds);
+        }
+
+        int32 index = (int32)wideNodes.size();
+        wideNodes.push_back(WideNode<N>());
+
+        if (entry.parent >= 0)
+        {
+            wideNodes[entry.parent].childIndex[entry.slot] = index;
+        }
+
+        WideNode<N>& wide = wideNodes[index];
+        wide.origin      = bounds.min;
+        wide.numChildren = (uint8)numChildren;
 
-        nodes[curNode].leftIndex  = (bvhRootStartIndices[meshIndex] % nodeTexWidth) << 12 | (bvhRootStartIndices[meshIndex] / nodeTexWidth);
-        nodes[curNode].rightIndex = materialID;
-        nodes[curNode].leaf       = -instanceIndex - 1;
+        // Smallest power of two step that covers the extent in 255 steps
+        double scales[3];
+        for (int32 axis = 0; axis < 3; ++axis)
+        {
+            int32 exponent = 0;
+            std::frexp((bounds.max[axis] - bounds.min[axis]) / 255.0f, &exponent);
+            exponent = MMath::Clamp(exponent, -128, 127);
+
+            wide.exponent[axis] = (int8)exponent;
+            scales[axis] = std::ldexp(1.0, -exponent);
+        }
+
+        for (int32 i = 0; i < N; ++i)
+        {
+            if (i >= numChildren)
+            {
+                for (int32 axis = 0; axis < 3; ++axis)
+                {
+                    wide.qmin[axis][i] = 0;
+                    wide.qmax[axis][i] = 0;
+                }
+                wide.childIndex[i] = -1;
+                wide.childPrims[i] = kEmptyChild;
+                continue;
+            }
+
+            // Differences of floats are exact in double, rounding then only ever grows the box
+            const Bvh::Node* child = children[i];
+            for (int32 axis = 0; axis < 3; ++axis)
+            {
+                double lo = std::floor(((double)child->bounds.min[axis] - wide.origin[axis]) * scales[axis]);
+                double hi = std::ceil(((double)child->bounds.max[axis] - wide.origin[axis]) * scales[axis]);
+                wide.qmin[axis][i] = (uint8)std::max(0.0, std::min(255.0, lo));
+                wide.qmax[axis][i] = (uint8)std::max(0.0, std::min(255.0, hi));
+            }
+
+            if (child->type == Bvh::NodeType::kLeaf)
+            {
+                wide.childIndex[i] = topLevel ? TLBvh->m_PackedIndices[child->startidx] : firstPrim + child->startidx;
+                wide.childPrims[i] = (uint8)child->numprims;
+            }
+            else
+            {
+                // Index is patched in once the child is emitted
+                wide.childIndex[i] = -1;
+                wide.childPrims[i] = kInternalChild;
+            }
+        }
+
+        // Reverse order so the first child is emitted next
+        for (int32 i = numChildren - 1; i >= 0; --i)
+        {
+            if (children[i]->type != Bvh::NodeType::kLeaf)
+            {
+                stack.push_back({ children[i], index, i });
+            }
+        }
     }
-    else
+
+    return rootIndex;
+}
+
+template <int32 N>
+void BvhTranslator::ProcessWideNodes(std::vector<WideNode<N>>& wideNodes)
+{
+    wideNodes.clear();
+    wideRootIndices.clear();
+
+    int32 triIndex = 0;
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        wideRootIndices.push_back((int32)wideNodes.size());
+        CollapseNodes<N>(meshes[i]->bvh->m_Root, wideNodes, triIndex, false);
+        triIndex += (int32)meshes[i]->bvh->GetNumIndices();
+    }
+
+    wideTopLevelIndex = (int32)wideNodes.size();
+    CollapseNodes<N>(TLBvh->m_Root, wideNodes, 0, true);
+}
+
+void BvhTranslator::ProcessWide(int32 width)
+{
+    wideNodes4.clear();
+    wideNodes8.clear();
+    wideRootIndices.clear();
+
+    wideWidth = width <= 0 ? 0 : (width > 4 ? 8 : 4);
+
+    if (wideWidth == 8)
+    {
+        ProcessWideNodes<8>(wideNodes8);
+    }
+    else if (wideWidth == 4)
     {
-        curNode++;
-        nodes[index].leftIndex = ProcessTLASNodes(node->lc);
-        nodes[index].leftIndex = ((nodes[index].leftIndex % nodeTexWidth) << 12) | (nodes[index].leftIndex / nodeTexWidth);
-        curNode++;
-        nodes[index].rightIndex = ProcessTLASNodes(node->rc);
-        nodes[index].rightIndex = ((nodes[index].rightIndex % nodeTexWidth) << 12) | (nodes[index].rightIndex / nodeTexWidth);
+        ProcessWideNodes<4>(wideNodes4);
     }
+}
 
-    return index;
+void BvhTranslator::UpdateWideTLAS()
+{
+    // Top level nodes are stored last, collapse them again from the refitted or rebuilt TLAS
+    if (wideWidth == 8)
+    {
+        wideNodes8.resize(wideTopLevelIndex);
+        CollapseNodes<8>(TLBvh->m_Root, wideNodes8, 0, true);
+    }
+    else if (wideWidth == 4)
+    {
+        wideNodes4.resize(wideTopLevelIndex);
+        CollapseNodes<4>(TLBvh->m_Root, wideNodes4, 0, true);
+    }
 }
 
 void BvhTranslator::ProcessBLAS()
 {
-    int32 nodeCnt = 0;
+    int64 nodeCnt = 0;
     for (size_t i = 0; i < meshes.size(); ++i)
     {
         nodeCnt += meshes[i]->bvh->m_Nodecnt;
     }
     
-    topLevelIndex = nodeCnt;
+    topLevelIndex = (int32)nodeCnt;
 
     // reserve space for top level nodes
-    nodeCnt += 2 * (int32)meshInstances.size();
-    nodeTexWidth = (int32)(MMath::Sqrt((float)nodeCnt) + 1);
+    nodeCnt += 2 * (int64)meshInstances.size();
+    // GLScene::Build refuses scenes whose node count does not fit, only the addressing can change here
+    ValidateTexelCapacity("Bvh nodes", nodeCnt, addressing);
 
-    // Resize to power of 2
-    bboxmin.resize(nodeTexWidth * nodeTexWidth);
-    bboxmax.resize(nodeTexWidth * nodeTexWidth);
-    nodes.resize(nodeTexWidth * nodeTexWidth);
+    if (addressing == IndexAddressing::ELinear)
+    {
+        // Flat tables for buffer textures
+        nodeTexWidth = 0;
+        bboxmin.resize((size_t)nodeCnt);
+        bboxmax.resize((size_t)nodeCnt);
+        nodes.resize((size_t)nodeCnt);
+    }
+    else
+    {
+        // Resize to power of 2
+        nodeTexWidth = GetSquareTexWidth(nodeCnt);
+        bboxmin.resize(nodeTexWidth * nodeTexWidth);
+        bboxmax.resize(nodeTexWidth * nodeTexWidth);
+        nodes.resize(nodeTexWidth * nodeTexWidth);
+    }
+
+    // Node and triangle offsets of every mesh, the meshes are then flattened independently
+    bvhRootStartIndices.resize(meshes.size());
+    std::vector<int32> triStartIndices(meshes.size());
 
-    curTriIndex = 0;
     int32 bvhRootIndex = 0;
+    int32 triIndex     = 0;
     for (size_t i = 0; i < meshes.size(); i++)
     {
-        MeshPtr mesh = meshes[i];
-        curNode = bvhRootIndex;
-
-        bvhRootStartIndices.push_back(bvhRootIndex);
-        bvhRootIndex += mesh->bvh->m_Nodecnt;
-            
-        ProcessBLASNodes(mesh->bvh->m_Root);
-        curTriIndex += (int32)mesh->bvh->GetNumIndices();
+        bvhRootStartIndices[i] = bvhRootIndex;
+        triStartIndices[i]     = triIndex;
+        bvhRootIndex += meshes[i]->bvh->m_Nodecnt;
+        triIndex     += (int32)meshes[i]->bvh->GetNumIndices();
     }
+
+    TaskGroup::ParallelFor(taskPool, (int32)meshes.size(), 1, [&](int32 first, int32 last) {
+        std::vector<int32> slots;
+        for (int32 i = first; i < last; ++i)
+        {
+            FlattenTree(meshes[i]->bvh->m_Root, bvhRootStartIndices[i], triStartIndices[i], false, slots);
+        }
+    });
 }
 
 void BvhTranslator::ProcessTLAS()
 {
-    curNode = topLevelIndex;
-    topLevelIndexPackedXY = ((topLevelIndex % nodeTexWidth) << 12) | (topLevelIndex / nodeTexWidth);
-    ProcessTLASNodes(TLBvh->m_Root);
+    topLevelIndexPackedXY = PackTexelIndex(topLevelIndex, nodeTexWidth, addressing);
+    FlattenTree(TLBvh->m_Root, topLevelIndex, 0, true, tlasSlots);
 }
 
 void BvhTranslator::UpdateTLAS(std::shared_ptr<Bvh> topLevelBvh, const std::vector<RendererNode>& sceneInstances)
 {
     TLBvh = topLevelBvh;
-    curNode = topLevelIndex;
     meshInstances = sceneInstances;
-    ProcessTLASNodes(TLBvh->m_Root);
+    FlattenTree(TLBvh->m_Root, topLevelIndex, 0, true, tlasSlots);
+    UpdateWideTLAS();
+}
+
+void BvhTranslator::UpdateTLASBounds(const std::vector<int32>& tlasNodes)
+{
+    // Refit ids are the preorder ids FlattenTree maps to slots
+    for (size_t i = 0; i < tlasNodes.size(); ++i)
+    {
+        const Bvh::Node* node = TLBvh->m_RefitNodes[tlasNodes[i]];
+        int32 index = topLevelIndex + tlasSlots[tlasNodes[i]];
+        bboxmin[index] = node->bounds.min;
+        bboxmax[index] = node->bounds.max;
+    }
+
+    UpdateWideTLAS();
 }
 
 void BvhTranslator::Process(std::shared_ptr<Bvh> topLevelBvh, const MeshArray& sceneMeshes, const std::vector<RendererNode>& sceneInstances)
@@ -149,6 +471,9 @@ void BvhTranslator::Process(std::shared_ptr<Bvh> topLevelBvh, const MeshArray& s
     TLBvh = topLevelBvh;
     meshes = sceneMeshes;
     meshInstances = sceneInstances;
+    wideWidth = 0;
+    wideNodes4.clear();
+    wideNodes8.clear();
     ProcessBLAS();
     ProcessTLAS();
 }
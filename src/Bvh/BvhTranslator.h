@@ -28,9 +28,20 @@ THE SOFTWARE.
 #pragma once
 
 #include <map>
+#include <cmath>
+#include <cstring>
 
 #include "Bvh/Bvh.h"
 #include "Base/Base.h"
+#include "Math/Vector3.h"
+#include "Math/Bounds3D.h"
+
+// Node order of the flattened trees
+enum class BvhLayout
+{
+    EDepthFirst  = 0,   // preorder, the left child directly follows its parent
+    EVanEmdeBoas = 1    // recursive half height blocks, subtrees stay close for any cache line or page size
+};
 
 /// This class translates pointer based BVH representation into
 /// index based one suitable for feeding to GPU or any other accelerator
@@ -46,39 +57,136 @@ public:
         int32 leaf;
     };
 
+    // childPrims markers for slots that are not leaves
+    static const uint8 kInternalChild = 0xFF;
+    static const uint8 kEmptyChild    = 0xFE;
+
+    static_assert(Bvh::kMaxLeafSize < kEmptyChild, "Leaf sizes must not collide with the childPrims markers");
+
+    // N-ary node with its child bounds quantized to 8 bits per plane.
+    // Child bounds are origin + q * 2^exponent per axis, rounded outwards.
+    template <int32 N>
+    struct WideNode
+    {
+        Vector3 origin;
+        int8    exponent[3];
+        uint8   numChildren;
+        uint8   qmin[3][N];
+        uint8   qmax[3][N];
+        // Wide node index of internal children, first primitive of leaves.
+        // BLAS leaves point into the packed triangle indices, TLAS leaves hold the instance index.
+        int32   childIndex[N];
+        // Primitives per leaf child, kInternalChild or kEmptyChild otherwise
+        uint8   childPrims[N];
+
+        // Child bounds of every slot. The addition to origin rounds to nearest, so each plane
+        // is moved outwards by more than the rounding error to keep the decoded box around the child.
+        void DecodeBounds(float bmin[3][N], float bmax[3][N]) const
+        {
+            for (int32 axis = 0; axis < 3; ++axis)
+            {
+                float scale = Exp2(exponent[axis]);
+                for (int32 i = 0; i < N; ++i)
+                {
+                    float lo = origin[axis] + qmin[axis][i] * scale;
+                    float hi = origin[axis] + qmax[axis][i] * scale;
+                    bmin[axis][i] = lo - RoundingMargin(lo);
+                    bmax[axis][i] = hi + RoundingMargin(hi);
+                }
+            }
+        }
+    };
+
+    // 2^exponent, exact for the whole int8 range
+    static FORCEINLINE float Exp2(int32 exponent)
+    {
+        if (exponent < -126)
+        {
+            return std::ldexp(1.0f, exponent);
+        }
+
+        uint32 bits = (uint32)(exponent + 127) << 23;
+        float result;
+        memcpy(&result, &bits, sizeof(float));
+        return result;
+    }
+
+    // 2^-22 of x is at least two ulps, a rounded sum is off by half an ulp at most.
+    // The constant covers denormal results, it is larger than their ulp.
+    static FORCEINLINE float RoundingMargin(float x)
+    {
+        return std::fabs(x) * 2.38418579e-7f + 1e-37f;
+    }
+
+    typedef WideNode<4> WideNode4;
+    typedef WideNode<8> WideNode8;
+
 public:
 
     // Constructor
     BvhTranslator() = default;
 
+    // Meshes are flattened as tasks on pool
+    void SetTaskPool(TaskThreadPool* pool)
+    {
+        taskPool = pool;
+    }
+
     void ProcessBLAS();
 
     void ProcessTLAS();
 
     void UpdateTLAS(std::shared_ptr<Bvh> bvh, const std::vector<RendererNode>& instances);
 
+    // Copies the bounds of refitted top level nodes, ids as returned by Bvh::RefitPrimitives
+    void UpdateTLASBounds(const std::vector<int32>& tlasNodes);
+
     void Process(std::shared_ptr<Bvh> bvh, const MeshArray& meshes, const std::vector<RendererNode>& instances);
+
+    // Collapses the BLAS and TLAS passed to Process into width-ary nodes, width is 4 or 8, 0 drops them.
+    // Fills wideNodes4 or wideNodes8, UpdateTLAS keeps the top level part up to date afterwards.
+    void ProcessWide(int32 width);
     
 private:
 
-    int32 ProcessBLASNodes(const Bvh::Node* root);
+    template <int32 N>
+    void ProcessWideNodes(std::vector<WideNode<N>>& wideNodes);
+
+    template <int32 N>
+    int32 CollapseNodes(const Bvh::Node* root, std::vector<WideNode<N>>& wideNodes, int32 firstPrim, bool topLevel);
 
-    int32 ProcessTLASNodes(const Bvh::Node* root);
+    void UpdateWideTLAS();
+
+    // Writes the tree below root to the node tables starting at baseIndex in the selected layout.
+    // slots receives the table offset of every node by preorder id.
+    void FlattenTree(const Bvh::Node* root, int32 baseIndex, int32 firstPrim, bool topLevel, std::vector<int32>& slots);
 
 public:
 
     std::vector<Vector3>        bboxmin;
     std::vector<Vector3>        bboxmax;
     std::vector<Node>           nodes;
-    int32                       nodeTexWidth;
+    // Node order, set before Process
+    BvhLayout                   layout = BvhLayout::EDepthFirst;
+    // Requested before Process, switched to ELinear when the nodes do not fit a packed texture
+    IndexAddressing             addressing = IndexAddressing::EPackedXY;
+    // Side of the square node texture, 0 with linear addressing
+    int32                       nodeTexWidth = 0;
+    // Top level root in the addressing above
     int32                       topLevelIndexPackedXY = 0;
     int32                       topLevelIndex = 0;
 
+    std::vector<WideNode4>      wideNodes4;
+    std::vector<WideNode8>      wideNodes8;
+    std::vector<int32>          wideRootIndices;
+    int32                       wideWidth = 0;
+    int32                       wideTopLevelIndex = 0;
+
 private:
 
-    int32                       curNode = 0;
-    int32                       curTriIndex = 0;
+    TaskThreadPool*             taskPool = nullptr;
     std::shared_ptr<Bvh>        TLBvh;
+    std::vector<int32>          tlasSlots;
     std::vector<int32>          bvhRootStartIndices;
     std::vector<RendererNode>   meshInstances;
     MeshArray                   meshes;
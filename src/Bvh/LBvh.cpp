@@ -0,0 +1,472 @@
+﻿#include <algorithm>
+#include <limits>
+
+#include "Bvh/LBvh.h"
+#include "Job/TaskGroup.h"
+#include "Job/TaskThreadPool.h"
+#include "Math/Math.h"
+#include "Math/PlatformAtomics.h"
+#include "Misc/ScratchVector.h"
+
+// Items per task for the data parallel passes
+static const int32 kParallelGrainSize = 4096;
+// Number of leaves in a restructured treelet
+static const int32 kTreeletSize = 7;
+// Bits per radix sort pass, three passes cover the 30 bit codes
+static const int32 kRadixBits = 10;
+static const int32 kRadixSize = 1 << kRadixBits;
+
+// Inserts two zero bits in front of each of the lower 10 bits
+static uint32 ExpandBits(uint32 v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static uint32 MortonCode(const Vector3& p)
+{
+    uint32 x = (uint32)MMath::Clamp(p.x * 1024.0f, 0.0f, 1023.0f);
+    uint32 y = (uint32)MMath::Clamp(p.y * 1024.0f, 0.0f, 1023.0f);
+    uint32 z = (uint32)MMath::Clamp(p.z * 1024.0f, 0.0f, 1023.0f);
+    return (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+}
+
+void LBvh::BuildImpl(const Bounds3D* bounds, int32 numbounds)
+{
+    m_NumPrims = numbounds;
+
+    // Internal nodes first, leaf i is stored at numbounds - 1 + i
+    const int32 numnodes = 2 * numbounds - 1;
+    InitNodeAllocator(numnodes);
+    m_Root = AllocateNodes(numnodes);
+
+    Bounds3D centroidBounds;
+    for (int32 i = 0; i < numbounds; ++i)
+    {
+        centroidBounds.Expand(bounds[i].Center());
+    }
+
+    // Map centroids to the unit cube, flat dimensions collapse to zero
+    Vector3 extents = centroidBounds.Extents();
+    Vector3 scale(
+        extents.x > 0.f ? 1.f / extents.x : 0.f,
+        extents.y > 0.f ? 1.f / extents.y : 0.f,
+        extents.z > 0.f ? 1.f / extents.z : 0.f
+    );
+
+    ScratchVector<uint32> codes(numbounds);
+    m_PackedIndices.resize(numbounds);
+
+    TaskGroup::ParallelFor(m_TaskPool, numbounds, kParallelGrainSize, [&](int32 first, int32 last) {
+        for (int32 i = first; i < last; ++i)
+        {
+            codes[i] = MortonCode((bounds[i].Center() - centroidBounds.min) * scale);
+            m_PackedIndices[i] = i;
+        }
+    });
+
+    SortMortonCodes(*codes, m_PackedIndices);
+
+    m_Parents.assign(numnodes, -1);
+    m_LeafCounts.assign(numnodes, 0);
+    m_Costs.assign(numnodes, 0.f);
+    m_VisitCounts.resize(numnodes);
+
+    // Leaves
+    for (int32 i = 0; i < numbounds; ++i)
+    {
+        Node& leaf    = m_Nodes[numbounds - 1 + i];
+        leaf.type     = kLeaf;
+        leaf.index    = 0;
+        leaf.startidx = i;
+        leaf.numprims = 1;
+    }
+
+    // Every internal node only depends on the sorted codes
+    TaskGroup::ParallelFor(m_TaskPool, numbounds - 1, kParallelGrainSize, [&](int32 first, int32 last) {
+        for (int32 i = first; i < last; ++i)
+        {
+            EmitInternalNode(*codes, i);
+        }
+    });
+
+    UpdateNodes(bounds, false);
+
+    for (int32 pass = 0; pass < m_RestructurePasses; ++pass)
+    {
+        UpdateNodes(bounds, true);
+    }
+
+    // Tree height
+    m_Height = 0;
+    std::vector<std::pair<const Node*, int32>> stack;
+    stack.push_back(std::make_pair(m_Root, 0));
+    while (!stack.empty())
+    {
+        const Node* node = stack.back().first;
+        int32 level      = stack.back().second;
+        stack.pop_back();
+
+        m_Height = std::max(m_Height, level);
+
+        if (node->type == kInternal)
+        {
+            stack.push_back(std::make_pair(node->lc, level + 1));
+            stack.push_back(std::make_pair(node->rc, level + 1));
+        }
+    }
+}
+
+void LBvh::SortMortonCodes(std::vector<uint32>& codes, std::vector<int32>& indices) const
+{
+    const int32 count = (int32)codes.size();
+
+    int32 numtasks = 1;
+    if (m_TaskPool != nullptr)
+    {
+        numtasks = MMath::Clamp(count / (4 * kParallelGrainSize), 1, m_TaskPool->GetNumThreads() + 1);
+    }
+
+    ScratchVector<uint32> tmpcodes(count);
+    ScratchVector<int32>  tmpindices(count);
+    ScratchVector<int32>  histograms(numtasks * kRadixSize);
+
+    uint32* srccodes   = &codes[0];
+    int32*  srcindices = &indices[0];
+    uint32* dstcodes   = &tmpcodes[0];
+    int32*  dstindices = &tmpindices[0];
+
+    for (int32 shift = 0; shift < 30; shift += kRadixBits)
+    {
+        std::fill(histograms->begin(), histograms->end(), 0);
+
+        // Count digits of every chunk
+        TaskGroup::ParallelFor(m_TaskPool, numtasks, 1, [&](int32 firsttask, int32 lasttask) {
+            for (int32 task = firsttask; task < lasttask; ++task)
+            {
+                int32 first = (int32)((int64)count * task / numtasks);
+                int32 last  = (int32)((int64)count * (task + 1) / numtasks);
+                int32* histogram = &histograms[task * kRadixSize];
+
+                for (int32 i = first; i < last; ++i)
+                {
+                    ++histogram[(srccodes[i] >> shift) & (kRadixSize - 1)];
+                }
+            }
+        });
+
+        // Turn counts into output offsets, chunks keep their order within a digit so the sort is stable
+        int32 offset = 0;
+        for (int32 digit = 0; digit < kRadixSize; ++digit)
+        {
+            for (int32 task = 0; task < numtasks; ++task)
+            {
+                int32 digitcount = histograms[task * kRadixSize + digit];
+                histograms[task * kRadixSize + digit] = offset;
+                offset += digitcount;
+            }
+        }
+
+        // Scatter
+        TaskGroup::ParallelFor(m_TaskPool, numtasks, 1, [&](int32 firsttask, int32 lasttask) {
+            for (int32 task = firsttask; task < lasttask; ++task)
+            {
+                int32 first = (int32)((int64)count * task / numtasks);
+                int32 last  = (int32)((int64)count * (task + 1) / numtasks);
+                int32* offsets = &histograms[task * kRadixSize];
+
+                for (int32 i = first; i < last; ++i)
+                {
+                    int32 dst = offsets[(srccodes[i] >> shift) & (kRadixSize - 1)]++;
+                    dstcodes[dst]   = srccodes[i];
+                    dstindices[dst] = srcindices[i];
+                }
+            }
+        });
+
+        std::swap(srccodes, dstcodes);
+        std::swap(srcindices, dstindices);
+    }
+
+    // Odd number of passes leaves the result in the temporary arrays
+    if (srccodes != &codes[0])
+    {
+        std::copy(srccodes, srccodes + count, codes.begin());
+        std::copy(srcindices, srcindices + count, indices.begin());
+    }
+}
+
+int32 LBvh::Delta(const std::vector<uint32>& codes, int32 i, int32 j) const
+{
+    if (j < 0 || j >= m_NumPrims)
+    {
+        return -1;
+    }
+
+    // Duplicate codes are told apart by their position
+    if (codes[i] == codes[j])
+    {
+        return 32 + (int32)MMath::CountLeadingZeros((uint32)(i ^ j));
+    }
+
+    return (int32)MMath::CountLeadingZeros(codes[i] ^ codes[j]);
+}
+
+void LBvh::EmitInternalNode(const std::vector<uint32>& codes, int32 i)
+{
+    // Direction of the range
+    int32 d = (Delta(codes, i, i + 1) - Delta(codes, i, i - 1)) >= 0 ? 1 : -1;
+
+    // Upper bound for the length of the range
+    int32 deltamin = Delta(codes, i, i - d);
+    int32 lmax = 2;
+    while (Delta(codes, i, i + lmax * d) > deltamin)
+    {
+        lmax <<= 1;
+    }
+
+    // Other end of the range
+    int32 l = 0;
+    for (int32 t = lmax >> 1; t >= 1; t >>= 1)
+    {
+        if (Delta(codes, i, i + (l + t) * d) > deltamin)
+        {
+            l += t;
+        }
+    }
+    int32 j = i + l * d;
+
+    // Split position
+    int32 deltanode = Delta(codes, i, j);
+    int32 s = 0;
+    int32 t = l;
+    do
+    {
+        t = (t + 1) >> 1;
+        if (Delta(codes, i, i + (s + t) * d) > deltanode)
+        {
+            s += t;
+        }
+    } while (t > 1);
+
+    int32 gamma = i + s * d + std::min(d, 0);
+
+    int32 leftidx  = std::min(i, j) == gamma     ? m_NumPrims - 1 + gamma     : gamma;
+    int32 rightidx = std::max(i, j) == gamma + 1 ? m_NumPrims - 1 + gamma + 1 : gamma + 1;
+
+    Node& node = m_Nodes[i];
+    node.type  = kInternal;
+    node.index = 0;
+    node.lc    = &m_Nodes[leftidx];
+    node.rc    = &m_Nodes[rightidx];
+
+    m_Parents[leftidx]  = i;
+    m_Parents[rightidx] = i;
+}
+
+void LBvh::UpdateNodes(const Bounds3D* bounds, bool restructure)
+{
+    std::fill(m_VisitCounts.begin(), m_VisitCounts.end(), 0);
+
+    // Walk up from every leaf, the second visitor of a node handles it.
+    // Both children are final at that point and nobody else touches the subtree.
+    TaskGroup::ParallelFor(m_TaskPool, m_NumPrims, kParallelGrainSize, [&](int32 first, int32 last) {
+        for (int32 i = first; i < last; ++i)
+        {
+            int32 index = m_NumPrims - 1 + i;
+            Node& leaf  = m_Nodes[index];
+
+            leaf.bounds = bounds[m_PackedIndices[leaf.startidx]];
+            m_LeafCounts[index] = 1;
+            m_Costs[index] = leaf.bounds.Area();
+
+            int32 parent = m_Parents[index];
+            while (parent != -1)
+            {
+                if (PlatformAtomics::InterlockedIncrement(&m_VisitCounts[parent]) == 1)
+                {
+                    break;
+                }
+
+                Node& node = m_Nodes[parent];
+                int32 lc = NodeIndex(node.lc);
+                int32 rc = NodeIndex(node.rc);
+
+                node.bounds = Bounds3D::Union(node.lc->bounds, node.rc->bounds);
+                m_LeafCounts[parent] = m_LeafCounts[lc] + m_LeafCounts[rc];
+                m_Costs[parent] = m_TraversalCost * node.bounds.Area() + m_Costs[lc] + m_Costs[rc];
+
+                if (restructure && m_LeafCounts[parent] >= kTreeletSize)
+                {
+                    RestructureTreelet(parent);
+                }
+
+                parent = m_Parents[parent];
+            }
+        }
+    });
+}
+
+void LBvh::RestructureTreelet(int32 root)
+{
+    const int32 kNumSubsets = 1 << kTreeletSize;
+
+    // Grow the treelet by expanding the leaf with the largest area
+    int32 leaves[kTreeletSize];
+    int32 internals[kTreeletSize - 1];
+    int32 numleaves    = 2;
+    int32 numinternals = 1;
+
+    leaves[0]    = NodeIndex(m_Nodes[root].lc);
+    leaves[1]    = NodeIndex(m_Nodes[root].rc);
+    internals[0] = root;
+
+    while (numleaves < kTreeletSize)
+    {
+        int32 largest = -1;
+        float maxarea = -1.f;
+        for (int32 i = 0; i < numleaves; ++i)
+        {
+            const Node& node = m_Nodes[leaves[i]];
+            float area = node.bounds.Area();
+            if (node.type == kInternal && area > maxarea)
+            {
+                largest = i;
+                maxarea = area;
+            }
+        }
+
+        if (largest == -1)
+        {
+            return;
+        }
+
+        const Node& expanded = m_Nodes[leaves[largest]];
+        internals[numinternals++] = leaves[largest];
+        leaves[largest]           = NodeIndex(expanded.lc);
+        leaves[numleaves++]       = NodeIndex(expanded.rc);
+    }
+
+    // Subsets with more than one leaf ordered by size, so smaller subsets are solved first
+    static const std::vector<int32> s_SubsetOrder = []() {
+        std::vector<int32> order;
+        for (int32 size = 2; size <= kTreeletSize; ++size)
+        {
+            for (int32 subset = 1; subset < (1 << kTreeletSize); ++subset)
+            {
+                if (MMath::CountBits((uint64)subset) == size)
+                {
+                    order.push_back(subset);
+                }
+            }
+        }
+        return order;
+    }();
+
+    // Optimal cost and partition of every subset of treelet leaves
+    Bounds3D boxes[kNumSubsets];
+    float costs[kNumSubsets];
+    int32 partitions[kNumSubsets];
+
+    for (int32 subset = 1; subset < kNumSubsets; ++subset)
+    {
+        // Add the lowest leaf to the box of the remaining ones
+        int32 lowest = subset & (-subset);
+        boxes[subset] = boxes[subset ^ lowest];
+        boxes[subset].Expand(m_Nodes[leaves[MMath::CountTrailingZeros((uint32)lowest)]].bounds);
+    }
+
+    for (int32 i = 0; i < kTreeletSize; ++i)
+    {
+        costs[1 << i] = m_Costs[leaves[i]];
+    }
+
+    for (size_t k = 0; k < s_SubsetOrder.size(); ++k)
+    {
+        int32 subset = s_SubsetOrder[k];
+
+        // Try every split into two non empty halves, each pair once
+        float best      = std::numeric_limits<float>::max();
+        int32 bestsplit = 0;
+        int32 delta     = (subset - 1) & subset;
+        int32 part      = (-delta) & subset;
+        while (part != 0)
+        {
+            float cost = costs[part] + costs[subset ^ part];
+            if (cost < best)
+            {
+                best      = cost;
+                bestsplit = part;
+            }
+            part = (part - delta) & subset;
+        }
+
+        costs[subset]      = m_TraversalCost * boxes[subset].Area() + best;
+        partitions[subset] = bestsplit;
+    }
+
+    const int32 all = kNumSubsets - 1;
+    if (!(costs[all] < m_Costs[root]))
+    {
+        return;
+    }
+
+    // Rebuild the treelet from the partitions, the root stays in place
+    struct Entry
+    {
+        int32 node;
+        int32 subset;
+    };
+
+    Entry stack[kTreeletSize];
+    int32 stacksize = 0;
+    int32 nextinternal = 1;
+    int32 order[kTreeletSize - 1];
+    int32 numordered = 0;
+
+    stack[stacksize++] = { root, all };
+    while (stacksize > 0)
+    {
+        Entry entry = stack[--stacksize];
+        order[numordered++] = entry.node;
+
+        int32 halves[2] = { partitions[entry.subset], entry.subset ^ partitions[entry.subset] };
+        Node* children[2];
+
+        for (int32 k = 0; k < 2; ++k)
+        {
+            int32 child;
+            if (MMath::CountBits((uint64)halves[k]) == 1)
+            {
+                child = leaves[MMath::CountTrailingZeros((uint32)halves[k])];
+            }
+            else
+            {
+                child = internals[nextinternal++];
+                stack[stacksize++] = { child, halves[k] };
+            }
+
+            children[k] = &m_Nodes[child];
+            m_Parents[child] = entry.node;
+        }
+
+        m_Nodes[entry.node].lc = children[0];
+        m_Nodes[entry.node].rc = children[1];
+    }
+
+    // Children always come after their parent in order, refresh bottom up
+    for (int32 i = numordered - 1; i >= 0; --i)
+    {
+        int32 index = order[i];
+        Node& node  = m_Nodes[index];
+        int32 lc    = NodeIndex(node.lc);
+        int32 rc    = NodeIndex(node.rc);
+
+        node.bounds = Bounds3D::Union(node.lc->bounds, node.rc->bounds);
+        m_LeafCounts[index] = m_LeafCounts[lc] + m_LeafCounts[rc];
+        m_Costs[index] = m_TraversalCost * node.bounds.Area() + m_Costs[lc] + m_Costs[rc];
+    }
+}
@@ -0,0 +1,70 @@
+﻿#pragma once
+
+#include "Bvh/Bvh.h"
+
+// Linear BVH for fast rebuilds.
+// Primitives are ordered by the 30 bit Morton code of their centroid and the hierarchy is
+// emitted from the sorted codes as in Karras, "Maximizing Parallelism in the Construction
+// of BVHs, Octrees, and k-d Trees". Optional treelet restructuring passes (Karras and Aila,
+// "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies") lower the SAH
+// cost of the tree. The result uses the regular Bvh node layout with one primitive per leaf.
+class LBvh : public Bvh
+{
+public:
+    LBvh(float traversalCost, int32 restructurePasses = 0)
+        : Bvh(traversalCost, 64, false)
+        , m_RestructurePasses(restructurePasses)
+    {
+
+    }
+
+    ~LBvh() = default;
+
+protected:
+
+    // Build function
+    void BuildImpl(const Bounds3D* bounds, int32 numbounds) override;
+
+private:
+
+    // Stable radix sort of the codes, indices are moved along with them
+    void SortMortonCodes(std::vector<uint32>& codes, std::vector<int32>& indices) const;
+
+    // Length of the common prefix of the sorted keys i and j, -1 if j is out of range
+    int32 Delta(const std::vector<uint32>& codes, int32 i, int32 j) const;
+
+    // Emits internal node i and links its children
+    void EmitInternalNode(const std::vector<uint32>& codes, int32 i);
+
+    // Bottom up pass that fills bounds, leaf counts and SAH costs,
+    // optionally restructuring every treelet it passes
+    void UpdateNodes(const Bounds3D* bounds, bool restructure);
+
+    // Finds the optimal topology for the treelet below node and applies it if it is cheaper
+    void RestructureTreelet(int32 node);
+
+    int32 NodeIndex(const Node* node) const
+    {
+        return (int32)(node - &m_Nodes[0]);
+    }
+
+private:
+
+    // Number of treelet restructuring passes, 0 disables them
+    int32 m_RestructurePasses;
+    // Number of primitives the tree was built for
+    int32 m_NumPrims;
+    // Parent of every node, -1 for the root
+    std::vector<int32> m_Parents;
+    // Number of leaves below every node
+    std::vector<int32> m_LeafCounts;
+    // SAH cost of every subtree
+    std::vector<float> m_Costs;
+    // Visit counters for the bottom up passes
+    std::vector<int32> m_VisitCounts;
+
+private:
+    LBvh(const LBvh& bvh) = delete;
+
+    LBvh& operator = (const LBvh& bvh) = delete;
+};
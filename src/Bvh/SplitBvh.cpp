@@ -1,16 +1,28 @@
 ﻿#include <algorithm>
-#include <cassert>
 #include <cmath>
+#include <limits>
 
 #include "Bvh/SplitBvh.h"
+#include "Job/TaskGroup.h"
+#include "Job/TaskThreadPool.h"
+#include "Misc/ScratchVector.h"
+
+// Spatial split candidates per axis
+static const int32 kNumSpatialBins = 32;
+// Chopping a reference into bins costs a lot more than binning its centroid
+static const int32 kMinRefsPerSpatialBinningTask = 2 * 1024;
+// Nodes per chunk once the reservation for a build without spatial splits is used up
+static const int32 kNodeChunkSize = 16 * 1024;
+
+static FORCEINLINE bool IsEmpty(const Bounds3D& bounds)
+{
+    return bounds.min.x > bounds.max.x || bounds.min.y > bounds.max.y || bounds.min.z > bounds.max.z;
+}
 
 void SplitBvh::BuildImpl(const Bounds3D* bounds, int32 numbounds)
 {
     // Initialize prim refs structures
-    PrimRefArray primrefs(numbounds);
-
-    // Keep centroids to speed up partitioning
-    std::vector<Vector3> centroids(numbounds);
+    ScratchVector<PrimRef> primrefs(numbounds);
     Bounds3D centroidBounds;
 
     for (auto i = 0; i < numbounds; ++i)
@@ -24,46 +36,101 @@ void SplitBvh::BuildImpl(const Bounds3D* bounds, int32 numbounds)
     m_NumNodesForRegular = (2 * numbounds - 1);
     m_NumNodesRequired   = (int32)(m_NumNodesForRegular * (1.f + m_ExtraRefsBudget));
 
-    InitNodeAllocator(m_NumNodesRequired);
+    // Spatial splits add chunks for the extra references as they need them
+    InitNodeAllocator(m_NumNodesForRegular);
 
-    SplitRequest init = { 0, numbounds, nullptr, m_Bounds, centroidBounds, 0 };
+    // Only references added by spatial splits can grow the index array
+    m_PackedIndices.clear();
+    m_PackedIndices.reserve(numbounds);
+
+    SplitRequest init = { 0, numbounds, nullptr, m_Bounds, centroidBounds, 0, 1 };
 
     // Start from the top
-    BuildNode(init, primrefs);
+    BuildNode(init, *primrefs);
+
+    // Subtrees below the spatial split depth have their ranges reserved already
+    // and can be built in any order
+    std::vector<int32> heights(m_PendingSubtrees.size(), 0);
+    {
+        TaskGroup group(m_TaskPool);
+        for (size_t i = 0; i < m_PendingSubtrees.size(); ++i)
+        {
+            group.Run([this, i, &heights]() {
+                SubtreeRequest& subtree = m_PendingSubtrees[i];
+                heights[i] = BuildSubtree(subtree.req, subtree.refs.data(), subtree.node, subtree.packedidx);
+            });
+        }
+        group.Wait();
+    }
+
+    for (size_t i = 0; i < heights.size(); ++i)
+    {
+        m_Height = std::max(m_Height, heights[i]);
+    }
+
+    m_PendingSubtrees.clear();
 }
 
 void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
 {
+    // Below the maximum split depth the reference count can't grow anymore,
+    // so the subtree fits into 2 * n - 1 nodes and n indices reserved up front
+    if (req.level >= m_MaxSplitDepth)
+    {
+        Node* subtreeRoot = AllocateNodes(2 * req.numprims - 1);
+        int32 packedidx   = (int32)m_PackedIndices.size();
+        m_PackedIndices.resize(packedidx + req.numprims);
+
+        if (req.ptr) {
+            *req.ptr = subtreeRoot;
+        }
+
+        // The root request owns the whole array and can be split in place
+        if (m_TaskPool == nullptr || req.ptr == nullptr)
+        {
+            m_Height = std::max(m_Height, BuildSubtree(req, primrefs.data(), subtreeRoot, packedidx));
+        }
+        else
+        {
+            // Partitioning direction depends on the parity of startidx, keep it in the private copy
+            int32 offset = req.startidx & 0x1;
+
+            SubtreeRequest subtree;
+            subtree.req          = req;
+            subtree.req.startidx = offset;
+            subtree.req.ptr      = nullptr;
+            subtree.node         = subtreeRoot;
+            subtree.packedidx    = packedidx;
+            subtree.refs.resize(offset + req.numprims);
+            std::copy(primrefs.begin() + req.startidx, primrefs.begin() + req.startidx + req.numprims, subtree.refs.begin() + offset);
+            m_PendingSubtrees.push_back(std::move(subtree));
+        }
+
+        return;
+    }
+
     // Update current height
     m_Height = std::max(m_Height, req.level);
 
     // Allocate new node
-    Node* node   = AllocateNode();
+    Node* node   = AllocateNodes(1);
     node->bounds = req.bounds;
 
+    SahSplit os;
+    SahSplit ss;
+    auto splitType = SplitType::kObject;
+
     // Create leaf node if we have enough prims
-    if (req.numprims < 2)
+    bool leaf = req.numprims < 2 || IsCancelled();
+    if (!leaf)
     {
-        node->type     = kLeaf;
-        node->startidx = (int32)m_PackedIndices.size();
-        node->numprims = req.numprims;
-
-        for (int32 i = req.startidx; i < req.startidx + req.numprims; ++i)
+        // The spatial split levels run serially, give queued interactive work a core between large nodes
+        if (m_TaskPool && req.numprims >= m_MinParallelPrims)
         {
-            m_PackedIndices.push_back(primrefs[i].idx);
+            m_TaskPool->RunInteractiveTasks();
         }
-    }
-    else
-    {
-        node->type = kInternal;
-
-        // Choose the maximum extent
-        int32 axis = req.centroidBounds.Maxdim();
-        float border = req.centroidBounds.Center()[axis];
 
-        SahSplit os = FindObjectSahSplit(req, primrefs);
-        SahSplit ss;
-        auto splitType = SplitType::kObject;
+        os = FindObjectSahSplit(req, primrefs.data());
 
         // Only use split if
         // 1. Maximum depth is not exceeded
@@ -71,9 +138,12 @@ void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
         // 3. It is better than object split
         // 4. Object split is not good enought (too much overlap)
         // 5. Our node budget still allows us to split references
-        if (req.level < m_MaxSplitDepth && m_Nodecnt < m_NumNodesRequired && os.overlap > m_MinOverlap)
+        // The overlap is measured against the root like in the SBVH paper, deep nodes rarely
+        // gain enough from a spatial split to pay for chopping their triangles into bins.
+        float overlap = os.overlap * req.bounds.Area() / m_Bounds.Area();
+        if (req.level < m_MaxSplitDepth && m_Nodecnt < m_NumNodesRequired && overlap > m_MinOverlap)
         {
-            ss = FindSpatialSahSplit(req, primrefs);
+            ss = FindSpatialSahSplit(req, primrefs.data());
 
             if (!std::isnan(ss.split) && ss.sah < os.sah)
             {
@@ -81,6 +151,30 @@ void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
             }
         }
 
+        // Small nodes stay leaves when intersecting their prims is cheaper than the best split
+        float sah = splitType == SplitType::kSpatial ? ss.sah : os.sah;
+        leaf = req.numprims <= m_MaxLeafSize && req.numprims <= sah;
+    }
+
+    if (leaf)
+    {
+        node->type     = kLeaf;
+        node->startidx = (int32)m_PackedIndices.size();
+        node->numprims = req.numprims;
+
+        for (int32 i = req.startidx; i < req.startidx + req.numprims; ++i)
+        {
+            m_PackedIndices.push_back(primrefs[i].idx);
+        }
+    }
+    else
+    {
+        node->type = kInternal;
+
+        // Choose the maximum extent
+        int32 axis = req.centroidBounds.Maxdim();
+        float border = req.centroidBounds.Center()[axis];
+
         if (splitType == SplitType::kSpatial)
         {
             // First we need maximum 2x numprims elements allocated
@@ -103,98 +197,188 @@ void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
             axis   = !std::isnan(os.split) ? os.dim   : axis;
         }
             
-        // Start partitioning and updating extents for children at the same time
-        Bounds3D leftbounds;
-        Bounds3D rightbounds;
-        Bounds3D leftcentroidBounds;
-        Bounds3D rightcentroidBounds;
+        SplitRequest leftrequest;
+        SplitRequest rightrequest;
+        PartitionPrimRefs(req, primrefs.data(), axis, border, leftrequest, rightrequest);
 
-        int32 splitidx  = req.startidx;
-        bool near2far = (req.numprims + req.startidx) & 0x1;
+        leftrequest.ptr  = &node->lc;
+        rightrequest.ptr = &node->rc;
 
-        bool(*cmpl)(float, float)  = [](float a, float b) -> bool { return a < b; };
-        bool(*cmpge)(float, float) = [](float a, float b) -> bool { return a >= b; };
+        // The order is very important here since right node uses the space at the end of the array to partition
+        BuildNode(rightrequest, primrefs);
+
+        // Put those to stack
+        BuildNode(leftrequest, primrefs);
+    }
 
-        auto cmp1 = near2far ? cmpl  : cmpge;
-        auto cmp2 = near2far ? cmpge : cmpl;
+    // Set parent ptr if any
+    if (req.ptr) {
+        *req.ptr = node;
+    }
+}
+
+int32 SplitBvh::BuildSubtree(const SplitRequest& req, PrimRef* refs, Node* node, int32 packedidx)
+{
+    int32 height = req.level;
+
+    node->bounds = req.bounds;
+
+    SahSplit os;
+
+    // Create leaf node if we have enough prims, or when intersecting them is cheaper than the best split
+    bool leaf = req.numprims < 2 || IsCancelled();
+    if (!leaf)
+    {
+        os   = FindObjectSahSplit(req, refs);
+        leaf = req.numprims <= m_MaxLeafSize && req.numprims <= os.sah;
+    }
 
-        if (req.centroidBounds.Extents()[axis] > 0.f)
+    if (leaf)
+    {
+        node->type     = kLeaf;
+        node->startidx = packedidx;
+        node->numprims = req.numprims;
+
+        for (int32 i = 0; i < req.numprims; ++i)
         {
-            auto first = req.startidx;
-            auto last = req.startidx + req.numprims;
+            m_PackedIndices[packedidx + i] = refs[req.startidx + i].idx;
+        }
 
-            while (true)
-            {
-                while ((first != last) && cmp1(primrefs[first].center[axis], border))
-                {
-                    leftbounds.Expand(primrefs[first].bounds);
-                    leftcentroidBounds.Expand(primrefs[first].center);
-                    ++first;
-                }
+        return height;
+    }
 
-                if (first == last--) {
-                    break;
-                }
+    node->type = kInternal;
 
-                rightbounds.Expand(primrefs[first].bounds);
-                rightcentroidBounds.Expand(primrefs[first].center);
+    // Choose the maximum extent
+    int32 axis   = req.centroidBounds.Maxdim();
+    float border = req.centroidBounds.Center()[axis];
 
-                while ((first != last) && cmp2(primrefs[last].center[axis], border))
-                {
-                    rightbounds.Expand(primrefs[last].bounds);
-                    rightcentroidBounds.Expand(primrefs[last].center);
-                    --last;
-                }
+    if (!std::isnan(os.split))
+    {
+        border = os.split;
+        axis   = os.dim;
+    }
 
-                if (first == last) {
-                    break;
-                }
+    SplitRequest leftrequest;
+    SplitRequest rightrequest;
+    PartitionPrimRefs(req, refs, axis, border, leftrequest, rightrequest);
 
-                leftbounds.Expand(primrefs[last].bounds);
-                leftcentroidBounds.Expand(primrefs[last].center);
+    // Same layout as the serial build, right subtree first.
+    // Right subtree follows its parent and needs at most 2 * rightprims - 1 nodes.
+    Node* rightnode = node + 1;
+    Node* leftnode  = node + 2 * rightrequest.numprims;
 
-                std::swap(primrefs[first++], primrefs[last]);
-            }
+    node->lc = leftnode;
+    node->rc = rightnode;
 
-            splitidx = first;
-        }
+    int32 rightpackedidx = packedidx;
+    int32 leftpackedidx  = packedidx + rightrequest.numprims;
 
-        if (splitidx == req.startidx || splitidx == req.startidx + req.numprims)
-        {
-            splitidx = req.startidx + (req.numprims >> 1);
+    if (m_TaskPool && leftrequest.numprims >= m_MinParallelPrims && rightrequest.numprims >= m_MinParallelPrims)
+    {
+        int32 leftheight = 0;
+
+        TaskGroup group(m_TaskPool);
+        group.Run([&]() {
+            leftheight = BuildSubtree(leftrequest, refs, leftnode, leftpackedidx);
+        });
 
-            for (int32 i = req.startidx; i < splitidx; ++i)
+        height = BuildSubtree(rightrequest, refs, rightnode, rightpackedidx);
+        group.Wait();
+
+        height = std::max(height, leftheight);
+    }
+    else
+    {
+        height = BuildSubtree(rightrequest, refs, rightnode, rightpackedidx);
+        height = std::max(height, BuildSubtree(leftrequest, refs, leftnode, leftpackedidx));
+    }
+
+    return height;
+}
+
+void SplitBvh::PartitionPrimRefs(const SplitRequest& req, PrimRef* primrefs, int32 axis, float border, SplitRequest& leftrequest, SplitRequest& rightrequest) const
+{
+    // Start partitioning and updating extents for children at the same time
+    Bounds3D leftbounds;
+    Bounds3D rightbounds;
+    Bounds3D leftcentroidBounds;
+    Bounds3D rightcentroidBounds;
+
+    int32 splitidx  = req.startidx;
+    bool near2far = (req.numprims + req.startidx) & 0x1;
+
+    bool(*cmpl)(float, float)  = [](float a, float b) -> bool { return a < b; };
+    bool(*cmpge)(float, float) = [](float a, float b) -> bool { return a >= b; };
+
+    auto cmp1 = near2far ? cmpl  : cmpge;
+    auto cmp2 = near2far ? cmpge : cmpl;
+
+    if (req.centroidBounds.Extents()[axis] > 0.f)
+    {
+        auto first = req.startidx;
+        auto last = req.startidx + req.numprims;
+
+        while (true)
+        {
+            while ((first != last) && cmp1(primrefs[first].center[axis], border))
             {
-                leftbounds.Expand(primrefs[i].bounds);
-                leftcentroidBounds.Expand(primrefs[i].center);
+                leftbounds.Expand(primrefs[first].bounds);
+                leftcentroidBounds.Expand(primrefs[first].center);
+                ++first;
+            }
+
+            if (first == last--) {
+                break;
             }
 
-            for (int32 i = splitidx; i < req.startidx + req.numprims; ++i)
+            rightbounds.Expand(primrefs[first].bounds);
+            rightcentroidBounds.Expand(primrefs[first].center);
+
+            while ((first != last) && cmp2(primrefs[last].center[axis], border))
             {
-                rightbounds.Expand(primrefs[i].bounds);
-                rightcentroidBounds.Expand(primrefs[i].center);
+                rightbounds.Expand(primrefs[last].bounds);
+                rightcentroidBounds.Expand(primrefs[last].center);
+                --last;
             }
-        }
 
-        // Left request
-        SplitRequest leftrequest  = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroidBounds, req.level + 1 };
-        // Right request
-        SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroidBounds, req.level + 1 };
+            if (first == last) {
+                break;
+            }
 
-        // The order is very important here since right node uses the space at the end of the array to partition
-        BuildNode(rightrequest, primrefs);
+            leftbounds.Expand(primrefs[last].bounds);
+            leftcentroidBounds.Expand(primrefs[last].center);
 
-        // Put those to stack
-        BuildNode(leftrequest, primrefs);
+            std::swap(primrefs[first++], primrefs[last]);
+        }
+
+        splitidx = first;
     }
 
-    // Set parent ptr if any
-    if (req.ptr) {
-        *req.ptr = node;
+    if (splitidx == req.startidx || splitidx == req.startidx + req.numprims)
+    {
+        splitidx = req.startidx + (req.numprims >> 1);
+
+        for (int32 i = req.startidx; i < splitidx; ++i)
+        {
+            leftbounds.Expand(primrefs[i].bounds);
+            leftcentroidBounds.Expand(primrefs[i].center);
+        }
+
+        for (int32 i = splitidx; i < req.startidx + req.numprims; ++i)
+        {
+            rightbounds.Expand(primrefs[i].bounds);
+            rightcentroidBounds.Expand(primrefs[i].center);
+        }
     }
+
+    // Left request
+    leftrequest  = { req.startidx, splitidx - req.startidx, nullptr, leftbounds, leftcentroidBounds, req.level + 1, (req.index << 1) };
+    // Right request
+    rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), nullptr, rightbounds, rightcentroidBounds, req.level + 1, (req.index << 1) + 1 };
 }
 
-SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(const SplitRequest& req, const PrimRefArray& refs) const
+SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(const SplitRequest& req, const PrimRef* refs) const
 {
     // SAH implementation
     // calc centroids histogram
@@ -207,6 +391,7 @@ SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(const SplitRequest& req, const P
     split.dim   = 0;
     split.split = std::numeric_limits<float>::quiet_NaN();
     split.sah   = sah;
+    split.overlap = 0.f;
 
     // if we cannot apply histogram algorithm
     // put NAN sentinel as split border
@@ -218,90 +403,87 @@ SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(const SplitRequest& req, const P
         return split;
     }
 
-    // Bin has bbox and occurence count
-    struct Bin
-    {
-        Bounds3D bounds;
-        int32 count;
-    };
-
     // Keep bins for each dimension
-    std::vector<Bin> bins[3];
-    bins[0].resize(m_NumBins);
-    bins[1].resize(m_NumBins);
-    bins[2].resize(m_NumBins);
+    Bin bins[3 * kMaxBins];
+
+    // Initialize bins
+    for (int32 i = 0; i < 3 * m_NumBins; ++i)
+    {
+        bins[i].count  = 0;
+        bins[i].bounds = SIMDBounds3D();
+    }
 
     // Precompute inverse parent area
     auto invarea = 1.f / req.bounds.Area();
     // Precompute min point
     auto rootmin = req.centroidBounds.min;
 
-    // Evaluate all dimensions
-    for (int32 axis = 0; axis < 3; ++axis)
+    // Calc primitive refs histogram for all dimensions in a single pass.
+    // Degenerate dimensions are skipped.
+    auto binfunc = [&](Bin* axisbins, int32 first, int32 last)
     {
-        float rootminc = rootmin[axis];
-        // Range for histogram
-        auto centroidRNG = centroidExtents[axis];
-        auto invcentroidRNG = 1.f / centroidRNG;
-
-        // If the box is degenerate in that dimension skip it
-        if (centroidRNG == 0.f) {
-            continue;
-        }
-
-        // Initialize bins
-        for (int32 i = 0; i < m_NumBins; ++i)
+        for (int32 i = first; i < last; ++i)
         {
-            bins[axis][i].count = 0;
-            bins[axis][i].bounds = Bounds3D();
-        }
+            const PrimRef& ref = refs[i];
 
-        // Calc primitive refs histogram
-        for (int32 i = req.startidx; i < req.startidx + req.numprims; ++i)
-        {
-            auto idx = i;
-            auto binidx = (int32)std::min<float>(static_cast<float>(m_NumBins) * ((refs[idx].center[axis] - rootminc) * invcentroidRNG), static_cast<float>(m_NumBins - 1));
+            for (int32 axis = 0; axis < 3; ++axis)
+            {
+                auto centroidRNG = centroidExtents[axis];
+                if (centroidRNG == 0.f) {
+                    continue;
+                }
+
+                auto invcentroidRNG = 1.f / centroidRNG;
+                auto binidx = (int32)std::min<float>(static_cast<float>(m_NumBins) * ((ref.center[axis] - rootmin[axis]) * invcentroidRNG), static_cast<float>(m_NumBins - 1));
 
-            ++bins[axis][binidx].count;
-            bins[axis][binidx].bounds.Expand(refs[idx].bounds);
+                Bin& bin = axisbins[axis * m_NumBins + binidx];
+                ++bin.count;
+                bin.bounds.Expand(ref.bounds);
+            }
         }
+    };
 
-        std::vector<Bounds3D> rightbounds(m_NumBins - 1);
+    int32 numtasks = GetNumBinningTasks(req.numprims);
+    if (numtasks > 1)
+    {
+        BinPrimitivesParallel(req, numtasks, &bins[0], binfunc);
+    }
+    else
+    {
+        binfunc(&bins[0], req.startidx, req.startidx + req.numprims);
+    }
 
-        // Start with 1-bin right box
-        Bounds3D rightbox;
-        for (int32 i = m_NumBins - 1; i > 0; --i)
-        {
-            rightbox.Expand(bins[axis][i].bounds);
-            rightbounds[i - 1] = rightbox;
+    // Evaluate all dimensions
+    for (int32 axis = 0; axis < 3; ++axis)
+    {
+        // If the box is degenerate in that dimension skip it
+        if (centroidExtents[axis] == 0.f) {
+            continue;
         }
 
-        Bounds3D leftbox ;
-        int32 leftcount = 0;
-        int32 rightcount = req.numprims;
+        const Bin* axisbins = &bins[axis * m_NumBins];
 
-        // Start best SAH search
-        // i is current split candidate (split between i and i + 1)
-        float sahtmp = 0.f;
-        for (int32 i = 0; i < m_NumBins - 1; ++i)
+        // Check if it is better than what we found so far
+        int32 binidx = FindBestSplitBin(axisbins, req.numprims, invarea, sah);
+        if (binidx != -1)
         {
-            leftbox.Expand(bins[axis][i].bounds);
-            leftcount += bins[axis][i].count;
-            rightcount -= bins[axis][i].count;
-
-            // Compute SAH
-            sahtmp = m_TraversalCost + (leftcount * leftbox.Area() + rightcount * rightbounds[i].Area()) * invarea;
+            split.dim = axis;
+            splitidx = binidx;
 
-            // Check if it is better than what we found so far
-            if (sahtmp < sah)
+            SIMDBounds3D leftbox;
+            for (int32 i = 0; i <= binidx; ++i)
             {
-                split.dim = axis;
-                splitidx = i;
-                sah = sahtmp;
+                leftbox.Expand(axisbins[i].bounds);
+            }
 
-                // Calculate percentage of overlap 
-                split.overlap = Bounds3D::Intersection(leftbox, rightbounds[i]).Area() * invarea;
+            SIMDBounds3D rightbox;
+            for (int32 i = binidx + 1; i < m_NumBins; ++i)
+            {
+                rightbox.Expand(axisbins[i].bounds);
             }
+
+            // Calculate percentage of overlap 
+            split.overlap = SIMDBounds3D::Intersection(leftbox, rightbox).Area() * invarea;
         }
     }
 
@@ -315,101 +497,83 @@ SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(const SplitRequest& req, const P
     return split;
 }
 
-SplitBvh::SahSplit SplitBvh::FindSpatialSahSplit(const SplitRequest& req, const PrimRefArray& refs) const
+SplitBvh::SahSplit SplitBvh::FindSpatialSahSplit(const SplitRequest& req, const PrimRef* refs) const
 {
-    // SAH implementation
-    // calc centroids histogram
-    int32 const kNumBins = 128;
     // Set SAH to maximum float value as a start
-    auto sah = std::numeric_limits<float>::max();
-
     SahSplit split;
     split.dim   = 0;
     split.split = std::numeric_limits<float>::quiet_NaN();
-    split.sah   = sah;
+    split.sah   = std::numeric_limits<float>::max();
+    split.overlap = 0.f;
 
     // Extents
     Vector3 extents = req.bounds.Extents();
     auto invarea = 1.f / req.bounds.Area();
 
     // If there are too few primitives don't split them
-        
     if (Vector3::DotProduct(extents, extents) == 0.f)
     {
         return split;
     }
 
-    // Bin has start and exit counts + bounds
-    struct Bin
-    {
-        Bounds3D bounds;
-        int32 enter;
-        int32 exit;
-    };
-
-    Bin bins[3][kNumBins];
-
-    // Prepcompute some useful stuff
-    Vector3 origin     = req.bounds.min;
-    Vector3 binsize    = req.bounds.Extents() * (1.f / kNumBins);
-    Vector3 invbinsize = Vector3(1.f / binsize.x, 1.f / binsize.y, 1.f / binsize.z);
+    const int32 numbins = 3 * kNumSpatialBins;
+    SpatialBin bins[numbins];
 
-    // Initialize bins
-    for (int32 axis = 0; axis < 3; ++axis)
+    int32 numtasks = 1;
+    if (m_TaskPool)
     {
-        for (int32 i = 0; i < kNumBins; ++i)
-        {
-            bins[axis][i].bounds = Bounds3D();
-            bins[axis][i].enter = 0;
-            bins[axis][i].exit = 0;
-        }
+        numtasks = std::min(req.numprims / kMinRefsPerSpatialBinningTask, m_TaskPool->GetNumThreads() + 1);
+        numtasks = std::max(numtasks, 1);
     }
 
-    // Iterate thru all primitive refs
-    for (int32 i = req.startidx; i < req.startidx + req.numprims; ++i)
+    if (numtasks > 1)
     {
-        PrimRef const& primref(refs[i]);
-        // Determine starting bin for this primitive
-        Vector3 firstbin = Vector3::Clamp((primref.bounds.min - origin) * invbinsize, Vector3(0, 0, 0), Vector3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
-        // Determine finishing bin
-        Vector3 lastbin  = Vector3::Clamp((primref.bounds.max - origin) * invbinsize, firstbin, Vector3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
-        
-        // Iterate over axis
-        for (int32 axis = 0; axis < 3; ++axis)
+        // Every chunk gets its own bins, bounds and counts merge to the same result in any order
+        ScratchVector<SpatialBin> taskbins(numtasks * numbins);
+
         {
-            // Skip in case of a degenerate dimension
-            if (extents[axis] == 0.f) {
-                continue;
+            TaskGroup group(m_TaskPool);
+
+            for (int32 task = 0; task < numtasks; ++task)
+            {
+                int32 first = req.startidx + (int32)((int64)req.numprims * task / numtasks);
+                int32 last  = req.startidx + (int32)((int64)req.numprims * (task + 1) / numtasks);
+                SpatialBin* chunk = &taskbins[task * numbins];
+
+                group.Run([this, &req, refs, first, last, chunk]() {
+                    BinSpatialRefs(req, refs, first, last, chunk);
+                });
             }
 
-            // Break the prim into bins
-            auto tempref = primref;
+            group.Wait();
+        }
 
-            for (int32 j = (int32)firstbin[axis]; j < (int32)lastbin[axis]; ++j)
+        for (int32 i = 0; i < numbins; ++i)
+        {
+            bins[i] = taskbins[i];
+        }
+
+        for (int32 task = 1; task < numtasks; ++task)
+        {
+            const SpatialBin* chunk = &taskbins[task * numbins];
+            for (int32 i = 0; i < numbins; ++i)
             {
-                PrimRef leftref, rightref;
-                // Split primitive ref into left and right
-                float splitval = origin[axis] + binsize[axis] * (j + 1);
-                if (SplitPrimRef(tempref, axis, splitval, leftref, rightref))
-                {
-                    // Add left one
-                    bins[axis][j].bounds.Expand(leftref.bounds);
-                    // Save right to add part of it into the next bin
-                    tempref = rightref;
-                }
+                bins[i].bounds.Expand(chunk[i].bounds);
+                bins[i].enter += chunk[i].enter;
+                bins[i].exit  += chunk[i].exit;
             }
-
-            // Add the last piece into the last bin
-            bins[axis][(int32)lastbin[axis]].bounds.Expand(tempref.bounds);
-            // Adjust enter & exit counters
-            bins[axis][(int32)firstbin[axis]].enter++;
-            bins[axis][(int32)lastbin[axis]].exit++;
         }
     }
+    else
+    {
+        BinSpatialRefs(req, refs, req.startidx, req.startidx + req.numprims, bins);
+    }
+
+    Vector3 origin  = req.bounds.min;
+    Vector3 binsize = req.bounds.Extents() * (1.f / kNumSpatialBins);
 
     // Prepare moving window data
-    Bounds3D rightbounds[kNumBins - 1];
-    split.sah = std::numeric_limits<float>::max();
+    Bounds3D rightbounds[kNumSpatialBins - 1];
 
     // Iterate over axis
     for (int32 axis = 0; axis < 3; ++axis)
@@ -418,12 +582,14 @@ SplitBvh::SahSplit SplitBvh::FindSpatialSahSplit(const SplitRequest& req, const
         if (extents[axis] == 0.f) {
             continue;
         }
+
+        const SpatialBin* axisbins = &bins[axis * kNumSpatialBins];
             
         // Start with 1-bin right box
         Bounds3D rightbox = Bounds3D();
-        for (int32 i = kNumBins - 1; i > 0; --i)
+        for (int32 i = kNumSpatialBins - 1; i > 0; --i)
         {
-            rightbox = Bounds3D::Union(rightbox, bins[axis][i].bounds);
+            rightbox = Bounds3D::Union(rightbox, axisbins[i].bounds);
             rightbounds[i - 1] = rightbox;
         }
 
@@ -432,16 +598,16 @@ SplitBvh::SahSplit SplitBvh::FindSpatialSahSplit(const SplitRequest& req, const
         int32 rightcount = req.numprims;
 
         // Start moving border to the right
-        for (int32 i = 1; i < kNumBins; ++i)
+        for (int32 i = 1; i < kNumSpatialBins; ++i)
         {
             // New left box
-            leftbox.Expand(bins[axis][i - 1].bounds);
+            leftbox.Expand(axisbins[i - 1].bounds);
             // New left box count
-            leftcount += bins[axis][i - 1].enter;
+            leftcount += axisbins[i - 1].enter;
             // Adjust right box
-            rightcount -= bins[axis][i - 1].exit;
+            rightcount -= axisbins[i - 1].exit;
             // Calc SAH
-            float sah = m_TraversalCost + (leftbox.Area() * rightbounds[i - 1].Area() * rightcount)  * invarea;
+            float sah = m_TraversalCost + (leftbox.Area() * leftcount + rightbounds[i - 1].Area() * rightcount) * invarea;
 
             // Update SAH if it is needed
             if (sah < split.sah)
@@ -459,11 +625,90 @@ SplitBvh::SahSplit SplitBvh::FindSpatialSahSplit(const SplitRequest& req, const
     return split;
 }
 
+void SplitBvh::BinSpatialRefs(const SplitRequest& req, const PrimRef* refs, int32 first, int32 last, SpatialBin* bins) const
+{
+    // Prepcompute some useful stuff
+    Vector3 extents    = req.bounds.Extents();
+    Vector3 origin     = req.bounds.min;
+    Vector3 binsize    = extents * (1.f / kNumSpatialBins);
+    Vector3 invbinsize = Vector3(1.f / binsize.x, 1.f / binsize.y, 1.f / binsize.z);
+
+    // Initialize bins
+    for (int32 i = 0; i < 3 * kNumSpatialBins; ++i)
+    {
+        bins[i].bounds = Bounds3D();
+        bins[i].enter = 0;
+        bins[i].exit = 0;
+    }
+
+    // Iterate thru all primitive refs
+    for (int32 i = first; i < last; ++i)
+    {
+        PrimRef const& primref(refs[i]);
+        // Determine starting bin for this primitive
+        Vector3 firstbin = Vector3::Clamp((primref.bounds.min - origin) * invbinsize, Vector3(0, 0, 0), Vector3(kNumSpatialBins - 1, kNumSpatialBins - 1, kNumSpatialBins - 1));
+        // Determine finishing bin
+        Vector3 lastbin  = Vector3::Clamp((primref.bounds.max - origin) * invbinsize, firstbin, Vector3(kNumSpatialBins - 1, kNumSpatialBins - 1, kNumSpatialBins - 1));
+        
+        // Iterate over axis
+        for (int32 axis = 0; axis < 3; ++axis)
+        {
+            // Skip in case of a degenerate dimension
+            if (extents[axis] == 0.f) {
+                continue;
+            }
+
+            SpatialBin* axisbins = &bins[axis * kNumSpatialBins];
+
+            // Adjust enter & exit counters
+            axisbins[(int32)firstbin[axis]].enter++;
+            axisbins[(int32)lastbin[axis]].exit++;
+
+            // Each bin gets the part of the triangle inside its slab
+            if (m_Vertices)
+            {
+                for (int32 j = (int32)firstbin[axis]; j <= (int32)lastbin[axis]; ++j)
+                {
+                    float lo = std::max(origin[axis] + binsize[axis] * j, primref.bounds.min[axis]);
+                    float hi = std::min(origin[axis] + binsize[axis] * (j + 1), primref.bounds.max[axis]);
+
+                    Bounds3D part = Bounds3D::Intersection(primref.bounds, ClipTriangle(primref.idx, axis, lo, hi));
+                    if (!IsEmpty(part))
+                    {
+                        axisbins[j].bounds.Expand(part);
+                    }
+                }
+                continue;
+            }
+
+            // Break the prim into bins
+            auto tempref = primref;
+
+            for (int32 j = (int32)firstbin[axis]; j < (int32)lastbin[axis]; ++j)
+            {
+                PrimRef leftref, rightref;
+                // Split primitive ref into left and right
+                float splitval = origin[axis] + binsize[axis] * (j + 1);
+                if (SplitPrimRef(tempref, axis, splitval, leftref, rightref))
+                {
+                    // Add left one
+                    axisbins[j].bounds.Expand(leftref.bounds);
+                    // Save right to add part of it into the next bin
+                    tempref = rightref;
+                }
+            }
+
+            // Add the last piece into the last bin
+            axisbins[(int32)lastbin[axis]].bounds.Expand(tempref.bounds);
+        }
+    }
+}
+
 bool SplitBvh::SplitPrimRef(PrimRef const& ref, int32 axis, float split, PrimRef& leftref, PrimRef& rightref) const
 {
     // Start with left and right refs equal to original ref
-    leftref.idx    = rightref.idx = ref.idx;
-    leftref.bounds = rightref.bounds = ref.bounds;
+    leftref  = ref;
+    rightref = ref;
 
     // Only split if split value is within our bounds range
     if (split > ref.bounds.min[axis] && split < ref.bounds.max[axis])
@@ -472,12 +717,72 @@ bool SplitBvh::SplitPrimRef(PrimRef const& ref, int32 axis, float split, PrimRef
         leftref.bounds.max[axis]  = split;
         // Trim right box on the left
         rightref.bounds.min[axis] = split;
+
+        // The parts of the triangle are usually much smaller than the trimmed boxes.
+        // A ref already is a part of its triangle, so the result stays inside the ref bounds.
+        if (m_Vertices)
+        {
+            Bounds3D leftpart  = Bounds3D::Intersection(leftref.bounds, ClipTriangle(ref.idx, axis, ref.bounds.min[axis], split));
+            Bounds3D rightpart = Bounds3D::Intersection(rightref.bounds, ClipTriangle(ref.idx, axis, split, ref.bounds.max[axis]));
+
+            // Ref bounds are conservative, the triangle part inside may not reach the plane at all
+            if (IsEmpty(leftpart) || IsEmpty(rightpart))
+            {
+                leftref  = ref;
+                rightref = ref;
+                return false;
+            }
+
+            leftref.bounds  = leftpart;
+            rightref.bounds = rightpart;
+        }
+
+        // Partitioning goes by the centers of the pieces
+        leftref.center  = leftref.bounds.Center();
+        rightref.center = rightref.bounds.Center();
         return true;
     }
 
     return false;
 }
 
+Bounds3D SplitBvh::ClipTriangle(int32 prim, int32 axis, float lo, float hi) const
+{
+    const Vector3* v[3] = {
+        &m_Vertices[m_TriIndices[prim * 3 + 0]],
+        &m_Vertices[m_TriIndices[prim * 3 + 1]],
+        &m_Vertices[m_TriIndices[prim * 3 + 2]]
+    };
+
+    // The clipped polygon is spanned by the vertices inside the slab and the points where edges cross its planes
+    Bounds3D bounds;
+    for (int32 i = 0; i < 3; ++i)
+    {
+        const Vector3& a = *v[i];
+        const Vector3& b = *v[(i + 1) % 3];
+
+        if (a[axis] >= lo && a[axis] <= hi)
+        {
+            bounds.Expand(a);
+        }
+
+        const float planes[2] = { lo, hi };
+        for (int32 k = 0; k < 2; ++k)
+        {
+            float plane = planes[k];
+            if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane))
+            {
+                float t = (plane - a[axis]) / (b[axis] - a[axis]);
+                Vector3 p = a + (b - a) * t;
+                p[axis] = plane;
+                bounds.Expand(p);
+            }
+        }
+    }
+
+    return bounds;
+}
+
 void SplitBvh::SplitPrimRefs(SahSplit const& split, SplitRequest const& req, PrimRefArray& refs, int32& extra_refs)
 {
     // We are going to append new primitives at the end of the array
@@ -500,24 +805,32 @@ void SplitBvh::SplitPrimRefs(SahSplit const& split, SplitRequest const& req, Pri
     extra_refs = appendprims - req.numprims;
 }
 
-SplitBvh::Node* SplitBvh::AllocateNode()
+SplitBvh::Node* SplitBvh::AllocateNodes(int32 count)
 {
-    if (m_Nodecnt - m_NumNodesArchived >= m_NumNodesForRegular)
+    // Reserved nodes have to be consecutive, start a new chunk if they don't fit
+    if (count > m_ChunkFree)
     {
-        m_NodeArchive.push_back(std::move(m_Nodes));
-        m_NumNodesArchived += m_NumNodesForRegular;
-        m_Nodes = std::vector<Node>(m_NumNodesForRegular);
+        int32 chunksize = std::max(count, kNodeChunkSize);
+        m_NodeChunks.emplace_back(new Node[chunksize]);
+        m_ChunkNodes = m_NodeChunks.back().get();
+        m_ChunkFree  = chunksize;
     }
 
-    return &m_Nodes[m_Nodecnt++ - m_NumNodesArchived];
+    Node* node = m_ChunkNodes;
+    m_ChunkNodes += count;
+    m_ChunkFree  -= count;
+    m_Nodecnt    += count;
+    return node;
 }
 
 void SplitBvh::InitNodeAllocator(size_t maxnum)
 {
-    m_NodeArchive.clear();
-    m_Nodecnt = 0;
-    m_Nodes.resize(maxnum);
-
-    // Set root_ pointer
-    m_Root = &m_Nodes[0];
+    m_NodeChunks.clear();
+    m_NodeChunks.emplace_back(new Node[maxnum]);
+    m_Nodecnt    = 0;
+    m_ChunkNodes = m_NodeChunks.back().get();
+    m_ChunkFree  = (int32)maxnum;
+
+    // The root is the first node allocated
+    m_Root = m_ChunkNodes;
 }
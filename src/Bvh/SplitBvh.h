@@ -21,7 +21,7 @@
  ********************************************************************/
 #pragma once
 
-#include <list>
+#include <memory>
 
 #include "Bvh/Bvh.h"
 
@@ -35,13 +35,24 @@ public:
         , m_ExtraRefsBudget(extraRefsBudget)
         , m_NumNodesRequired(0)
         , m_NumNodesForRegular(0)
-        , m_NumNodesArchived(0)
+        , m_ChunkNodes(nullptr)
+        , m_ChunkFree(0)
+        , m_Vertices(nullptr)
+        , m_TriIndices(nullptr)
     {
 
     }
 
     ~SplitBvh() = default;
 
+    // Primitive i of the next Build is the triangle indices[3 * i .. 3 * i + 2], spatial splits then
+    // clip the triangle itself instead of its bounding box. The arrays are only read during Build.
+    void SetTriangles(const Vector3* vertices, const uint32* indices)
+    {
+        m_Vertices   = vertices;
+        m_TriIndices = indices;
+    }
+
 protected:
 
     struct PrimRef
@@ -53,6 +64,14 @@ protected:
     };
 
     using PrimRefArray = std::vector<PrimRef>;
+
+    // Spatial bins count the references starting and ending in them
+    struct SpatialBin
+    {
+        Bounds3D bounds;
+        int32 enter;
+        int32 exit;
+    };
         
     enum class SplitType
     {
@@ -60,19 +79,42 @@ protected:
         kSpatial
     };
 
+    // Subtree below the spatial split depth waiting to be built in its reserved ranges
+    struct SubtreeRequest
+    {
+        SplitRequest req;
+        Node* node;
+        int32 packedidx;
+        // Private copy of the subtree refs, the shared array keeps changing while spatial splits run
+        PrimRefArray refs;
+    };
+
     // Build function
     void BuildImpl(const Bounds3D* bounds, int32 numbounds) override;
     void BuildNode(SplitRequest& req, PrimRefArray& primrefs);
+
+    // Builds a subtree without spatial splits into node and the nodes following it,
+    // leaf indices go to m_PackedIndices starting at packedidx. Returns the subtree height.
+    int32 BuildSubtree(const SplitRequest& req, PrimRef* refs, Node* node, int32 packedidx);
         
-    SahSplit FindObjectSahSplit(const SplitRequest& req, const PrimRefArray& refs) const;
-    SahSplit FindSpatialSahSplit(const SplitRequest& req, const PrimRefArray& refs) const;
+    SahSplit FindObjectSahSplit(const SplitRequest& req, const PrimRef* refs) const;
+    SahSplit FindSpatialSahSplit(const SplitRequest& req, const PrimRef* refs) const;
+
+    // Chops refs [first, last) of req into the spatial bins of all three axes
+    void BinSpatialRefs(const SplitRequest& req, const PrimRef* refs, int32 first, int32 last, SpatialBin* bins) const;
         
     void SplitPrimRefs(const SahSplit& split, const SplitRequest& req, PrimRefArray& refs, int32& extra_refs);
     bool SplitPrimRef(const PrimRef& ref, int32 axis, float split, PrimRef& leftref, PrimRef& rightref) const;
 
+    // Bounds of the part of triangle prim between the planes lo and hi along axis
+    Bounds3D ClipTriangle(int32 prim, int32 axis, float lo, float hi) const;
+
+    // Partitions refs of req around border and fills child requests
+    void PartitionPrimRefs(const SplitRequest& req, PrimRef* refs, int32 axis, float border, SplitRequest& leftrequest, SplitRequest& rightrequest) const;
+
 protected:
 
-    Node* AllocateNode() override;
+    Node* AllocateNodes(int32 count) override;
 
     void InitNodeAllocator(size_t maxnum) override;
 
@@ -84,14 +126,17 @@ private:
     int32 m_NumNodesRequired;
     int32 m_NumNodesForRegular;
 
-    // Node archive for memory management
-    // As m_nodes fills up we archive it into m_node_archive
-    // allocate new chunk and work there.
-
-    // How many nodes have been archived so far
-    int32 m_NumNodesArchived;
-    // Container for archived chunks
-    std::list<std::vector<Node>> m_NodeArchive;
+    // Nodes are allocated from chunks that never move, so node pointers stay valid while the tree grows.
+    // Reserved ranges do not straddle chunks, the rest of a chunk too small for one is left unused.
+    std::vector<std::unique_ptr<Node[]>> m_NodeChunks;
+    // Next free node of the last chunk and the number of nodes left in it
+    Node* m_ChunkNodes;
+    int32 m_ChunkFree;
+    // Triangles of the current build, see SetTriangles
+    const Vector3* m_Vertices;
+    const uint32* m_TriIndices;
+    // Subtrees deferred for the parallel build
+    std::vector<SubtreeRequest> m_PendingSubtrees;
 
 private:
     SplitBvh(const SplitBvh& bvh) = delete;
@@ -4,12 +4,18 @@
 #define PROJECT_VERSION_MINOR 0
 #define PROJECT_VERSION_PATCH 0
 
-#if defined(_WIN64)
+#if defined(_WIN64) || defined(__x86_64__) || defined(__aarch64__)
     #define PLATFORM_64BITS 1
 #else
     #define PLATFORM_64BITS	0
 #endif
 
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+    #define PLATFORM_ENABLE_VECTORINTRINSICS 1
+#else
+    #define PLATFORM_ENABLE_VECTORINTRINSICS 0
+#endif
+
 typedef unsigned char 		uint8;
 typedef unsigned short int	uint16;
 typedef unsigned int		uint32;
@@ -3,10 +3,21 @@
 
 #include "Core/Scene.h"
 
+#include "Misc/JobManager.h"
+#include "Job/TaskGroup.h"
+
+#include "Parser/MeshCache.h"
 #include "Parser/stb_image_resize.h"
 
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+
+// Refit the whole TLAS once more than 1 / kMaxPartialRefitFraction of the renderers moved
+static const size_t kMaxPartialRefitFraction = 4;
+// Rebuild the TLAS once refitting made it this much more expensive to traverse
+static const float kMaxTLASCostRatio = 1.5f;
 
 GLScene::GLScene()
 {
@@ -18,8 +29,9 @@ GLScene::~GLScene()
 
 }
 
-bool GLScene::Init()
+bool GLScene::Init(bool headless)
 {
+    m_Headless      = headless;
     m_SceneTextures = nullptr;
 
     // camera
@@ -51,6 +63,7 @@ void GLScene::Free(bool freeHDR)
     m_Tangents.clear();
     m_Colors.clear();
     m_Transforms.clear();
+    m_InstanceBounds.clear();
     m_Scenes.clear();
 
     if (freeHDR)
@@ -258,6 +271,11 @@ int32 GLScene::AddHDR(HDRImagePtr hdr)
     int32 id = (int32)m_Hdrs.size();
     m_Hdrs.push_back(hdr);
 
+    if (m_Headless)
+    {
+        return id;
+    }
+
     IBLSampler* sampler = new IBLSampler();
     sampler->Init(hdr);
     m_IBLs.push_back(sampler);
@@ -265,56 +283,175 @@ int32 GLScene::AddHDR(HDRImagePtr hdr)
     return id;
 }
 
-void GLScene::Build()
+bool GLScene::Build()
 {
     CreateBLAS();
-    BuildMesheDatas();
+
+    // Wrapped indices would address the wrong triangles and nodes
+    if (!ValidateCapacity())
+    {
+        m_SceneBvh      = nullptr;
+        m_BvhTranslator = nullptr;
+        return false;
+    }
+
+    // Streams that can't be paged in would leave zeroed triangles in the tables
+    if (!BuildMesheDatas())
+    {
+        return false;
+    }
+
     BuildRendererDatas();
-    GenVertexBuffers();
-    GenIndexBuffers();
+
+    if (m_Headless)
+    {
+        return true;
+    }
+
+    if (!GenVertexBuffers() || !GenIndexBuffers())
+    {
+        return false;
+    }
+
     GenTextureArrays();
+
+    return true;
 }
 
-void GLScene::BuildMesheDatas()
+// Copies a mesh stream into its slot of a scene table, a shorter stream leaves the rest of the slot as it was
+template <typename T>
+static void CopyMeshStream(const std::vector<T>& stream, std::vector<T>& table, int64 offset, int64 count)
 {
-    // Copy mesh data
-    int32 verticesCnt = 0;
-    for (size_t i = 0; i < m_Meshes.size(); ++i)
+    size_t size = (size_t)std::min((int64)stream.size(), count);
+    if (size > 0)
+    {
+        memcpy(table.data() + offset, stream.data(), size * sizeof(T));
+    }
+}
+
+bool GLScene::BuildMesheDatas()
+{
+    // The frame waits on the copies, see CreateBLAS
+    TaskPriorityScope priority(TaskPriority::Interactive);
+
+    const int32 numMeshes = (int32)m_Meshes.size();
+
+    // Slot of every mesh in the tables, they are sized once and the meshes copied in parallel
+    std::vector<int64> vertexOffsets(numMeshes + 1, 0);
+    std::vector<int64> indexOffsets(numMeshes + 1, 0);
+    for (int32 i = 0; i < numMeshes; ++i)
     {
-        // Copy m_Indices from BVH and not from Mesh
-        const int32 numIndices  = (int32)m_Meshes[i]->bvh->GetNumIndices();
-        const int32* triIndices = m_Meshes[i]->bvh->GetIndices();
+        vertexOffsets[i + 1] = vertexOffsets[i] + m_Meshes[i]->NumVertices();
+        indexOffsets[i + 1]  = indexOffsets[i] + 3 * (int64)m_Meshes[i]->bvh->GetNumIndices();
+    }
+
+    int64 numVertices = vertexOffsets[numMeshes];
+    int64 numIndices  = indexOffsets[numMeshes];
 
-        for (int32 j = 0; j < numIndices; ++j)
+    if (m_IndexAddressing == IndexAddressing::ELinear)
+    {
+        // Flat tables for buffer textures, indices stay plain vertex indices
+        m_IndicesTexWidth = 0;
+        m_TriDataTexWidth = 0;
+    }
+    else
+    {
+        // Square textures, the padding is never addressed
+        m_IndicesTexWidth = GetSquareTexWidth(numIndices);
+        m_TriDataTexWidth = GetSquareTexWidth(numVertices);
+        numIndices  = (int64)m_IndicesTexWidth * m_IndicesTexWidth;
+        numVertices = (int64)m_TriDataTexWidth * m_TriDataTexWidth;
+    }
+
+    m_Indices.clear();
+    m_Positions.clear();
+    m_Normals.clear();
+    m_Uvs.clear();
+    m_Tangents.clear();
+    m_Colors.clear();
+
+    m_Indices.resize(numIndices);
+    m_Positions.resize(numVertices);
+    m_Normals.resize(numVertices);
+    m_Uvs.resize(numVertices);
+    m_Tangents.resize(numVertices);
+    m_Colors.resize(numVertices);
+
+    const int32 texWidth = m_TriDataTexWidth;
+    const IndexAddressing addressing = m_IndexAddressing;
+    std::atomic<bool> failed(false);
+
+    TaskGroup::ParallelFor(JobManager::TaskPool(), numMeshes, 1, [&](int32 first, int32 last) {
+        for (int32 i = first; i < last; ++i)
         {
-            m_Indices.push_back(triIndices[j] + verticesCnt);
+            Mesh& mesh = *m_Meshes[i];
+
+            // Out-of-core meshes are paged in for the copy, only the tables stay resident
+            bool paged = !mesh.resident;
+            if (!MeshCache::PageIn(mesh))
+            {
+                failed = true;
+                continue;
+            }
+
+            // Triangles in BVH leaf order, three vertex indices each
+            const int32 vertexOffset = (int32)vertexOffsets[i];
+            const int32 numTriangles = mesh.bvh->GetNumIndices();
+            const int32* triIndices  = mesh.bvh->GetIndices();
+            uint32* indices = m_Indices.data() + indexOffsets[i];
+
+            for (int32 j = 0; j < numTriangles; ++j)
+            {
+                indices[j * 3 + 0] = PackTexelIndex(mesh.indices[triIndices[j] * 3 + 0] + vertexOffset, texWidth, addressing);
+                indices[j * 3 + 1] = PackTexelIndex(mesh.indices[triIndices[j] * 3 + 1] + vertexOffset, texWidth, addressing);
+                indices[j * 3 + 2] = PackTexelIndex(mesh.indices[triIndices[j] * 3 + 2] + vertexOffset, texWidth, addressing);
+            }
+
+            const int64 count = vertexOffsets[i + 1] - vertexOffsets[i];
+            CopyMeshStream(mesh.positions, m_Positions, vertexOffsets[i], count);
+            CopyMeshStream(mesh.normals, m_Normals, vertexOffsets[i], count);
+            CopyMeshStream(mesh.uvs, m_Uvs, vertexOffsets[i], count);
+            CopyMeshStream(mesh.tangents, m_Tangents, vertexOffsets[i], count);
+            CopyMeshStream(mesh.colors, m_Colors, vertexOffsets[i], count);
+
+            if (paged)
+            {
+                MeshCache::PageOut(mesh);
+            }
         }
+    });
+
+    return !failed;
+}
 
-        verticesCnt += (int32)m_Meshes[i]->positions.size();
+bool GLScene::ValidateCapacity()
+{
+    int64 numVertices = 0;
+    int64 numIndices  = 0;
+    int64 numNodes    = 2 * (int64)m_Renderers.size();
 
-        m_Positions.insert(m_Positions.begin(), m_Meshes[i]->positions.begin(), m_Meshes[i]->positions.end());
-        m_Normals.insert(m_Normals.begin(), m_Meshes[i]->normals.begin(), m_Meshes[i]->normals.end());
-        m_Uvs.insert(m_Uvs.begin(), m_Meshes[i]->uvs.begin(), m_Meshes[i]->uvs.end());
-        m_Tangents.insert(m_Tangents.begin(), m_Meshes[i]->tangents.begin(), m_Meshes[i]->tangents.end());
-        m_Colors.insert(m_Colors.begin(), m_Meshes[i]->colors.begin(), m_Meshes[i]->colors.end());
+    for (size_t i = 0; i < m_Meshes.size(); ++i)
+    {
+        numVertices += m_Meshes[i]->NumVertices();
+        numIndices  += 3 * (int64)m_Meshes[i]->bvh->GetNumIndices();
+        numNodes    += m_Meshes[i]->bvh->GetNumNodes();
     }
 
-    // Resize to power of 2
-    m_IndicesTexWidth = (int32)(MMath::Sqrt((float)m_Indices.size()) + 1);
-    m_TriDataTexWidth = (int32)(MMath::Sqrt((float)m_Positions.size()) + 1);
+    // One mode for all tables, a single table over the packed limit switches the whole scene
+    m_IndexAddressing = m_RequestedAddressing;
+    bool valid = ValidateTexelCapacity("Vertices", numVertices, m_IndexAddressing);
+    valid = ValidateTexelCapacity("Indices", numIndices, m_IndexAddressing) && valid;
+    valid = ValidateTexelCapacity("Bvh nodes", numNodes, m_IndexAddressing) && valid;
 
-    m_Indices.resize(m_IndicesTexWidth * m_IndicesTexWidth);
-    m_Positions.resize(m_TriDataTexWidth * m_TriDataTexWidth);
-    m_Normals.resize(m_TriDataTexWidth * m_TriDataTexWidth);
-    m_Uvs.resize(m_TriDataTexWidth * m_TriDataTexWidth);
-    m_Tangents.resize(m_TriDataTexWidth * m_TriDataTexWidth);
-    m_Colors.resize(m_TriDataTexWidth * m_TriDataTexWidth);
-
-    // update indices
-    for (size_t i = 0; i < m_Indices.size(); ++i)
+    if (!valid)
     {
-        m_Indices[i] = ((m_Indices[i] % m_TriDataTexWidth) << 12) | (m_Indices[i] / m_TriDataTexWidth);
+        LOGE("Scene capacity: %lld vertices, %lld indices, %lld bvh nodes exceed 32 bit indices, the scene is not built.\n", (long long)numVertices, (long long)numIndices, (long long)numNodes);
+        return false;
     }
+
+    LOGI("Scene capacity: %lld vertices, %lld indices, %lld bvh nodes, %s addressing.\n", (long long)numVertices, (long long)numIndices, (long long)numNodes, m_IndexAddressing == IndexAddressing::ELinear ? "linear" : "packed xy");
+
+    return true;
 }
 
 void GLScene::BuildRendererDatas()
@@ -323,7 +460,11 @@ void GLScene::BuildRendererDatas()
     
     // Flatten BVH
     m_BvhTranslator = std::make_shared<BvhTranslator>();
+    m_BvhTranslator->addressing = m_IndexAddressing;
+    m_BvhTranslator->layout     = m_BvhLayout;
+    m_BvhTranslator->SetTaskPool(JobManager::TaskPool());
     m_BvhTranslator->Process(m_SceneBvh, m_Meshes, m_Renderers);
+    m_BvhTranslator->ProcessWide(m_WideBvhWidth);
 
     // Copy transforms
     m_Transforms.resize(m_Renderers.size());
@@ -335,64 +476,144 @@ void GLScene::BuildRendererDatas()
 
 void GLScene::RebuildRendererDatas()
 {
-    CreateTLAS();
+    if (!m_SceneBvh || !m_BvhTranslator)
+    {
+        return;
+    }
 
-    m_BvhTranslator->UpdateTLAS(m_SceneBvh, m_Renderers);
+    std::vector<int32> changed;
+    for (int32 i = 0; i < (int32)m_Renderers.size(); i++)
+    {
+        if (m_Nodes[m_Renderers[i].nodeID]->instanceDirty)
+        {
+            changed.push_back(i);
+        }
+    }
 
-    for (int32 i = 0; i < m_Renderers.size(); i++) 
+    if (changed.empty())
     {
-        m_Transforms[i] = m_Nodes[m_Renderers[i].nodeID]->GetGlobalTransform();
+        return;
     }
+
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+        Object3DPtr node = m_Nodes[m_Renderers[changed[i]].nodeID];
+        m_InstanceBounds[changed[i]] = CalcInstanceBounds(changed[i]);
+        m_Transforms[changed[i]]     = node->GetGlobalTransform();
+    }
+
+    // A node can own several renderers, clear after all of them were picked up
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+        m_Nodes[m_Renderers[changed[i]].nodeID]->instanceDirty = false;
+    }
+
+    std::vector<int32> tlasNodes;
+    bool refitAll = changed.size() * kMaxPartialRefitFraction > m_Renderers.size();
+
+    if (refitAll)
+    {
+        m_SceneBvh->Refit(&m_InstanceBounds[0]);
+    }
+    else
+    {
+        m_SceneBvh->RefitPrimitives(&m_InstanceBounds[0], &changed[0], (int32)changed.size(), &tlasNodes);
+    }
+
+    if (m_SceneBvh->GetCostRatio() > kMaxTLASCostRatio)
+    {
+        BuildTLAS();
+        m_BvhTranslator->UpdateTLAS(m_SceneBvh, m_Renderers);
+    }
+    else if (refitAll)
+    {
+        m_BvhTranslator->UpdateTLAS(m_SceneBvh, m_Renderers);
+    }
+    else
+    {
+        m_BvhTranslator->UpdateTLASBounds(tlasNodes);
+    }
+
+    m_SceneBounds = m_SceneBvh->Bounds();
+}
+
+Bounds3D GLScene::CalcInstanceBounds(int32 renderer)
+{
+    Bounds3D aabb    = m_Meshes[m_Renderers[renderer].meshID]->bvh->Bounds();
+    Matrix4x4 matrix = m_Nodes[m_Renderers[renderer].nodeID]->GetGlobalTransform();
+    Vector3 minBound = aabb.min;
+    Vector3 maxBound = aabb.max;
+
+    Vector3 right       = Vector3(matrix.m[0][0], matrix.m[0][1], matrix.m[0][2]);
+    Vector3 up          = Vector3(matrix.m[1][0], matrix.m[1][1], matrix.m[1][2]);
+    Vector3 forward     = Vector3(matrix.m[2][0], matrix.m[2][1], matrix.m[2][2]);
+    Vector3 translation = Vector3(matrix.m[3][0], matrix.m[3][1], matrix.m[3][2]);
+
+    Vector3 xa = minBound.x * right;
+    Vector3 xb = maxBound.x * right;
+    Vector3 ya = minBound.y * up;
+    Vector3 yb = maxBound.y * up;
+    Vector3 za = minBound.z * forward;
+    Vector3 zb = maxBound.z * forward;
+
+    Bounds3D bounds;
+    bounds.min = Vector3::Min(xa, xb) + Vector3::Min(ya, yb) + Vector3::Min(za, zb) + translation;
+    bounds.max = Vector3::Max(xa, xb) + Vector3::Max(ya, yb) + Vector3::Max(za, zb) + translation;
+
+    return bounds;
 }
 
 void GLScene::CreateTLAS()
 {
-    std::vector<Bounds3D> bounds;
-    bounds.resize(m_Renderers.size());
+    m_InstanceBounds.resize(m_Renderers.size());
 
     for (size_t i = 0; i < m_Renderers.size(); i++)
     {
-        Bounds3D aabb    = m_Meshes[m_Renderers[i].meshID]->bvh->Bounds();
-        Matrix4x4 matrix = m_Nodes[m_Renderers[i].nodeID]->GetGlobalTransform();
-        Vector3 minBound = aabb.min;
-        Vector3 maxBound = aabb.max;
-
-        Vector3 right       = Vector3(matrix.m[0][0], matrix.m[0][1], matrix.m[0][2]);
-        Vector3 up          = Vector3(matrix.m[1][0], matrix.m[1][1], matrix.m[1][2]);
-        Vector3 forward     = Vector3(matrix.m[2][0], matrix.m[2][1], matrix.m[2][2]);
-        Vector3 translation = Vector3(matrix.m[3][0], matrix.m[3][1], matrix.m[3][2]);
-
-        Vector3 xa = minBound.x * right;
-        Vector3 xb = maxBound.x * right;
-        Vector3 ya = minBound.y * up;
-        Vector3 yb = maxBound.y * up;
-        Vector3 za = minBound.z * forward;
-        Vector3 zb = maxBound.z * forward;
+        m_InstanceBounds[i] = CalcInstanceBounds((int32)i);
+    }
 
-        bounds[i].min = Vector3::Min(xa, xb) + Vector3::Min(ya, yb) + Vector3::Min(za, zb) + translation;
-        bounds[i].max = Vector3::Max(xa, xb) + Vector3::Max(ya, yb) + Vector3::Max(za, zb) + translation;
+    for (size_t i = 0; i < m_Renderers.size(); i++)
+    {
+        m_Nodes[m_Renderers[i].nodeID]->instanceDirty = false;
     }
 
+    BuildTLAS();
+}
+
+void GLScene::BuildTLAS()
+{
     m_SceneBvh = std::make_shared<Bvh>(10.0f, 64, false);
-    m_SceneBvh->Build(&bounds[0], (int32)bounds.size());
+    m_SceneBvh->Build(&m_InstanceBounds[0], (int32)m_InstanceBounds.size());
 
     m_SceneBounds = m_SceneBvh->Bounds();
 }
 
 void GLScene::CreateBLAS()
 {
+    // The frame waits on these builds, their tasks go ahead of loads still running on the pool
+    TaskPriorityScope priority(TaskPriority::Interactive);
+
     for (size_t i = 0; i < m_Meshes.size(); ++i)
     {
         auto mesh = m_Meshes[i];
         if (mesh->bvh)
         {
+            bool paged = !mesh->resident;
+            if (mesh->bvhDirty && MeshCache::PageIn(*mesh))
+            {
+                mesh->RefitBVH(JobManager::TaskPool());
+                if (paged)
+                {
+                    MeshCache::PageOut(*mesh);
+                }
+            }
             continue;
         }
-        mesh->BuildBVH();
+        mesh->BuildBVH(JobManager::TaskPool());
     }
 }
 
-void GLScene::GenVertexBuffers()
+bool GLScene::GenVertexBuffers()
 {
     m_VAOs.resize(m_Meshes.size());
     m_VertexBuffers0.resize(m_Meshes.size());
@@ -403,7 +624,12 @@ void GLScene::GenVertexBuffers()
 
     for (size_t i = 0; i < m_Meshes.size(); ++i)
     {
-        auto mesh = m_Meshes[i];
+        auto mesh  = m_Meshes[i];
+        bool paged = !mesh->resident;
+        if (!MeshCache::PageIn(*mesh))
+        {
+            return false;
+        }
 
         // vbo
         {
@@ -458,17 +684,37 @@ void GLScene::GenVertexBuffers()
             glBindVertexArray(0);
             glBindBuffer(GL_ARRAY_BUFFER, 0);
         }
+
+        if (paged)
+        {
+            MeshCache::PageOut(*mesh);
+        }
     }
+
+    return true;
 }
 
-void GLScene::GenIndexBuffers()
+bool GLScene::GenIndexBuffers()
 {
     m_IndexBuffers.resize(m_Meshes.size());
     for (size_t i = 0; i < m_Meshes.size(); ++i)
     {
+        bool paged = !m_Meshes[i]->resident;
+        if (!MeshCache::PageIn(*m_Meshes[i]))
+        {
+            return false;
+        }
+
         m_IndexBuffers[i] = new IndexBuffer();
         m_IndexBuffers[i]->Upload((uint8*)(m_Meshes[i]->indices.data()), (int32)(m_Meshes[i]->indices.size() * sizeof(uint32)));
+
+        if (paged)
+        {
+            MeshCache::PageOut(*m_Meshes[i]);
+        }
     }
+
+    return true;
 }
 
 void GLScene::GenTextureArrays()
@@ -22,7 +22,13 @@ public:
 
     virtual ~GLScene();
 
-    bool Init();
+    // A headless scene only keeps the cpu side tables, no gl object is created
+    bool Init(bool headless = false);
+
+    FORCEINLINE bool IsHeadless() const
+    {
+        return m_Headless;
+    }
 
     void Free(bool freeHDR = false);
 
@@ -44,10 +50,39 @@ public:
 
     void AddScene(Scene3DPtr scene3D);
 
-    void Build();
+    // False when a table does not fit 32 bit indices. Nothing is built or uploaded then,
+    // the scene has no bvh and renders nothing.
+    bool Build();
 
+    // Refits the top level BVH for renderers whose node transform changed since the last call.
+    // The tree is rebuilt from the cached instance bounds once refitting degraded it too much.
     void RebuildRendererDatas();
 
+    // Addressing to try on the next Build, large scenes fall back to linear addressing
+    FORCEINLINE void SetIndexAddressing(IndexAddressing addressing)
+    {
+        m_RequestedAddressing = addressing;
+    }
+
+    // Node order of the flattened bvh on the next Build
+    FORCEINLINE void SetBvhLayout(BvhLayout layout)
+    {
+        m_BvhLayout = layout;
+    }
+
+    // 4 or 8 collapses the bvh into wide nodes on the next Build, the cpu tracer can traverse them.
+    // 0 skips the collapse, nothing uploads the wide nodes to the gpu.
+    FORCEINLINE void SetWideBvhWidth(int32 width)
+    {
+        m_WideBvhWidth = width;
+    }
+
+    // Addressing used by the index and bvh node tables of the last Build
+    FORCEINLINE IndexAddressing GetIndexAddressing() const
+    {
+        return m_IndexAddressing;
+    }
+
     FORCEINLINE CameraPtr GetCamera() const
     {
         return m_Camera;
@@ -83,6 +118,59 @@ public:
         return m_Renderers;
     }
 
+    FORCEINLINE const MaterialArray& Materials() const
+    {
+        return m_Materials;
+    }
+
+    FORCEINLINE const TextureArray& Textures() const
+    {
+        return m_Textures;
+    }
+
+    FORCEINLINE const HDRImageArray& HDRs() const
+    {
+        return m_Hdrs;
+    }
+
+    // Three vertex indices per triangle in BVH leaf order, packed like the bvh nodes
+    FORCEINLINE const std::vector<uint32>& Indices() const
+    {
+        return m_Indices;
+    }
+
+    FORCEINLINE const std::vector<Vector3>& Positions() const
+    {
+        return m_Positions;
+    }
+
+    FORCEINLINE const std::vector<Vector3>& Normals() const
+    {
+        return m_Normals;
+    }
+
+    FORCEINLINE const std::vector<Vector2>& Uvs() const
+    {
+        return m_Uvs;
+    }
+
+    // Global transform of every renderer
+    FORCEINLINE const std::vector<Matrix4x4>& Transforms() const
+    {
+        return m_Transforms;
+    }
+
+    // Side of the square vertex data texture, 0 with linear addressing
+    FORCEINLINE int32 GetTriDataTexWidth() const
+    {
+        return m_TriDataTexWidth;
+    }
+
+    FORCEINLINE std::shared_ptr<BvhTranslator> GetBvhTranslator() const
+    {
+        return m_BvhTranslator;
+    }
+
     FORCEINLINE const GLTexture* SceneTextures() const
     {
         return m_SceneTextures;
@@ -131,13 +219,19 @@ private:
 
     void CreateTLAS();
 
-    void BuildMesheDatas();
+    void BuildTLAS();
+
+    Bounds3D CalcInstanceBounds(int32 renderer);
+
+    bool ValidateCapacity();
+
+    bool BuildMesheDatas();
 
     void BuildRendererDatas();
 
-    void GenVertexBuffers();
+    bool GenVertexBuffers();
 
-    void GenIndexBuffers();
+    bool GenIndexBuffers();
 
     void GenTextureArrays();
     
@@ -162,9 +256,14 @@ protected:
     std::vector<Vector4>            m_Tangents;
     std::vector<Vector4>            m_Colors;
     std::vector<Matrix4x4>          m_Transforms;
+    std::vector<Bounds3D>           m_InstanceBounds;
     
     int32					        m_IndicesTexWidth;
     int32						    m_TriDataTexWidth;
+    IndexAddressing                 m_RequestedAddressing = IndexAddressing::EPackedXY;
+    IndexAddressing                 m_IndexAddressing = IndexAddressing::EPackedXY;
+    BvhLayout                       m_BvhLayout = BvhLayout::EDepthFirst;
+    int32                           m_WideBvhWidth = 0;
 
     std::shared_ptr<BvhTranslator>  m_BvhTranslator;
     std::shared_ptr<Bvh>            m_SceneBvh;
@@ -178,6 +277,7 @@ protected:
     std::vector<GLuint>             m_VAOs;
     GLTexture*                      m_SceneTextures;
     std::vector<IBLSampler*>        m_IBLs;
+    bool                            m_Headless = false;
 };
 
 typedef std::shared_ptr<GLScene> GLScenePtr;
@@ -0,0 +1,31 @@
+﻿#pragma once
+
+#include "Math/PlatformAtomics.h"
+
+// Flag shared between a job and the code that may want to stop it.
+// Cancellation is cooperative, long running work polls IsCancelled() between chunks
+// and leaves early with a result that is valid but incomplete.
+class CancellationToken
+{
+public:
+
+    CancellationToken()
+        : m_Cancelled(0)
+    {
+
+    }
+
+    void Cancel()
+    {
+        PlatformAtomics::InterlockedExchange(&m_Cancelled, 1);
+    }
+
+    bool IsCancelled() const
+    {
+        return PlatformAtomics::AtomicRead(&m_Cancelled) == 1;
+    }
+
+private:
+
+    volatile int32 m_Cancelled;
+};
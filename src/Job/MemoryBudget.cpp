@@ -0,0 +1,48 @@
+﻿#include "Job/MemoryBudget.h"
+#include "Job/TaskThreadPool.h"
+
+#include <thread>
+
+MemoryBudget::MemoryBudget(uint64 limit)
+    : m_Limit(limit)
+    , m_Used(0)
+    , m_Peak(0)
+{
+
+}
+
+bool MemoryBudget::TryAcquire(uint64 bytes)
+{
+    uint64 used = m_Used.load(std::memory_order_relaxed);
+    do
+    {
+        if (used > 0 && used + bytes > m_Limit)
+        {
+            return false;
+        }
+    } while (!m_Used.compare_exchange_weak(used, used + bytes, std::memory_order_acquire, std::memory_order_relaxed));
+
+    uint64 peak = m_Peak.load(std::memory_order_relaxed);
+    while (used + bytes > peak && !m_Peak.compare_exchange_weak(peak, used + bytes, std::memory_order_relaxed))
+    {
+
+    }
+
+    return true;
+}
+
+void MemoryBudget::Acquire(uint64 bytes, TaskThreadPool* pool)
+{
+    while (!TryAcquire(bytes))
+    {
+        if (pool == nullptr || !pool->RunPendingTask(TaskThreadPool::GetCurrentPriority()))
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void MemoryBudget::Release(uint64 bytes)
+{
+    m_Used.fetch_sub(bytes, std::memory_order_release);
+}
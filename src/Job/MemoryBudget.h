@@ -0,0 +1,47 @@
+﻿#pragma once
+
+#include "Math/Math.h"
+
+#include <atomic>
+
+class TaskThreadPool;
+
+// Bytes that work in flight may hold at once. Producers acquire before they start work and the
+// work releases the bytes once its memory is gone. A request larger than the whole budget is
+// still admitted once nothing else is held, so the budget can not stall the producer forever.
+class MemoryBudget
+{
+public:
+
+    MemoryBudget(uint64 limit);
+
+    bool TryAcquire(uint64 bytes);
+
+    // Runs queued tasks of pool at the current priority or higher until the bytes fit. Only call it from threads that hold
+    // nothing themselves, the bytes it waits for are released by other work.
+    void Acquire(uint64 bytes, TaskThreadPool* pool);
+
+    void Release(uint64 bytes);
+
+    FORCEINLINE uint64 GetLimit() const
+    {
+        return m_Limit;
+    }
+
+    FORCEINLINE uint64 GetPeak() const
+    {
+        return m_Peak.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    MemoryBudget(const MemoryBudget& budget) = delete;
+
+    MemoryBudget& operator = (const MemoryBudget& budget) = delete;
+
+private:
+
+    uint64                  m_Limit;
+    std::atomic<uint64>     m_Used;
+    std::atomic<uint64>     m_Peak;
+};
@@ -0,0 +1,141 @@
+﻿#include "Job/TaskGraph.h"
+#include "Job/TaskThreadPool.h"
+
+#include <thread>
+
+GraphTask::GraphTask(TaskThreadPool* pool, const std::function<void()>& func)
+    : m_Pool(pool)
+    , m_Func(func)
+    , m_NumPending(0)
+    , m_Completed(false)
+{
+
+}
+
+GraphTask::~GraphTask()
+{
+
+}
+
+void GraphTask::Wait()
+{
+    while (!IsDone())
+    {
+        if (m_Pool == nullptr || !m_Pool->RunPendingTask(TaskThreadPool::GetCurrentPriority()))
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void GraphTask::DoThreadedWork()
+{
+    if (m_Func)
+    {
+        m_Func();
+    }
+}
+
+void GraphTask::OnComplete()
+{
+    // The pool drops its pointer after this call, the local reference outlives the member
+    TaskHandle self = m_Self;
+    m_Self = nullptr;
+
+    std::vector<TaskHandle> continuations;
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Completed = true;
+        continuations.swap(m_Continuations);
+    }
+
+    ThreadTask::OnComplete();
+
+    for (size_t i = 0; i < continuations.size(); ++i)
+    {
+        continuations[i]->PrerequisiteDone();
+    }
+}
+
+void GraphTask::Abandon()
+{
+    DoThreadedWork();
+    OnComplete();
+}
+
+void GraphTask::AddContinuation(const TaskHandle& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (!m_Completed)
+        {
+            m_Continuations.push_back(task);
+            return;
+        }
+    }
+
+    task->PrerequisiteDone();
+}
+
+void GraphTask::PrerequisiteDone()
+{
+    if (PlatformAtomics::InterlockedDecrement(&m_NumPending) == 0)
+    {
+        Schedule();
+    }
+}
+
+void GraphTask::Schedule()
+{
+    // Joins have no work, a pool round trip would only add latency
+    if (m_Pool == nullptr || !m_Func)
+    {
+        DoThreadedWork();
+        OnComplete();
+        return;
+    }
+
+    m_Self = shared_from_this();
+    m_Pool->AddTask(this);
+}
+
+TaskHandle TaskGraph::Launch(TaskThreadPool* pool, const std::function<void()>& func, const std::vector<TaskHandle>& prerequisites)
+{
+    TaskHandle task = std::make_shared<GraphTask>(pool, func);
+    task->SetPriority(TaskThreadPool::GetCurrentPriority());
+
+    // One extra count so the task can not start before every prerequisite was registered
+    task->m_NumPending = (int32)prerequisites.size() + 1;
+
+    for (size_t i = 0; i < prerequisites.size(); ++i)
+    {
+        if (prerequisites[i])
+        {
+            prerequisites[i]->AddContinuation(task);
+        }
+        else
+        {
+            task->PrerequisiteDone();
+        }
+    }
+
+    task->PrerequisiteDone();
+
+    return task;
+}
+
+TaskHandle TaskGraph::WhenAll(TaskThreadPool* pool, const std::vector<TaskHandle>& tasks)
+{
+    return Launch(pool, nullptr, tasks);
+}
+
+void TaskGraph::WaitAll(const std::vector<TaskHandle>& tasks)
+{
+    for (size_t i = 0; i < tasks.size(); ++i)
+    {
+        if (tasks[i])
+        {
+            tasks[i]->Wait();
+        }
+    }
+}
@@ -0,0 +1,75 @@
+﻿#pragma once
+
+#include "Job/ThreadTask.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+
+class TaskThreadPool;
+class GraphTask;
+
+typedef std::shared_ptr<GraphTask> TaskHandle;
+
+// Node of a task graph. It is queued on the pool once all of its prerequisites completed and
+// releases its continuations when it completes itself. Without a pool it runs on the thread
+// that completed its last prerequisite.
+class GraphTask : public ThreadTask, public std::enable_shared_from_this<GraphTask>
+{
+public:
+
+    GraphTask(TaskThreadPool* pool, const std::function<void()>& func);
+
+    virtual ~GraphTask();
+
+    // Returns once the task completed, runs other queued tasks of the pool meanwhile, only
+    // those of the current priority or higher.
+    // Safe to call from pool workers.
+    void Wait();
+
+    virtual void DoThreadedWork() override;
+
+    // Also releases the continuations
+    virtual void OnComplete() override;
+
+    // The pool is shutting down, runs the task on the calling thread so the graph still completes
+    virtual void Abandon() override;
+
+private:
+
+    friend class TaskGraph;
+
+    void AddContinuation(const TaskHandle& task);
+
+    void PrerequisiteDone();
+
+    void Schedule();
+
+private:
+
+    TaskThreadPool*             m_Pool;
+    std::function<void()>       m_Func;
+    volatile int32              m_NumPending;
+
+    std::mutex                  m_Mutex;
+    std::vector<TaskHandle>     m_Continuations;
+    bool                        m_Completed;
+
+    // Keeps the task alive while the pool holds it
+    TaskHandle                  m_Self;
+};
+
+class TaskGraph
+{
+public:
+
+    // Runs func on the pool once every prerequisite completed, null prerequisites count as completed.
+    // The task gets the priority of the calling thread.
+    static TaskHandle Launch(TaskThreadPool* pool, const std::function<void()>& func, const std::vector<TaskHandle>& prerequisites = std::vector<TaskHandle>());
+
+    // Completes once all tasks completed, without occupying a pool thread
+    static TaskHandle WhenAll(TaskThreadPool* pool, const std::vector<TaskHandle>& tasks);
+
+    static void WaitAll(const std::vector<TaskHandle>& tasks);
+};
@@ -0,0 +1,103 @@
+﻿#include "Job/TaskGroup.h"
+#include "Job/TaskThreadPool.h"
+
+#include <thread>
+#include <algorithm>
+
+TaskGroup::TaskGroup(TaskThreadPool* pool)
+    : m_Pool(pool)
+{
+
+}
+
+TaskGroup::~TaskGroup()
+{
+    Wait();
+}
+
+void TaskGroup::Run(const std::function<void()>& func)
+{
+    if (m_Pool == nullptr)
+    {
+        func();
+        return;
+    }
+
+    FunctionTask* task = new FunctionTask(func);
+    task->SetPriority(TaskThreadPool::GetCurrentPriority());
+    m_Tasks.push_back(task);
+    m_Pool->AddTask(task);
+}
+
+void TaskGroup::Wait()
+{
+    // Newest tasks first, they are the most likely to still sit in the queue
+    for (int32 i = (int32)m_Tasks.size() - 1; i >= 0; --i)
+    {
+        FunctionTask* task = m_Tasks[i];
+
+        if (m_Pool->RetractTask(task))
+        {
+            task->DoThreadedWork();
+            task->OnComplete();
+        }
+
+        while (!task->IsDone())
+        {
+            // Pool refused the task while shutting down, nobody else will run it
+            if (task->IsAbandoned())
+            {
+                task->DoThreadedWork();
+                task->OnComplete();
+                break;
+            }
+
+            // Help with other queued work, it may be what the task is waiting for. Lower lanes stay
+            // queued, an interactive wait must not run a whole load job inline.
+            if (!m_Pool->RunPendingTask(TaskThreadPool::GetCurrentPriority()))
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    for (size_t i = 0; i < m_Tasks.size(); ++i)
+    {
+        delete m_Tasks[i];
+    }
+
+    m_Tasks.clear();
+}
+
+void TaskGroup::ParallelFor(TaskThreadPool* pool, int32 count, int32 grainSize, const std::function<void(int32, int32)>& func)
+{
+    int32 numtasks = 1;
+    if (pool != nullptr && grainSize > 0)
+    {
+        // A few chunks per thread to even out uneven work
+        numtasks = std::min(count / grainSize, 4 * (pool->GetNumThreads() + 1));
+    }
+
+    if (numtasks <= 1)
+    {
+        if (count > 0)
+        {
+            func(0, count);
+        }
+        return;
+    }
+
+    TaskGroup group(pool);
+
+    for (int32 task = 0; task < numtasks; ++task)
+    {
+        int32 first = (int32)((int64)count * task / numtasks);
+        int32 last  = (int32)((int64)count * (task + 1) / numtasks);
+
+        group.Run([&func, first, last]() {
+            func(first, last);
+        });
+    }
+
+    group.Wait();
+}
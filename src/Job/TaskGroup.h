@@ -0,0 +1,75 @@
+﻿#pragma once
+
+#include "Job/ThreadTask.h"
+
+#include <vector>
+#include <functional>
+
+class TaskThreadPool;
+
+// Runs a batch of functions on a TaskThreadPool and waits for all of them.
+// Wait() pulls tasks that are still queued back out of the pool, or runs other
+// queued tasks of its own priority or higher while it waits, so a group can be waited on
+// from inside a pool worker.
+// Without a pool every function runs inline in Run(). Tasks get the priority of the calling thread.
+class TaskGroup
+{
+private:
+
+    class FunctionTask : public ThreadTask
+    {
+    public:
+
+        FunctionTask(const std::function<void()>& func)
+            : m_Func(func)
+            , m_Abandoned(0)
+        {
+
+        }
+
+        virtual void DoThreadedWork() override
+        {
+            m_Func();
+        }
+
+        virtual void Abandon() override
+        {
+            PlatformAtomics::InterlockedExchange(&m_Abandoned, 1);
+        }
+
+        bool IsAbandoned() const
+        {
+            return PlatformAtomics::AtomicRead(&m_Abandoned) == 1;
+        }
+
+    private:
+
+        std::function<void()>   m_Func;
+        volatile int32          m_Abandoned;
+    };
+
+public:
+
+    TaskGroup(TaskThreadPool* pool);
+
+    ~TaskGroup();
+
+    void Run(const std::function<void()>& func);
+
+    void Wait();
+
+    // Calls func(first, last) for chunks of [0, count) with at least grainSize items each
+    // and returns when all of them are done. Runs inline without a pool or for small ranges.
+    static void ParallelFor(TaskThreadPool* pool, int32 count, int32 grainSize, const std::function<void(int32, int32)>& func);
+
+private:
+
+    TaskGroup(const TaskGroup& group) = delete;
+
+    TaskGroup& operator = (const TaskGroup& group) = delete;
+
+private:
+
+    TaskThreadPool*             m_Pool;
+    std::vector<FunctionTask*>  m_Tasks;
+};
@@ -67,8 +67,7 @@ int32 TaskThread::Run()
 
         while (localTask != nullptr)
         {
-            localTask->DoThreadedWork();
-            localTask->OnComplete();
+            TaskThreadPool::ExecuteTask(localTask);
             localTask = m_OwningThreadPool->ReturnToPoolOrGetNextJob(this);
         } 
     }
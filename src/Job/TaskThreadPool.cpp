@@ -1,6 +1,20 @@
 ﻿#include "Job/TaskThreadPool.h"
 #include "Job/TaskThread.h"
 #include "Job/ThreadTask.h"
+#include "Job/WorkStealingThreadPool.h"
+
+static thread_local TaskPriority s_CurrentPriority = TaskPriority::Normal;
+
+TaskPriorityScope::TaskPriorityScope(TaskPriority priority)
+    : m_Previous(s_CurrentPriority)
+{
+    s_CurrentPriority = priority;
+}
+
+TaskPriorityScope::~TaskPriorityScope()
+{
+    s_CurrentPriority = m_Previous;
+}
 
 TaskThreadPool::TaskThreadPool()
 {
@@ -138,21 +152,91 @@ ThreadTask* TaskThreadPool::ReturnToPoolOrGetNextJob(TaskThread* thread)
 
     std::lock_guard<std::mutex> lock(m_SynchMutex);
 
-    if (m_QueuedTask.size() > 0)
+    task = PopQueuedTask(TaskPriority::Background);
+
+    if (task == nullptr)
+    {
+        m_QueuedThreads.push_back(thread);
+    }
+
+    return task;
+}
+
+bool TaskThreadPool::RunPendingTask(TaskPriority lowest)
+{
+    ThreadTask* task = nullptr;
+
     {
-        task = m_QueuedTask.back();
-        m_QueuedTask.pop_back();
+        std::lock_guard<std::mutex> lock(m_SynchMutex);
+        task = PopQueuedTask(lowest);
     }
 
     if (task == nullptr)
     {
-        m_QueuedThreads.push_back(thread);
+        return false;
+    }
+
+    ExecuteTask(task);
+
+    return true;
+}
+
+void TaskThreadPool::RunInteractiveTasks()
+{
+    if (s_CurrentPriority == TaskPriority::Interactive)
+    {
+        return;
+    }
+
+    while (RunPendingTask(TaskPriority::Interactive))
+    {
+
+    }
+}
+
+TaskPriority TaskThreadPool::GetCurrentPriority()
+{
+    return s_CurrentPriority;
+}
+
+void TaskThreadPool::ExecuteTask(ThreadTask* task)
+{
+    TaskPriorityScope scope(task->GetPriority());
+
+    // The owner may delete the task as soon as it is complete
+    task->DoThreadedWork();
+    task->OnComplete();
+}
+
+ThreadTask* TaskThreadPool::PopQueuedTask(TaskPriority lowest)
+{
+    // Newest task of the highest priority
+    int32 best = -1;
+    for (int32 i = (int32)m_QueuedTask.size() - 1; i >= 0; --i)
+    {
+        TaskPriority priority = m_QueuedTask[i]->GetPriority();
+        if (priority <= lowest && (best < 0 || priority < m_QueuedTask[best]->GetPriority()))
+        {
+            best = i;
+            if (priority == TaskPriority::Interactive)
+            {
+                break;
+            }
+        }
+    }
+
+    if (best < 0)
+    {
+        return nullptr;
     }
 
+    ThreadTask* task = m_QueuedTask[best];
+    m_QueuedTask.erase(m_QueuedTask.begin() + best);
+
     return task;
 }
 
 TaskThreadPool* TaskThreadPool::Allocate()
 {
-    return new TaskThreadPool();
+    return new WorkStealingThreadPool();
 }
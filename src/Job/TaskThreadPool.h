@@ -5,9 +5,9 @@
 #include <condition_variable>
 
 #include "Math/Math.h"
+#include "Job/ThreadTask.h"
 
 class TaskThread;
-class ThreadTask;
 
 class TaskThreadPool
 {
@@ -27,18 +27,39 @@ public:
 
     virtual ThreadTask* ReturnToPoolOrGetNextJob(TaskThread* thread);
 
+    // Runs one queued task of priority lowest or higher on the calling thread, false when there was none.
+    // Threads waiting on tasks call it to help instead of idling.
+    virtual bool RunPendingTask(TaskPriority lowest = TaskPriority::Background);
+
+    // Preemption point for long running tasks, runs the queued interactive tasks on the calling
+    // thread. Call it between chunks of work so interactive tasks do not wait for whole jobs.
+    void RunInteractiveTasks();
+
+    // Priority of the task running on the calling thread, Normal outside of tasks.
+    // Tasks created by TaskGroup and TaskGraph inherit it.
+    static TaskPriority GetCurrentPriority();
+
+    // Runs task on the calling thread with its priority as the current one
+    static void ExecuteTask(ThreadTask* task);
+
+    // The default pool of the engine, a WorkStealingThreadPool
     static TaskThreadPool* Allocate();
 
-    int32 GetNumQueuedJobs() const
+    virtual int32 GetNumQueuedJobs() const
     {
         return (int32)m_QueuedTask.size();
     }
 
-    int32 GetNumThreads() const
+    virtual int32 GetNumThreads() const
     {
         return (int32)m_AllThreads.size();
     }
 
+protected:
+
+    // Highest priority queued task, lock m_SynchMutex first
+    ThreadTask* PopQueuedTask(TaskPriority lowest);
+
 protected:
 
     std::vector<ThreadTask*>		m_QueuedTask;
@@ -49,3 +70,17 @@ protected:
     bool							m_TimeToDie = false;
 
 };
+
+// Overrides the current priority of the calling thread, e.g. for a frame that waits on its tasks
+class TaskPriorityScope
+{
+public:
+
+    TaskPriorityScope(TaskPriority priority);
+
+    ~TaskPriorityScope();
+
+private:
+
+    TaskPriority m_Previous;
+};
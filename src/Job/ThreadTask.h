@@ -1,9 +1,20 @@
 ﻿#pragma once
 
-#include "Math/WindowsPlatformAtomics.h"
+#include "Math/PlatformAtomics.h"
+#include "Job/CancellationToken.h"
 
 #include <functional>
 
+// Lanes of the task pools. Workers take interactive tasks first and background tasks
+// only when nothing else is queued.
+enum class TaskPriority : int32
+{
+    Interactive = 0,
+    Normal,
+    Background,
+    Num
+};
+
 class ThreadTask
 {
 private:
@@ -17,8 +28,9 @@ private:
 public:
 
     ThreadTask()
-        : m_Status((int32)Status::None)
-        , onCompleteEvent(nullptr)
+        : onCompleteEvent(nullptr)
+        , m_Status((int32)Status::None)
+        , m_Priority(TaskPriority::Normal)
     {
 
     }
@@ -42,11 +54,40 @@ public:
         PlatformAtomics::InterlockedExchange(&m_Status, (int32)Status::Done);
     }
 
+    // Set before the task is added to a pool
+    void SetPriority(TaskPriority priority)
+    {
+        m_Priority = priority;
+    }
+
+    TaskPriority GetPriority() const
+    {
+        return m_Priority;
+    }
+
+    // Asks the task to stop, it still completes
+    void Cancel()
+    {
+        m_Cancellation.Cancel();
+    }
+
+    bool IsCancelled() const
+    {
+        return m_Cancellation.IsCancelled();
+    }
+
+    const CancellationToken* GetCancellationToken() const
+    {
+        return &m_Cancellation;
+    }
+
 public:
 
     std::function<void(ThreadTask*)>    onCompleteEvent;
 
 protected:
 
-    volatile int32 m_Status;
+    volatile int32      m_Status;
+    TaskPriority        m_Priority;
+    CancellationToken   m_Cancellation;
 };
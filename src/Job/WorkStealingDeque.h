@@ -0,0 +1,158 @@
+﻿#pragma once
+
+#include "Math/Math.h"
+
+#include <atomic>
+#include <vector>
+
+// Chase-Lev deque with the memory orders of Le, Pop, Cohen, Nardelli (PPoPP 2013).
+// The owning thread pushes and pops at the bottom, any thread steals from the top.
+// The ring grows when full, retired rings are kept until the deque is destroyed
+// because a thief may still read from them.
+template <typename T>
+class WorkStealingDeque
+{
+private:
+
+    struct Ring
+    {
+        int64               capacity;
+        std::atomic<T>*     items;
+
+        Ring(int64 inCapacity)
+            : capacity(inCapacity)
+            , items(new std::atomic<T>[inCapacity])
+        {
+
+        }
+
+        ~Ring()
+        {
+            delete[] items;
+        }
+
+        FORCEINLINE T Get(int64 index) const
+        {
+            return items[index & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+
+        FORCEINLINE void Put(int64 index, T item)
+        {
+            items[index & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+
+        Ring* Grow(int64 bottom, int64 top) const
+        {
+            Ring* ring = new Ring(capacity * 2);
+            for (int64 i = top; i < bottom; ++i)
+            {
+                ring->Put(i, Get(i));
+            }
+            return ring;
+        }
+    };
+
+public:
+
+    // capacity has to be a power of two
+    WorkStealingDeque(int64 capacity = 256)
+        : m_Top(0)
+        , m_Bottom(0)
+        , m_Ring(new Ring(capacity))
+    {
+
+    }
+
+    ~WorkStealingDeque()
+    {
+        delete m_Ring.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < m_Retired.size(); ++i)
+        {
+            delete m_Retired[i];
+        }
+    }
+
+    // Owner only
+    void Push(T item)
+    {
+        int64 bottom = m_Bottom.load(std::memory_order_relaxed);
+        int64 top    = m_Top.load(std::memory_order_acquire);
+        Ring* ring   = m_Ring.load(std::memory_order_relaxed);
+
+        if (bottom - top > ring->capacity - 1)
+        {
+            m_Retired.push_back(ring);
+            ring = ring->Grow(bottom, top);
+            m_Ring.store(ring, std::memory_order_release);
+        }
+
+        ring->Put(bottom, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only, newest item first
+    bool Pop(T& item)
+    {
+        int64 bottom = m_Bottom.load(std::memory_order_relaxed) - 1;
+        Ring* ring   = m_Ring.load(std::memory_order_relaxed);
+        m_Bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64 top    = m_Top.load(std::memory_order_relaxed);
+
+        if (top > bottom)
+        {
+            m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        item = ring->Get(bottom);
+        if (top == bottom)
+        {
+            // Last item, race the thieves for it
+            bool won = m_Top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_Bottom.store(bottom + 1, std::memory_order_relaxed);
+            return won;
+        }
+
+        return true;
+    }
+
+    // Any thread, oldest item first. Also fails when another thief won the race.
+    bool Steal(T& item)
+    {
+        int64 top = m_Top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64 bottom = m_Bottom.load(std::memory_order_acquire);
+
+        if (top >= bottom)
+        {
+            return false;
+        }
+
+        Ring* ring = m_Ring.load(std::memory_order_acquire);
+        item = ring->Get(top);
+        return m_Top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    // Approximate when other threads push or steal at the same time
+    int64 Size() const
+    {
+        int64 bottom = m_Bottom.load(std::memory_order_relaxed);
+        int64 top    = m_Top.load(std::memory_order_relaxed);
+        return bottom > top ? bottom - top : 0;
+    }
+
+private:
+
+    WorkStealingDeque(const WorkStealingDeque& deque) = delete;
+
+    WorkStealingDeque& operator = (const WorkStealingDeque& deque) = delete;
+
+private:
+
+    std::atomic<int64>  m_Top;
+    std::atomic<int64>  m_Bottom;
+    std::atomic<Ring*>  m_Ring;
+    std::vector<Ring*>  m_Retired;
+};
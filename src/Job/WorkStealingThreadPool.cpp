@@ -0,0 +1,382 @@
+﻿#include "Job/WorkStealingThreadPool.h"
+#include "Job/RunnableThread.h"
+#include "Job/ThreadTask.h"
+
+#include <thread>
+
+// Yields before a worker with nothing to do parks, work often arrives in bursts
+static const int32 kSpinRounds = 64;
+
+thread_local WorkStealingThreadPool::Worker* WorkStealingThreadPool::s_CurrentWorker = nullptr;
+
+// Victim selection of threads that are not workers of the pool
+static thread_local uint32 s_StealSeed = 0x9E3779B9u;
+
+static FORCEINLINE uint32 XorShift(uint32& seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+WorkStealingThreadPool::Worker::Worker(WorkStealingThreadPool* pool, int32 inIndex)
+    : owner(pool)
+    , index(inIndex)
+    , seed((uint32)inIndex * 2654435761u + 1)
+    , thread(nullptr)
+{
+
+}
+
+WorkStealingThreadPool::Worker::~Worker()
+{
+
+}
+
+bool WorkStealingThreadPool::Worker::Create()
+{
+    char buf[128];
+    sprintf(buf, "WorkStealingThread %d", index);
+
+    thread = RunnableThread::Create(this, std::string(buf));
+
+    return thread != nullptr;
+}
+
+void WorkStealingThreadPool::Worker::Kill()
+{
+    thread->WaitForCompletion();
+
+    delete thread;
+    thread = nullptr;
+}
+
+int32 WorkStealingThreadPool::Worker::Run()
+{
+    s_CurrentWorker = this;
+
+    while (!owner->m_Stopping.load(std::memory_order_acquire))
+    {
+        ThreadTask* task = owner->FindTask(this, TaskPriority::Background);
+        if (task)
+        {
+            ExecuteTask(task);
+        }
+        else
+        {
+            owner->Park();
+        }
+    }
+
+    s_CurrentWorker = nullptr;
+
+    return 0;
+}
+
+WorkStealingThreadPool::WorkStealingThreadPool()
+    : m_WakeEpoch(0)
+    , m_NumParked(0)
+    , m_NumSpinning(0)
+    , m_Stopping(false)
+{
+    for (int32 lane = 0; lane < kNumLanes; ++lane)
+    {
+        m_InjectionSize[lane].store(0, std::memory_order_relaxed);
+        m_NumQueued[lane].store(0, std::memory_order_relaxed);
+    }
+}
+
+WorkStealingThreadPool::~WorkStealingThreadPool()
+{
+    Destroy();
+}
+
+bool WorkStealingThreadPool::Create(uint32 numThreads)
+{
+    m_Stopping.store(false, std::memory_order_release);
+
+    // Every deque exists before the first worker starts stealing
+    for (uint32 i = 0; i < numThreads; ++i)
+    {
+        m_Workers.push_back(new Worker(this, (int32)i));
+    }
+
+    bool success = true;
+    for (uint32 i = 0; i < numThreads; ++i)
+    {
+        if (!m_Workers[i]->Create())
+        {
+            success = false;
+            break;
+        }
+    }
+
+    if (success == false)
+    {
+        Destroy();
+    }
+
+    return success;
+}
+
+void WorkStealingThreadPool::Destroy()
+{
+    m_Stopping.store(true, std::memory_order_release);
+
+    AbandonQueued();
+    WakeAll();
+
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        if (m_Workers[i]->thread)
+        {
+            m_Workers[i]->Kill();
+        }
+    }
+
+    // Tasks that raced the shutdown
+    AbandonQueued();
+
+    for (size_t i = 0; i < m_Workers.size(); ++i)
+    {
+        delete m_Workers[i];
+    }
+    m_Workers.clear();
+}
+
+void WorkStealingThreadPool::AddTask(ThreadTask* task)
+{
+    if (m_Stopping.load(std::memory_order_acquire))
+    {
+        task->Abandon();
+        return;
+    }
+
+    const int32 lane = (int32)task->GetPriority();
+
+    m_NumQueued[lane].fetch_add(1, std::memory_order_seq_cst);
+
+    Worker* worker = CurrentWorker();
+    if (worker)
+    {
+        worker->deques[lane].Push(task);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(m_InjectionMutex);
+        m_Injection[lane].push_back(task);
+        m_InjectionSize[lane].fetch_add(1, std::memory_order_release);
+    }
+
+    WakeOne();
+}
+
+bool WorkStealingThreadPool::RetractTask(ThreadTask* task)
+{
+    const int32 lane = (int32)task->GetPriority();
+
+    if (m_InjectionSize[lane].load(std::memory_order_acquire) == 0)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_InjectionMutex);
+
+    // Newest first, the caller usually retracts what it just added
+    std::deque<ThreadTask*>& injection = m_Injection[lane];
+    for (int32 i = (int32)injection.size() - 1; i >= 0; --i)
+    {
+        if (injection[i] == task)
+        {
+            injection.erase(injection.begin() + i);
+            m_InjectionSize[lane].fetch_sub(1, std::memory_order_relaxed);
+            m_NumQueued[lane].fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool WorkStealingThreadPool::RunPendingTask(TaskPriority lowest)
+{
+    ThreadTask* task = FindTask(CurrentWorker(), lowest);
+    if (task == nullptr)
+    {
+        return false;
+    }
+
+    ExecuteTask(task);
+
+    return true;
+}
+
+int32 WorkStealingThreadPool::GetNumQueuedJobs() const
+{
+    int32 count = 0;
+    for (int32 lane = 0; lane < kNumLanes; ++lane)
+    {
+        count += m_NumQueued[lane].load(std::memory_order_seq_cst);
+    }
+    return count;
+}
+
+WorkStealingThreadPool::Worker* WorkStealingThreadPool::CurrentWorker() const
+{
+    Worker* worker = s_CurrentWorker;
+    return worker && worker->owner == this ? worker : nullptr;
+}
+
+ThreadTask* WorkStealingThreadPool::FindTask(Worker* worker, TaskPriority lowest)
+{
+    ThreadTask* task = nullptr;
+
+    for (int32 lane = 0; lane <= (int32)lowest; ++lane)
+    {
+        if (m_NumQueued[lane].load(std::memory_order_relaxed) == 0)
+        {
+            continue;
+        }
+
+        if (worker && worker->deques[lane].Pop(task))
+        {
+            m_NumQueued[lane].fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+
+        if (m_InjectionSize[lane].load(std::memory_order_acquire) > 0)
+        {
+            std::lock_guard<std::mutex> lock(m_InjectionMutex);
+            if (!m_Injection[lane].empty())
+            {
+                task = m_Injection[lane].front();
+                m_Injection[lane].pop_front();
+                m_InjectionSize[lane].fetch_sub(1, std::memory_order_relaxed);
+                m_NumQueued[lane].fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+
+        task = worker ? StealTask(lane, worker->seed, worker->index) : StealTask(lane, s_StealSeed, -1);
+        if (task)
+        {
+            m_NumQueued[lane].fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+
+    return nullptr;
+}
+
+ThreadTask* WorkStealingThreadPool::StealTask(int32 lane, uint32& seed, int32 skip)
+{
+    const int32 numWorkers = (int32)m_Workers.size();
+    if (numWorkers == 0)
+    {
+        return nullptr;
+    }
+
+    ThreadTask* task = nullptr;
+    int32 start = (int32)(XorShift(seed) % (uint32)numWorkers);
+    for (int32 i = 0; i < numWorkers; ++i)
+    {
+        int32 victim = (start + i) % numWorkers;
+        if (victim != skip && m_Workers[victim]->deques[lane].Steal(task))
+        {
+            return task;
+        }
+    }
+
+    return nullptr;
+}
+
+void WorkStealingThreadPool::Park()
+{
+    m_NumSpinning.fetch_add(1, std::memory_order_seq_cst);
+    for (int32 spin = 0; spin < kSpinRounds; ++spin)
+    {
+        if (GetNumQueuedJobs() > 0 || m_Stopping.load(std::memory_order_relaxed))
+        {
+            m_NumSpinning.fetch_sub(1, std::memory_order_seq_cst);
+            return;
+        }
+        std::this_thread::yield();
+    }
+    m_NumSpinning.fetch_sub(1, std::memory_order_seq_cst);
+
+    // AddTask counts the task before it looks at the spinning and parked workers, so either
+    // the count is seen here, or the epoch differs below, or AddTask notifies this worker.
+    uint32 epoch = m_WakeEpoch.load(std::memory_order_seq_cst);
+    if (GetNumQueuedJobs() > 0)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_ParkMutex);
+    m_NumParked.fetch_add(1, std::memory_order_seq_cst);
+    while (m_WakeEpoch.load(std::memory_order_seq_cst) == epoch && !m_Stopping.load(std::memory_order_seq_cst))
+    {
+        m_ParkCondition.wait(lock);
+    }
+    m_NumParked.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void WorkStealingThreadPool::WakeOne()
+{
+    m_WakeEpoch.fetch_add(1, std::memory_order_seq_cst);
+
+    // A spinning worker picks the task up, waking another one only costs a context switch
+    if (m_NumSpinning.load(std::memory_order_seq_cst) == 0 && m_NumParked.load(std::memory_order_seq_cst) > 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_ParkMutex);
+        }
+        m_ParkCondition.notify_one();
+    }
+}
+
+void WorkStealingThreadPool::WakeAll()
+{
+    m_WakeEpoch.fetch_add(1, std::memory_order_seq_cst);
+    {
+        std::lock_guard<std::mutex> lock(m_ParkMutex);
+    }
+    m_ParkCondition.notify_all();
+}
+
+void WorkStealingThreadPool::AbandonQueued()
+{
+    std::vector<ThreadTask*> abandoned;
+
+    for (int32 lane = 0; lane < kNumLanes; ++lane)
+    {
+        size_t first = abandoned.size();
+
+        {
+            std::lock_guard<std::mutex> lock(m_InjectionMutex);
+            abandoned.insert(abandoned.end(), m_Injection[lane].begin(), m_Injection[lane].end());
+            m_Injection[lane].clear();
+            m_InjectionSize[lane].store(0, std::memory_order_relaxed);
+        }
+
+        for (size_t i = 0; i < m_Workers.size(); ++i)
+        {
+            ThreadTask* task = nullptr;
+            while (m_Workers[i]->deques[lane].Size() > 0)
+            {
+                if (m_Workers[i]->deques[lane].Steal(task))
+                {
+                    abandoned.push_back(task);
+                }
+            }
+        }
+
+        m_NumQueued[lane].fetch_sub((int32)(abandoned.size() - first), std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < abandoned.size(); ++i)
+    {
+        abandoned[i]->Abandon();
+    }
+}
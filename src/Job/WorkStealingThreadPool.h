@@ -0,0 +1,108 @@
+﻿#pragma once
+
+#include "Job/TaskThreadPool.h"
+#include "Job/Runnable.h"
+#include "Job/WorkStealingDeque.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+class RunnableThread;
+
+// Task pool with one Chase-Lev deque per worker and priority lane. Tasks added from a worker go
+// to its own deque, tasks from other threads to a shared injection queue of their lane. Idle
+// workers go through the lanes from interactive to background, and in each lane take from their
+// deque, then the injection queue, then steal from random victims. They park on a condition
+// variable once there is nothing left.
+class WorkStealingThreadPool : public TaskThreadPool
+{
+private:
+
+    static const int32 kNumLanes = (int32)TaskPriority::Num;
+
+    class Worker : public Runnable
+    {
+    public:
+
+        Worker(WorkStealingThreadPool* pool, int32 index);
+
+        virtual ~Worker();
+
+        bool Create();
+
+        void Kill();
+
+        virtual int32 Run() override;
+
+    public:
+
+        WorkStealingThreadPool*         owner;
+        int32                           index;
+        uint32                          seed;
+        WorkStealingDeque<ThreadTask*>  deques[kNumLanes];
+        RunnableThread*                 thread;
+    };
+
+public:
+
+    WorkStealingThreadPool();
+
+    virtual ~WorkStealingThreadPool();
+
+    virtual bool Create(uint32 numThreads) override;
+
+    virtual void Destroy() override;
+
+    virtual void AddTask(ThreadTask* task) override;
+
+    // Only tasks still in the injection queue can be retracted
+    virtual bool RetractTask(ThreadTask* task) override;
+
+    virtual bool RunPendingTask(TaskPriority lowest = TaskPriority::Background) override;
+
+    virtual int32 GetNumQueuedJobs() const override;
+
+    virtual int32 GetNumThreads() const override
+    {
+        return (int32)m_Workers.size();
+    }
+
+private:
+
+    // Worker of this pool running on the calling thread, or null
+    Worker* CurrentWorker() const;
+
+    ThreadTask* FindTask(Worker* worker, TaskPriority lowest);
+
+    ThreadTask* StealTask(int32 lane, uint32& seed, int32 skip);
+
+    void Park();
+
+    void WakeOne();
+
+    void WakeAll();
+
+    // Abandons everything still queued
+    void AbandonQueued();
+
+private:
+
+    std::vector<Worker*>            m_Workers;
+
+    std::mutex                      m_InjectionMutex;
+    std::deque<ThreadTask*>         m_Injection[kNumLanes];
+    std::atomic<int32>              m_InjectionSize[kNumLanes];
+
+    std::mutex                      m_ParkMutex;
+    std::condition_variable         m_ParkCondition;
+    std::atomic<uint32>             m_WakeEpoch;
+    std::atomic<int32>              m_NumParked;
+    std::atomic<int32>              m_NumSpinning;
+
+    std::atomic<int32>              m_NumQueued[kNumLanes];
+    std::atomic<bool>               m_Stopping;
+
+    static thread_local Worker*     s_CurrentWorker;
+};
@@ -0,0 +1,553 @@
+﻿#include "Common/Log.h"
+
+#include "Misc/JobManager.h"
+#include "Misc/FileMisc.h"
+#include "Job/TaskThreadPool.h"
+#include "Job/TaskGroup.h"
+#include "Parser/GLTFParser.h"
+#include "Parser/MeshCache.h"
+#include "Core/Scene.h"
+#include "Renderer/CpuPathTracer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Warnings and errors only, the loaders would otherwise interleave with the result tables
+void LogTrace::LogToConsole(Type type, const ANSICHAR* msg)
+{
+    if (type >= Type::Warning)
+    {
+        fprintf(stderr, "%s", msg);
+    }
+}
+
+struct BenchOptions
+{
+    std::string bench;
+    std::string gltfPath;
+    // Largest thread count of the scaling runs, 0 is the number of cores
+    int32       maxThreads = 0;
+    // Every measurement reports the best of this many runs
+    int32       repeat = 3;
+    // Image size of the traversal runs
+    int32       width = 640;
+    int32       height = 360;
+};
+
+struct Benchmark
+{
+    const char* name;
+    const char* description;
+    bool        needsScene;
+    void        (*run)(const BenchOptions& options, Scene3DPtr scene);
+};
+
+// Every operator new of the process is counted, the build and import runs report their share
+static std::atomic<int64> s_NumAllocations(0);
+static std::atomic<int64> s_AllocatedBytes(0);
+
+void* operator new(size_t size)
+{
+    s_NumAllocations.fetch_add(1, std::memory_order_relaxed);
+    s_AllocatedBytes.fetch_add((int64)size, std::memory_order_relaxed);
+
+    void* ptr = malloc(size > 0 ? size : 1);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+struct AllocationCount
+{
+    int64   allocations = 0;
+    int64   bytes = 0;
+};
+
+static AllocationCount CountAllocations()
+{
+    AllocationCount count;
+    count.allocations = s_NumAllocations.load(std::memory_order_relaxed);
+    count.bytes       = s_AllocatedBytes.load(std::memory_order_relaxed);
+    return count;
+}
+
+static double ElapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Best wall clock of options.repeat calls of func, allocations gets the operator new calls of the last one
+template <typename Func>
+static double BestOf(const BenchOptions& options, Func func, AllocationCount* allocations = nullptr)
+{
+    double best = 0.0;
+    for (int32 i = 0; i < options.repeat; ++i)
+    {
+        AllocationCount before = CountAllocations();
+        auto start = std::chrono::high_resolution_clock::now();
+        func();
+        double ms = ElapsedMs(start);
+        AllocationCount after = CountAllocations();
+
+        best = i == 0 ? ms : MMath::Min(best, ms);
+        if (allocations)
+        {
+            allocations->allocations = after.allocations - before.allocations;
+            allocations->bytes       = after.bytes - before.bytes;
+        }
+    }
+    return best;
+}
+
+// Thread counts 1, 2, 4 .. up to the maximum, the maximum itself is always included
+static std::vector<int32> ThreadCounts(const BenchOptions& options)
+{
+    int32 maxThreads = options.maxThreads > 0 ? options.maxThreads : MMath::Max((int32)std::thread::hardware_concurrency(), 1);
+
+    std::vector<int32> counts;
+    for (int32 count = 1; count < maxThreads; count *= 2)
+    {
+        counts.push_back(count);
+    }
+    counts.push_back(maxThreads);
+    return counts;
+}
+
+// The calling thread helps in TaskGroup::Wait, so n threads are n - 1 workers. One thread builds serially.
+static TaskThreadPool* CreatePool(int32 numThreads)
+{
+    if (numThreads <= 1)
+    {
+        return nullptr;
+    }
+
+    TaskThreadPool* pool = TaskThreadPool::Allocate();
+    pool->Create(numThreads - 1);
+    return pool;
+}
+
+static void DestroyPool(TaskThreadPool* pool)
+{
+    if (pool)
+    {
+        pool->Destroy();
+        delete pool;
+    }
+}
+
+static int64 CountTriangles(const MeshArray& meshes)
+{
+    int64 numTris = 0;
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        numTris += meshes[i]->NumIndices() / 3;
+    }
+    return numTris;
+}
+
+// Rebuilds every BLAS of the scene one after another, each build split into tasks
+static void BenchBuildScaling(const BenchOptions& options, Scene3DPtr scene)
+{
+    const MeshArray& meshes = scene->meshes;
+    printf("%d meshes, %lld triangles\n", (int32)meshes.size(), (long long)CountTriangles(meshes));
+    printf("%-8s %12s %10s %12s %12s\n", "threads", "ms", "speedup", "allocs", "alloc MB");
+
+    double serialMs = 0.0;
+    std::vector<int32> counts = ThreadCounts(options);
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        TaskThreadPool* pool = CreatePool(counts[i]);
+
+        AllocationCount allocations;
+        double ms = BestOf(options, [&]() {
+            for (size_t m = 0; m < meshes.size(); ++m)
+            {
+                meshes[m]->BuildBVH(pool);
+            }
+        }, &allocations);
+
+        serialMs = i == 0 ? ms : serialMs;
+        printf("%-8d %12.2f %9.2fx %12lld %12.1f\n", counts[i], ms, serialMs / ms, (long long)allocations.allocations, allocations.bytes / (1024.0 * 1024.0));
+        fflush(stdout);
+
+        DestroyPool(pool);
+    }
+}
+
+// Serial binned SAH builds of every mesh, the split search dominates them
+static void BenchSah(const BenchOptions& options, Scene3DPtr scene)
+{
+    const MeshArray& meshes = scene->meshes;
+
+    std::vector<std::vector<Bounds3D>> bounds(meshes.size());
+    for (size_t m = 0; m < meshes.size(); ++m)
+    {
+        meshes[m]->CalcTriangleBounds(bounds[m]);
+    }
+
+    const int64 numTris = CountTriangles(meshes);
+    printf("%d meshes, %lld triangles, %s bins\n", (int32)meshes.size(), (long long)numTris, PLATFORM_ENABLE_VECTORINTRINSICS ? "SSE" : "scalar");
+    printf("%-8s %12s %12s %12s\n", "bins", "ms", "Mtris/s", "SAH cost");
+
+    static const int32 numBins[] = { 8, 16, 32, 64, 128 };
+    for (int32 i = 0; i < 5; ++i)
+    {
+        float cost = 0.0f;
+        double ms = BestOf(options, [&]() {
+            cost = 0.0f;
+            for (size_t m = 0; m < meshes.size(); ++m)
+            {
+                if (bounds[m].empty())
+                {
+                    continue;
+                }
+
+                Bvh bvh(BvhBuildSettings().traversalCost, numBins[i], true);
+                bvh.Build(&bounds[m][0], (int32)bounds[m].size());
+                cost += bvh.GetCost();
+            }
+        });
+
+        printf("%-8d %12.2f %12.2f %12.1f\n", numBins[i], ms, numTris / ms * 1e-3, cost);
+        fflush(stdout);
+    }
+}
+
+// Rays per second of every traversal kernel on the default view, once per node layout and wide node width
+static void BenchTraversal(const BenchOptions& options, Scene3DPtr scene3D)
+{
+    static const char* layoutNames[] = { "depth-first", "veb" };
+    static const BvhLayout layouts[] = { BvhLayout::EDepthFirst, BvhLayout::EVanEmdeBoas };
+    static const char* modeNames[] = { "single", "packet4", "packet8", "packet16", "stream" };
+    static const TraversalMode modes[] = { TraversalMode::ESingle, TraversalMode::EPacket4, TraversalMode::EPacket8, TraversalMode::EPacket16, TraversalMode::EStream };
+
+    printf("%dx%d, best of %d\n", options.width, options.height, options.repeat);
+    printf("%-12s %-10s %10s %10s %10s   Mrays/s\n", "layout", "traversal", "primary", "shadow", "secondary");
+
+    for (int32 l = 0; l < 2; ++l)
+    {
+        auto scene = std::make_shared<GLScene>();
+        scene->Init(true);
+        scene->SetBvhLayout(layouts[l]);
+        scene->AddScene(scene3D);
+        if (!scene->Build())
+        {
+            scene->Free(true);
+            return;
+        }
+        scene->GetCamera()->Perspective(MMath::DegreesToRadians(60.0f), options.width * 1.0f / options.height, 0.1f, 3000.0f);
+
+        CpuPathTracer tracer;
+        tracer.SetTaskPool(JobManager::TaskPool());
+        tracer.SetScene(scene);
+        tracer.Resize(options.width, options.height);
+        tracer.RenderSample();
+
+        auto measure = [&](const char* layoutName, const char* modeName, TraversalMode mode) {
+            TraversalStats best;
+            for (int32 r = 0; r < options.repeat; ++r)
+            {
+                TraversalStats stats = tracer.MeasureTraversal(mode);
+                best.primaryMrays   = MMath::Max(best.primaryMrays, stats.primaryMrays);
+                best.shadowMrays    = MMath::Max(best.shadowMrays, stats.shadowMrays);
+                best.secondaryMrays = MMath::Max(best.secondaryMrays, stats.secondaryMrays);
+            }
+            printf("%-12s %-10s %10.2f %10.2f %10.2f\n", layoutName, modeName, best.primaryMrays, best.shadowMrays, best.secondaryMrays);
+            fflush(stdout);
+        };
+
+        for (int32 m = 0; m < 5; ++m)
+        {
+            measure(layoutNames[l], modeNames[m], modes[m]);
+        }
+
+        // Wide nodes are collapsed from the tree, the layout of the binary nodes does not change them
+        if (l == 0)
+        {
+            scene->GetBvhTranslator()->ProcessWide(4);
+            measure("wide", "wide4", TraversalMode::EWide);
+            scene->GetBvhTranslator()->ProcessWide(8);
+            measure("wide", "wide8", TraversalMode::EWide);
+            scene->GetBvhTranslator()->ProcessWide(0);
+        }
+
+        scene->Free(true);
+    }
+}
+
+static const int32 kNumFlatTasks = 20000;
+static const int32 kNestedFanout = 4;
+static const int32 kNestedDepth = 8;
+
+// Every level waits on its own group, so waits nest inside pool workers
+static void SpawnNested(TaskThreadPool* pool, int32 depth, std::atomic<int32>& counter)
+{
+    if (depth == 0)
+    {
+        counter.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TaskGroup group(pool);
+    for (int32 i = 0; i < kNestedFanout; ++i)
+    {
+        group.Run([pool, depth, &counter]() {
+            SpawnNested(pool, depth - 1, counter);
+        });
+    }
+    group.Wait();
+}
+
+// Task throughput of the mutex pool and the work stealing pool
+static void BenchPool(const BenchOptions& options, Scene3DPtr)
+{
+    // Tasks of the whole tree and the leaves among them
+    int32 numNested = 0;
+    int32 numLeaves = 1;
+    for (int32 level = 1; level <= kNestedDepth; ++level)
+    {
+        numLeaves *= kNestedFanout;
+        numNested += numLeaves;
+    }
+
+    printf("flat: %d tasks from the main thread, nested: %d^%d task tree, Mtasks/s\n", kNumFlatTasks, kNestedFanout, kNestedDepth);
+    printf("%-8s %12s %12s %12s %12s\n", "workers", "mutex flat", "mutex nest", "steal flat", "steal nest");
+
+    std::vector<int32> counts = ThreadCounts(options);
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        double rates[4];
+        for (int32 stealing = 0; stealing < 2; ++stealing)
+        {
+            TaskThreadPool* pool = stealing ? TaskThreadPool::Allocate() : new TaskThreadPool();
+            pool->Create(counts[i]);
+
+            std::atomic<int32> counter(0);
+            double flatMs = BestOf(options, [&]() {
+                TaskGroup group(pool);
+                for (int32 t = 0; t < kNumFlatTasks; ++t)
+                {
+                    group.Run([&counter]() {
+                        counter.fetch_add(1, std::memory_order_relaxed);
+                    });
+                }
+                group.Wait();
+            });
+
+            double nestedMs = BestOf(options, [&]() {
+                SpawnNested(pool, kNestedDepth, counter);
+            });
+
+            const int32 expected = options.repeat * (kNumFlatTasks + numLeaves);
+            if (counter.load() != expected)
+            {
+                LOGE("Lost tasks, %d of %d ran\n", counter.load(), expected);
+            }
+
+            rates[2 * stealing + 0] = kNumFlatTasks / flatMs * 1e-3;
+            rates[2 * stealing + 1] = numNested / nestedMs * 1e-3;
+
+            DestroyPool(pool);
+        }
+
+        printf("%-8d %12.2f %12.2f %12.2f %12.2f\n", counts[i], rates[0], rates[1], rates[2], rates[3]);
+        fflush(stdout);
+    }
+}
+
+// Whole glTF loads. Cold loads decode every primitive, build every BLAS and write the mesh cache,
+// warm loads read the streams and BVHs back from the cache.
+static void BenchImport(const BenchOptions& options, Scene3DPtr scene)
+{
+    const std::string cachePath = MeshCache::GetCachePath(options.gltfPath);
+
+    printf("%d meshes, %lld triangles\n", (int32)scene->meshes.size(), (long long)CountTriangles(scene->meshes));
+    printf("%-8s %12s %12s %12s\n", "load", "ms", "allocs", "alloc MB");
+
+    const char* names[] = { "cold", "warm" };
+    for (int32 warm = 0; warm < 2; ++warm)
+    {
+        double best = 0.0;
+        AllocationCount allocations;
+        for (int32 i = 0; i < options.repeat; ++i)
+        {
+            if (!warm)
+            {
+                remove(cachePath.c_str());
+            }
+
+            AllocationCount before = CountAllocations();
+            auto start = std::chrono::high_resolution_clock::now();
+            {
+                LoadGLTFJob gltfJob(options.gltfPath);
+                gltfJob.DoThreadedWork();
+            }
+            double ms = ElapsedMs(start);
+            AllocationCount after = CountAllocations();
+
+            best = i == 0 ? ms : MMath::Min(best, ms);
+            allocations.allocations = after.allocations - before.allocations;
+            allocations.bytes       = after.bytes - before.bytes;
+        }
+
+        printf("%-8s %12.2f %12lld %12.1f\n", names[warm], best, (long long)allocations.allocations, allocations.bytes / (1024.0 * 1024.0));
+        fflush(stdout);
+    }
+}
+
+static const Benchmark s_Benchmarks[] =
+{
+    { "build", "BLAS rebuild of every mesh with 1..N threads", true, BenchBuildScaling },
+    { "sah", "serial binned SAH builds with 8 to 128 bins", true, BenchSah },
+    { "trace", "cpu traversal Mrays/s per node layout and kernel", true, BenchTraversal },
+    { "import", "cold and warm glTF loads, rewrites the mesh cache", true, BenchImport },
+    { "pool", "task throughput of the mutex and the work stealing pool with 1..N workers", false, BenchPool },
+};
+
+static const int32 s_NumBenchmarks = sizeof(s_Benchmarks) / sizeof(s_Benchmarks[0]);
+
+static void PrintUsage()
+{
+    printf("Usage: GLSLRayTracingStudioBench <benchmark> [scene.gltf] [options]\n");
+    for (int32 i = 0; i < s_NumBenchmarks; ++i)
+    {
+        printf("  %-20s %s%s\n", s_Benchmarks[i].name, s_Benchmarks[i].description, s_Benchmarks[i].needsScene ? ", needs a scene" : "");
+    }
+    printf("Options:\n");
+    printf("  --threads <n>        largest thread count of the scaling runs, default the number of cores\n");
+    printf("  --repeat <n>         runs per measurement, the best one is reported, default 3\n");
+    printf("  --size <w>x<h>       image size of the traversal runs, default 640x360\n");
+}
+
+static bool ParseOptions(int32 argc, char** argv, BenchOptions& options)
+{
+    for (int32 i = 1; i < argc; ++i)
+    {
+        const char* arg   = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (arg[0] != '-')
+        {
+            if (options.bench.empty())
+            {
+                options.bench = arg;
+            }
+            else
+            {
+                options.gltfPath = arg;
+            }
+            continue;
+        }
+
+        if (value == nullptr)
+        {
+            return false;
+        }
+
+        ++i;
+        if (strcmp(arg, "--threads") == 0)
+        {
+            options.maxThreads = atoi(value);
+            if (options.maxThreads <= 0)
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--repeat") == 0)
+        {
+            options.repeat = atoi(value);
+            if (options.repeat <= 0)
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return !options.bench.empty();
+}
+
+int32 main(int32 argc, char** argv)
+{
+    BenchOptions options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    const Benchmark* benchmark = nullptr;
+    for (int32 i = 0; i < s_NumBenchmarks; ++i)
+    {
+        if (options.bench == s_Benchmarks[i].name)
+        {
+            benchmark = &s_Benchmarks[i];
+        }
+    }
+
+    if (benchmark == nullptr || (benchmark->needsScene && options.gltfPath.empty()))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    SetExePath(argv[0]);
+
+    JobManager::Init((int32)std::thread::hardware_concurrency());
+
+    Scene3DPtr scene = nullptr;
+    if (benchmark->needsScene)
+    {
+        LoadGLTFJob gltfJob(options.gltfPath);
+        gltfJob.DoThreadedWork();
+        scene = gltfJob.GetScene();
+        if (!scene)
+        {
+            LOGE("Failed to load %s\n", options.gltfPath.c_str());
+            JobManager::Destroy();
+            return 1;
+        }
+    }
+
+    benchmark->run(options, scene);
+
+    scene = nullptr;
+    JobManager::Destroy();
+
+    return 0;
+}
@@ -0,0 +1,349 @@
+﻿#include "Common/Log.h"
+
+#include "Misc/JobManager.h"
+#include "Misc/FileMisc.h"
+#include "Core/Scene.h"
+#include "Parser/GLTFParser.h"
+#include "Parser/HDRParser.h"
+#include "Parser/ImageWriter.h"
+#include "Renderer/CpuPathTracer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+// The editor routes the log into its log panel, here it only goes to the console
+void LogTrace::LogToConsole(Type type, const ANSICHAR* msg)
+{
+    static const char* prefixes[] = { "[ DEBUG ]", "[ INFO  ]", "[WARNING]", "[ ERROR ]", "[ FATAL ]" };
+    fprintf(type >= Type::Warning ? stderr : stdout, "%s:%s", prefixes[type], msg);
+}
+
+struct RenderOptions
+{
+    std::string gltfPath;
+    std::string hdrPath;
+    std::string outPath = "output.png";
+    int32       width = 1280;
+    int32       height = 720;
+    int32       samples = 64;
+    int32       maxDepth = 8;
+    float       fov = 60.0f;
+    // MB, 0 imports every mesh in memory
+    int32       memoryBudget = 0;
+    BvhQuality  bvhQuality = BvhQuality::EBalanced;
+    // 4 or 8 traces the collapsed wide bvh, 0 the binary one
+    int32       wideBvh = 0;
+    bool        measureTraversal = false;
+    bool        hasEye = false;
+    bool        hasTarget = false;
+    Vector3     eye;
+    Vector3     target;
+};
+
+static void PrintUsage()
+{
+    printf("Usage: GLSLRayTracingStudioCLI scene.gltf [options]\n");
+    printf("  --hdr <path>          environment map\n");
+    printf("  --out <path>          .png, .hdr or .exr, default output.png\n");
+    printf("  --size <w>x<h>        default 1280x720\n");
+    printf("  --samples <n>         samples per pixel, default 64\n");
+    printf("  --depth <n>           max bounces, default 8\n");
+    printf("  --eye <x,y,z>         camera position, default fits the scene\n");
+    printf("  --target <x,y,z>      camera target, default the scene center\n");
+    printf("  --fov <degrees>       vertical field of view, default 60\n");
+    printf("  --memory-budget <mb>  import out of core, meshes are paged in from the mesh cache\n");
+    printf("  --bvh-quality <q>     fast, balanced or high, default balanced\n");
+    printf("  --wide-bvh <n>        trace a 4 or 8 wide bvh, default the binary one\n");
+    printf("  --measure-traversal   print the rays per second of every traversal kernel\n");
+}
+
+static bool ParseVector3(const char* str, Vector3& value)
+{
+    return sscanf(str, "%f,%f,%f", &value.x, &value.y, &value.z) == 3;
+}
+
+static bool ParseOptions(int32 argc, char** argv, RenderOptions& options)
+{
+    for (int32 i = 1; i < argc; ++i)
+    {
+        const char* arg   = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (arg[0] != '-')
+        {
+            options.gltfPath = arg;
+            continue;
+        }
+
+        // Flags without a value
+        if (strcmp(arg, "--measure-traversal") == 0)
+        {
+            options.measureTraversal = true;
+            continue;
+        }
+
+        if (value == nullptr)
+        {
+            return false;
+        }
+
+        ++i;
+        if (strcmp(arg, "--hdr") == 0)
+        {
+            options.hdrPath = value;
+        }
+        else if (strcmp(arg, "--out") == 0)
+        {
+            options.outPath = value;
+        }
+        else if (strcmp(arg, "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0)
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--samples") == 0)
+        {
+            options.samples = atoi(value);
+        }
+        else if (strcmp(arg, "--depth") == 0)
+        {
+            options.maxDepth = atoi(value);
+        }
+        else if (strcmp(arg, "--eye") == 0)
+        {
+            options.hasEye = ParseVector3(value, options.eye);
+            if (!options.hasEye)
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--target") == 0)
+        {
+            options.hasTarget = ParseVector3(value, options.target);
+            if (!options.hasTarget)
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--fov") == 0)
+        {
+            options.fov = (float)atof(value);
+        }
+        else if (strcmp(arg, "--memory-budget") == 0)
+        {
+            options.memoryBudget = atoi(value);
+            if (options.memoryBudget <= 0)
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--bvh-quality") == 0)
+        {
+            if (strcmp(value, "fast") == 0)
+            {
+                options.bvhQuality = BvhQuality::EFast;
+            }
+            else if (strcmp(value, "balanced") == 0)
+            {
+                options.bvhQuality = BvhQuality::EBalanced;
+            }
+            else if (strcmp(value, "high") == 0)
+            {
+                options.bvhQuality = BvhQuality::EHighQuality;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--wide-bvh") == 0)
+        {
+            options.wideBvh = atoi(value);
+            if (options.wideBvh != 4 && options.wideBvh != 8)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return !options.gltfPath.empty() && options.samples > 0;
+}
+
+// Primary, shadow and diffuse bounce rays of every kernel on the current view.
+// The wide kernels run on both widths, the scene keeps wideBvh afterwards.
+static void PrintTraversalStats(CpuPathTracer& tracer, BvhTranslator& translator, int32 wideBvh)
+{
+    static const char* names[] = { "single", "packet4", "packet8", "packet16", "stream" };
+    static const TraversalMode modes[] = { TraversalMode::ESingle, TraversalMode::EPacket4, TraversalMode::EPacket8, TraversalMode::EPacket16, TraversalMode::EStream };
+
+    printf("%-12s %10s %10s %10s   Mrays/s\n", "traversal", "primary", "shadow", "secondary");
+    for (int32 i = 0; i < 5; ++i)
+    {
+        TraversalStats stats = tracer.MeasureTraversal(modes[i]);
+        printf("%-12s %10.2f %10.2f %10.2f\n", names[i], stats.primaryMrays, stats.shadowMrays, stats.secondaryMrays);
+    }
+
+    static const int32 widths[] = { 4, 8 };
+    for (int32 i = 0; i < 2; ++i)
+    {
+        translator.ProcessWide(widths[i]);
+        TraversalStats stats = tracer.MeasureTraversal(TraversalMode::EWide);
+        printf("wide%-8d %10.2f %10.2f %10.2f\n", widths[i], stats.primaryMrays, stats.shadowMrays, stats.secondaryMrays);
+    }
+    translator.ProcessWide(wideBvh);
+    fflush(stdout);
+}
+
+// Wall clock of the stages, printed to stdout for the farm logs
+class StageTimer
+{
+public:
+
+    StageTimer()
+        : m_Start(std::chrono::high_resolution_clock::now())
+    {
+
+    }
+
+    double Stop(const char* stage)
+    {
+        auto now  = std::chrono::high_resolution_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(now - m_Start).count();
+        printf("%-12s %10.2f ms\n", stage, ms);
+        fflush(stdout);
+        m_Start = now;
+        return ms;
+    }
+
+private:
+
+    std::chrono::high_resolution_clock::time_point m_Start;
+};
+
+int32 main(int32 argc, char** argv)
+{
+    RenderOptions options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    SetExePath(argv[0]);
+
+    JobManager::Init((int32)std::thread::hardware_concurrency());
+
+    StageTimer timer;
+    StageTimer total;
+
+    // The loaders run on this thread, nothing has to wait for JobManager::Tick
+    LoadGLTFJob gltfJob(options.gltfPath);
+    gltfJob.SetMemoryBudget((uint64)options.memoryBudget * 1024 * 1024);
+    gltfJob.SetBvhQuality(options.bvhQuality);
+    gltfJob.DoThreadedWork();
+    if (!gltfJob.GetScene())
+    {
+        LOGE("Failed to load %s\n", options.gltfPath.c_str());
+        JobManager::Destroy();
+        return 1;
+    }
+    timer.Stop("load gltf");
+
+    HDRImagePtr hdr = nullptr;
+    if (!options.hdrPath.empty())
+    {
+        LoadHDRJob hdrJob(options.hdrPath);
+        hdrJob.DoThreadedWork();
+        hdr = hdrJob.GetHDRImage();
+        if (!hdr || hdr->width == 0)
+        {
+            LOGE("Failed to load %s\n", options.hdrPath.c_str());
+            JobManager::Destroy();
+            return 1;
+        }
+        timer.Stop("load hdr");
+    }
+
+    auto scene = std::make_shared<GLScene>();
+    scene->Init(true);
+    scene->AddScene(gltfJob.GetScene());
+    scene->SetWideBvhWidth(options.wideBvh);
+    if (!scene->Build())
+    {
+        LOGE("Failed to build %s\n", options.gltfPath.c_str());
+        scene->Free(true);
+        JobManager::Destroy();
+        return 1;
+    }
+    if (hdr)
+    {
+        scene->AddHDR(hdr);
+    }
+    timer.Stop("build scene");
+
+    CameraPtr camera = scene->GetCamera();
+    camera->Perspective(MMath::DegreesToRadians(options.fov), options.width * 1.0f / options.height, 0.1f, 3000.0f);
+    if (options.hasEye)
+    {
+        camera->SetPosition(options.eye);
+    }
+    if (options.hasEye || options.hasTarget)
+    {
+        camera->LookAt(options.hasTarget ? options.target : gltfJob.GetScene()->bounds.Center());
+    }
+
+    CpuPathTracer tracer;
+    tracer.SetTaskPool(JobManager::TaskPool());
+    tracer.maxDepth = options.maxDepth;
+    if (options.wideBvh > 0)
+    {
+        tracer.primaryTraversal   = TraversalMode::EWide;
+        tracer.secondaryTraversal = TraversalMode::EWide;
+    }
+    tracer.SetScene(scene);
+    tracer.Resize(options.width, options.height);
+
+    // The first sample also builds the triangle blocks of the tracer
+    tracer.RenderSample();
+    timer.Stop("first sample");
+
+    if (options.measureTraversal)
+    {
+        PrintTraversalStats(tracer, *scene->GetBvhTranslator(), options.wideBvh);
+        timer.Stop("traversal");
+    }
+
+    for (int32 i = 1; i < options.samples; ++i)
+    {
+        tracer.RenderSample();
+    }
+    double renderMs = options.samples > 1 ? timer.Stop("render") : 0.0;
+    if (options.samples > 1)
+    {
+        printf("%-12s %10.2f ms/sample\n", "", renderMs / (options.samples - 1));
+    }
+
+    bool written = ImageWriter::Write(options.outPath, tracer.Framebuffer().data(), tracer.GetWidth(), tracer.GetHeight());
+    if (!written)
+    {
+        LOGE("Failed to write %s\n", options.outPath.c_str());
+    }
+    timer.Stop("write");
+    total.Stop("total");
+
+    scene->Free(true);
+    JobManager::Destroy();
+
+    return written ? 0 : 1;
+}
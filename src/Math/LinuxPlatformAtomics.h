@@ -0,0 +1,204 @@
+﻿#pragma once
+
+#include "Common/Common.h"
+
+// Same interface as WindowsPlatformAtomics on the gcc and clang __atomic builtins, sequentially consistent
+struct LinuxPlatformAtomics
+{
+    static FORCEINLINE int8 InterlockedIncrement(volatile int8* value)
+    {
+        return __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int16 InterlockedIncrement(volatile int16* value)
+    {
+        return __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int32 InterlockedIncrement(volatile int32* value)
+    {
+        return __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int64 InterlockedIncrement(volatile int64* value)
+    {
+        return __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int8 InterlockedDecrement(volatile int8* value)
+    {
+        return __atomic_sub_fetch(value, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int16 InterlockedDecrement(volatile int16* value)
+    {
+        return __atomic_sub_fetch(value, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int32 InterlockedDecrement(volatile int32* value)
+    {
+        return __atomic_sub_fetch(value, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int64 InterlockedDecrement(volatile int64* value)
+    {
+        return __atomic_sub_fetch(value, 1, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int8 InterlockedAdd(volatile int8* value, int8 amount)
+    {
+        return __atomic_fetch_add(value, amount, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int16 InterlockedAdd(volatile int16* value, int16 amount)
+    {
+        return __atomic_fetch_add(value, amount, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int32 InterlockedAdd(volatile int32* value, int32 amount)
+    {
+        return __atomic_fetch_add(value, amount, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int64 InterlockedAdd(volatile int64* value, int64 amount)
+    {
+        return __atomic_fetch_add(value, amount, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int8 InterlockedExchange(volatile int8* value, int8 exchange)
+    {
+        return __atomic_exchange_n(value, exchange, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int16 InterlockedExchange(volatile int16* value, int16 exchange)
+    {
+        return __atomic_exchange_n(value, exchange, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int32 InterlockedExchange(volatile int32* value, int32 exchange)
+    {
+        return __atomic_exchange_n(value, exchange, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int64 InterlockedExchange(volatile int64* value, int64 exchange)
+    {
+        return __atomic_exchange_n(value, exchange, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE void* InterlockedExchangePtr(void** dest, void* exchange)
+    {
+        return __atomic_exchange_n(dest, exchange, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int8 InterlockedCompareExchange(volatile int8* dest, int8 exchange, int8 comparand)
+    {
+        __atomic_compare_exchange_n(dest, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return comparand;
+    }
+
+    static FORCEINLINE int16 InterlockedCompareExchange(volatile int16* dest, int16 exchange, int16 comparand)
+    {
+        __atomic_compare_exchange_n(dest, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return comparand;
+    }
+
+    static FORCEINLINE int32 InterlockedCompareExchange(volatile int32* dest, int32 exchange, int32 comparand)
+    {
+        __atomic_compare_exchange_n(dest, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return comparand;
+    }
+
+    static FORCEINLINE int64 InterlockedCompareExchange(volatile int64* dest, int64 exchange, int64 comparand)
+    {
+        __atomic_compare_exchange_n(dest, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return comparand;
+    }
+
+    static FORCEINLINE int8 AtomicRead(volatile const int8* src)
+    {
+        return __atomic_load_n(src, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int16 AtomicRead(volatile const int16* src)
+    {
+        return __atomic_load_n(src, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int32 AtomicRead(volatile const int32* src)
+    {
+        return __atomic_load_n(src, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int64 AtomicRead(volatile const int64* src)
+    {
+        return __atomic_load_n(src, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE int8 AtomicRead_Relaxed(volatile const int8* src)
+    {
+        return __atomic_load_n(src, __ATOMIC_RELAXED);
+    }
+
+    static FORCEINLINE int16 AtomicRead_Relaxed(volatile const int16* src)
+    {
+        return __atomic_load_n(src, __ATOMIC_RELAXED);
+    }
+
+    static FORCEINLINE int32 AtomicRead_Relaxed(volatile const int32* src)
+    {
+        return __atomic_load_n(src, __ATOMIC_RELAXED);
+    }
+
+    static FORCEINLINE int64 AtomicRead_Relaxed(volatile const int64* src)
+    {
+        return __atomic_load_n(src, __ATOMIC_RELAXED);
+    }
+
+    static FORCEINLINE void AtomicStore(volatile int8* src, int8 val)
+    {
+        __atomic_store_n(src, val, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE void AtomicStore(volatile int16* src, int16 val)
+    {
+        __atomic_store_n(src, val, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE void AtomicStore(volatile int32* src, int32 val)
+    {
+        __atomic_store_n(src, val, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE void AtomicStore(volatile int64* src, int64 val)
+    {
+        __atomic_store_n(src, val, __ATOMIC_SEQ_CST);
+    }
+
+    static FORCEINLINE void AtomicStore_Relaxed(volatile int8* src, int8 val)
+    {
+        __atomic_store_n(src, val, __ATOMIC_RELAXED);
+    }
+
+    static FORCEINLINE void AtomicStore_Relaxed(volatile int16* src, int16 val)
+    {
+        __atomic_store_n(src, val, __ATOMIC_RELAXED);
+    }
+
+    static FORCEINLINE void AtomicStore_Relaxed(volatile int32* src, int32 val)
+    {
+        __atomic_store_n(src, val, __ATOMIC_RELAXED);
+    }
+
+    static FORCEINLINE void AtomicStore_Relaxed(volatile int64* src, int64 val)
+    {
+        __atomic_store_n(src, val, __ATOMIC_RELAXED);
+    }
+
+    static FORCEINLINE void* InterlockedCompareExchangePointer(void** dest, void* exchange, void* comparand)
+    {
+        __atomic_compare_exchange_n(dest, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return comparand;
+    }
+};
+
+typedef LinuxPlatformAtomics PlatformAtomics;
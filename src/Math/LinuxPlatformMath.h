@@ -0,0 +1,61 @@
+﻿#pragma once
+
+#include "Math/GenericPlatformMath.h"
+
+// Bit scans on the gcc and clang builtins, the rest is the generic implementation
+struct LinuxPlatformMath : public GenericPlatformMath
+{
+    static FORCEINLINE uint32 FloorLog2(uint32 value)
+    {
+        return value == 0 ? 0 : 31 - __builtin_clz(value);
+    }
+
+    static FORCEINLINE uint64 FloorLog264(uint64 value)
+    {
+        return value == 0 ? 0 : 63 - __builtin_clzll(value);
+    }
+
+    static FORCEINLINE uint32 CountLeadingZeros(uint32 value)
+    {
+        return value == 0 ? 32 : __builtin_clz(value);
+    }
+
+    static FORCEINLINE uint64 CountLeadingZeros64(uint64 value)
+    {
+        return value == 0 ? 64 : __builtin_clzll(value);
+    }
+
+    static FORCEINLINE uint32 CountTrailingZeros(uint32 value)
+    {
+        return value == 0 ? 32 : __builtin_ctz(value);
+    }
+
+    static FORCEINLINE uint64 CountTrailingZeros64(uint64 value)
+    {
+        return value == 0 ? 64 : __builtin_ctzll(value);
+    }
+
+    static FORCEINLINE uint32 CeilLogTwo(uint32 value)
+    {
+        int32 bitmask = ((int32)(CountLeadingZeros(value) << 26)) >> 31;
+        return (32 - CountLeadingZeros(value - 1)) & (~bitmask);
+    }
+
+    static FORCEINLINE uint64 CeilLogTwo64(uint64 value)
+    {
+        int64 bitmask = ((int64)(CountLeadingZeros64(value) << 57)) >> 63;
+        return (64 - CountLeadingZeros64(value - 1)) & (~bitmask);
+    }
+
+    static FORCEINLINE uint32 RoundUpToPowerOfTwo(uint32 value)
+    {
+        return 1 << CeilLogTwo(value);
+    }
+
+    static FORCEINLINE uint64 RoundUpToPowerOfTwo64(uint64 value)
+    {
+        return uint64(1) << CeilLogTwo64(value);
+    }
+};
+
+typedef LinuxPlatformMath PlatformMath;
@@ -0,0 +1,7 @@
+﻿#pragma once
+
+#ifdef PLATFORM_WINDOWS
+    #include "Math/WindowsPlatformAtomics.h"
+#else
+    #include "Math/LinuxPlatformAtomics.h"
+#endif
@@ -2,4 +2,9 @@
 
 #include "Common/Common.h"
 #include "Math/GenericPlatformMath.h"
-#include "Math/WindowsPlatformMath.h"
+
+#ifdef PLATFORM_WINDOWS
+    #include "Math/WindowsPlatformMath.h"
+#else
+    #include "Math/LinuxPlatformMath.h"
+#endif
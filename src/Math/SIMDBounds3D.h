@@ -0,0 +1,147 @@
+﻿#pragma once
+
+#include "Common/Common.h"
+#include "Math/Bounds3D.h"
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+    #include <emmintrin.h>
+#endif
+
+// Axis aligned box for the hot loops of the BVH builders.
+// With vector intrinsics min and max are kept in one SSE register each (w is unused),
+// otherwise it falls back to Bounds3D. Results are bit identical to Bounds3D.
+class SIMDBounds3D
+{
+public:
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+
+    SIMDBounds3D()
+        : m_Min(_mm_set1_ps(+MAX_FLT))
+        , m_Max(_mm_set1_ps(-MAX_FLT))
+    {
+
+    }
+
+    explicit SIMDBounds3D(const Bounds3D& b)
+        : m_Min(LoadMin(b))
+        , m_Max(LoadMax(b))
+    {
+
+    }
+
+    void Expand(const Bounds3D& b)
+    {
+        m_Min = _mm_min_ps(LoadMin(b), m_Min);
+        m_Max = _mm_max_ps(LoadMax(b), m_Max);
+    }
+
+    void Expand(const SIMDBounds3D& b)
+    {
+        m_Min = _mm_min_ps(b.m_Min, m_Min);
+        m_Max = _mm_max_ps(b.m_Max, m_Max);
+    }
+
+    float Area() const
+    {
+        // (x * y, y * z, z * x), summed in the same order as Bounds3D::Area
+        __m128 ext  = _mm_sub_ps(m_Max, m_Min);
+        __m128 prod = _mm_mul_ps(ext, _mm_shuffle_ps(ext, ext, _MM_SHUFFLE(3, 0, 2, 1)));
+
+        float xy = _mm_cvtss_f32(prod);
+        float yz = _mm_cvtss_f32(_mm_shuffle_ps(prod, prod, _MM_SHUFFLE(1, 1, 1, 1)));
+        float zx = _mm_cvtss_f32(_mm_shuffle_ps(prod, prod, _MM_SHUFFLE(2, 2, 2, 2)));
+
+        return 2.f * (xy + zx + yz);
+    }
+
+    Bounds3D ToBounds3D() const
+    {
+        float mn[4];
+        float mx[4];
+        _mm_storeu_ps(mn, m_Min);
+        _mm_storeu_ps(mx, m_Max);
+
+        Bounds3D result;
+        result.min = Vector3(mn[0], mn[1], mn[2]);
+        result.max = Vector3(mx[0], mx[1], mx[2]);
+        return result;
+    }
+
+    static SIMDBounds3D Intersection(const SIMDBounds3D& box1, const SIMDBounds3D& box2)
+    {
+        __m128 mn = _mm_max_ps(box2.m_Min, box1.m_Min);
+        __m128 mx = _mm_min_ps(box2.m_Max, box1.m_Max);
+
+        // Like the Bounds3D constructor, disjoint boxes get their corners sorted
+        SIMDBounds3D result;
+        result.m_Min = _mm_min_ps(mx, mn);
+        result.m_Max = _mm_max_ps(mx, mn);
+        return result;
+    }
+
+private:
+
+    static_assert(sizeof(Bounds3D) == 6 * sizeof(float), "Bounds3D must be tightly packed");
+
+    // Loads never touch memory past the box, so arrays of Bounds3D can be read up to the last element
+    static FORCEINLINE __m128 LoadMin(const Bounds3D& b)
+    {
+        return _mm_loadu_ps(&b.min.x);
+    }
+
+    static FORCEINLINE __m128 LoadMax(const Bounds3D& b)
+    {
+        __m128 v = _mm_loadu_ps(&b.min.z);
+        return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+
+private:
+
+    __m128 m_Min;
+    __m128 m_Max;
+
+#else
+
+    SIMDBounds3D()
+    {
+
+    }
+
+    explicit SIMDBounds3D(const Bounds3D& b)
+        : m_Bounds(b)
+    {
+
+    }
+
+    void Expand(const Bounds3D& b)
+    {
+        m_Bounds.Expand(b);
+    }
+
+    void Expand(const SIMDBounds3D& b)
+    {
+        m_Bounds.Expand(b.m_Bounds);
+    }
+
+    float Area() const
+    {
+        return m_Bounds.Area();
+    }
+
+    Bounds3D ToBounds3D() const
+    {
+        return m_Bounds;
+    }
+
+    static SIMDBounds3D Intersection(const SIMDBounds3D& box1, const SIMDBounds3D& box2)
+    {
+        return SIMDBounds3D(Bounds3D::Intersection(box1.m_Bounds, box2.m_Bounds));
+    }
+
+private:
+
+    Bounds3D m_Bounds;
+
+#endif
+};
@@ -0,0 +1,47 @@
+﻿#pragma once
+
+#include "Common/Common.h"
+
+#include <cstring>
+
+// Fast non cryptographic 64 bit hash for change detection, not stable across endianness
+FORCEINLINE uint64 HashMix(uint64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+FORCEINLINE uint64 HashCombine(uint64 seed, uint64 value)
+{
+    return HashMix(seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+}
+
+FORCEINLINE uint64 HashBytes(const void* data, uint64 size, uint64 seed = 0)
+{
+    const uint8* bytes = (const uint8*)data;
+    uint64 h = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+
+    // Word at a time, a byte loop is several times slower on large buffers
+    uint64 i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64 word;
+        memcpy(&word, bytes + i, 8);
+        word *= 0x87c37b91114253d5ULL;
+        word  = (word << 31) | (word >> 33);
+        h    ^= word * 0x4cf5ad432745937fULL;
+        h     = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+
+    uint64 tail = 0;
+    for (uint64 j = 0; i + j < size; ++j)
+    {
+        tail |= (uint64)bytes[i + j] << (j * 8);
+    }
+
+    return HashMix(h ^ tail);
+}
@@ -1,6 +1,8 @@
 ﻿#include "Misc/JobManager.h"
 #include "Math/Math.h"
 
+#include <thread>
+
 static TaskThreadPool*          s_TaskPool = nullptr;
 static std::vector<ThreadTask*> s_Jobs;
 
@@ -26,20 +28,27 @@ void JobManager::Tick()
         return;
     }
 
-    for (int32 i = (int32)s_Jobs.size() - 1; i >= 0; --i)
+    // One pass that keeps the pending jobs in order, callbacks may append new jobs meanwhile
+    const size_t count = s_Jobs.size();
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i)
     {
         ThreadTask* job = s_Jobs[i];
-        if (job->IsDone())
+        if (!job->IsDone())
+        {
+            s_Jobs[kept++] = job;
+            continue;
+        }
+
+        if (job->onCompleteEvent && !job->IsCancelled())
         {
-            if (job->onCompleteEvent)
-            {
-                job->onCompleteEvent(job);
-                job->onCompleteEvent = nullptr;
-            }
-            delete job;
-            s_Jobs.erase(s_Jobs.begin() + i);
+            job->onCompleteEvent(job);
+            job->onCompleteEvent = nullptr;
         }
+        delete job;
     }
+
+    s_Jobs.erase(s_Jobs.begin() + kept, s_Jobs.begin() + count);
 }
 
 void JobManager::Init(int32 threadNum)
@@ -49,7 +58,7 @@ void JobManager::Init(int32 threadNum)
         return;
     }
 
-    s_TaskPool = new TaskThreadPool();
+    s_TaskPool = TaskThreadPool::Allocate();
     s_TaskPool->Create(MMath::Max((int32)std::thread::hardware_concurrency(), 8));
 }
 
@@ -60,6 +69,9 @@ void JobManager::Destroy()
         return;
     }
 
+    // Long jobs stop early instead of running to the end on the calling thread
+    CancelJobs([](const ThreadTask*) -> bool { return true; });
+
     {
         s_TaskPool->Destroy();
         delete s_TaskPool;
@@ -80,13 +92,26 @@ TaskThreadPool* JobManager::TaskPool()
     return s_TaskPool;
 }
 
-void JobManager::AddJob(ThreadTask* task)
+void JobManager::CancelJobs(const std::function<bool(const ThreadTask*)>& filter)
+{
+    for (size_t i = 0; i < s_Jobs.size(); ++i)
+    {
+        if (!s_Jobs[i]->IsDone() && filter(s_Jobs[i]))
+        {
+            s_Jobs[i]->Cancel();
+        }
+    }
+}
+
+void JobManager::AddJob(ThreadTask* task, TaskPriority priority)
 {
     if (task == nullptr)
     {
         return;
     }
 
+    task->SetPriority(priority);
+
     if (s_TaskPool)
     {
         s_Jobs.push_back(task);
@@ -4,6 +4,8 @@
 #include "Job/ThreadTask.h"
 #include "Job/TaskThreadPool.h"
 
+#include <functional>
+
 class JobManager
 {
 private:
@@ -18,7 +20,11 @@ public:
 
     static void Destroy();
 
-    static void AddJob(ThreadTask* task);
+    static void AddJob(ThreadTask* task, TaskPriority priority = TaskPriority::Normal);
+
+    // Cancels the pending jobs filter returns true for. They are deleted once they stopped,
+    // without calling their onCompleteEvent.
+    static void CancelJobs(const std::function<bool(const ThreadTask*)>& filter);
 
     static void Tick();
 
@@ -0,0 +1,174 @@
+﻿#include "Misc/MappedFile.h"
+
+#ifdef PLATFORM_WINDOWS
+    #include <Windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+MappedFile::MappedFile()
+    : m_Data(nullptr)
+    , m_Size(0)
+    , m_File(nullptr)
+    , m_Mapping(nullptr)
+{
+
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#ifdef PLATFORM_WINDOWS
+
+bool MappedFile::Open(const std::string& path)
+{
+    Close();
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+
+    m_File    = file;
+    m_Mapping = mapping;
+    m_Data    = (const uint8*)data;
+    m_Size    = (uint64)size.QuadPart;
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_Data)
+    {
+        UnmapViewOfFile(m_Data);
+        CloseHandle((HANDLE)m_Mapping);
+        CloseHandle((HANDLE)m_File);
+    }
+
+    m_Data    = nullptr;
+    m_Size    = 0;
+    m_File    = nullptr;
+    m_Mapping = nullptr;
+}
+
+static uint64 GetPageSize()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+}
+
+static void ReleasePages(uint8* data, uint64 size)
+{
+    // Unlocking pages that are not locked removes them from the working set
+    VirtualUnlock(data, (SIZE_T)size);
+}
+
+#else
+
+bool MappedFile::Open(const std::string& path)
+{
+    Close();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping keeps the file referenced
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+    m_Data = (const uint8*)data;
+    m_Size = (uint64)info.st_size;
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_Data)
+    {
+        munmap((void*)m_Data, (size_t)m_Size);
+    }
+
+    m_Data    = nullptr;
+    m_Size    = 0;
+    m_File    = nullptr;
+    m_Mapping = nullptr;
+}
+
+static uint64 GetPageSize()
+{
+    return (uint64)sysconf(_SC_PAGESIZE);
+}
+
+static void ReleasePages(uint8* data, uint64 size)
+{
+    madvise(data, (size_t)size, MADV_DONTNEED);
+}
+
+#endif
+
+void MappedFile::Release(const uint8* data, uint64 size) const
+{
+    if (m_Data == nullptr || data < m_Data || data + size > m_Data + m_Size)
+    {
+        return;
+    }
+
+    static const uint64 pageSize = GetPageSize();
+
+    // Pages partly outside the range may still be in use
+    uint64 first = ((uint64)(data - m_Data) + pageSize - 1) / pageSize * pageSize;
+    uint64 last  = (uint64)(data - m_Data + size) / pageSize * pageSize;
+    if (first < last)
+    {
+        ReleasePages((uint8*)m_Data + first, last - first);
+    }
+}
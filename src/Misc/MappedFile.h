@@ -0,0 +1,51 @@
+﻿#pragma once
+
+#include "Common/Common.h"
+
+#include <string>
+
+// Read only view of a whole file mapped into memory
+class MappedFile
+{
+public:
+
+    MappedFile();
+
+    ~MappedFile();
+
+    bool Open(const std::string& path);
+
+    void Close();
+
+    FORCEINLINE bool IsOpen() const
+    {
+        return m_Data != nullptr;
+    }
+
+    FORCEINLINE const uint8* GetData() const
+    {
+        return m_Data;
+    }
+
+    FORCEINLINE uint64 GetSize() const
+    {
+        return m_Size;
+    }
+
+    // Drops the whole pages of a range from the working set of the process once it was consumed.
+    // The range stays readable, touching it again reads the pages back from the file.
+    void Release(const uint8* data, uint64 size) const;
+
+private:
+
+    MappedFile(const MappedFile& file) = delete;
+
+    MappedFile& operator = (const MappedFile& file) = delete;
+
+private:
+
+    const uint8*    m_Data;
+    uint64          m_Size;
+    void*           m_File;
+    void*           m_Mapping;
+};
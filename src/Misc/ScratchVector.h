@@ -0,0 +1,95 @@
+﻿#pragma once
+
+#include "Common/Common.h"
+
+#include <vector>
+#include <memory>
+#include <utility>
+
+// Temporary vector borrowed from a pool of the calling thread. It goes back with its capacity,
+// so builds of many small meshes on the same thread stop hitting the allocator after the first one.
+// Every ScratchVector owns its storage while it lives, scopes can nest, e.g. when a task waiting
+// for its group runs another build on the same thread.
+template <typename T>
+class ScratchVector
+{
+public:
+
+    // Larger buffers are freed on release, they would otherwise pin memory of big meshes per thread
+    static const size_t kMaxRetainedBytes = 4 * 1024 * 1024;
+
+    ScratchVector()
+        : m_Vector(Acquire())
+    {
+
+    }
+
+    explicit ScratchVector(size_t size)
+        : m_Vector(Acquire())
+    {
+        m_Vector->resize(size);
+    }
+
+    ~ScratchVector()
+    {
+        Release(std::move(m_Vector));
+    }
+
+    FORCEINLINE std::vector<T>& operator*()
+    {
+        return *m_Vector;
+    }
+
+    FORCEINLINE std::vector<T>* operator->()
+    {
+        return m_Vector.get();
+    }
+
+    FORCEINLINE T& operator[](size_t index)
+    {
+        return (*m_Vector)[index];
+    }
+
+private:
+
+    typedef std::unique_ptr<std::vector<T>> VectorPtr;
+
+    static std::vector<VectorPtr>& FreeList()
+    {
+        static thread_local std::vector<VectorPtr> s_FreeList;
+        return s_FreeList;
+    }
+
+    static VectorPtr Acquire()
+    {
+        std::vector<VectorPtr>& freeList = FreeList();
+        if (freeList.empty())
+        {
+            return VectorPtr(new std::vector<T>());
+        }
+
+        VectorPtr vector = std::move(freeList.back());
+        freeList.pop_back();
+        return vector;
+    }
+
+    static void Release(VectorPtr vector)
+    {
+        if (vector->capacity() * sizeof(T) > kMaxRetainedBytes)
+        {
+            return;
+        }
+
+        vector->clear();
+        FreeList().push_back(std::move(vector));
+    }
+
+private:
+
+    VectorPtr m_Vector;
+
+private:
+    ScratchVector(const ScratchVector&) = delete;
+
+    ScratchVector& operator = (const ScratchVector&) = delete;
+};
@@ -1,10 +1,16 @@
 ﻿#include "Base/Base.h"
+#include "Common/Log.h"
 
 #include "Parser/GLTFParser.h"
+#include "Parser/MeshCache.h"
 #include "Parser/tiny_gltf.h"
 
 #include "Misc/FileMisc.h"
+#include "Misc/MappedFile.h"
 #include "Misc/JobManager.h"
+#include "Job/TaskGraph.h"
+#include "Job/MemoryBudget.h"
+#include "Misc/Hash.h"
 
 #include "Math/Vector2.h"
 #include "Math/Vector3.h"
@@ -12,7 +18,6 @@
 #include "Math/Quat.h"
 
 #include <string>
-#include <thread>
 #include <glad/glad.h>
 
 #define KHR_LIGHTS_PUNCTUAL_EXTENSION_NAME "KHR_lights_punctual"
@@ -25,6 +30,58 @@
 #define KHR_MATERIALS_ANISOTROPY_EXTENSION_NAME "KHR_materials_anisotropy"
 #define KHR_MATERIALS_IOR_EXTENSION_NAME "KHR_materials_ior"
 #define KHR_MATERIALS_VOLUME_EXTENSION_NAME "KHR_materials_volume"
+#define EXT_MESH_GPU_INSTANCING_EXTENSION_NAME "EXT_mesh_gpu_instancing"
+
+// Primitives with fewer indices are imported together, one task per primitive would cost more than the import
+static const size_t kMinImportBatchIndices = 64 * 1024;
+// Budget charged for a primitive until its streams are freed, with a rough estimate of the
+// references, bins and nodes the SplitBvh build allocates per triangle
+static const uint64 kImportBytesPerVertex = 2 * sizeof(Vector3) + sizeof(Vector2) + 2 * sizeof(Vector4);
+static const uint64 kImportBytesPerTriangle = 3 * sizeof(uint32) + 256;
+
+// Bytes of one glTF buffer, mapped or loaded by tinygltf
+struct GLTFBuffer
+{
+    const uint8*    data = nullptr;
+    uint64          size = 0;
+};
+
+struct PendingPrimitive
+{
+    const tinygltf::Primitive*  primitive;
+    MeshPtr                     mesh;
+    // Slot in ImportContext::meshTasks
+    size_t                      slot;
+    // Acquired from ImportContext::budget
+    uint64                      bytes;
+};
+
+// State shared by the import steps of one asset
+struct ImportContext
+{
+    MeshCache*              cache = nullptr;
+    TaskThreadPool*         pool = nullptr;
+    // Cancellation of the owning job, polled by every import task
+    const CancellationToken* cancellation = nullptr;
+    // Each glTF buffer, see LoadGLTFModel
+    std::vector<GLTFBuffer> buffers;
+    // Mapping of a .glb, null for .gltf files
+    const MappedFile*       mapping = nullptr;
+    // Out-of-core imports only, the meshes are appended to writer and freed once their BVH is built
+    MemoryBudget*           budget = nullptr;
+    MeshCacheWriter*        writer = nullptr;
+    BvhQuality              bvhQuality = BvhQuality::EBalanced;
+    // Meshes of each glTF mesh, one per primitive, shared by every node that instances it
+    std::vector<MeshArray>  gltfMeshes;
+    // Skipped primitives leave gltfMeshes empty, they are only reported once
+    std::vector<bool>       gltfMeshImported;
+    // Streams of scene->meshes[i], null when they came from the cache
+    std::vector<TaskHandle> meshTasks;
+    std::vector<TaskHandle> bvhTasks;
+    // Primitives waiting for the current batch to fill up
+    std::vector<PendingPrimitive> batch;
+    size_t                  batchIndices = 0;
+};
 
 template <typename T>
 static FORCEINLINE std::vector<T> GetGLTFVector(const tinygltf::Value& value)
@@ -94,87 +151,153 @@ static FORCEINLINE void GetGLTFTexId(const tinygltf::Value& value, const std::st
     }
 }
 
+// Reads one component of a normalized integer or float accessor
+static FORCEINLINE float GetGLTFComponent(const uint8* data, int32 componentType)
+{
+    switch (componentType)
+    {
+        case TINYGLTF_COMPONENT_TYPE_FLOAT:
+        {
+            float value;
+            memcpy(&value, data, sizeof(float));
+            return value;
+        }
+        case TINYGLTF_COMPONENT_TYPE_BYTE:
+        {
+            return MMath::Max(*reinterpret_cast<const int8*>(data) / 127.f, -1.f);
+        }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        {
+            return *data / 255.f;
+        }
+        case TINYGLTF_COMPONENT_TYPE_SHORT:
+        {
+            int16 value;
+            memcpy(&value, data, sizeof(int16));
+            return MMath::Max(value / 32767.f, -1.f);
+        }
+        case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+        {
+            uint16 value;
+            memcpy(&value, data, sizeof(uint16));
+            return value / 65535.f;
+        }
+        default:
+        {
+            return 0.0f;
+        }
+    }
+}
+
+// First byte of the accessor, null unless every element lies in its buffer view
+// and the view lies in its buffer
+static const uint8* GetGLTFAccessorData(const tinygltf::Model& model, const std::vector<GLTFBuffer>& buffers, const tinygltf::Accessor& accessor)
+{
+    if (accessor.bufferView < 0 || accessor.bufferView >= (int32)model.bufferViews.size())
+    {
+        return nullptr;
+    }
+
+    const auto& bufView = model.bufferViews[accessor.bufferView];
+    if (bufView.buffer < 0 || bufView.buffer >= (int32)buffers.size())
+    {
+        return nullptr;
+    }
+
+    const GLTFBuffer& buffer = buffers[bufView.buffer];
+    if (buffer.data == nullptr || bufView.byteOffset > buffer.size || bufView.byteLength > buffer.size - bufView.byteOffset)
+    {
+        return nullptr;
+    }
+
+    const int32 numComps = tinygltf::GetNumComponentsInType(accessor.type);
+    const int32 compSize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+    if (numComps <= 0 || compSize <= 0)
+    {
+        return nullptr;
+    }
+
+    // byteOffset + (count - 1) * stride + elemSize <= byteLength, without overflows
+    const uint64 elemSize = (uint64)numComps * compSize;
+    const uint64 stride   = bufView.byteStride > 0 ? bufView.byteStride : elemSize;
+    if (stride < elemSize)
+    {
+        return nullptr;
+    }
+
+    if (accessor.count > 0 &&
+        (accessor.byteOffset > bufView.byteLength ||
+         elemSize > bufView.byteLength - accessor.byteOffset ||
+         accessor.count - 1 > (bufView.byteLength - accessor.byteOffset - elemSize) / stride))
+    {
+        return nullptr;
+    }
+
+    return buffer.data + bufView.byteOffset + accessor.byteOffset;
+}
+
+// Appends the elements of the accessor to attribVec, which is resized once up front.
+// Components missing in the accessor, e.g. the alpha of a VEC3 color, keep the defaults of T.
 template <typename T>
-static bool GetGLTFAttribute(const tinygltf::Model& model, const tinygltf::Primitive& primitive, std::vector<T>& attribVec, const std::string& attribName)
+static bool GetGLTFAccessor(const tinygltf::Model& model, const std::vector<GLTFBuffer>& buffers, int32 accessorID, std::vector<T>& attribVec)
 {
-    if (primitive.attributes.find(attribName) == primitive.attributes.end())
+    if (accessorID < 0 || accessorID >= (int32)model.accessors.size())
     {
         return false;
     }
-    
-    const auto& accessor = model.accessors[primitive.attributes.find(attribName)->second];
+
+    const auto& accessor = model.accessors[accessorID];
+    const auto  bufData  = GetGLTFAccessorData(model, buffers, accessor);
+    if (bufData == nullptr)
+    {
+        return false;
+    }
+
     const auto& bufView  = model.bufferViews[accessor.bufferView];
-    const auto& buffer   = model.buffers[bufView.buffer];
-    const auto  bufData  = reinterpret_cast<const T*>(&(buffer.data[accessor.byteOffset + bufView.byteOffset]));
     const auto  numElems = accessor.count;
 
-    if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT)
+    const int32  numDstComps = int32(sizeof(T) / sizeof(float));
+    const int32  numComps    = MMath::Min(tinygltf::GetNumComponentsInType(accessor.type), numDstComps);
+    const size_t compSize    = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+    const size_t elemSize    = tinygltf::GetNumComponentsInType(accessor.type) * compSize;
+    const size_t byteStride  = bufView.byteStride > 0 ? bufView.byteStride : elemSize;
+
+    const size_t first = attribVec.size();
+    attribVec.resize(first + numElems);
+    T* dst = attribVec.data() + first;
+
+    // Tightly packed floats of the same layout as T
+    if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT && elemSize == sizeof(T) && byteStride == sizeof(T))
     {
-        if (bufView.byteStride == 0)
-        {
-            attribVec.insert(attribVec.end(), bufData, bufData + numElems);
-        }
-        else
-        {
-            auto bufferByte = reinterpret_cast<const uint8*>(bufData);
-            for (size_t i = 0; i < numElems; ++i)
-            {
-                attribVec.push_back(*reinterpret_cast<const T*>(bufferByte));
-                bufferByte += bufView.byteStride;
-            }
-        }
+        memcpy(dst, bufData, numElems * sizeof(T));
+        return true;
     }
-    else
-    {
-        int32 numComps    = accessor.type == TINYGLTF_TYPE_VEC2 ? 2 : (accessor.type == TINYGLTF_TYPE_VEC3) ? 3 : 4;
-        size_t strideComp = accessor.componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE ? 1 : 2;
-        size_t byteStride = bufView.byteStride > 0 ? bufView.byteStride : size_t(numComps) * strideComp;
-        auto   bufferByte = reinterpret_cast<const uint8*>(bufData);
 
-        for (size_t i = 0; i < numElems; ++i)
+    const uint8* src = bufData;
+    for (size_t i = 0; i < numElems; ++i)
+    {
+        for (int32 c = 0; c < numComps; ++c)
         {
-            T vecValue;
-            auto bufferByteData = bufferByte;
-            for (int32 c = 0; c < numComps; ++c)
-            {
-                float value = *reinterpret_cast<const float*>(bufferByteData);
-                switch (accessor.componentType)
-                {
-                    case TINYGLTF_COMPONENT_TYPE_BYTE:
-                    {
-                        vecValue[c] = MMath::Max(value / 127.f, -1.f);
-                        break;
-                    }
-                    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
-                    {
-                        vecValue[c] = value / 255.f;
-                        break;
-                    }
-                    case TINYGLTF_COMPONENT_TYPE_SHORT:
-                    {
-                        vecValue[c] = MMath::Max(value / 32767.f, -1.f);
-                        break;
-                    }
-                    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
-                    {
-                        vecValue[c] = value / 65535.f;
-                        break;
-                    }
-                    default:
-                    {
-                        break;
-                    }
-                }
-                bufferByteData += strideComp;
-            }
-            bufferByte += byteStride;
-            attribVec.push_back(vecValue);
+            dst[i][c] = GetGLTFComponent(src + c * compSize, accessor.componentType);
         }
+        src += byteStride;
     }
 
     return true;
 }
 
+template <typename T>
+static bool GetGLTFAttribute(const tinygltf::Model& model, const std::vector<GLTFBuffer>& buffers, const tinygltf::Primitive& primitive, std::vector<T>& attribVec, const std::string& attribName)
+{
+    auto it = primitive.attributes.find(attribName);
+    if (it == primitive.attributes.end())
+    {
+        return false;
+    }
+
+    return GetGLTFAccessor(model, buffers, it->second, attribVec);
+}
+
 static void ImportMaterials(Scene3DPtr scene, tinygltf::Model& model)
 {
     for (int32 i = 0; i < (int32)model.materials.size(); ++i)
@@ -306,227 +429,467 @@ static void ImportMaterials(Scene3DPtr scene, tinygltf::Model& model)
     }
 }
 
-static void ImportMesh(Scene3DPtr scene, tinygltf::Model& model, Object3DPtr object3D, int32 gltfMeshID)
+// Accessors of the primitive lie in their buffers, every attribute has a value per vertex
+// and the indices form at least one triangle. Only reads the accessors, not the data.
+static bool IsValidGLTFPrimitive(const tinygltf::Model& model, const std::vector<GLTFBuffer>& buffers, const tinygltf::Primitive& gltfPrim)
 {
-    auto& gltfMesh = model.meshes[gltfMeshID];
-    for (int32 gltfPrimIdx = 0; gltfPrimIdx < (int32)gltfMesh.primitives.size(); ++gltfPrimIdx)
+    auto position = gltfPrim.attributes.find("POSITION");
+    if (position == gltfPrim.attributes.end() || position->second < 0 || position->second >= (int32)model.accessors.size())
     {
-        auto& gltfPrim = gltfMesh.primitives[gltfPrimIdx];
-        MeshPtr mesh   = std::make_shared<Mesh>();
-        mesh->material = MMath::Max(0, gltfPrim.material);
-        mesh->node     = object3D;
+        return false;
+    }
 
-        // add to scene
-        {
-            scene->meshes.push_back(mesh);
-            object3D->meshes.push_back(mesh);
-            object3D->materials.push_back(scene->materials[mesh->material]);
-        }
+    const size_t numVertices = model.accessors[position->second].count;
+    if (numVertices == 0 || numVertices > MAX_uint32)
+    {
+        return false;
+    }
 
-        if (gltfMesh.primitives.size() == 1)
+    for (auto it = gltfPrim.attributes.begin(); it != gltfPrim.attributes.end(); ++it)
+    {
+        if (it->second < 0 || it->second >= (int32)model.accessors.size())
         {
-            mesh->name = gltfMesh.name;
+            return false;
         }
-        else
+
+        const auto& accessor = model.accessors[it->second];
+        if (accessor.count != numVertices || GetGLTFAccessorData(model, buffers, accessor) == nullptr)
         {
-            mesh->name = std::string(gltfMesh.name) + "_primitive" + std::to_string(gltfPrimIdx);
+            return false;
         }
+    }
 
-        // indices
-        if (gltfPrim.indices > -1)
-        {
-            const tinygltf::Accessor&   indexAccessor = model.accessors[gltfPrim.indices];
-            const tinygltf::BufferView& bufferView    = model.bufferViews[indexAccessor.bufferView];
-            const tinygltf::Buffer&     buffer        = model.buffers[bufferView.buffer];
+    if (gltfPrim.indices < 0)
+    {
+        return numVertices % 3 == 0;
+    }
+
+    if (gltfPrim.indices >= (int32)model.accessors.size())
+    {
+        return false;
+    }
 
-            mesh->indices.resize(indexAccessor.count);
+    const auto& accessor = model.accessors[gltfPrim.indices];
+    return accessor.type == TINYGLTF_TYPE_SCALAR &&
+           (accessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT ||
+            accessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT ||
+            accessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE) &&
+           accessor.count > 0 &&
+           accessor.count % 3 == 0 &&
+           GetGLTFAccessorData(model, buffers, accessor) != nullptr;
+}
+
+// Decodes indices and vertex streams of one primitive, generates the missing normals and tangents.
+// Only touches mesh, imports of different primitives run in parallel. See IsValidGLTFPrimitive.
+static void ImportPrimitive(const tinygltf::Model& model, const std::vector<GLTFBuffer>& buffers, const tinygltf::Primitive& gltfPrim, MeshPtr mesh)
+{
+    // indices
+    if (gltfPrim.indices > -1)
+    {
+        const tinygltf::Accessor&   indexAccessor = model.accessors[gltfPrim.indices];
+        const uint8*                indexData     = GetGLTFAccessorData(model, buffers, indexAccessor);
+        const size_t                numIndices    = indexAccessor.count;
+
+        mesh->indices.resize(numIndices);
+        uint32* indices = mesh->indices.data();
 
-            if (indexAccessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT)
+        if (indexAccessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT)
+        {
+            memcpy(indices, indexData, numIndices * sizeof(uint32));
+        }
+        else if (indexAccessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT)
+        {
+            for (size_t i = 0; i < numIndices; ++i)
             {
-                memcpy(mesh->indices.data(), &buffer.data[indexAccessor.byteOffset + bufferView.byteOffset], indexAccessor.count * sizeof(uint32));
+                uint16 index;
+                memcpy(&index, indexData + i * sizeof(uint16), sizeof(uint16));
+                indices[i] = index;
             }
-            else if (indexAccessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT)
+        }
+        else if (indexAccessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE)
+        {
+            for (size_t i = 0; i < numIndices; ++i)
             {
-                std::vector<uint16> temp;
-                temp.resize(indexAccessor.count);
-                memcpy(temp.data(), &buffer.data[indexAccessor.byteOffset + bufferView.byteOffset], indexAccessor.count * sizeof(uint16));
-                for (int32 idx = 0; idx < (int32)temp.size(); ++idx)
-                {
-                    mesh->indices[idx] = temp[idx];
-                }
+                indices[i] = indexData[i];
             }
-            else if (indexAccessor.componentType == TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE)
+        }
+    }
+    else
+    {
+        const auto& accessor = model.accessors[gltfPrim.attributes.find("POSITION")->second];
+        mesh->indices.resize(accessor.count);
+        for (uint32 i = 0; i < (uint32)accessor.count; ++i)
+        {
+            mesh->indices[i] = i;
+        }
+    }
+
+    // position
+    {
+        GetGLTFAttribute<Vector3>(model, buffers, gltfPrim, mesh->positions, "POSITION");
+
+        // Triangles with missing vertices become degenerate
+        const uint32 numVertices = (uint32)mesh->positions.size();
+        for (size_t i = 0; i < mesh->indices.size(); i += 3)
+        {
+            uint32* tri = &mesh->indices[i];
+            if (tri[0] >= numVertices || tri[1] >= numVertices || tri[2] >= numVertices)
             {
-                std::vector<uint8> temp;
-                temp.resize(indexAccessor.count);
-                memcpy(temp.data(), &buffer.data[indexAccessor.byteOffset + bufferView.byteOffset], indexAccessor.count * sizeof(uint8));
-                for (int32 idx = 0; idx < (int32)temp.size(); ++idx)
-                {
-                    mesh->indices[idx] = temp[idx];
-                }
+                tri[0] = tri[1] = tri[2] = 0;
             }
         }
+
+        const auto& accessor = model.accessors[gltfPrim.attributes.find("POSITION")->second];
+        if (accessor.minValues.size() == 3 && accessor.maxValues.size() == 3)
+        {
+            mesh->aabb.min = Vector3((float)accessor.minValues[0], (float)accessor.minValues[1], (float)accessor.minValues[2]);
+            mesh->aabb.max = Vector3((float)accessor.maxValues[0], (float)accessor.maxValues[1], (float)accessor.maxValues[2]);
+        }
         else
         {
-            const auto& accessor = model.accessors[gltfPrim.attributes.find("POSITION")->second];
-            mesh->indices.resize(accessor.count);
-            for (uint32 i = 0; i < (uint32)accessor.count; ++i)
+            for (size_t i = 0; i < mesh->positions.size(); ++i)
             {
-                mesh->indices[i] = i;
+                if (i == 0)
+                {
+                    mesh->aabb.min = mesh->positions[i];
+                    mesh->aabb.max = mesh->positions[i];
+                }
+                else
+                {
+                    mesh->aabb.Expand(mesh->positions[i]);
+                }
             }
         }
+    }
 
-        // position
+    // normal
+    {
+        if (!GetGLTFAttribute<Vector3>(model, buffers, gltfPrim, mesh->normals, "NORMAL"))
         {
-            GetGLTFAttribute<Vector3>(model, gltfPrim, mesh->positions, "POSITION");
-
-            const auto& accessor = model.accessors[gltfPrim.attributes.find("POSITION")->second];
-            if (accessor.minValues.size() == 3 && accessor.maxValues.size() == 3)
+            std::vector<Vector3>& normals = mesh->normals;
+            normals.resize(mesh->positions.size());
+            for (size_t i = 0; i < mesh->indices.size(); i += 3)
             {
-                mesh->aabb.min = Vector3((float)accessor.minValues[0], (float)accessor.minValues[1], (float)accessor.minValues[2]);
-                mesh->aabb.max = Vector3((float)accessor.maxValues[0], (float)accessor.maxValues[1], (float)accessor.maxValues[2]);
+                uint32 idx0 = mesh->indices[i + 0];
+                uint32 idx1 = mesh->indices[i + 1];
+                uint32 idx2 = mesh->indices[i + 2];
+                const auto& pos0 = mesh->positions[idx0];
+                const auto& pos1 = mesh->positions[idx1];
+                const auto& pos2 = mesh->positions[idx2];
+                const auto v1 = (pos1 - pos0).GetSafeNormal();
+                const auto v2 = (pos2 - pos0).GetSafeNormal();
+                const auto n  = Vector3::CrossProduct(v2, v1);
+                normals[idx0] += n;
+                normals[idx1] += n;
+                normals[idx2] += n;
             }
-            else
+
+            for (size_t i = 0; i < normals.size(); ++i)
             {
-                for (size_t i = 0; i < mesh->positions.size(); ++i)
-                {
-                    if (i == 0)
-                    {
-                        mesh->aabb.min = mesh->positions[i];
-                        mesh->aabb.max = mesh->positions[i];
-                    }
-                    else
-                    {
-                        mesh->aabb.Expand(mesh->positions[i]);
-                    }
-                }
+                normals[i].Normalize();
             }
         }
+    }
+
+    // uv
+    {
+        if (!GetGLTFAttribute<Vector2>(model, buffers, gltfPrim, mesh->uvs, "TEXCOORD_0"))
+        {
+            mesh->uvs.assign(mesh->positions.size(), Vector2(0.0f, 0.0f));
+        }
+    }
 
-        // normal
+    // tangent
+    {
+        if (!GetGLTFAttribute<Vector4>(model, buffers, gltfPrim, mesh->tangents, "TANGENT"))
         {
-            std::vector<Vector3> normals;
+            std::vector<Vector3> tempTangents;
+            tempTangents.resize(mesh->positions.size());
+
+            std::vector<Vector3> tempBitangents;
+            tempBitangents.resize(mesh->positions.size());
 
-            if (!GetGLTFAttribute<Vector3>(model, gltfPrim, normals, "NORMAL"))
+            for (size_t i = 0; i < mesh->indices.size(); i += 3)
             {
-                normals.resize(mesh->positions.size());
-                for (size_t i = 0; i < mesh->indices.size(); i += 3)
-                {
-                    uint32 idx0 = mesh->indices[i + 0];
-                    uint32 idx1 = mesh->indices[i + 1];
-                    uint32 idx2 = mesh->indices[i + 2];
-                    const auto& pos0 = mesh->positions[idx0];
-                    const auto& pos1 = mesh->positions[idx1];
-                    const auto& pos2 = mesh->positions[idx2];
-                    const auto v1 = (pos1 - pos0).GetSafeNormal();
-                    const auto v2 = (pos2 - pos0).GetSafeNormal();
-                    const auto n  = Vector3::CrossProduct(v2, v1);
-                    normals[idx0] += n;
-                    normals[idx1] += n;
-                    normals[idx2] += n;
-                }
+                uint32 idx0 = mesh->indices[i + 0];
+                uint32 idx1 = mesh->indices[i + 1];
+                uint32 idx2 = mesh->indices[i + 2];
+
+                const auto& p0 = mesh->positions[idx0];
+                const auto& p1 = mesh->positions[idx1];
+                const auto& p2 = mesh->positions[idx2];
+
+                const auto& uv0 = mesh->uvs[idx0];
+                const auto& uv1 = mesh->uvs[idx1];
+                const auto& uv2 = mesh->uvs[idx2];
+
+                Vector3 e1 = p1 - p0;
+                Vector3 e2 = p2 - p0;
+
+                Vector2 duvE1 = uv1 - uv0;
+                Vector2 duvE2 = uv2 - uv0;
 
-                for (size_t i = 0; i < normals.size(); ++i)
+                float r = 1.0f;
+                float a = duvE1.x * duvE2.y - duvE2.x * duvE1.y;
+                if (MMath::Abs(a) > 0.0f)
                 {
-                    normals[i].Normalize();
+                    r = 1.0f / a;
                 }
+
+                Vector3 t = (e1 * duvE2.y - e2 * duvE1.y) * r;
+                Vector3 b = (e2 * duvE1.x - e1 * duvE2.x) * r;
+
+                tempTangents[idx0] += t;
+                tempTangents[idx1] += t;
+                tempTangents[idx2] += t;
+
+                tempBitangents[idx0] += b;
+                tempBitangents[idx1] += b;
+                tempBitangents[idx2] += b;
             }
 
-            mesh->normals.resize(normals.size());
-            for (size_t i = 0; i < normals.size(); ++i)
+            mesh->tangents.resize(mesh->positions.size());
+            for (size_t i = 0; i < mesh->positions.size(); ++i)
             {
-                mesh->normals[i] = normals[i];
+                const auto& n = mesh->normals[i];
+                const auto& t = tempTangents[i];
+                const auto& b = tempBitangents[i];
+
+                Vector3 tangent  = (t - (Vector3::DotProduct(n, t) * n)).GetSafeNormal();
+                float handedness = (Vector3::DotProduct(Vector3::CrossProduct(n, t), b) < 0.0f) ? -1.0f : 1.0f;
+
+                mesh->tangents[i] = Vector4(tangent, handedness);
             }
         }
+    }
 
-        // uv
+    // color
+    {
+        if (!GetGLTFAttribute<Vector4>(model, buffers, gltfPrim, mesh->colors, "COLOR_0"))
         {
-            if (!GetGLTFAttribute<Vector2>(model, gltfPrim, mesh->uvs, "TEXCOORD_0"))
+            mesh->colors.assign(mesh->positions.size(), Vector4(1.0f, 1.0f, 1.0f, 1.0f));
+        }
+    }
+}
+
+static size_t GetPrimitiveNumIndices(const tinygltf::Model& model, const tinygltf::Primitive& gltfPrim)
+{
+    if (gltfPrim.indices > -1)
+    {
+        return model.accessors[gltfPrim.indices].count;
+    }
+
+    auto it = gltfPrim.attributes.find("POSITION");
+    return it != gltfPrim.attributes.end() ? model.accessors[it->second].count : 0;
+}
+
+static uint64 EstimateImportBytes(const tinygltf::Model& model, const tinygltf::Primitive& gltfPrim)
+{
+    auto it = gltfPrim.attributes.find("POSITION");
+    uint64 numVertices  = it != gltfPrim.attributes.end() ? model.accessors[it->second].count : 0;
+    uint64 numTriangles = GetPrimitiveNumIndices(model, gltfPrim) / 3;
+    return numVertices * kImportBytesPerVertex + numTriangles * kImportBytesPerTriangle;
+}
+
+// BVH build of one mesh, it starts as soon as the streams of the mesh are imported.
+// Out-of-core imports write the finished mesh to the cache and free its streams right away.
+static void LaunchBottomLevelAS(MeshPtr mesh, int32 index, uint64 bytes, const TaskHandle& streams, ImportContext& context)
+{
+    TaskThreadPool* pool = context.pool;
+    const CancellationToken* cancellation = context.cancellation;
+    MemoryBudget* budget = context.budget;
+    MeshCacheWriter* writer = context.writer;
+    context.bvhTasks.push_back(TaskGraph::Launch(pool, [mesh, index, bytes, pool, cancellation, budget, writer]() {
+        if (!cancellation->IsCancelled())
+        {
+            if (mesh->bvh == nullptr)
             {
-                mesh->uvs.resize(mesh->positions.size());
-                for (size_t i = 0; i < mesh->positions.size(); ++i)
-                {
-                    mesh->uvs[i].x = 0.0f;
-                    mesh->uvs[i].y = 0.0f;
-                }
+                mesh->BuildBVH(pool, cancellation);
+            }
+
+            if (writer)
+            {
+                writer->Append(index, *mesh);
+                MeshCache::PageOut(*mesh);
             }
         }
 
-        // tangent
+        // Also when cancelled, the importer may be waiting for the bytes
+        if (budget)
         {
-            if (!GetGLTFAttribute<Vector4>(model, gltfPrim, mesh->tangents, "TANGENT"))
-            {
-                std::vector<Vector3> tempTangents;
-                tempTangents.resize(mesh->positions.size());
+            budget->Release(bytes);
+        }
+    }, { streams }));
+}
 
-                std::vector<Vector3> tempBitangents;
-                tempBitangents.resize(mesh->positions.size());
+// The mapped source of a primitive is not read again once it is imported
+static void ReleaseGLTFPrimitive(const tinygltf::Model& model, const std::vector<GLTFBuffer>& buffers, const tinygltf::Primitive& gltfPrim, const MappedFile& mapping)
+{
+    auto release = [&](int32 accessorID) {
+        if (accessorID < 0 || accessorID >= (int32)model.accessors.size())
+        {
+            return;
+        }
 
-                for (size_t i = 0; i < mesh->indices.size(); i += 3)
-                {
-                    uint32 idx0 = mesh->indices[i + 0];
-                    uint32 idx1 = mesh->indices[i + 1];
-                    uint32 idx2 = mesh->indices[i + 2];
+        const auto& accessor = model.accessors[accessorID];
+        const uint8* data = GetGLTFAccessorData(model, buffers, accessor);
+        if (data == nullptr || accessor.count == 0)
+        {
+            return;
+        }
 
-                    const auto& p0 = mesh->positions[idx0];
-                    const auto& p1 = mesh->positions[idx0];
-                    const auto& p2 = mesh->positions[idx0];
+        const auto& bufView = model.bufferViews[accessor.bufferView];
+        size_t elemSize = tinygltf::GetNumComponentsInType(accessor.type) * tinygltf::GetComponentSizeInBytes(accessor.componentType);
+        size_t stride   = bufView.byteStride > 0 ? bufView.byteStride : elemSize;
+        mapping.Release(data, (accessor.count - 1) * stride + elemSize);
+    };
 
-                    const auto& uv0 = mesh->uvs[idx0];
-                    const auto& uv1 = mesh->uvs[idx0];
-                    const auto& uv2 = mesh->uvs[idx0];
+    if (gltfPrim.indices > -1)
+    {
+        release(gltfPrim.indices);
+    }
 
-                    Vector3 e1 = p1 - p0;
-                    Vector3 e2 = p2 - p0;
+    for (auto it = gltfPrim.attributes.begin(); it != gltfPrim.attributes.end(); ++it)
+    {
+        release(it->second);
+    }
+}
 
-                    Vector2 duvE1 = uv1 - uv0;
-                    Vector2 duvE2 = uv2 - uv0;
+// Launches one task for the pending primitives, each of them waits on it
+static void FlushImportBatch(const tinygltf::Model& model, ImportContext& context)
+{
+    if (context.batch.empty())
+    {
+        return;
+    }
 
-                    float r = 1.0f;
-                    float a = duvE1.x * duvE2.y - duvE2.x * duvE1.y;
-                    if (MMath::Abs(a) > 0.0f)
-                    {
-                        r = 1.0f / a;
-                    }
+    std::vector<PendingPrimitive> batch;
+    batch.swap(context.batch);
+    context.batchIndices = 0;
 
-                    Vector3 t = (e1 * duvE2.y - e2 * duvE1.y) * r;
-                    Vector3 b = (e2 * duvE1.x - e1 * duvE2.x) * r;
+    const tinygltf::Model* gltfModel = &model;
+    const std::vector<GLTFBuffer>* buffers = &context.buffers;
+    const MappedFile* mapping = context.mapping;
+    const CancellationToken* cancellation = context.cancellation;
+    TaskHandle task = TaskGraph::Launch(context.pool, [gltfModel, buffers, mapping, batch, cancellation]() {
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            if (cancellation->IsCancelled())
+            {
+                return;
+            }
+            ImportPrimitive(*gltfModel, *buffers, *batch[i].primitive, batch[i].mesh);
 
-                    tempTangents[idx0] += t;
-                    tempTangents[idx1] += t;
-                    tempTangents[idx2] += t;
+            if (mapping)
+            {
+                ReleaseGLTFPrimitive(*gltfModel, *buffers, *batch[i].primitive, *mapping);
+            }
+        }
+    });
 
-                    tempBitangents[idx0] += b;
-                    tempBitangents[idx1] += b;
-                    tempBitangents[idx2] += b;
-                }
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        context.meshTasks[batch[i].slot] = task;
+        LaunchBottomLevelAS(batch[i].mesh, (int32)batch[i].slot, batch[i].bytes, task, context);
+    }
+}
 
-                mesh->tangents.resize(mesh->positions.size());
-                for (size_t i = 0; i < mesh->positions.size(); ++i)
-                {
-                    const auto& n = mesh->normals[i];
-                    const auto& t = tempTangents[i];
-                    const auto& b = tempBitangents[i];
+static void ImportMesh(Scene3DPtr scene, tinygltf::Model& model, Object3DPtr object3D, int32 gltfMeshID, ImportContext& context)
+{
+    // Later instances only add renderers, the streams and the BLAS are shared
+    MeshArray& sharedMeshes = context.gltfMeshes[gltfMeshID];
+    if (context.gltfMeshImported[gltfMeshID])
+    {
+        for (size_t i = 0; i < sharedMeshes.size(); ++i)
+        {
+            object3D->meshes.push_back(sharedMeshes[i]);
+            object3D->materials.push_back(scene->materials[sharedMeshes[i]->material]);
+        }
+        return;
+    }
 
-                    Vector3 tangent  = (t - (Vector3::DotProduct(n, t) * n)).GetSafeNormal();
-                    float handedness = (Vector3::DotProduct(Vector3::CrossProduct(n, t), b) < 0.0f) ? -1.0f : 1.0f;
+    context.gltfMeshImported[gltfMeshID] = true;
 
-                    mesh->tangents[i] = Vector4(tangent, handedness);
-                }
+    auto& gltfMesh = model.meshes[gltfMeshID];
+    for (int32 gltfPrimIdx = 0; gltfPrimIdx < (int32)gltfMesh.primitives.size(); ++gltfPrimIdx)
+    {
+        auto& gltfPrim = gltfMesh.primitives[gltfPrimIdx];
+        if (!IsValidGLTFPrimitive(model, context.buffers, gltfPrim))
+        {
+            LOGW("Primitive %d of mesh %s has invalid accessors and is skipped.\n", gltfPrimIdx, gltfMesh.name.c_str());
+            continue;
+        }
+
+        MeshPtr mesh   = std::make_shared<Mesh>();
+        mesh->material = MMath::Max(0, gltfPrim.material);
+        mesh->SetBvhQuality(context.bvhQuality);
+        // The first node that instances the mesh
+        mesh->node     = object3D;
+
+        // add to scene
+        {
+            scene->meshes.push_back(mesh);
+            sharedMeshes.push_back(mesh);
+            object3D->meshes.push_back(mesh);
+            object3D->materials.push_back(scene->materials[mesh->material]);
+        }
+
+        if (gltfMesh.primitives.size() == 1)
+        {
+            mesh->name = gltfMesh.name;
+        }
+        else
+        {
+            mesh->name = std::string(gltfMesh.name) + "_primitive" + std::to_string(gltfPrimIdx);
+        }
+
+        const int32 index = (int32)scene->meshes.size() - 1;
+        mesh->storeIndex  = index;
+
+        // Keeps meshTasks aligned with scene->meshes, the job throws the scene away
+        if (context.cancellation->IsCancelled())
+        {
+            context.meshTasks.push_back(nullptr);
+            continue;
+        }
+
+        // Cached streams are final, generated normals and tangents included
+        if (context.cache && context.cache->ReadMesh(index, *mesh))
+        {
+            context.meshTasks.push_back(nullptr);
+            if (mesh->bvh == nullptr)
+            {
+                LaunchBottomLevelAS(mesh, index, 0, nullptr, context);
+            }
+            else if (context.budget)
+            {
+                // The cache itself is the store of out-of-core meshes
+                MeshCache::PageOut(*mesh);
             }
+            continue;
         }
 
-        // color
+        uint64 bytes = 0;
+        if (context.budget)
         {
-            if (!GetGLTFAttribute<Vector4>(model, gltfPrim, mesh->colors, "COLOR_0"))
+            bytes = EstimateImportBytes(model, gltfPrim);
+            if (!context.budget->TryAcquire(bytes))
             {
-                mesh->colors.resize(mesh->positions.size());
-                for (size_t i = 0; i < mesh->positions.size(); ++i)
-                {
-                    mesh->colors[i] = Vector4(1.0f, 1.0f, 1.0f, 1.0f);
-                }
+                // The pending batch holds bytes too, nothing is released before it ran
+                FlushImportBatch(model, context);
+                context.budget->Acquire(bytes, context.pool);
             }
         }
+
+        PendingPrimitive pending = { &gltfPrim, mesh, context.meshTasks.size(), bytes };
+        context.meshTasks.push_back(nullptr);
+        context.batch.push_back(pending);
+        context.batchIndices += GetPrimitiveNumIndices(model, gltfPrim);
+
+        if (context.batchIndices >= kMinImportBatchIndices)
+        {
+            FlushImportBatch(model, context);
+        }
     }
 }
 
@@ -563,7 +926,57 @@ static void ImportLight(Scene3DPtr scene, tinygltf::Model& model, Object3DPtr ob
     }
 }
 
-static void ImportNode(Scene3DPtr scene, tinygltf::Model& model, int32 nodeID, Object3DPtr parent)
+// Local transform of glTF TRS properties, scaled first, then rotated and translated
+static Matrix4x4 GetGLTFTransform(const Vector3& translation, const Vector4& rotation, const Vector3& scale)
+{
+    Matrix4x4 transform;
+    transform.SetIdentity();
+    transform.AppendScale(scale);
+    transform.Append(Quat(rotation.x, rotation.y, rotation.z, rotation.w).ToMatrix());
+    transform.AppendTranslation(translation);
+    return transform;
+}
+
+// EXT_mesh_gpu_instancing, every instance becomes a child node that shares the meshes of the
+// glTF mesh, so each one is a single TLAS instance. The node itself renders nothing.
+static void ImportInstances(Scene3DPtr scene, tinygltf::Model& model, Object3DPtr object3D, int32 gltfMeshID, const tinygltf::Value& extension, ImportContext& context)
+{
+    const tinygltf::Value& attributes = extension.Get("attributes");
+
+    auto getAccessor = [&](const char* name) {
+        return attributes.Has(name) ? attributes.Get(name).GetNumberAsInt() : -1;
+    };
+
+    std::vector<Vector3> translations;
+    std::vector<Vector4> rotations;
+    std::vector<Vector3> scales;
+    GetGLTFAccessor(model, context.buffers, getAccessor("TRANSLATION"), translations);
+    GetGLTFAccessor(model, context.buffers, getAccessor("ROTATION"), rotations);
+    GetGLTFAccessor(model, context.buffers, getAccessor("SCALE"), scales);
+
+    const size_t numInstances = MMath::Max(translations.size(), MMath::Max(rotations.size(), scales.size()));
+    for (size_t i = 0; i < numInstances; ++i)
+    {
+        auto instance = std::make_shared<Object3D>();
+        instance->name   = object3D->name + "_instance" + std::to_string(i);
+        instance->parent = object3D;
+        instance->transform = GetGLTFTransform(
+            i < translations.size() ? translations[i] : Vector3(0.0f, 0.0f, 0.0f),
+            i < rotations.size() ? rotations[i] : Vector4(0.0f, 0.0f, 0.0f, 1.0f),
+            i < scales.size() ? scales[i] : Vector3(1.0f, 1.0f, 1.0f)
+        );
+
+        // add to scene
+        {
+            scene->nodes.push_back(instance);
+            object3D->children.push_back(instance);
+        }
+
+        ImportMesh(scene, model, instance, gltfMeshID, context);
+    }
+}
+
+static void ImportNode(Scene3DPtr scene, tinygltf::Model& model, int32 nodeID, Object3DPtr parent, ImportContext& context)
 {
     auto& gltfNode = model.nodes[nodeID];
     auto object3D  = std::make_shared<Object3D>();
@@ -591,26 +1004,33 @@ static void ImportNode(Scene3DPtr scene, tinygltf::Model& model, int32 nodeID, O
 
     // transform
     {
-        object3D->transform.SetIdentity();
+        Vector3 translation(0.0f, 0.0f, 0.0f);
+        Vector4 rotation(0.0f, 0.0f, 0.0f, 1.0f);
+        Vector3 scale(1.0f, 1.0f, 1.0f);
         if (gltfNode.rotation.size() == 4) 
         {
-            Quat quat((float)gltfNode.rotation[0], (float)gltfNode.rotation[1], (float)gltfNode.rotation[2], (float)gltfNode.rotation[3]);
-            object3D->transform.Append(quat.ToMatrix());
+            rotation = Vector4((float)gltfNode.rotation[0], (float)gltfNode.rotation[1], (float)gltfNode.rotation[2], (float)gltfNode.rotation[3]);
         }
         if (gltfNode.scale.size() == 3) 
         {
-            object3D->transform.AppendScale(Vector3((float)gltfNode.scale[0], (float)gltfNode.scale[1], (float)gltfNode.scale[2]));
+            scale = Vector3((float)gltfNode.scale[0], (float)gltfNode.scale[1], (float)gltfNode.scale[2]);
         }
         if (gltfNode.translation.size() == 3) 
         {
-            object3D->transform.AppendTranslation(Vector3((float)gltfNode.translation[0], (float)gltfNode.translation[1], (float)gltfNode.translation[2]));
+            translation = Vector3((float)gltfNode.translation[0], (float)gltfNode.translation[1], (float)gltfNode.translation[2]);
         }
+        object3D->transform = GetGLTFTransform(translation, rotation, scale);
     }
 
     // mesh
-    if (gltfNode.mesh > -1)
+    auto instancing = gltfNode.extensions.find(EXT_MESH_GPU_INSTANCING_EXTENSION_NAME);
+    if (gltfNode.mesh > -1 && instancing != gltfNode.extensions.end())
+    {
+        ImportInstances(scene, model, object3D, gltfNode.mesh, instancing->second, context);
+    }
+    else if (gltfNode.mesh > -1)
     {
-        ImportMesh(scene, model, object3D, gltfNode.mesh);
+        ImportMesh(scene, model, object3D, gltfNode.mesh, context);
     }
     else if (gltfNode.extensions.find(KHR_LIGHTS_PUNCTUAL_EXTENSION_NAME) != gltfNode.extensions.end())
     {
@@ -620,11 +1040,11 @@ static void ImportNode(Scene3DPtr scene, tinygltf::Model& model, int32 nodeID, O
     // children
     for (size_t i = 0; i < gltfNode.children.size(); ++i)
     {
-        ImportNode(scene, model, gltfNode.children[i], object3D);
+        ImportNode(scene, model, gltfNode.children[i], object3D, context);
     }
 }
 
-static void ImportNodes(Scene3DPtr scene, tinygltf::Model& model)
+static void ImportNodes(Scene3DPtr scene, tinygltf::Model& model, ImportContext& context)
 {
     const auto& gltfScene = model.scenes[model.defaultScene > -1 ? model.defaultScene : 0];
 
@@ -638,11 +1058,16 @@ static void ImportNodes(Scene3DPtr scene, tinygltf::Model& model)
         scene->nodes.push_back(scene->rootNode);
     }
 
+    context.gltfMeshes.resize(model.meshes.size());
+    context.gltfMeshImported.resize(model.meshes.size(), false);
+
     for (size_t idx = 0; idx < gltfScene.nodes.size(); ++idx)
     {
         int32 nodeID = gltfScene.nodes[idx];
-        ImportNode(scene, model, nodeID, scene->rootNode);
+        ImportNode(scene, model, nodeID, scene->rootNode, context);
     }
+
+    FlushImportBatch(model, context);
 }
 
 static void ImportImages(Scene3DPtr scene, tinygltf::Model& model)
@@ -752,71 +1177,84 @@ static void CalcSceneDimensions(Scene3DPtr scene)
     }
 }
 
-static void BuildBottomLevelAS(Scene3DPtr scene)
+// .glb files are mapped and their binary chunk is read in place instead of being copied
+// into the model. buffers receives the bytes of every buffer of the model,
+// mapping has to stay open while they are in use.
+static bool LoadGLTFModel(const std::string& path, tinygltf::Model& model, MappedFile& mapping, std::vector<GLTFBuffer>& buffers)
 {
-    if (scene->meshes.size() == 0)
+    std::string error;
+    std::string warn;
+    tinygltf::TinyGLTF tinyContext;
+    GLTFBuffer binaryChunk;
+
+    if (GetFileExtension(path) == "gltf")
     {
-        return;
+        if (!tinyContext.LoadASCIIFromFile(&model, &error, &warn, path))
+        {
+            return false;
+        }
     }
-
-    struct BuildBVHJob : ThreadTask
+    else
     {
-        MeshPtr mesh;
+        // Header, JSON chunk header and the chunk, then the binary chunk header
+        const uint64 kHeaderSize = 12;
+        const uint64 kChunkHeaderSize = 8;
 
-        BuildBVHJob(MeshPtr inMesh)
-            : mesh(inMesh)
+        if (!mapping.Open(path) || mapping.GetSize() < kHeaderSize + kChunkHeaderSize || mapping.GetSize() > MAX_uint32)
         {
-
+            return false;
         }
 
-        virtual void DoThreadedWork() override
-		{
-            mesh->BuildBVH();
-		}
+        uint32 jsonLength = 0;
+        memcpy(&jsonLength, mapping.GetData() + kHeaderSize, sizeof(uint32));
 
-		virtual void Abandon() override
-		{
+        uint64 binaryOffset = kHeaderSize + kChunkHeaderSize + jsonLength + kChunkHeaderSize;
+        if (binaryOffset <= mapping.GetSize())
+        {
+            // Truncated files only expose the mapped part of the chunk
+            uint32 binaryLength = 0;
+            memcpy(&binaryLength, mapping.GetData() + binaryOffset - kChunkHeaderSize, sizeof(uint32));
+            binaryChunk.data = mapping.GetData() + binaryOffset;
+            binaryChunk.size = MMath::Min((uint64)binaryLength, mapping.GetSize() - binaryOffset);
+        }
 
-		}
-    };
+        std::string baseDir;
+        size_t slash = path.find_last_of("/\\");
+        if (slash != std::string::npos)
+        {
+            baseDir = path.substr(0, slash);
+        }
 
-    std::vector<BuildBVHJob*> jobs;
-    for (size_t i = 0; i < scene->meshes.size(); ++i)
-    {
-        BuildBVHJob* job = new BuildBVHJob(scene->meshes[i]);
-        jobs.push_back(job);
-        JobManager::TaskPool()->AddTask(job);
+        tinyContext.SetExternalBinaryChunk(true);
+        if (!tinyContext.LoadBinaryFromMemory(&model, &error, &warn, mapping.GetData(), (uint32)mapping.GetSize(), baseDir))
+        {
+            return false;
+        }
     }
 
-    while (true)
+    buffers.resize(model.buffers.size());
+    for (size_t i = 0; i < model.buffers.size(); ++i)
     {
-        bool complete = true;
-        for (size_t i = 0; i < jobs.size(); ++i)
+        const auto& buffer = model.buffers[i];
+        if (buffer.data.empty() && buffer.uri.empty())
         {
-            if (!jobs[i]->IsDone())
-            {
-                complete = false;
-                break;
-            }
+            buffers[i] = binaryChunk;
         }
-
-        if (complete)
+        else
         {
-            break;
+            buffers[i].data = buffer.data.data();
+            buffers[i].size = buffer.data.size();
         }
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 
-    for (size_t i = 0; i < jobs.size(); ++i)
-    {
-        delete jobs[i];
-    }
+    return true;
 }
 
 LoadGLTFJob::LoadGLTFJob(const std::string& path)
     : m_Path(path)
     , m_Scene3D(nullptr)
+    , m_MemoryBudget(0)
+    , m_BvhQuality(BvhQuality::EBalanced)
 {
 
 }
@@ -828,34 +1266,157 @@ LoadGLTFJob::~LoadGLTFJob()
 
 void LoadGLTFJob::DoThreadedWork()
 {
-    bool result = false;
-    std::string error;
-    std::string warn;
     tinygltf::Model tinyModel;
-    tinygltf::TinyGLTF tinyContext;
-    std::string extension = GetFileExtension(m_Path);
+    MappedFile mapping;
+    std::vector<GLTFBuffer> buffers;
+
+    bool result = LoadGLTFModel(m_Path, tinyModel, mapping, buffers);
 
-    if (extension == "gltf")
+    if (result == false || IsCancelled())
     {
-        result = tinyContext.LoadASCIIFromFile(&tinyModel, &error, &warn, m_Path);
+        m_Scene3D = nullptr;
+        return;
     }
-    else
+
+    m_Scene3D = std::make_shared<Scene3D>();
+
+    // The mesh cache is keyed on the content of the asset and its external buffers.
+    // Embedded buffers are part of the asset file. Its size and modification times are
+    // checked first, the content is only hashed when they changed.
+    std::string baseDir;
+    size_t slash = m_Path.find_last_of("/\\");
+    if (slash != std::string::npos)
     {
-        result = tinyContext.LoadBinaryFromFile(&tinyModel, &error, &warn, m_Path);
+        baseDir = m_Path.substr(0, slash + 1);
     }
 
-    if (result == false)
+    std::vector<const tinygltf::Buffer*> externalBuffers;
+    uint64 stamp = MeshCache::GetFileStamp(m_Path);
+    for (size_t i = 0; i < tinyModel.buffers.size(); ++i)
+    {
+        const auto& buffer = tinyModel.buffers[i];
+        if (buffer.uri.empty() || buffer.uri.compare(0, 5, "data:") == 0)
+        {
+            continue;
+        }
+
+        // Escaped uris can not be found again, their content is always hashed
+        uint64 bufferStamp = MeshCache::GetFileStamp(baseDir + buffer.uri);
+        stamp = stamp != 0 && bufferStamp != 0 ? HashCombine(stamp, bufferStamp) : 0;
+        externalBuffers.push_back(&buffer);
+    }
+
+    uint64 contentHash = 0;
+    bool hashed = false;
+    auto hashContent = [&]() -> uint64 {
+        if (!hashed)
+        {
+            hashed = true;
+            contentHash = MeshCache::HashFile(m_Path);
+            for (size_t i = 0; i < externalBuffers.size() && contentHash != 0; ++i)
+            {
+                const auto& data = externalBuffers[i]->data;
+                contentHash = HashCombine(contentHash, HashBytes(data.data(), data.size()));
+            }
+        }
+        return contentHash;
+    };
+
+    std::string cachePath = MeshCache::GetCachePath(m_Path);
+    std::shared_ptr<MeshCache> cache = std::make_shared<MeshCache>();
+    bool warm = cache->Open(cachePath, stamp, hashContent);
+
+    // Out-of-core imports stream every mesh through the cache file and page it in from there later.
+    // A cache with stale meshes is written again from scratch.
+    bool outOfCore = m_MemoryBudget > 0;
+    Mesh defaults;
+    defaults.SetBvhQuality(m_BvhQuality);
+    if (outOfCore && warm && !cache->IsComplete(defaults.bvhBuilder, defaults.bvhSettings))
+    {
+        cache->Close();
+        warm = false;
+    }
+
+    MemoryBudget budget(m_MemoryBudget);
+    MeshCacheWriter writer;
+    if (outOfCore && !warm && !writer.Open(cachePath, stamp, hashContent()))
+    {
+        LOGW("Out-of-core import needs a writable mesh cache, %s is imported in memory.\n", m_Path.c_str());
+        outOfCore = false;
+    }
+
+    ImportContext context;
+    context.cache = warm ? cache.get() : nullptr;
+    context.pool  = JobManager::TaskPool();
+    context.cancellation = GetCancellationToken();
+    context.buffers.swap(buffers);
+    context.mapping = mapping.IsOpen() ? &mapping : nullptr;
+    context.budget  = outOfCore ? &budget : nullptr;
+    context.writer  = writer.IsOpen() ? &writer : nullptr;
+    context.bvhQuality = m_BvhQuality;
+
+    // parse -> primitive streams -> BLAS per mesh, the scene bounds wait for all streams.
+    // Images decode on this thread while the pool works on the meshes.
+    ImportMaterials(m_Scene3D, tinyModel);
+    ImportNodes(m_Scene3D, tinyModel, context);
+
+    Scene3DPtr scene3D = m_Scene3D;
+    TaskHandle bounds  = TaskGraph::Launch(context.pool, [scene3D]() {
+        CalcSceneDimensions(scene3D);
+    }, context.meshTasks);
+
+    if (!IsCancelled())
+    {
+        ImportImages(m_Scene3D, tinyModel);
+        ImportTextures(m_Scene3D, tinyModel);
+    }
+
+    // Cancelled tasks return right away, but they still reference tinyModel
+    bounds->Wait();
+    TaskGraph::WaitAll(context.bvhTasks);
+
+    // Half imported meshes must not end up in the cache
+    if (IsCancelled())
     {
         m_Scene3D = nullptr;
         return;
     }
 
-    m_Scene3D = std::make_shared<Scene3D>();
+    // Also when every primitive was skipped, the TLAS needs at least one instance
+    if (m_Scene3D->meshes.empty())
+    {
+        LOGE("%s has no meshes to import.\n", m_Path.c_str());
+        m_Scene3D = nullptr;
+        return;
+    }
 
-    ImportMaterials(m_Scene3D, tinyModel);
-    ImportNodes(m_Scene3D, tinyModel);
-    ImportImages(m_Scene3D, tinyModel);
-    ImportTextures(m_Scene3D, tinyModel);
-    CalcSceneDimensions(m_Scene3D);
-    BuildBottomLevelAS(m_Scene3D);
+    if (outOfCore)
+    {
+        if (context.writer)
+        {
+            cache->Close();
+            if (!writer.Commit((int32)m_Scene3D->meshes.size()) || !cache->Open(cachePath, stamp, hashContent))
+            {
+                LOGE("Can't write the mesh store of %s.\n", m_Path.c_str());
+                m_Scene3D = nullptr;
+                return;
+            }
+        }
+
+        for (size_t i = 0; i < m_Scene3D->meshes.size(); ++i)
+        {
+            m_Scene3D->meshes[i]->store = cache;
+        }
+
+        LOGI("Out-of-core import of %s peaked at %.1f MB of a %.1f MB budget.\n", m_Path.c_str(), budget.GetPeak() / (1024.0 * 1024.0), budget.GetLimit() / (1024.0 * 1024.0));
+        return;
+    }
+
+    bool stale = !warm || cache->IsStale();
+    cache->Close();
+
+    if (stale)
+    {
+        MeshCache::Write(cachePath, stamp, hashContent(), m_Scene3D->meshes);
+    }
 }
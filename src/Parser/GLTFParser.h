@@ -23,8 +23,24 @@ public:
         return m_Scene3D;
     }
 
+    // Bytes of mesh streams and BVH build scratch the import may hold at once. The meshes are
+    // then kept in the mesh cache file and only paged in while they are used, see Mesh::store.
+    // 0 keeps every mesh in memory.
+    FORCEINLINE void SetMemoryBudget(uint64 bytes)
+    {
+        m_MemoryBudget = bytes;
+    }
+
+    // Bottom level BVH preset of every imported mesh, cached BVHs built with other settings are rebuilt
+    FORCEINLINE void SetBvhQuality(BvhQuality quality)
+    {
+        m_BvhQuality = quality;
+    }
+
 private:
 
     std::string         m_Path;
     Scene3DPtr          m_Scene3D;
+    uint64              m_MemoryBudget;
+    BvhQuality          m_BvhQuality;
 };
@@ -1,5 +1,6 @@
 ﻿#include "Parser/HDRParser.h"
 #include "Misc/FileMisc.h"
+#include "Misc/JobManager.h"
 #include "Base/Base.h"
 #include "Math/Math.h"
 #include "Parser/stb_image.h"
@@ -29,6 +30,13 @@ LoadHDRJob::~LoadHDRJob()
 void LoadHDRJob::DoThreadedWork()
 {
     LoadHDRImage();
+
+    if (IsCancelled())
+    {
+        m_HDRImage = nullptr;
+        return;
+    }
+
     CreateEnvImportanceTexture();
 }
 
@@ -65,8 +73,16 @@ void LoadHDRJob::CreateEnvImportanceTexture()
     std::vector<EnvAccel> envAccel(width * height);
     std::vector<float>    importanceData(width * height);
 
+    TaskThreadPool* pool = JobManager::TaskPool();
+
     for (int32 y = 0; y < height; ++y)
     {
+        // Usually runs as a background job, let interactive work in between rows
+        if (pool && (y & 63) == 0)
+        {
+            pool->RunInteractiveTasks();
+        }
+
         float theta1    = (y + 1) * stepTheta;
         float cosTheta1 = MMath::Cos(theta1);
         float area      = (cosTheta0 - cosTheta1) * stepPhi;
@@ -0,0 +1,158 @@
+﻿#include "Parser/ImageWriter.h"
+#include "Parser/stb_image_write.h"
+#include "Misc/FileMisc.h"
+#include "Math/Math.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+static FORCEINLINE uint8 LinearToSRGB8(float value)
+{
+    value = MMath::Clamp(value, 0.0f, 1.0f);
+    value = value <= 0.0031308f ? value * 12.92f : 1.055f * MMath::Pow(value, 1.0f / 2.4f) - 0.055f;
+    return (uint8)(value * 255.0f + 0.5f);
+}
+
+bool ImageWriter::Write(const std::string& path, const float* rgba, int32 width, int32 height)
+{
+    std::string extension = GetFileExtension(path);
+    if (extension == "png")
+    {
+        return WritePNG(path, rgba, width, height);
+    }
+    else if (extension == "hdr")
+    {
+        return WriteHDR(path, rgba, width, height);
+    }
+    else if (extension == "exr")
+    {
+        return WriteEXR(path, rgba, width, height);
+    }
+
+    return false;
+}
+
+bool ImageWriter::WritePNG(const std::string& path, const float* rgba, int32 width, int32 height)
+{
+    std::vector<uint8> pixels(width * height * 4);
+    for (int32 i = 0; i < width * height; ++i)
+    {
+        pixels[i * 4 + 0] = LinearToSRGB8(rgba[i * 4 + 0]);
+        pixels[i * 4 + 1] = LinearToSRGB8(rgba[i * 4 + 1]);
+        pixels[i * 4 + 2] = LinearToSRGB8(rgba[i * 4 + 2]);
+        pixels[i * 4 + 3] = (uint8)(MMath::Clamp(rgba[i * 4 + 3], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+
+    return stbi_write_png(path.c_str(), width, height, 4, pixels.data(), width * 4) != 0;
+}
+
+bool ImageWriter::WriteHDR(const std::string& path, const float* rgba, int32 width, int32 height)
+{
+    return stbi_write_hdr(path.c_str(), width, height, 4, rgba) != 0;
+}
+
+// Header attributes and pixel data of OpenEXR are little endian, like every target we build for
+struct EXRStream
+{
+    std::vector<uint8> data;
+
+    void Bytes(const void* src, size_t size)
+    {
+        data.insert(data.end(), (const uint8*)src, (const uint8*)src + size);
+    }
+
+    void String(const char* str)
+    {
+        Bytes(str, strlen(str) + 1);
+    }
+
+    template <typename T>
+    void Value(T value)
+    {
+        Bytes(&value, sizeof(T));
+    }
+
+    void Attribute(const char* name, const char* type, int32 size)
+    {
+        String(name);
+        String(type);
+        Value<int32>(size);
+    }
+};
+
+bool ImageWriter::WriteEXR(const std::string& path, const float* rgba, int32 width, int32 height)
+{
+    // Channels have to be sorted by name, A B G R map to these rgba components
+    static const char* channelNames[4] = { "A", "B", "G", "R" };
+    static const int32 channelSources[4] = { 3, 2, 1, 0 };
+
+    EXRStream stream;
+    stream.Value<uint32>(20000630);
+    stream.Value<uint32>(2);
+
+    stream.Attribute("channels", "chlist", 4 * 18 + 1);
+    for (int32 c = 0; c < 4; ++c)
+    {
+        stream.String(channelNames[c]);
+        stream.Value<int32>(2);     // FLOAT
+        stream.Value<uint32>(0);    // pLinear and reserved
+        stream.Value<int32>(1);     // xSampling
+        stream.Value<int32>(1);     // ySampling
+    }
+    stream.Value<uint8>(0);
+
+    stream.Attribute("compression", "compression", 1);
+    stream.Value<uint8>(0);
+
+    const int32 window[4] = { 0, 0, width - 1, height - 1 };
+    stream.Attribute("dataWindow", "box2i", 16);
+    stream.Bytes(window, sizeof(window));
+    stream.Attribute("displayWindow", "box2i", 16);
+    stream.Bytes(window, sizeof(window));
+
+    stream.Attribute("lineOrder", "lineOrder", 1);
+    stream.Value<uint8>(0);
+    stream.Attribute("pixelAspectRatio", "float", 4);
+    stream.Value<float>(1.0f);
+    stream.Attribute("screenWindowCenter", "v2f", 8);
+    stream.Value<float>(0.0f);
+    stream.Value<float>(0.0f);
+    stream.Attribute("screenWindowWidth", "float", 4);
+    stream.Value<float>(1.0f);
+    stream.Value<uint8>(0);
+
+    // One block per scanline, the offset table points at each of them
+    const int32 lineSize = width * 4 * (int32)sizeof(float);
+    uint64 offset = stream.data.size() + height * sizeof(uint64);
+    for (int32 y = 0; y < height; ++y)
+    {
+        stream.Value<uint64>(offset);
+        offset += 8 + lineSize;
+    }
+
+    for (int32 y = 0; y < height; ++y)
+    {
+        stream.Value<int32>(y);
+        stream.Value<int32>(lineSize);
+        for (int32 c = 0; c < 4; ++c)
+        {
+            const float* row = rgba + y * width * 4;
+            for (int32 x = 0; x < width; ++x)
+            {
+                stream.Value<float>(row[x * 4 + channelSources[c]]);
+            }
+        }
+    }
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+
+    bool result = fwrite(stream.data.data(), 1, stream.data.size(), file) == stream.data.size();
+    fclose(file);
+
+    return result;
+}
@@ -0,0 +1,21 @@
+﻿#pragma once
+
+#include "Common/Common.h"
+
+#include <string>
+
+// Writes RGBA float images, top row first, as produced by CpuPathTracer::Framebuffer
+struct ImageWriter
+{
+    // Picks the format from the extension of path, png, hdr or exr
+    static bool Write(const std::string& path, const float* rgba, int32 width, int32 height);
+
+    // Clamped and sRGB encoded, 8 bits per channel
+    static bool WritePNG(const std::string& path, const float* rgba, int32 width, int32 height);
+
+    // Radiance RGBE, linear
+    static bool WriteHDR(const std::string& path, const float* rgba, int32 width, int32 height);
+
+    // OpenEXR scanlines, uncompressed 32 bit float RGBA, linear
+    static bool WriteEXR(const std::string& path, const float* rgba, int32 width, int32 height);
+};
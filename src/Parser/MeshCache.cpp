@@ -0,0 +1,548 @@
+﻿#include "Parser/MeshCache.h"
+
+#include "Common/Log.h"
+#include "Misc/Hash.h"
+#include "Misc/JobManager.h"
+#include "Job/TaskGroup.h"
+
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Bump when the file layout or the mesh import changes
+static const uint32 kMeshCacheVersion = 5;
+static const char   kMeshCacheMagic[8] = { 'G', 'R', 'T', 'S', 'M', 'E', 'S', 'H' };
+static const uint64 kStreamAlignment = 16;
+static const uint64 kHashChunkSize = 64 * 1024 * 1024;
+
+enum MeshStream
+{
+    kIndices = 0,
+    kPositions,
+    kNormals,
+    kUvs,
+    kTangents,
+    kColors,
+    kBvhNodes,
+    kBvhIndices,
+    kNumStreams
+};
+
+static const uint64 kStreamElementSizes[kNumStreams] =
+{
+    sizeof(uint32),
+    sizeof(Vector3),
+    sizeof(Vector3),
+    sizeof(Vector2),
+    sizeof(Vector4),
+    sizeof(Vector4),
+    sizeof(Bvh::FlatNode),
+    sizeof(int32)
+};
+
+struct MeshCache::Header
+{
+    char    magic[8];
+    uint32  version;
+    uint32  numMeshes;
+    // Size and modification times the content hash was last checked against
+    uint64  stamp;
+    uint64  contentHash;
+    // Guards against caches written by a build with other struct layouts
+    uint32  recordSize;
+    uint32  nodeSize;
+    // The records follow the streams, the writer only knows their number at the end
+    uint64  recordsOffset;
+};
+
+struct MeshCache::MeshRecord
+{
+    // -1 if the mesh had no BVH
+    int32               builder;
+    BvhBuildSettings    settings;
+    Bounds3D            aabb;
+    uint64              offsets[kNumStreams];
+    uint64              counts[kNumStreams];
+};
+
+static FORCEINLINE uint64 AlignStream(uint64 offset)
+{
+    return (offset + kStreamAlignment - 1) & ~(kStreamAlignment - 1);
+}
+
+template <class T>
+static void ReadStream(const uint8* data, uint64 offset, uint64 count, std::vector<T>& stream)
+{
+    const T* first = (const T*)(data + offset);
+    stream.assign(first, first + count);
+}
+
+MeshCache::MeshCache()
+    : m_Header(nullptr)
+    , m_Records(nullptr)
+    , m_NumStale(0)
+{
+
+}
+
+MeshCache::~MeshCache()
+{
+    Close();
+}
+
+std::string MeshCache::GetCachePath(const std::string& assetPath)
+{
+    return assetPath + ".meshcache";
+}
+
+uint64 MeshCache::GetFileStamp(const std::string& path)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+    {
+        return 0;
+    }
+
+    // ctime changes with every write, also when a copy restored the mtime
+    uint64 stamp = HashCombine(HashMix((uint64)info.st_size), HashMix((uint64)info.st_mtime));
+    stamp = HashCombine(stamp, HashMix((uint64)info.st_ctime));
+
+    // 0 is reserved for unreadable files
+    return stamp != 0 ? stamp : 1;
+}
+
+uint64 MeshCache::HashFile(const std::string& path)
+{
+    MappedFile file;
+    if (!file.Open(path))
+    {
+        return 0;
+    }
+
+    // Chunks are hashed in parallel and combined in order, the result does not depend on the pool
+    const int32 numChunks = (int32)((file.GetSize() + kHashChunkSize - 1) / kHashChunkSize);
+    std::vector<uint64> chunkHashes(numChunks);
+
+    TaskGroup::ParallelFor(JobManager::TaskPool(), numChunks, 1, [&](int32 first, int32 last) {
+        for (int32 i = first; i < last; ++i)
+        {
+            uint64 offset = (uint64)i * kHashChunkSize;
+            uint64 size   = std::min(kHashChunkSize, file.GetSize() - offset);
+            chunkHashes[i] = HashBytes(file.GetData() + offset, size, i);
+        }
+    });
+
+    uint64 hash = HashMix(file.GetSize());
+    for (int32 i = 0; i < numChunks; ++i)
+    {
+        hash = HashCombine(hash, chunkHashes[i]);
+    }
+
+    // 0 is reserved for unreadable files
+    return hash != 0 ? hash : 1;
+}
+
+bool MeshCache::Open(const std::string& path, uint64 stamp, const std::function<uint64()>& hashContent)
+{
+    Close();
+
+    if (!m_File.Open(path))
+    {
+        return false;
+    }
+
+    const Header* header = (const Header*)m_File.GetData();
+
+    bool valid = m_File.GetSize() >= sizeof(Header) &&
+                 memcmp(header->magic, kMeshCacheMagic, sizeof(kMeshCacheMagic)) == 0 &&
+                 header->version == kMeshCacheVersion &&
+                 header->recordSize == sizeof(MeshRecord) &&
+                 header->nodeSize == sizeof(Bvh::FlatNode) &&
+                 header->recordsOffset <= m_File.GetSize() &&
+                 (uint64)header->numMeshes * sizeof(MeshRecord) <= m_File.GetSize() - header->recordsOffset;
+
+    // The content is only hashed when the files changed on disk since the last check
+    if (valid && (stamp == 0 || header->stamp != stamp))
+    {
+        uint64 contentHash = hashContent();
+        valid = contentHash != 0 && header->contentHash == contentHash;
+
+        if (valid && stamp != 0)
+        {
+            // Later loads skip the hash again, the cache stays usable if this fails.
+            // The mapping is dropped while writing, Windows does not share it for writes.
+            uint64 size = m_File.GetSize();
+            m_File.Close();
+
+            FILE* file = fopen(path.c_str(), "r+b");
+            if (file)
+            {
+                if (fseek(file, offsetof(Header, stamp), SEEK_SET) == 0)
+                {
+                    fwrite(&stamp, sizeof(uint64), 1, file);
+                }
+                fclose(file);
+            }
+
+            valid  = m_File.Open(path) && m_File.GetSize() == size;
+            header = (const Header*)m_File.GetData();
+            valid  = valid && header->contentHash == contentHash;
+        }
+    }
+
+    if (!valid)
+    {
+        LOGI("Mesh cache %s is outdated.\n", path.c_str());
+        m_File.Close();
+        return false;
+    }
+
+    m_Header  = header;
+    m_Records = (const MeshRecord*)(m_File.GetData() + header->recordsOffset);
+
+    return true;
+}
+
+void MeshCache::Close()
+{
+    m_File.Close();
+    m_Header   = nullptr;
+    m_Records  = nullptr;
+    m_NumStale = 0;
+}
+
+bool MeshCache::ReadStreams(int32 index, Mesh& mesh) const
+{
+    if (m_Header == nullptr || index < 0 || index >= (int32)m_Header->numMeshes)
+    {
+        return false;
+    }
+
+    const MeshRecord& record = m_Records[index];
+    const uint8* data = m_File.GetData();
+
+    for (int32 i = 0; i < kNumStreams; ++i)
+    {
+        if (record.offsets[i] > m_File.GetSize() || record.counts[i] > (m_File.GetSize() - record.offsets[i]) / kStreamElementSizes[i])
+        {
+            LOGW("Mesh cache entry %d is truncated.\n", index);
+            return false;
+        }
+    }
+
+    mesh.aabb = record.aabb;
+    ReadStream(data, record.offsets[kIndices], record.counts[kIndices], mesh.indices);
+    ReadStream(data, record.offsets[kPositions], record.counts[kPositions], mesh.positions);
+    ReadStream(data, record.offsets[kNormals], record.counts[kNormals], mesh.normals);
+    ReadStream(data, record.offsets[kUvs], record.counts[kUvs], mesh.uvs);
+    ReadStream(data, record.offsets[kTangents], record.counts[kTangents], mesh.tangents);
+    ReadStream(data, record.offsets[kColors], record.counts[kColors], mesh.colors);
+    mesh.resident = true;
+
+    // The streams are copied out, their pages would only add to the working set
+    for (int32 i = kIndices; i <= kColors; ++i)
+    {
+        m_File.Release(data + record.offsets[i], record.counts[i] * kStreamElementSizes[i]);
+    }
+
+    return true;
+}
+
+bool MeshCache::ReadMesh(int32 index, Mesh& mesh)
+{
+    if (!ReadStreams(index, mesh))
+    {
+        m_NumStale += 1;
+        return false;
+    }
+
+    const MeshRecord& record = m_Records[index];
+    const uint8* data = m_File.GetData();
+
+    bool imported = false;
+    if (record.builder == (int32)mesh.bvhBuilder && record.settings == mesh.bvhSettings && record.counts[kBvhNodes] > 0 &&
+        record.counts[kBvhNodes] <= (uint64)MAX_int32 && record.counts[kBvhIndices] <= (uint64)MAX_int32)
+    {
+        // A corrupt tree is rebuilt, it would index past the node and triangle tables
+        std::shared_ptr<Bvh> bvh = std::make_shared<Bvh>(record.settings.traversalCost);
+        imported = bvh->Import(
+            (const Bvh::FlatNode*)(data + record.offsets[kBvhNodes]), (int32)record.counts[kBvhNodes],
+            (const int32*)(data + record.offsets[kBvhIndices]), (int32)record.counts[kBvhIndices],
+            (int32)(mesh.indices.size() / 3)
+        );
+
+        if (imported)
+        {
+            mesh.bvh      = bvh;
+            mesh.bvhDirty = false;
+        }
+        else
+        {
+            LOGW("Mesh cache entry %d has an invalid BVH.\n", index);
+        }
+
+        m_File.Release(data + record.offsets[kBvhNodes], record.counts[kBvhNodes] * sizeof(Bvh::FlatNode));
+        m_File.Release(data + record.offsets[kBvhIndices], record.counts[kBvhIndices] * sizeof(int32));
+    }
+
+    if (!imported)
+    {
+        m_NumStale += 1;
+    }
+
+    return true;
+}
+
+bool MeshCache::IsComplete(BvhBuilder builder, const BvhBuildSettings& settings) const
+{
+    if (m_Header == nullptr)
+    {
+        return false;
+    }
+
+    for (uint32 i = 0; i < m_Header->numMeshes; ++i)
+    {
+        const MeshRecord& record = m_Records[i];
+        if (record.builder != (int32)builder || !(record.settings == settings) || record.counts[kBvhNodes] == 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool MeshCache::Write(const std::string& path, uint64 stamp, uint64 contentHash, const MeshArray& meshes)
+{
+    MeshCacheWriter writer;
+    if (!writer.Open(path, stamp, contentHash))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < meshes.size(); ++i)
+    {
+        if (!writer.Append((int32)i, *meshes[i]))
+        {
+            return false;
+        }
+    }
+
+    return writer.Commit((int32)meshes.size());
+}
+
+bool MeshCache::PageIn(Mesh& mesh)
+{
+    if (mesh.resident)
+    {
+        return true;
+    }
+
+    if (mesh.store == nullptr || !mesh.store->ReadStreams(mesh.storeIndex, mesh))
+    {
+        LOGE("Can't page in the streams of mesh %s.\n", mesh.name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void MeshCache::PageOut(Mesh& mesh)
+{
+    if (!mesh.resident)
+    {
+        return;
+    }
+
+    mesh.numVertices = (int32)mesh.positions.size();
+    mesh.numIndices  = (int32)mesh.indices.size();
+    mesh.resident    = false;
+
+    // swap, clear() would keep the capacity
+    std::vector<uint32>().swap(mesh.indices);
+    std::vector<Vector3>().swap(mesh.positions);
+    std::vector<Vector3>().swap(mesh.normals);
+    std::vector<Vector2>().swap(mesh.uvs);
+    std::vector<Vector4>().swap(mesh.tangents);
+    std::vector<Vector4>().swap(mesh.colors);
+}
+
+MeshCacheWriter::MeshCacheWriter()
+    : m_Stamp(0)
+    , m_ContentHash(0)
+    , m_File(nullptr)
+    , m_Offset(0)
+    , m_Failed(false)
+{
+
+}
+
+MeshCacheWriter::~MeshCacheWriter()
+{
+    Discard();
+}
+
+bool MeshCacheWriter::Open(const std::string& path, uint64 stamp, uint64 contentHash)
+{
+    Discard();
+
+    if (contentHash == 0)
+    {
+        return false;
+    }
+
+    // Written to a temporary file first, a crash never leaves a truncated cache behind
+    m_File = fopen((path + ".tmp").c_str(), "wb");
+    if (m_File == nullptr)
+    {
+        LOGW("Can't write mesh cache %s.\n", path.c_str());
+        return false;
+    }
+
+    m_Path        = path;
+    m_Stamp       = stamp;
+    m_ContentHash = contentHash;
+    m_Offset      = 0;
+    m_Failed      = false;
+
+    // Room for the header, it is written by Commit
+    MeshCache::Header header;
+    memset(&header, 0, sizeof(MeshCache::Header));
+    WriteBytes(&header, sizeof(MeshCache::Header));
+
+    return !m_Failed;
+}
+
+bool MeshCacheWriter::WriteBytes(const void* data, uint64 size)
+{
+    if (size > 0 && !m_Failed && fwrite(data, 1, (size_t)size, m_File) != size)
+    {
+        m_Failed = true;
+    }
+    m_Offset += size;
+    return !m_Failed;
+}
+
+bool MeshCacheWriter::Append(int32 index, const Mesh& mesh)
+{
+    MeshCache::MeshRecord record;
+    memset((void*)&record, 0, sizeof(MeshCache::MeshRecord));
+
+    record.builder  = mesh.bvh ? (int32)mesh.bvhBuilder : -1;
+    record.settings = mesh.bvhSettings;
+    record.aabb     = mesh.aabb;
+
+    // Exported outside of the lock
+    std::vector<Bvh::FlatNode> bvhNodes;
+    if (mesh.bvh)
+    {
+        mesh.bvh->Export(bvhNodes);
+    }
+
+    const void* streams[kNumStreams];
+    streams[kIndices]    = mesh.indices.data();
+    streams[kPositions]  = mesh.positions.data();
+    streams[kNormals]    = mesh.normals.data();
+    streams[kUvs]        = mesh.uvs.data();
+    streams[kTangents]   = mesh.tangents.data();
+    streams[kColors]     = mesh.colors.data();
+    streams[kBvhNodes]   = bvhNodes.data();
+    streams[kBvhIndices] = mesh.bvh ? mesh.bvh->GetIndices() : nullptr;
+
+    record.counts[kIndices]    = mesh.indices.size();
+    record.counts[kPositions]  = mesh.positions.size();
+    record.counts[kNormals]    = mesh.normals.size();
+    record.counts[kUvs]        = mesh.uvs.size();
+    record.counts[kTangents]   = mesh.tangents.size();
+    record.counts[kColors]     = mesh.colors.size();
+    record.counts[kBvhNodes]   = bvhNodes.size();
+    record.counts[kBvhIndices] = mesh.bvh ? mesh.bvh->GetNumIndices() : 0;
+
+    const uint8 padding[kStreamAlignment] = { 0 };
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (m_File == nullptr || index < 0)
+    {
+        return false;
+    }
+
+    for (int32 s = 0; s < kNumStreams; ++s)
+    {
+        WriteBytes(padding, AlignStream(m_Offset) - m_Offset);
+        record.offsets[s] = m_Offset;
+        WriteBytes(streams[s], record.counts[s] * kStreamElementSizes[s]);
+    }
+
+    if (index >= (int32)m_Records.size())
+    {
+        m_Records.resize(index + 1);
+        m_Appended.resize(index + 1, false);
+    }
+    m_Records[index]  = record;
+    m_Appended[index] = true;
+
+    return !m_Failed;
+}
+
+bool MeshCacheWriter::Commit(int32 numMeshes)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (m_File == nullptr)
+    {
+        return false;
+    }
+
+    bool complete = numMeshes == (int32)m_Records.size();
+    for (int32 i = 0; i < numMeshes && complete; ++i)
+    {
+        complete = m_Appended[i];
+    }
+
+    const uint8 padding[kStreamAlignment] = { 0 };
+    WriteBytes(padding, AlignStream(m_Offset) - m_Offset);
+
+    MeshCache::Header header;
+    memset(&header, 0, sizeof(MeshCache::Header));
+    memcpy(header.magic, kMeshCacheMagic, sizeof(kMeshCacheMagic));
+    header.version       = kMeshCacheVersion;
+    header.numMeshes     = (uint32)numMeshes;
+    header.stamp         = m_Stamp;
+    header.contentHash   = m_ContentHash;
+    header.recordSize    = sizeof(MeshCache::MeshRecord);
+    header.nodeSize      = sizeof(Bvh::FlatNode);
+    header.recordsOffset = m_Offset;
+
+    WriteBytes(m_Records.data(), m_Records.size() * sizeof(MeshCache::MeshRecord));
+
+    bool result = complete && !m_Failed && fseek(m_File, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(MeshCache::Header), 1, m_File) == 1;
+    result = fclose(m_File) == 0 && result;
+    m_File = nullptr;
+
+    std::string tempPath = m_Path + ".tmp";
+    if (!result)
+    {
+        LOGW("Can't write mesh cache %s.\n", m_Path.c_str());
+        std::remove(tempPath.c_str());
+        return false;
+    }
+
+    std::remove(m_Path.c_str());
+    return std::rename(tempPath.c_str(), m_Path.c_str()) == 0;
+}
+
+void MeshCacheWriter::Discard()
+{
+    if (m_File)
+    {
+        fclose(m_File);
+        m_File = nullptr;
+        std::remove((m_Path + ".tmp").c_str());
+    }
+
+    m_Records.clear();
+    m_Appended.clear();
+}
@@ -0,0 +1,124 @@
+﻿#pragma once
+
+#include "Base/Base.h"
+#include "Misc/MappedFile.h"
+
+#include <string>
+#include <mutex>
+#include <cstdio>
+#include <functional>
+
+// Versioned binary cache of imported mesh streams and their BLAS, stored next to the asset.
+// A cache is only used when the asset content hash matches, BVHs built with other settings are skipped.
+// Warm loads map the file and copy the streams out, BVH nodes only need their pointers fixed up.
+class MeshCache
+{
+public:
+
+    MeshCache();
+
+    ~MeshCache();
+
+    static std::string GetCachePath(const std::string& assetPath);
+
+    // Hash of the size and modification times of the file, 0 if it can not be read
+    static uint64 GetFileStamp(const std::string& path);
+
+    // Hash of the file content, 0 if it can not be read
+    static uint64 HashFile(const std::string& path);
+
+    // The cache is used without hashing the content when stamp matches the one it was last checked against.
+    // Otherwise hashContent has to return the content hash it was written for, the stamp is then updated.
+    // A stamp of 0 always hashes the content.
+    bool Open(const std::string& path, uint64 stamp, const std::function<uint64()>& hashContent);
+
+    void Close();
+
+    // Fills the streams of mesh from the cached mesh index, false if there is none
+    bool ReadMesh(int32 index, Mesh& mesh);
+
+    // Only the streams, the BVH of mesh is kept. Safe to call from several threads.
+    bool ReadStreams(int32 index, Mesh& mesh) const;
+
+    // True if every cached mesh has a BVH built with these settings
+    bool IsComplete(BvhBuilder builder, const BvhBuildSettings& settings) const;
+
+    // True if a mesh was missing or its BVH was built with other settings
+    FORCEINLINE bool IsStale() const
+    {
+        return m_NumStale > 0;
+    }
+
+    static bool Write(const std::string& path, uint64 stamp, uint64 contentHash, const MeshArray& meshes);
+
+    // Reads the streams of an out-of-core mesh back from its store, false if they could not be read
+    static bool PageIn(Mesh& mesh);
+
+    // Frees the streams and keeps their sizes. Only for meshes whose streams were written to their store.
+    static void PageOut(Mesh& mesh);
+
+private:
+
+    friend class MeshCacheWriter;
+
+    MeshCache(const MeshCache& cache) = delete;
+
+    MeshCache& operator = (const MeshCache& cache) = delete;
+
+    struct Header;
+    struct MeshRecord;
+
+private:
+
+    MappedFile          m_File;
+    const Header*       m_Header;
+    const MeshRecord*   m_Records;
+    int32               m_NumStale;
+};
+
+// Writes a cache one mesh at a time, so the streams of a mesh can be freed once it was appended.
+// Meshes are appended in any order and from any thread, the record table follows the streams.
+// Nothing is visible at the cache path before Commit succeeded.
+class MeshCacheWriter
+{
+public:
+
+    MeshCacheWriter();
+
+    // Discards the file if it was not committed
+    ~MeshCacheWriter();
+
+    bool Open(const std::string& path, uint64 stamp, uint64 contentHash);
+
+    bool Append(int32 index, const Mesh& mesh);
+
+    // Fails unless the meshes 0 to numMeshes - 1 were all appended
+    bool Commit(int32 numMeshes);
+
+    void Discard();
+
+    FORCEINLINE bool IsOpen() const
+    {
+        return m_File != nullptr;
+    }
+
+private:
+
+    MeshCacheWriter(const MeshCacheWriter& writer) = delete;
+
+    MeshCacheWriter& operator = (const MeshCacheWriter& writer) = delete;
+
+    bool WriteBytes(const void* data, uint64 size);
+
+private:
+
+    std::string                         m_Path;
+    uint64                              m_Stamp;
+    uint64                              m_ContentHash;
+    FILE*                               m_File;
+    uint64                              m_Offset;
+    bool                                m_Failed;
+    std::vector<MeshCache::MeshRecord>  m_Records;
+    std::vector<bool>                   m_Appended;
+    std::mutex                          m_Mutex;
+};
@@ -1402,6 +1402,19 @@ class TinyGLTF {
     return preserve_image_channels_;
   }
 
+  ///
+  /// Keep the GLB binary chunk in the memory passed to LoadBinaryFromMemory
+  /// instead of copying it. Buffer::data of the chunk buffer stays empty and
+  /// the memory has to outlive every use of the model's buffer views.
+  ///
+  void SetExternalBinaryChunk(bool onoff) {
+    external_binary_chunk_ = onoff;
+  }
+
+  bool GetExternalBinaryChunk() const {
+    return external_binary_chunk_;
+  }
+
  private:
   ///
   /// Loads glTF asset from string(memory).
@@ -1423,6 +1436,8 @@ class TinyGLTF {
 
   bool preserve_image_channels_ = false; /// Default false(expand channels to RGBA) for backward compatibility.
 
+  bool external_binary_chunk_ = false;
+
   FsCallbacks fs = {
 #ifndef TINYGLTF_NO_FS
       &tinygltf::FileExists, &tinygltf::ExpandFilePath,
@@ -4010,7 +4025,8 @@ static bool ParseBuffer(Buffer *buffer, std::string *err, const json &o,
                         FsCallbacks *fs, const std::string &basedir,
                         bool is_binary = false,
                         const unsigned char *bin_data = nullptr,
-                        size_t bin_size = 0) {
+                        size_t bin_size = 0,
+                        bool copy_bin_data = true) {
   size_t byteLength;
   if (!ParseUnsignedProperty(&byteLength, err, o, "byteLength", true,
                              "Buffer")) {
@@ -4083,8 +4099,10 @@ static bool ParseBuffer(Buffer *buffer, std::string *err, const json &o,
       }
 
       // Read buffer data
-      buffer->data.resize(static_cast<size_t>(byteLength));
-      memcpy(&(buffer->data.at(0)), bin_data, static_cast<size_t>(byteLength));
+      if (copy_bin_data) {
+        buffer->data.resize(static_cast<size_t>(byteLength));
+        memcpy(&(buffer->data.at(0)), bin_data, static_cast<size_t>(byteLength));
+      }
     }
 
   } else {
@@ -5635,7 +5653,8 @@ bool TinyGLTF::LoadFromString(Model *model, std::string *err, std::string *warn,
       Buffer buffer;
       if (!ParseBuffer(&buffer, err, o,
                        store_original_json_for_extras_and_extensions_, &fs,
-                       base_dir, is_binary_, bin_data_, bin_size_)) {
+                       base_dir, is_binary_, bin_data_, bin_size_,
+                       !external_binary_chunk_)) {
         return false;
       }
 
@@ -5927,6 +5946,10 @@ bool TinyGLTF::LoadFromString(Model *model, std::string *err, std::string *warn,
           return false;
         }
         const Buffer &buffer = model->buffers[size_t(bufferView.buffer)];
+        const unsigned char *bufferData =
+            (is_binary_ && buffer.uri.empty() && buffer.data.empty())
+                ? bin_data_
+                : buffer.data.data();
 
         if (*LoadImageData == nullptr) {
           if (err) {
@@ -5936,7 +5959,7 @@ bool TinyGLTF::LoadFromString(Model *model, std::string *err, std::string *warn,
         }
         bool ret = LoadImageData(
             &image, idx, err, warn, image.width, image.height,
-            &buffer.data[bufferView.byteOffset],
+            bufferData + bufferView.byteOffset,
             static_cast<int>(bufferView.byteLength), load_image_user_data);
         if (!ret) {
           return false;
@@ -0,0 +1,1325 @@
+﻿#include "Renderer/CpuPathTracer.h"
+
+#include "Job/TaskGroup.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+
+// Traversal stack entries per ray
+static const int32 kMaxStackSize = 64;
+// Wide nodes push up to 7 children per level
+static const int32 kMaxWideStackSize = 256;
+
+static FORCEINLINE uint32 PCGHash(uint32 value)
+{
+    uint32 state = value * 747796405u + 2891336453u;
+    uint32 word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static FORCEINLINE float RandomFloat(uint32& seed)
+{
+    seed = PCGHash(seed);
+    return (seed >> 8) * (1.0f / 16777216.0f);
+}
+
+// Orthonormal basis around a unit normal, Duff et al. 2017
+static FORCEINLINE void BuildBasis(const Vector3& n, Vector3& t, Vector3& b)
+{
+    float sign = n.z >= 0.0f ? 1.0f : -1.0f;
+    float a    = -1.0f / (sign + n.z);
+    float c    = n.x * n.y * a;
+    t = Vector3(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = Vector3(c, sign + n.y * n.y * a, -n.y);
+}
+
+static FORCEINLINE Vector3 TransformDirection(const Matrix4x4& matrix, const Vector3& v)
+{
+    Vector4 result = matrix.TransformVector4(Vector4(v.x, v.y, v.z, 0.0f));
+    return Vector3(result.x, result.y, result.z);
+}
+
+static FORCEINLINE Vector3 TransformPoint(const Matrix4x4& matrix, const Vector3& v)
+{
+    Vector4 result = matrix.TransformPosition(v);
+    return Vector3(result.x, result.y, result.z);
+}
+
+// Normals go through the inverse transpose, matrices apply to row vectors
+static FORCEINLINE Vector3 TransformNormal(const Matrix4x4& inverse, const Vector3& n)
+{
+    return Vector3(
+        inverse.m[0][0] * n.x + inverse.m[0][1] * n.y + inverse.m[0][2] * n.z,
+        inverse.m[1][0] * n.x + inverse.m[1][1] * n.y + inverse.m[1][2] * n.z,
+        inverse.m[2][0] * n.x + inverse.m[2][1] * n.y + inverse.m[2][2] * n.z
+    );
+}
+
+static FORCEINLINE bool IntersectBounds(const Vector3& bmin, const Vector3& bmax, const Vector3& origin, const Vector3& invDir, float tmax)
+{
+    float t0 = 0.0f;
+    float t1 = tmax;
+    for (int32 axis = 0; axis < 3; ++axis)
+    {
+        float tnear = (bmin[axis] - origin[axis]) * invDir[axis];
+        float tfar  = (bmax[axis] - origin[axis]) * invDir[axis];
+        if (tnear > tfar)
+        {
+            std::swap(tnear, tfar);
+        }
+        t0 = tnear > t0 ? tnear : t0;
+        t1 = tfar < t1 ? tfar : t1;
+        if (t0 > t1)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static FORCEINLINE Vector3 SafeInverse(const Vector3& dir)
+{
+    return Vector3(
+        1.0f / (MMath::Abs(dir.x) > 1e-20f ? dir.x : 1e-20f),
+        1.0f / (MMath::Abs(dir.y) > 1e-20f ? dir.y : 1e-20f),
+        1.0f / (MMath::Abs(dir.z) > 1e-20f ? dir.z : 1e-20f)
+    );
+}
+
+// Bits [begin, end) of a block of lanes, clamped to the block
+static FORCEINLINE uint32 LaneRange(int32 begin, int32 end, int32 lanes)
+{
+    begin = MMath::Max(begin, 0);
+    end   = MMath::Min(end, lanes);
+    return ((1u << end) - 1) & ~((1u << begin) - 1);
+}
+
+static FORCEINLINE int32 DirectionOctant(const Vector3& direction)
+{
+    return (direction.x < 0.0f ? 1 : 0) | (direction.y < 0.0f ? 2 : 0) | (direction.z < 0.0f ? 4 : 0);
+}
+
+static FORCEINLINE float SRGBToLinear(float c)
+{
+    return MMath::Pow(c, 2.2f);
+}
+
+CpuPathTracer::CpuPathTracer()
+    : m_Scene(nullptr)
+    , m_Translator(nullptr)
+    , m_TaskPool(nullptr)
+    , m_Width(0)
+    , m_Height(0)
+    , m_NumSamples(0)
+    , m_SamplesPerSecond(0.0)
+    , m_TriangleBlocks(nullptr)
+{
+
+}
+
+CpuPathTracer::~CpuPathTracer()
+{
+
+}
+
+void CpuPathTracer::SetScene(GLScenePtr scene)
+{
+    m_Scene      = scene;
+    m_Translator = nullptr;
+    Reset();
+}
+
+void CpuPathTracer::Resize(int32 width, int32 height)
+{
+    m_Width  = MMath::Max(width, 0);
+    m_Height = MMath::Max(height, 0);
+    m_Accumulation.resize(m_Width * m_Height * 4);
+    m_Framebuffer.resize(m_Width * m_Height * 4);
+    Reset();
+}
+
+void CpuPathTracer::Reset()
+{
+    m_NumSamples = 0;
+    std::fill(m_Accumulation.begin(), m_Accumulation.end(), 0.0f);
+    std::fill(m_Framebuffer.begin(), m_Framebuffer.end(), 0.0f);
+}
+
+void CpuPathTracer::RenderSample()
+{
+    if (!m_Scene || m_Width == 0 || m_Height == 0)
+    {
+        return;
+    }
+
+    // Scene is built later than it is set, and rebuilt when assets change
+    std::shared_ptr<BvhTranslator> translator = m_Scene->GetBvhTranslator();
+    if (!translator || translator->nodes.empty())
+    {
+        return;
+    }
+
+    if (translator != m_Translator)
+    {
+        m_Translator = translator;
+        BuildTriangleBlocks();
+        Reset();
+    }
+
+    CameraPtr camera    = m_Scene->GetCamera();
+    Matrix4x4 transform = camera->GetTransform();
+    if (m_NumSamples > 0 && transform != m_CameraTransform)
+    {
+        Reset();
+    }
+
+    const std::vector<Matrix4x4>& transforms = m_Scene->Transforms();
+    if (m_NumSamples > 0 && transforms != m_Transforms)
+    {
+        Reset();
+    }
+
+    if (m_NumSamples == 0)
+    {
+        m_Transforms = transforms;
+        m_InvTransforms.resize(transforms.size());
+        for (size_t i = 0; i < transforms.size(); ++i)
+        {
+            m_InvTransforms[i] = transforms[i].Inverse();
+        }
+    }
+
+    float tanHalfFov  = MMath::Tan(camera->GetFov() * 0.5f);
+    float aspect      = (float)m_Width / (float)m_Height;
+    m_CameraTransform = transform;
+    m_CameraPosition  = transform.GetOrigin();
+    m_CameraRight     = transform.GetRight().GetSafeNormal() * (tanHalfFov * aspect);
+    m_CameraUp        = transform.GetUp().GetSafeNormal() * tanHalfFov;
+    m_CameraForward   = transform.GetForward().GetSafeNormal();
+
+    const int32 tilesX = (m_Width + tileSize - 1) / tileSize;
+    const int32 tilesY = (m_Height + tileSize - 1) / tileSize;
+
+    auto start = std::chrono::steady_clock::now();
+
+    TaskGroup::ParallelFor(m_TaskPool, tilesX * tilesY, 1, [this](int32 first, int32 last) {
+        for (int32 tile = first; tile < last; ++tile)
+        {
+            RenderTile(tile);
+        }
+    });
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    m_NumSamples += 1;
+    m_SamplesPerSecond = elapsed.count() > 0.0 ? (double)m_Width * m_Height / elapsed.count() : 0.0;
+}
+
+void CpuPathTracer::RenderTile(int32 tile)
+{
+    const int32 tilesX = (m_Width + tileSize - 1) / tileSize;
+    const int32 x0     = (tile % tilesX) * tileSize;
+    const int32 y0     = (tile / tilesX) * tileSize;
+    const int32 x1     = MMath::Min(x0 + tileSize, m_Width);
+    const int32 y1     = MMath::Min(y0 + tileSize, m_Height);
+
+    std::vector<PathState> paths;
+    std::vector<Ray> rays;
+    std::vector<Hit> hits;
+    paths.reserve((x1 - x0) * (y1 - y0));
+    rays.reserve((x1 - x0) * (y1 - y0));
+
+    // 4x4 pixel blocks, so consecutive rays of a packet are neighbours on screen
+    for (int32 by = y0; by < y1; by += 4)
+    {
+        for (int32 bx = x0; bx < x1; bx += 4)
+        {
+            for (int32 y = by; y < MMath::Min(by + 4, y1); ++y)
+            {
+                for (int32 x = bx; x < MMath::Min(bx + 4, x1); ++x)
+                {
+                    PathState path;
+                    path.pixel      = y * m_Width + x;
+                    path.seed       = PCGHash((uint32)path.pixel ^ PCGHash((uint32)m_NumSamples));
+                    path.throughput = Vector3(1.0f, 1.0f, 1.0f);
+                    path.radiance   = Vector3(0.0f, 0.0f, 0.0f);
+
+                    float px = 2.0f * (x + RandomFloat(path.seed)) / m_Width - 1.0f;
+                    float py = 1.0f - 2.0f * (y + RandomFloat(path.seed)) / m_Height;
+
+                    Ray ray;
+                    ray.origin    = m_CameraPosition;
+                    ray.direction = (m_CameraForward + m_CameraRight * px + m_CameraUp * py).GetSafeNormal();
+
+                    paths.push_back(path);
+                    rays.push_back(ray);
+                }
+            }
+        }
+    }
+
+    const float weight = 1.0f / (m_NumSamples + 1);
+
+    // Paths advance one bounce at a time, finished ones are compacted away
+    int32 count = (int32)paths.size();
+    hits.resize(count);
+
+    for (int32 depth = 0; depth < maxDepth && count > 0; ++depth)
+    {
+        IntersectRays(depth == 0 ? primaryTraversal : secondaryTraversal, rays.data(), hits.data(), count);
+
+        int32 alive = 0;
+        for (int32 i = 0; i < count; ++i)
+        {
+            if (ShadePath(paths[i], rays[i], hits[i], depth) && depth + 1 < maxDepth)
+            {
+                paths[alive] = paths[i];
+                rays[alive]  = rays[i];
+                alive += 1;
+                continue;
+            }
+
+            Vector3 radiance = paths[i].radiance;
+            if (!MMath::IsFinite(radiance.x) || !MMath::IsFinite(radiance.y) || !MMath::IsFinite(radiance.z))
+            {
+                radiance = Vector3(0.0f, 0.0f, 0.0f);
+            }
+
+            float* accum = &m_Accumulation[paths[i].pixel * 4];
+            float* color = &m_Framebuffer[paths[i].pixel * 4];
+            accum[0] += radiance.x;
+            accum[1] += radiance.y;
+            accum[2] += radiance.z;
+            color[0]  = accum[0] * weight;
+            color[1]  = accum[1] * weight;
+            color[2]  = accum[2] * weight;
+            color[3]  = 1.0f;
+        }
+
+        count = alive;
+    }
+}
+
+bool CpuPathTracer::Intersect(const Ray& ray, Hit& hit) const
+{
+    const std::vector<BvhTranslator::Node>& nodes = m_Translator->nodes;
+    const Vector3 invDir = SafeInverse(ray.direction);
+
+    hit.t        = MAX_FLT;
+    hit.triangle = -1;
+
+    int32 stack[kMaxStackSize];
+    int32 stackSize = 0;
+    stack[stackSize++] = m_Translator->topLevelIndex;
+
+    while (stackSize > 0)
+    {
+        int32 index = stack[--stackSize];
+
+        if (!IntersectBounds(m_Translator->bboxmin[index], m_Translator->bboxmax[index], ray.origin, invDir, hit.t))
+        {
+            continue;
+        }
+
+        const BvhTranslator::Node& node = nodes[index];
+        if (node.leaf < 0)
+        {
+            // Instance leaf, the bottom level is traversed in the space of the mesh
+            int32 instance = -node.leaf - 1;
+            const Matrix4x4& inverse = m_InvTransforms[instance];
+
+            Ray local;
+            local.origin    = TransformPoint(inverse, ray.origin);
+            local.direction = TransformDirection(inverse, ray.direction);
+
+            IntersectBLAS(NodeIndex(node.leftIndex), local, instance, node.rightIndex, hit);
+        }
+        else if (stackSize + 2 <= kMaxStackSize)
+        {
+            stack[stackSize++] = NodeIndex(node.rightIndex);
+            stack[stackSize++] = NodeIndex(node.leftIndex);
+        }
+    }
+
+    return hit.triangle >= 0;
+}
+
+void CpuPathTracer::IntersectBLAS(int32 root, const Ray& ray, int32 instance, int32 material, Hit& hit) const
+{
+    const std::vector<BvhTranslator::Node>& nodes = m_Translator->nodes;
+    const Vector3 invDir = SafeInverse(ray.direction);
+
+    WatertightRay watertight;
+    watertight.Init(ray.direction);
+
+    int32 stack[kMaxStackSize];
+    int32 stackSize = 0;
+    stack[stackSize++] = root;
+
+    while (stackSize > 0)
+    {
+        int32 index = stack[--stackSize];
+
+        // The local direction is not normalized, so t is the same as in world space
+        if (!IntersectBounds(m_Translator->bboxmin[index], m_Translator->bboxmax[index], ray.origin, invDir, hit.t))
+        {
+            continue;
+        }
+
+        const BvhTranslator::Node& node = nodes[index];
+        if (node.leaf > 0)
+        {
+            // t only changes on a closer hit, the triangle index may repeat across instances
+            float closest = hit.t;
+            IntersectLeaf(node.leftIndex, node.rightIndex, ray, watertight, hit);
+            if (hit.t != closest)
+            {
+                hit.instance = instance;
+                hit.material = material;
+            }
+        }
+        else if (stackSize + 2 <= kMaxStackSize)
+        {
+            stack[stackSize++] = NodeIndex(node.rightIndex);
+            stack[stackSize++] = NodeIndex(node.leftIndex);
+        }
+    }
+}
+
+void CpuPathTracer::IntersectLeaf(int32 first, int32 count, const Ray& ray, const WatertightRay& watertight, Hit& hit) const
+{
+    const int32 last = first + count;
+
+    for (int32 block = first / kTriangleLanes; block * kTriangleLanes < last; ++block)
+    {
+        const int32 base = block * kTriangleLanes;
+
+        float t[kTriangleLanes];
+        float u[kTriangleLanes];
+        float v[kTriangleLanes];
+        uint32 mask = m_TriangleBlocks[block].Intersect(ray.origin, watertight, hit.t, LaneRange(first - base, last - base, kTriangleLanes), t, u, v);
+
+        // Lanes in triangle order, the first of equally close hits wins
+        for (int32 lane = 0; mask != 0; ++lane, mask >>= 1)
+        {
+            if ((mask & 1) != 0 && t[lane] < hit.t)
+            {
+                hit.t        = t[lane];
+                hit.u        = u[lane];
+                hit.v        = v[lane];
+                hit.triangle = base + lane;
+            }
+        }
+    }
+}
+
+void CpuPathTracer::BuildTriangleBlocks()
+{
+    const std::vector<uint32>& indices    = m_Scene->Indices();
+    const std::vector<Vector3>& positions = m_Scene->Positions();
+
+    const int32 numTriangles = (int32)indices.size() / 3;
+    const int32 numBlocks    = (numTriangles + kTriangleLanes - 1) / kTriangleLanes;
+
+    // Zeroed lanes past the last triangle are degenerate
+    m_TriangleStorage.assign(numBlocks * sizeof(TriangleBlock<kTriangleLanes>) + 64, 0);
+    TriangleBlock<kTriangleLanes>* blocks = (TriangleBlock<kTriangleLanes>*)MMath::Align(m_TriangleStorage.data(), 64);
+    m_TriangleBlocks = blocks;
+
+    TaskGroup::ParallelFor(m_TaskPool, numBlocks, 1024, [&](int32 first, int32 last) {
+        for (int32 block = first; block < last; ++block)
+        {
+            for (int32 lane = 0; lane < kTriangleLanes; ++lane)
+            {
+                int32 triangle = block * kTriangleLanes + lane;
+                if (triangle >= numTriangles)
+                {
+                    break;
+                }
+
+                blocks[block].Set(
+                    lane,
+                    positions[VertexIndex(indices[triangle * 3 + 0])],
+                    positions[VertexIndex(indices[triangle * 3 + 1])],
+                    positions[VertexIndex(indices[triangle * 3 + 2])]
+                );
+            }
+        }
+    });
+}
+
+void CpuPathTracer::IntersectRays(TraversalMode mode, const Ray* rays, Hit* hits, int32 count) const
+{
+    switch (mode)
+    {
+        case TraversalMode::EPacket4:
+        {
+            TraceRays<4, false>(rays, nullptr, hits, nullptr, count, false);
+            break;
+        }
+        case TraversalMode::EPacket8:
+        {
+            TraceRays<8, false>(rays, nullptr, hits, nullptr, count, false);
+            break;
+        }
+        case TraversalMode::EPacket16:
+        {
+            TraceRays<16, false>(rays, nullptr, hits, nullptr, count, false);
+            break;
+        }
+        case TraversalMode::EStream:
+        {
+            TraceRays<8, false>(rays, nullptr, hits, nullptr, count, true);
+            break;
+        }
+        case TraversalMode::EWide:
+        {
+            TraceWideRays<false>(rays, nullptr, hits, nullptr, count);
+            break;
+        }
+        default:
+        {
+            for (int32 i = 0; i < count; ++i)
+            {
+                Intersect(rays[i], hits[i]);
+            }
+            break;
+        }
+    }
+}
+
+void CpuPathTracer::OccludedRays(TraversalMode mode, const Ray* rays, const float* tmax, uint8* occluded, int32 count) const
+{
+    switch (mode)
+    {
+        case TraversalMode::EPacket4:
+        {
+            TraceRays<4, true>(rays, tmax, nullptr, occluded, count, false);
+            break;
+        }
+        case TraversalMode::EPacket8:
+        {
+            TraceRays<8, true>(rays, tmax, nullptr, occluded, count, false);
+            break;
+        }
+        case TraversalMode::EPacket16:
+        {
+            TraceRays<16, true>(rays, tmax, nullptr, occluded, count, false);
+            break;
+        }
+        case TraversalMode::EStream:
+        {
+            TraceRays<8, true>(rays, tmax, nullptr, occluded, count, true);
+            break;
+        }
+        case TraversalMode::EWide:
+        {
+            TraceWideRays<true>(rays, tmax, nullptr, occluded, count);
+            break;
+        }
+        default:
+        {
+            TraceRays<1, true>(rays, tmax, nullptr, occluded, count, false);
+            break;
+        }
+    }
+}
+
+template <bool AnyHit>
+void CpuPathTracer::TraceWideRays(const Ray* rays, const float* tmax, Hit* hits, uint8* occluded, int32 count) const
+{
+    const int32 width = m_Translator->wideWidth;
+    if (width == 0)
+    {
+        if (AnyHit)
+        {
+            TraceRays<1, true>(rays, tmax, nullptr, occluded, count, false);
+        }
+        else
+        {
+            for (int32 i = 0; i < count; ++i)
+            {
+                Intersect(rays[i], hits[i]);
+            }
+        }
+        return;
+    }
+
+    for (int32 i = 0; i < count; ++i)
+    {
+        Hit hit;
+        hit.t        = tmax ? tmax[i] : MAX_FLT;
+        hit.triangle = -1;
+
+        if (width == 8)
+        {
+            IntersectWide<8, AnyHit>(rays[i], hit);
+        }
+        else
+        {
+            IntersectWide<4, AnyHit>(rays[i], hit);
+        }
+
+        if (AnyHit)
+        {
+            occluded[i] = hit.triangle >= 0 ? 1 : 0;
+        }
+        else
+        {
+            hits[i] = hit;
+        }
+    }
+}
+
+// Wide node lists of the translator by width
+template <int32 N>
+static const std::vector<BvhTranslator::WideNode<N>>& GetWideNodes(const BvhTranslator& translator);
+
+template <>
+FORCEINLINE const std::vector<BvhTranslator::WideNode4>& GetWideNodes<4>(const BvhTranslator& translator)
+{
+    return translator.wideNodes4;
+}
+
+template <>
+FORCEINLINE const std::vector<BvhTranslator::WideNode8>& GetWideNodes<8>(const BvhTranslator& translator)
+{
+    return translator.wideNodes8;
+}
+
+// Children of node the ray enters before tmax, nearest first
+template <int32 N>
+static FORCEINLINE int32 IntersectWideChildren(const BvhTranslator::WideNode<N>& node, const Vector3& origin, const Vector3& invDir, float tmax, int32* children, float* distances)
+{
+    float bmin[3][N];
+    float bmax[3][N];
+    node.DecodeBounds(bmin, bmax);
+
+    // Slab test of all slots at once, empty slots are culled by numChildren below
+    float t0[N];
+    float t1[N];
+    for (int32 i = 0; i < N; ++i)
+    {
+        t0[i] = 0.0f;
+        t1[i] = tmax;
+    }
+
+    for (int32 axis = 0; axis < 3; ++axis)
+    {
+        for (int32 i = 0; i < N; ++i)
+        {
+            float tnear = (bmin[axis][i] - origin[axis]) * invDir[axis];
+            float tfar  = (bmax[axis][i] - origin[axis]) * invDir[axis];
+            float lo    = tnear < tfar ? tnear : tfar;
+            float hi    = tnear < tfar ? tfar : tnear;
+            t0[i] = lo > t0[i] ? lo : t0[i];
+            t1[i] = hi < t1[i] ? hi : t1[i];
+        }
+    }
+
+    int32 numHits = 0;
+    for (int32 i = 0; i < node.numChildren; ++i)
+    {
+        if (t0[i] > t1[i])
+        {
+            continue;
+        }
+
+        float t = t0[i];
+        int32 j = numHits++;
+        for (; j > 0 && distances[j - 1] > t; --j)
+        {
+            distances[j] = distances[j - 1];
+            children[j]  = children[j - 1];
+        }
+        distances[j] = t;
+        children[j]  = i;
+    }
+    return numHits;
+}
+
+// Internal children and leaves share the stack, so both are visited nearest first
+struct WideStackEntry
+{
+    // Wide node index of internal children, first primitive or instance of leaves
+    int32 index;
+    // Primitives of leaves, 0 for internal children
+    int32 count;
+    float t;
+};
+
+// Pushes the hit children of node farthest first, so the nearest one is popped next
+template <int32 N>
+static FORCEINLINE void PushWideChildren(const BvhTranslator::WideNode<N>& node, const int32* children, const float* distances, int32 numHits, WideStackEntry* stack, int32& stackSize)
+{
+    for (int32 i = numHits - 1; i >= 0 && stackSize < kMaxWideStackSize; --i)
+    {
+        int32 child = children[i];
+        int32 count = node.childPrims[child] == BvhTranslator::kInternalChild ? 0 : node.childPrims[child];
+        stack[stackSize++] = { node.childIndex[child], count, distances[i] };
+    }
+}
+
+template <int32 N, bool AnyHit>
+void CpuPathTracer::IntersectWide(const Ray& ray, Hit& hit) const
+{
+    const std::vector<BvhTranslator::WideNode<N>>& nodes = GetWideNodes<N>(*m_Translator);
+    const std::vector<RendererNode>& renderers = m_Scene->Renderers();
+    const Vector3 invDir = SafeInverse(ray.direction);
+
+    WideStackEntry stack[kMaxWideStackSize];
+    int32 stackSize = 0;
+    stack[stackSize++] = { m_Translator->wideTopLevelIndex, 0, 0.0f };
+
+    while (stackSize > 0)
+    {
+        WideStackEntry entry = stack[--stackSize];
+        if (entry.t > hit.t)
+        {
+            continue;
+        }
+
+        if (entry.count > 0)
+        {
+            // Instance leaf, the bottom level is traversed in the space of the mesh
+            const RendererNode& renderer = renderers[entry.index];
+            const Matrix4x4& inverse = m_InvTransforms[entry.index];
+
+            Ray local;
+            local.origin    = TransformPoint(inverse, ray.origin);
+            local.direction = TransformDirection(inverse, ray.direction);
+
+            if (IntersectWideBLAS<N, AnyHit>(m_Translator->wideRootIndices[renderer.meshID], local, entry.index, renderer.materialID, hit))
+            {
+                return;
+            }
+            continue;
+        }
+
+        const BvhTranslator::WideNode<N>& node = nodes[entry.index];
+
+        int32 children[N];
+        float distances[N];
+        int32 numHits = IntersectWideChildren<N>(node, ray.origin, invDir, hit.t, children, distances);
+        PushWideChildren<N>(node, children, distances, numHits, stack, stackSize);
+    }
+}
+
+template <int32 N, bool AnyHit>
+bool CpuPathTracer::IntersectWideBLAS(int32 root, const Ray& ray, int32 instance, int32 material, Hit& hit) const
+{
+    const std::vector<BvhTranslator::WideNode<N>>& nodes = GetWideNodes<N>(*m_Translator);
+    const Vector3 invDir = SafeInverse(ray.direction);
+
+    WatertightRay watertight;
+    watertight.Init(ray.direction);
+
+    WideStackEntry stack[kMaxWideStackSize];
+    int32 stackSize = 0;
+    stack[stackSize++] = { root, 0, 0.0f };
+
+    while (stackSize > 0)
+    {
+        WideStackEntry entry = stack[--stackSize];
+
+        // The local direction is not normalized, so t is the same as in world space
+        if (entry.t > hit.t)
+        {
+            continue;
+        }
+
+        if (entry.count > 0)
+        {
+            float closest = hit.t;
+            IntersectLeaf(entry.index, entry.count, ray, watertight, hit);
+            if (hit.t != closest)
+            {
+                hit.instance = instance;
+                hit.material = material;
+
+                if (AnyHit)
+                {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        const BvhTranslator::WideNode<N>& node = nodes[entry.index];
+
+        int32 children[N];
+        float distances[N];
+        int32 numHits = IntersectWideChildren<N>(node, ray.origin, invDir, hit.t, children, distances);
+        PushWideChildren<N>(node, children, distances, numHits, stack, stackSize);
+    }
+
+    return false;
+}
+
+template <int32 N, bool AnyHit>
+void CpuPathTracer::TraceRays(const Ray* rays, const float* tmax, Hit* hits, uint8* occluded, int32 count, bool sortByOctant) const
+{
+    // Counting sort by direction octant, packets then only mix rays heading the same way
+    std::vector<int32> order;
+    if (sortByOctant)
+    {
+        int32 offsets[9] = { 0 };
+        for (int32 i = 0; i < count; ++i)
+        {
+            offsets[DirectionOctant(rays[i].direction) + 1] += 1;
+        }
+        for (int32 octant = 1; octant < 9; ++octant)
+        {
+            offsets[octant] += offsets[octant - 1];
+        }
+
+        order.resize(count);
+        for (int32 i = 0; i < count; ++i)
+        {
+            order[offsets[DirectionOctant(rays[i].direction)]++] = i;
+        }
+    }
+
+    for (int32 first = 0; first < count; first += N)
+    {
+        RayPacket<N> packet;
+        PacketHit<N> packetHit;
+        int32 rayIndices[N];
+
+        for (int32 lane = 0; lane < N; ++lane)
+        {
+            if (first + lane >= count)
+            {
+                packet.SetInactive(lane);
+                rayIndices[lane] = -1;
+                continue;
+            }
+
+            const int32 index = sortByOctant ? order[first + lane] : first + lane;
+            const Ray& ray    = rays[index];
+
+            rayIndices[lane]  = index;
+            packet.ox[lane]   = ray.origin.x;
+            packet.oy[lane]   = ray.origin.y;
+            packet.oz[lane]   = ray.origin.z;
+            packet.dx[lane]   = ray.direction.x;
+            packet.dy[lane]   = ray.direction.y;
+            packet.dz[lane]   = ray.direction.z;
+            packet.tmax[lane] = tmax ? tmax[index] : MAX_FLT;
+        }
+
+        packet.UpdateInverse();
+        TracePacket<N, AnyHit>(packet, packetHit);
+
+        for (int32 lane = 0; lane < N; ++lane)
+        {
+            const int32 index = rayIndices[lane];
+            if (index < 0)
+            {
+                continue;
+            }
+
+            if (AnyHit)
+            {
+                occluded[index] = packetHit.triangle[lane] >= 0 ? 1 : 0;
+                continue;
+            }
+
+            Hit& hit     = hits[index];
+            hit.t        = packet.tmax[lane];
+            hit.u        = packetHit.u[lane];
+            hit.v        = packetHit.v[lane];
+            hit.triangle = packetHit.triangle[lane];
+            hit.instance = packetHit.instance[lane];
+            hit.material = packetHit.material[lane];
+        }
+    }
+}
+
+template <int32 N, bool AnyHit>
+void CpuPathTracer::TracePacket(RayPacket<N>& packet, PacketHit<N>& hit) const
+{
+    const std::vector<BvhTranslator::Node>& nodes = m_Translator->nodes;
+
+    for (int32 lane = 0; lane < N; ++lane)
+    {
+        hit.u[lane]        = 0.0f;
+        hit.v[lane]        = 0.0f;
+        hit.triangle[lane] = -1;
+        hit.instance[lane] = -1;
+        hit.material[lane] = -1;
+    }
+
+    PacketFrustum frustum;
+    frustum.Init(packet);
+
+    int32 stack[kMaxStackSize];
+    int32 stackSize = 0;
+    stack[stackSize++] = m_Translator->topLevelIndex;
+
+    while (stackSize > 0)
+    {
+        int32 index = stack[--stackSize];
+
+        const Vector3& bmin = m_Translator->bboxmin[index];
+        const Vector3& bmax = m_Translator->bboxmax[index];
+        if (frustum.Cull(bmin, bmax) || !packet.AnyLaneHits(bmin, bmax))
+        {
+            continue;
+        }
+
+        const BvhTranslator::Node& node = nodes[index];
+        if (node.leaf < 0)
+        {
+            // Every lane goes to the space of the instance, t stays comparable
+            int32 instance = -node.leaf - 1;
+            const Matrix4x4& inverse = m_InvTransforms[instance];
+
+            RayPacket<N> local;
+            for (int32 lane = 0; lane < N; ++lane)
+            {
+                Vector3 origin    = TransformPoint(inverse, Vector3(packet.ox[lane], packet.oy[lane], packet.oz[lane]));
+                Vector3 direction = TransformDirection(inverse, Vector3(packet.dx[lane], packet.dy[lane], packet.dz[lane]));
+
+                local.ox[lane]   = origin.x;
+                local.oy[lane]   = origin.y;
+                local.oz[lane]   = origin.z;
+                local.dx[lane]   = direction.x;
+                local.dy[lane]   = direction.y;
+                local.dz[lane]   = direction.z;
+                local.tmax[lane] = packet.tmax[lane];
+            }
+            local.UpdateInverse();
+
+            TracePacketBLAS<N, AnyHit>(NodeIndex(node.leftIndex), local, instance, node.rightIndex, hit);
+
+            for (int32 lane = 0; lane < N; ++lane)
+            {
+                packet.tmax[lane] = local.tmax[lane];
+            }
+
+            if (AnyHit && !packet.AnyLaneActive())
+            {
+                return;
+            }
+
+            // Closer hits shrink the frustum
+            frustum.Init(packet);
+        }
+        else if (stackSize + 2 <= kMaxStackSize)
+        {
+            stack[stackSize++] = NodeIndex(node.rightIndex);
+            stack[stackSize++] = NodeIndex(node.leftIndex);
+        }
+    }
+}
+
+template <int32 N, bool AnyHit>
+void CpuPathTracer::TracePacketBLAS(int32 root, RayPacket<N>& packet, int32 instance, int32 material, PacketHit<N>& hit) const
+{
+    const std::vector<BvhTranslator::Node>& nodes = m_Translator->nodes;
+
+    PacketFrustum frustum;
+    frustum.Init(packet);
+
+    int32 stack[kMaxStackSize];
+    int32 stackSize = 0;
+    stack[stackSize++] = root;
+
+    while (stackSize > 0)
+    {
+        int32 index = stack[--stackSize];
+
+        const Vector3& bmin = m_Translator->bboxmin[index];
+        const Vector3& bmax = m_Translator->bboxmax[index];
+        if (frustum.Cull(bmin, bmax) || !packet.AnyLaneHits(bmin, bmax))
+        {
+            continue;
+        }
+
+        const BvhTranslator::Node& node = nodes[index];
+        if (node.leaf == 0)
+        {
+            if (stackSize + 2 <= kMaxStackSize)
+            {
+                stack[stackSize++] = NodeIndex(node.rightIndex);
+                stack[stackSize++] = NodeIndex(node.leftIndex);
+            }
+            continue;
+        }
+
+        bool anyHit = false;
+        for (int32 i = 0; i < node.rightIndex; ++i)
+        {
+            const int32 triangle = node.leftIndex + i;
+            const TriangleBlock<kTriangleLanes>& block = m_TriangleBlocks[triangle / kTriangleLanes];
+            const int32 slot = triangle % kTriangleLanes;
+
+            // Same results as the single ray kernel, lane by lane
+            float t[N];
+            float u[N];
+            float v[N];
+            uint32 mask = packet.IntersectTriangle(block.P0(slot), block.P1(slot), block.P2(slot), t, u, v);
+
+            for (int32 lane = 0; mask != 0; ++lane, mask >>= 1)
+            {
+                if ((mask & 1) == 0)
+                {
+                    continue;
+                }
+
+                // Occluded lanes are done, they get disabled
+                packet.tmax[lane]  = AnyHit ? -1.0f : t[lane];
+                hit.u[lane]        = u[lane];
+                hit.v[lane]        = v[lane];
+                hit.triangle[lane] = triangle;
+                hit.instance[lane] = instance;
+                hit.material[lane] = material;
+                anyHit = true;
+            }
+        }
+
+        if (anyHit)
+        {
+            if (AnyHit && !packet.AnyLaneActive())
+            {
+                return;
+            }
+            frustum.Init(packet);
+        }
+    }
+}
+
+TraversalStats CpuPathTracer::MeasureTraversal(TraversalMode mode)
+{
+    TraversalStats stats;
+    if (!m_Translator || m_Width == 0 || m_Height == 0)
+    {
+        return stats;
+    }
+
+    const int32 numRays = m_Width * m_Height;
+    const int32 batch   = tileSize * tileSize;
+
+    std::vector<Ray> rays;
+    std::vector<Hit> hits(numRays);
+    rays.reserve(numRays);
+
+    // Pixel centers in 4x4 blocks, the order RenderTile traces them in
+    for (int32 by = 0; by < m_Height; by += 4)
+    {
+        for (int32 bx = 0; bx < m_Width; bx += 4)
+        {
+            for (int32 y = by; y < MMath::Min(by + 4, m_Height); ++y)
+            {
+                for (int32 x = bx; x < MMath::Min(bx + 4, m_Width); ++x)
+                {
+                    float px = 2.0f * (x + 0.5f) / m_Width - 1.0f;
+                    float py = 1.0f - 2.0f * (y + 0.5f) / m_Height;
+
+                    Ray ray;
+                    ray.origin    = m_CameraPosition;
+                    ray.direction = (m_CameraForward + m_CameraRight * px + m_CameraUp * py).GetSafeNormal();
+                    rays.push_back(ray);
+                }
+            }
+        }
+    }
+
+    // Rays are handed to the kernels in tile sized batches like in RenderTile
+    auto timeBatches = [this, batch](int32 count, const std::function<void(int32, int32)>& func) -> double {
+        auto start = std::chrono::steady_clock::now();
+        TaskGroup::ParallelFor(m_TaskPool, (count + batch - 1) / batch, 1, [&func, batch, count](int32 first, int32 last) {
+            for (int32 i = first; i < last; ++i)
+            {
+                func(i * batch, MMath::Min((i + 1) * batch, count));
+            }
+        });
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return MMath::Max(elapsed.count(), 1e-9);
+    };
+
+    double seconds = timeBatches(numRays, [&](int32 first, int32 last) {
+        IntersectRays(mode, &rays[first], &hits[first], last - first);
+    });
+    stats.primaryMrays = numRays / seconds * 1e-6;
+
+    // Shadow rays towards a fixed light direction and diffuse bounces from every primary hit
+    const Vector3 lightDir = Vector3(0.3f, 1.0f, 0.2f).GetSafeNormal();
+
+    std::vector<Ray> shadowRays;
+    std::vector<Ray> bounceRays;
+    for (int32 i = 0; i < numRays; ++i)
+    {
+        if (hits[i].triangle < 0)
+        {
+            continue;
+        }
+
+        Vector3 normal   = GeometricNormal(rays[i], hits[i]);
+        Vector3 position = rays[i].origin + rays[i].direction * hits[i].t;
+        float epsilon    = 1e-4f * MMath::Max(1.0f, position.GetAbsMax());
+
+        Ray ray;
+        ray.origin    = position + normal * epsilon;
+        ray.direction = Vector3::DotProduct(normal, lightDir) > 0.0f ? lightDir : -lightDir;
+        shadowRays.push_back(ray);
+
+        Vector3 tangent;
+        Vector3 bitangent;
+        BuildBasis(normal, tangent, bitangent);
+
+        uint32 seed  = PCGHash((uint32)i);
+        float r1     = RandomFloat(seed);
+        float phi    = 2.0f * PI * RandomFloat(seed);
+        float radius = MMath::Sqrt(r1);
+        ray.direction = tangent * (radius * MMath::Cos(phi)) + bitangent * (radius * MMath::Sin(phi)) + normal * MMath::Sqrt(MMath::Max(0.0f, 1.0f - r1));
+        bounceRays.push_back(ray);
+    }
+
+    std::vector<float> shadowTMax(shadowRays.size(), MAX_FLT);
+    std::vector<uint8> occluded(shadowRays.size());
+    seconds = timeBatches((int32)shadowRays.size(), [&](int32 first, int32 last) {
+        OccludedRays(mode, &shadowRays[first], &shadowTMax[first], &occluded[first], last - first);
+    });
+    stats.shadowMrays = shadowRays.size() / seconds * 1e-6;
+
+    std::vector<Hit> bounceHits(bounceRays.size());
+    seconds = timeBatches((int32)bounceRays.size(), [&](int32 first, int32 last) {
+        IntersectRays(mode, &bounceRays[first], &bounceHits[first], last - first);
+    });
+    stats.secondaryMrays = bounceRays.size() / seconds * 1e-6;
+
+    return stats;
+}
+
+Vector3 CpuPathTracer::SampleEnvironment(const Vector3& direction) const
+{
+    const HDRImageArray& hdrs = m_Scene->HDRs();
+    if (hdrs.empty() || hdrs[0]->hdrRGB.empty())
+    {
+        return backgroundColor;
+    }
+
+    // Same equirectangular mapping as the ibl shaders
+    const HDRImagePtr& hdr = hdrs[0];
+    float u = 0.5f + 0.5f * MMath::Atan2(direction.z, direction.x) / PI;
+    float v = 1.0f - MMath::Acos(MMath::Clamp(direction.y, -1.0f, 1.0f)) / PI;
+
+    int32 x = MMath::Clamp((int32)(u * hdr->width), 0, hdr->width - 1);
+    int32 y = MMath::Clamp((int32)(v * hdr->height), 0, hdr->height - 1);
+
+    const float* texel = &hdr->hdrRGB[(y * hdr->width + x) * hdr->component];
+    return Vector3(texel[0], texel[1], texel[2]);
+}
+
+bool CpuPathTracer::FetchTexture(int32 texture, const Vector2& uv, float rgba[4]) const
+{
+    const TextureArray& textures = m_Scene->Textures();
+    if (texture < 0 || texture >= (int32)textures.size() || !textures[texture]->source)
+    {
+        return false;
+    }
+
+    const ImagePtr& image = textures[texture]->source;
+    if (image->width == 0 || image->height == 0 || image->rgba.empty())
+    {
+        return false;
+    }
+
+    float u = MMath::Frac(uv.x);
+    float v = MMath::Frac(uv.y);
+    int32 x = MMath::Clamp((int32)(u * image->width), 0, image->width - 1);
+    int32 y = MMath::Clamp((int32)(v * image->height), 0, image->height - 1);
+
+    const uint8* texel = &image->rgba[(y * image->width + x) * image->comp];
+    for (int32 i = 0; i < 4; ++i)
+    {
+        rgba[i] = i < image->comp ? texel[i] / 255.0f : 1.0f;
+    }
+
+    return true;
+}
+
+Vector3 CpuPathTracer::GeometricNormal(const Ray& ray, const Hit& hit) const
+{
+    const TriangleBlock<kTriangleLanes>& block = m_TriangleBlocks[hit.triangle / kTriangleLanes];
+    const int32 slot = hit.triangle % kTriangleLanes;
+
+    const Vector3 p0 = block.P0(slot);
+    const Vector3 p1 = block.P1(slot);
+    const Vector3 p2 = block.P2(slot);
+
+    Vector3 normal = TransformNormal(m_InvTransforms[hit.instance], Vector3::CrossProduct(p1 - p0, p2 - p0)).GetSafeNormal();
+    return Vector3::DotProduct(normal, ray.direction) > 0.0f ? -normal : normal;
+}
+
+bool CpuPathTracer::ShadePath(PathState& path, Ray& ray, const Hit& hit, int32 depth) const
+{
+    const MaterialArray& materials         = m_Scene->Materials();
+    const std::vector<uint32>& indices     = m_Scene->Indices();
+    const std::vector<Vector3>& positions  = m_Scene->Positions();
+    const std::vector<Vector3>& normals    = m_Scene->Normals();
+    const std::vector<Vector2>& uvs        = m_Scene->Uvs();
+
+    Vector3& radiance   = path.radiance;
+    Vector3& throughput = path.throughput;
+    uint32& seed        = path.seed;
+
+    if (hit.triangle < 0)
+    {
+        radiance += throughput * SampleEnvironment(ray.direction);
+        return false;
+    }
+
+    int32 idx0 = VertexIndex(indices[hit.triangle * 3 + 0]);
+    int32 idx1 = VertexIndex(indices[hit.triangle * 3 + 1]);
+    int32 idx2 = VertexIndex(indices[hit.triangle * 3 + 2]);
+    float w    = 1.0f - hit.u - hit.v;
+
+    const Matrix4x4& inverse = m_InvTransforms[hit.instance];
+
+    Vector3 geomNormal = TransformNormal(inverse, Vector3::CrossProduct(positions[idx1] - positions[idx0], positions[idx2] - positions[idx0])).GetSafeNormal();
+    Vector3 normal     = geomNormal;
+    if (idx2 < (int32)normals.size())
+    {
+        Vector3 shading = normals[idx0] * w + normals[idx1] * hit.u + normals[idx2] * hit.v;
+        if (!shading.IsNearlyZero())
+        {
+            normal = TransformNormal(inverse, shading).GetSafeNormal();
+        }
+    }
+
+    Vector2 uv(0.0f, 0.0f);
+    if (idx2 < (int32)uvs.size())
+    {
+        uv = uvs[idx0] * w + uvs[idx1] * hit.u + uvs[idx2] * hit.v;
+    }
+
+    // Everything is shaded double sided
+    if (Vector3::DotProduct(geomNormal, ray.direction) > 0.0f)
+    {
+        geomNormal = -geomNormal;
+    }
+    if (Vector3::DotProduct(normal, geomNormal) < 0.0f)
+    {
+        normal = -normal;
+    }
+
+    Vector3 baseColor(0.8f, 0.8f, 0.8f);
+    Vector3 emissive(0.0f, 0.0f, 0.0f);
+    float metallic  = 0.0f;
+    float roughness = 1.0f;
+
+    if (hit.material >= 0 && hit.material < (int32)materials.size())
+    {
+        const Material& material = *materials[hit.material];
+        float texel[4];
+
+        baseColor = Vector3(material.pbrBaseColorFactor.x, material.pbrBaseColorFactor.y, material.pbrBaseColorFactor.z);
+        if (FetchTexture(material.pbrBaseColorTexture, uv, texel))
+        {
+            baseColor *= Vector3(SRGBToLinear(texel[0]), SRGBToLinear(texel[1]), SRGBToLinear(texel[2]));
+        }
+
+        metallic  = material.pbrMetallicFactor;
+        roughness = material.pbrRoughnessFactor;
+        if (FetchTexture(material.pbrMetallicRoughnessTexture, uv, texel))
+        {
+            roughness *= texel[1];
+            metallic  *= texel[2];
+        }
+
+        emissive = material.emissiveFactor;
+        if (FetchTexture(material.emissiveTexture, uv, texel))
+        {
+            emissive *= Vector3(SRGBToLinear(texel[0]), SRGBToLinear(texel[1]), SRGBToLinear(texel[2]));
+        }
+    }
+
+    radiance += throughput * emissive;
+
+    // Metallic roughness brdf, lambert plus ggx, sampled by a lobe choice
+    Vector3 view = -ray.direction;
+    float NdotV  = Vector3::DotProduct(normal, view);
+    if (NdotV <= 0.0f)
+    {
+        return false;
+    }
+
+    float alpha        = MMath::Max(roughness * roughness, 1e-3f);
+    float alpha2       = alpha * alpha;
+    float diffuseRatio = 0.5f * (1.0f - metallic);
+
+    Vector3 tangent;
+    Vector3 bitangent;
+    BuildBasis(normal, tangent, bitangent);
+
+    float r1 = RandomFloat(seed);
+    float r2 = RandomFloat(seed);
+    float phi = 2.0f * PI * r2;
+
+    Vector3 light;
+    if (RandomFloat(seed) < diffuseRatio)
+    {
+        float radius = MMath::Sqrt(r1);
+        float z      = MMath::Sqrt(MMath::Max(0.0f, 1.0f - r1));
+        light = tangent * (radius * MMath::Cos(phi)) + bitangent * (radius * MMath::Sin(phi)) + normal * z;
+    }
+    else
+    {
+        float cosTheta = MMath::Sqrt((1.0f - r1) / (1.0f + (alpha2 - 1.0f) * r1));
+        float sinTheta = MMath::Sqrt(MMath::Max(0.0f, 1.0f - cosTheta * cosTheta));
+        Vector3 half   = tangent * (sinTheta * MMath::Cos(phi)) + bitangent * (sinTheta * MMath::Sin(phi)) + normal * cosTheta;
+        light = half * (2.0f * Vector3::DotProduct(view, half)) - view;
+    }
+
+    float NdotL = Vector3::DotProduct(normal, light);
+    if (NdotL <= 0.0f || Vector3::DotProduct(geomNormal, light) <= 0.0f)
+    {
+        return false;
+    }
+
+    Vector3 half = (view + light).GetSafeNormal();
+    float NdotH  = MMath::Max(Vector3::DotProduct(normal, half), 0.0f);
+    float VdotH  = MMath::Max(Vector3::DotProduct(view, half), 1e-6f);
+
+    float denom  = NdotH * NdotH * (alpha2 - 1.0f) + 1.0f;
+    float D      = alpha2 / (PI * denom * denom);
+    float G1V    = 2.0f * NdotV / (NdotV + MMath::Sqrt(alpha2 + (1.0f - alpha2) * NdotV * NdotV));
+    float G1L    = 2.0f * NdotL / (NdotL + MMath::Sqrt(alpha2 + (1.0f - alpha2) * NdotL * NdotL));
+    float fresnel = MMath::Pow(1.0f - VdotH, 5.0f);
+
+    Vector3 F0 = Vector3(0.04f, 0.04f, 0.04f) * (1.0f - metallic) + baseColor * metallic;
+    Vector3 F  = F0 + (Vector3(1.0f, 1.0f, 1.0f) - F0) * fresnel;
+
+    Vector3 brdf = baseColor * ((1.0f - metallic) / PI) + F * (D * G1V * G1L / (4.0f * NdotL * NdotV));
+    float pdf    = diffuseRatio * NdotL / PI + (1.0f - diffuseRatio) * D * NdotH / (4.0f * VdotH);
+    if (pdf <= 0.0f)
+    {
+        return false;
+    }
+
+    throughput *= brdf * (NdotL / pdf);
+
+    // Russian roulette once the path carries little energy
+    if (depth >= 3)
+    {
+        float survive = MMath::Min(throughput.GetMax(), 0.95f);
+        if (RandomFloat(seed) >= survive)
+        {
+            return false;
+        }
+        throughput /= survive;
+    }
+
+    Vector3 position = ray.origin + ray.direction * hit.t;
+    float epsilon    = 1e-4f * MMath::Max(1.0f, position.GetAbsMax());
+
+    ray.origin    = position + geomNormal * epsilon;
+    ray.direction = light.GetSafeNormal();
+
+    return true;
+}
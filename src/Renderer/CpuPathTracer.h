@@ -0,0 +1,213 @@
+﻿#pragma once
+
+#include "Core/Scene.h"
+#include "Renderer/RayPacket.h"
+
+#include "Job/TaskThreadPool.h"
+
+#include "Math/Vector2.h"
+#include "Math/Vector3.h"
+#include "Math/Matrix4x4.h"
+
+#include <vector>
+
+// Ray traversal kernels of the cpu tracer
+enum class TraversalMode
+{
+    ESingle   = 0,  // one ray at a time
+    EPacket4  = 1,  // coherent packets, culled per node by the packet frustum
+    EPacket8  = 2,
+    EPacket16 = 3,
+    EStream   = 4,  // rays sorted by direction octant, then traced as 8 wide packets
+    EWide     = 5   // one ray at a time over the 4 or 8 wide nodes of the scene, ESingle when it has none
+};
+
+// Throughput of one traversal mode, in million rays per second
+struct TraversalStats
+{
+    double  primaryMrays = 0.0;
+    double  shadowMrays = 0.0;
+    double  secondaryMrays = 0.0;
+};
+
+// Reference path tracer on the cpu, it reads the tables GLScene builds for the gpu.
+// Every RenderSample adds one sample per pixel, tiles are rendered on the task pool.
+class CpuPathTracer
+{
+public:
+
+    CpuPathTracer();
+
+    ~CpuPathTracer();
+
+    FORCEINLINE void SetTaskPool(TaskThreadPool* pool)
+    {
+        m_TaskPool = pool;
+    }
+
+    void SetScene(GLScenePtr scene);
+
+    void Resize(int32 width, int32 height);
+
+    // Drops the accumulated samples
+    void Reset();
+
+    // Traces one sample per pixel and blends it into the framebuffer.
+    // Accumulation restarts by itself when the camera, the transforms or the scene changed.
+    void RenderSample();
+
+    // Average of all samples, RGBA float per pixel, top row first
+    FORCEINLINE const std::vector<float>& Framebuffer() const
+    {
+        return m_Framebuffer;
+    }
+
+    FORCEINLINE int32 GetWidth() const
+    {
+        return m_Width;
+    }
+
+    FORCEINLINE int32 GetHeight() const
+    {
+        return m_Height;
+    }
+
+    FORCEINLINE int32 GetNumSamples() const
+    {
+        return m_NumSamples;
+    }
+
+    // Camera paths per second of the last RenderSample
+    FORCEINLINE double GetSamplesPerSecond() const
+    {
+        return m_SamplesPerSecond;
+    }
+
+    // Traces one primary ray per pixel, a shadow ray and a diffuse bounce from every hit
+    // with mode and reports the rays per second of each kind. Call after a RenderSample.
+    TraversalStats MeasureTraversal(TraversalMode mode);
+
+private:
+
+    struct Ray
+    {
+        Vector3 origin;
+        Vector3 direction;
+    };
+
+    struct Hit
+    {
+        float   t;
+        float   u;
+        float   v;
+        int32   triangle;
+        int32   instance;
+        int32   material;
+    };
+
+    struct PathState
+    {
+        Vector3 throughput;
+        Vector3 radiance;
+        uint32  seed;
+        int32   pixel;
+    };
+
+    bool Intersect(const Ray& ray, Hit& hit) const;
+
+    void IntersectBLAS(int32 root, const Ray& ray, int32 instance, int32 material, Hit& hit) const;
+
+    // Closest of the triangles [first, first + count) of a leaf
+    void IntersectLeaf(int32 first, int32 count, const Ray& ray, const WatertightRay& watertight, Hit& hit) const;
+
+    // Copies the vertices of every triangle into blocks, in the order of the BLAS leaves
+    void BuildTriangleBlocks();
+
+    // Closest hits of count rays with the kernels of mode
+    void IntersectRays(TraversalMode mode, const Ray* rays, Hit* hits, int32 count) const;
+
+    // Sets occluded for the rays that hit anything closer than their tmax
+    void OccludedRays(TraversalMode mode, const Ray* rays, const float* tmax, uint8* occluded, int32 count) const;
+
+    // Closest hits, or the occluded flags with AnyHit, of count rays over the wide nodes
+    template <bool AnyHit>
+    void TraceWideRays(const Ray* rays, const float* tmax, Hit* hits, uint8* occluded, int32 count) const;
+
+    // Only hits closer than hit.t count, AnyHit stops at the first of them
+    template <int32 N, bool AnyHit>
+    void IntersectWide(const Ray& ray, Hit& hit) const;
+
+    // True if AnyHit found a hit
+    template <int32 N, bool AnyHit>
+    bool IntersectWideBLAS(int32 root, const Ray& ray, int32 instance, int32 material, Hit& hit) const;
+
+    template <int32 N, bool AnyHit>
+    void TraceRays(const Ray* rays, const float* tmax, Hit* hits, uint8* occluded, int32 count, bool sortByOctant) const;
+
+    template <int32 N, bool AnyHit>
+    void TracePacket(RayPacket<N>& packet, PacketHit<N>& hit) const;
+
+    template <int32 N, bool AnyHit>
+    void TracePacketBLAS(int32 root, RayPacket<N>& packet, int32 instance, int32 material, PacketHit<N>& hit) const;
+
+    // Shades the hit of a path and sets up its next ray, false once the path ended
+    bool ShadePath(PathState& path, Ray& ray, const Hit& hit, int32 depth) const;
+
+    // World space normal facing the ray
+    Vector3 GeometricNormal(const Ray& ray, const Hit& hit) const;
+
+    Vector3 SampleEnvironment(const Vector3& direction) const;
+
+    // Texel in [0, 1] of a scene texture, wraps like GL_REPEAT
+    bool FetchTexture(int32 texture, const Vector2& uv, float rgba[4]) const;
+
+    void RenderTile(int32 tile);
+
+    FORCEINLINE int32 NodeIndex(int32 packed) const
+    {
+        return UnpackTexelIndex(packed, m_Translator->nodeTexWidth, m_Translator->addressing);
+    }
+
+    FORCEINLINE int32 VertexIndex(int32 packed) const
+    {
+        return UnpackTexelIndex(packed, m_Scene->GetTriDataTexWidth(), m_Scene->GetIndexAddressing());
+    }
+
+public:
+
+    int32                           maxDepth = 8;
+    int32                           tileSize = 16;
+    // Kernels for camera rays and for the bounces after them
+    TraversalMode                   primaryTraversal = TraversalMode::EPacket8;
+    TraversalMode                   secondaryTraversal = TraversalMode::EPacket4;
+    // Radiance of rays leaving the scene when no hdr was loaded
+    Vector3                         backgroundColor = Vector3(1.0f, 1.0f, 1.0f);
+
+private:
+
+    static const int32 kTriangleLanes = 4;
+
+    GLScenePtr                      m_Scene;
+    std::shared_ptr<BvhTranslator>  m_Translator;
+    TaskThreadPool*                 m_TaskPool;
+
+    int32                           m_Width;
+    int32                           m_Height;
+    int32                           m_NumSamples;
+    double                          m_SamplesPerSecond;
+    std::vector<float>              m_Accumulation;
+    std::vector<float>              m_Framebuffer;
+
+    Matrix4x4                       m_CameraTransform;
+    Vector3                         m_CameraPosition;
+    Vector3                         m_CameraRight;
+    Vector3                         m_CameraUp;
+    Vector3                         m_CameraForward;
+
+    std::vector<Matrix4x4>          m_Transforms;
+    std::vector<Matrix4x4>          m_InvTransforms;
+
+    // Cache line aligned view of m_TriangleStorage
+    std::vector<uint8>              m_TriangleStorage;
+    const TriangleBlock<kTriangleLanes>* m_TriangleBlocks;
+};
@@ -64,7 +64,7 @@ void PBRRenderer::RenderOpaqueEntites()
 
         glBindVertexArray(vao);
         glBindBuffer(indexBuffer->Target(), indexBuffer->Object());
-        glDrawElements(GL_TRIANGLES, (GLsizei)(mesh->indices.size()), GL_UNSIGNED_INT, (void*)(0));
+        glDrawElements(GL_TRIANGLES, (GLsizei)(mesh->NumIndices()), GL_UNSIGNED_INT, (void*)(0));
         glBindVertexArray(0);
     }
 
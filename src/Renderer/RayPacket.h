@@ -0,0 +1,375 @@
+﻿#pragma once
+
+#include "Common/Common.h"
+
+#include "Math/Math.h"
+#include "Math/Vector3.h"
+
+#include "Renderer/TriangleBlock.h"
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+    #include <emmintrin.h>
+#endif
+
+// Rays of a packet in SoA layout, with vector intrinsics four lanes are tested at once.
+// Inactive lanes have tmax < 0 and fail every slab test.
+template <int32 N>
+struct RayPacket
+{
+    float   ox[N];
+    float   oy[N];
+    float   oz[N];
+    float   dx[N];
+    float   dy[N];
+    float   dz[N];
+    float   ix[N];
+    float   iy[N];
+    float   iz[N];
+    float   tmax[N];
+    // WatertightRay of every lane
+    int32   kx[N];
+    int32   ky[N];
+    int32   kz[N];
+    float   sx[N];
+    float   sy[N];
+    float   sz[N];
+    // True when the active lanes share kx, ky and kz
+    bool    sharedAxes;
+
+    FORCEINLINE void SetInactive(int32 lane)
+    {
+        ox[lane]   = oy[lane] = oz[lane] = 0.0f;
+        dx[lane]   = dy[lane] = dz[lane] = 1.0f;
+        tmax[lane] = -1.0f;
+    }
+
+    // Inverse directions and shears, call after the directions changed
+    FORCEINLINE void UpdateInverse()
+    {
+        int32 axes  = -1;
+        sharedAxes  = true;
+
+        for (int32 lane = 0; lane < N; ++lane)
+        {
+            ix[lane] = 1.0f / (MMath::Abs(dx[lane]) > 1e-20f ? dx[lane] : 1e-20f);
+            iy[lane] = 1.0f / (MMath::Abs(dy[lane]) > 1e-20f ? dy[lane] : 1e-20f);
+            iz[lane] = 1.0f / (MMath::Abs(dz[lane]) > 1e-20f ? dz[lane] : 1e-20f);
+
+            WatertightRay ray;
+            ray.Init(Vector3(dx[lane], dy[lane], dz[lane]));
+            kx[lane] = ray.kx;
+            ky[lane] = ray.ky;
+            kz[lane] = ray.kz;
+            sx[lane] = ray.sx;
+            sy[lane] = ray.sy;
+            sz[lane] = ray.sz;
+
+            if (tmax[lane] >= 0.0f)
+            {
+                int32 laneAxes = ray.kx * 9 + ray.ky * 3 + ray.kz;
+                sharedAxes = sharedAxes && (axes < 0 || axes == laneAxes);
+                axes = laneAxes;
+            }
+        }
+    }
+
+    FORCEINLINE WatertightRay GetWatertightRay(int32 lane) const
+    {
+        WatertightRay ray;
+        ray.kx = kx[lane];
+        ray.ky = ky[lane];
+        ray.kz = kz[lane];
+        ray.sx = sx[lane];
+        ray.sy = sy[lane];
+        ray.sz = sz[lane];
+        return ray;
+    }
+
+    // True when any lane overlaps [bmin, bmax] closer than its tmax
+    FORCEINLINE bool AnyLaneHits(const Vector3& bmin, const Vector3& bmax) const
+    {
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+        if (N % 4 == 0)
+        {
+            const __m128 zero  = _mm_setzero_ps();
+            const __m128 minX  = _mm_set1_ps(bmin.x);
+            const __m128 minY  = _mm_set1_ps(bmin.y);
+            const __m128 minZ  = _mm_set1_ps(bmin.z);
+            const __m128 maxX  = _mm_set1_ps(bmax.x);
+            const __m128 maxY  = _mm_set1_ps(bmax.y);
+            const __m128 maxZ  = _mm_set1_ps(bmax.z);
+
+            __m128 hits = zero;
+            for (int32 lane = 0; lane < N; lane += 4)
+            {
+                __m128 orgX = _mm_loadu_ps(ox + lane);
+                __m128 orgY = _mm_loadu_ps(oy + lane);
+                __m128 orgZ = _mm_loadu_ps(oz + lane);
+                __m128 invX = _mm_loadu_ps(ix + lane);
+                __m128 invY = _mm_loadu_ps(iy + lane);
+                __m128 invZ = _mm_loadu_ps(iz + lane);
+
+                __m128 x0 = _mm_mul_ps(_mm_sub_ps(minX, orgX), invX);
+                __m128 x1 = _mm_mul_ps(_mm_sub_ps(maxX, orgX), invX);
+                __m128 y0 = _mm_mul_ps(_mm_sub_ps(minY, orgY), invY);
+                __m128 y1 = _mm_mul_ps(_mm_sub_ps(maxY, orgY), invY);
+                __m128 z0 = _mm_mul_ps(_mm_sub_ps(minZ, orgZ), invZ);
+                __m128 z1 = _mm_mul_ps(_mm_sub_ps(maxZ, orgZ), invZ);
+
+                __m128 tnear = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), zero));
+                __m128 tfar  = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), _mm_loadu_ps(tmax + lane)));
+                hits = _mm_or_ps(hits, _mm_cmple_ps(tnear, tfar));
+            }
+            return _mm_movemask_ps(hits) != 0;
+        }
+#endif
+
+        bool any = false;
+        for (int32 lane = 0; lane < N; ++lane)
+        {
+            float x0 = (bmin.x - ox[lane]) * ix[lane];
+            float x1 = (bmax.x - ox[lane]) * ix[lane];
+            float y0 = (bmin.y - oy[lane]) * iy[lane];
+            float y1 = (bmax.y - oy[lane]) * iy[lane];
+            float z0 = (bmin.z - oz[lane]) * iz[lane];
+            float z1 = (bmax.z - oz[lane]) * iz[lane];
+
+            float tnear = MMath::Max(MMath::Max(MMath::Min(x0, x1), MMath::Min(y0, y1)), MMath::Max(MMath::Min(z0, z1), 0.0f));
+            float tfar  = MMath::Min(MMath::Min(MMath::Max(x0, x1), MMath::Max(y0, y1)), MMath::Min(MMath::Max(z0, z1), tmax[lane]));
+            any |= tnear <= tfar;
+        }
+        return any;
+    }
+
+    // WatertightTriangle of every lane against one triangle.
+    // Lanes with a hit closer than tmax get their t, u, v, returns the mask of those lanes.
+    FORCEINLINE uint32 IntersectTriangle(const Vector3& p0, const Vector3& p1, const Vector3& p2, float t[N], float u[N], float v[N]) const
+    {
+        uint32 mask = 0;
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+        if (N % 4 == 0)
+        {
+            const __m128i axisY = _mm_set1_epi32(1);
+            const __m128i axisZ = _mm_set1_epi32(2);
+
+            // Axes of the first active lane when they are shared, the others have tmax < 0
+            int32 first = 0;
+            while (first < N - 1 && tmax[first] < 0.0f)
+            {
+                ++first;
+            }
+
+            const float* origins[3] = { ox, oy, oz };
+            const int32 sharedX     = kx[first];
+            const int32 sharedY     = ky[first];
+            const int32 sharedZ     = kz[first];
+
+            for (int32 lane = 0; lane < N; lane += 4)
+            {
+                __m128 tt;
+                __m128 uu;
+                __m128 vv;
+                int32 needsDouble;
+                __m128 accept;
+
+                if (sharedAxes)
+                {
+                    const __m128 orgX = _mm_loadu_ps(origins[sharedX] + lane);
+                    const __m128 orgY = _mm_loadu_ps(origins[sharedY] + lane);
+                    const __m128 orgZ = _mm_loadu_ps(origins[sharedZ] + lane);
+
+                    accept = WatertightTriangle4(
+                        _mm_sub_ps(_mm_set1_ps(p0[sharedX]), orgX), _mm_sub_ps(_mm_set1_ps(p0[sharedY]), orgY), _mm_sub_ps(_mm_set1_ps(p0[sharedZ]), orgZ),
+                        _mm_sub_ps(_mm_set1_ps(p1[sharedX]), orgX), _mm_sub_ps(_mm_set1_ps(p1[sharedY]), orgY), _mm_sub_ps(_mm_set1_ps(p1[sharedZ]), orgZ),
+                        _mm_sub_ps(_mm_set1_ps(p2[sharedX]), orgX), _mm_sub_ps(_mm_set1_ps(p2[sharedY]), orgY), _mm_sub_ps(_mm_set1_ps(p2[sharedZ]), orgZ),
+                        _mm_loadu_ps(sx + lane), _mm_loadu_ps(sy + lane), _mm_loadu_ps(sz + lane),
+                        _mm_loadu_ps(tmax + lane), tt, uu, vv, needsDouble
+                    );
+                }
+                else
+                {
+                    const __m128 orgX = _mm_loadu_ps(ox + lane);
+                    const __m128 orgY = _mm_loadu_ps(oy + lane);
+                    const __m128 orgZ = _mm_loadu_ps(oz + lane);
+
+                    // The vertices relative to each origin, then their components along kx, ky, kz of each lane
+                    __m128 ax = _mm_sub_ps(_mm_set1_ps(p0.x), orgX);
+                    __m128 ay = _mm_sub_ps(_mm_set1_ps(p0.y), orgY);
+                    __m128 az = _mm_sub_ps(_mm_set1_ps(p0.z), orgZ);
+                    __m128 bx = _mm_sub_ps(_mm_set1_ps(p1.x), orgX);
+                    __m128 by = _mm_sub_ps(_mm_set1_ps(p1.y), orgY);
+                    __m128 bz = _mm_sub_ps(_mm_set1_ps(p1.z), orgZ);
+                    __m128 cx = _mm_sub_ps(_mm_set1_ps(p2.x), orgX);
+                    __m128 cy = _mm_sub_ps(_mm_set1_ps(p2.y), orgY);
+                    __m128 cz = _mm_sub_ps(_mm_set1_ps(p2.z), orgZ);
+
+                    const __m128i axisKx = _mm_loadu_si128((const __m128i*)(kx + lane));
+                    const __m128i axisKy = _mm_loadu_si128((const __m128i*)(ky + lane));
+                    const __m128i axisKz = _mm_loadu_si128((const __m128i*)(kz + lane));
+                    const __m128 kxY = _mm_castsi128_ps(_mm_cmpeq_epi32(axisKx, axisY));
+                    const __m128 kxZ = _mm_castsi128_ps(_mm_cmpeq_epi32(axisKx, axisZ));
+                    const __m128 kyY = _mm_castsi128_ps(_mm_cmpeq_epi32(axisKy, axisY));
+                    const __m128 kyZ = _mm_castsi128_ps(_mm_cmpeq_epi32(axisKy, axisZ));
+                    const __m128 kzY = _mm_castsi128_ps(_mm_cmpeq_epi32(axisKz, axisY));
+                    const __m128 kzZ = _mm_castsi128_ps(_mm_cmpeq_epi32(axisKz, axisZ));
+
+                    accept = WatertightTriangle4(
+                        SelectAxis(ax, ay, az, kxY, kxZ), SelectAxis(ax, ay, az, kyY, kyZ), SelectAxis(ax, ay, az, kzY, kzZ),
+                        SelectAxis(bx, by, bz, kxY, kxZ), SelectAxis(bx, by, bz, kyY, kyZ), SelectAxis(bx, by, bz, kzY, kzZ),
+                        SelectAxis(cx, cy, cz, kxY, kxZ), SelectAxis(cx, cy, cz, kyY, kyZ), SelectAxis(cx, cy, cz, kzY, kzZ),
+                        _mm_loadu_ps(sx + lane), _mm_loadu_ps(sy + lane), _mm_loadu_ps(sz + lane),
+                        _mm_loadu_ps(tmax + lane), tt, uu, vv, needsDouble
+                    );
+                }
+
+                uint32 accepted = (uint32)_mm_movemask_ps(accept);
+                if (accepted != 0)
+                {
+                    _mm_storeu_ps(t + lane, tt);
+                    _mm_storeu_ps(u + lane, uu);
+                    _mm_storeu_ps(v + lane, vv);
+                }
+
+                for (int32 i = 0; needsDouble != 0; ++i, needsDouble >>= 1)
+                {
+                    if ((needsDouble & 1) != 0 && tmax[lane + i] >= 0.0f)
+                    {
+                        bool hit = IntersectLane(lane + i, p0, p1, p2, t, u, v);
+                        accepted = hit ? (accepted | (1u << i)) : (accepted & ~(1u << i));
+                    }
+                }
+
+                mask |= accepted << lane;
+            }
+            return mask;
+        }
+#endif
+
+        for (int32 lane = 0; lane < N; ++lane)
+        {
+            mask |= (IntersectLane(lane, p0, p1, p2, t, u, v) ? 1u : 0u) << lane;
+        }
+        return mask;
+    }
+
+    FORCEINLINE bool IntersectLane(int32 lane, const Vector3& p0, const Vector3& p1, const Vector3& p2, float t[N], float u[N], float v[N]) const
+    {
+        const Vector3 origin(ox[lane], oy[lane], oz[lane]);
+        return WatertightTriangle(p0, p1, p2, origin, GetWatertightRay(lane), tmax[lane], t[lane], u[lane], v[lane]);
+    }
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+    // Per lane component of (x, y, z), isY and isZ are the lane masks of the axis
+    static FORCEINLINE __m128 SelectAxis(__m128 x, __m128 y, __m128 z, __m128 isY, __m128 isZ)
+    {
+        __m128 xy = _mm_or_ps(_mm_and_ps(isY, y), _mm_andnot_ps(isY, x));
+        return _mm_or_ps(_mm_and_ps(isZ, z), _mm_andnot_ps(isZ, xy));
+    }
+#endif
+
+    FORCEINLINE bool AnyLaneActive() const
+    {
+        bool any = false;
+        for (int32 lane = 0; lane < N; ++lane)
+        {
+            any |= tmax[lane] >= 0.0f;
+        }
+        return any;
+    }
+};
+
+// Closest hit per lane, triangle is -1 for lanes that hit nothing
+template <int32 N>
+struct PacketHit
+{
+    float   u[N];
+    float   v[N];
+    int32   triangle[N];
+    int32   instance[N];
+    int32   material[N];
+};
+
+// Interval bounds of the origins and inverse directions of the active lanes.
+// Rejects a node for the whole packet with one test when no ray can reach it,
+// only valid when every axis has one direction sign across the packet.
+struct PacketFrustum
+{
+    float   omin[3];
+    float   omax[3];
+    float   imin[3];
+    float   imax[3];
+    float   tmax;
+    bool    valid;
+
+    template <int32 N>
+    FORCEINLINE void Init(const RayPacket<N>& packet)
+    {
+        valid = N > 1;
+        tmax  = -1.0f;
+
+        const float* origins[3]  = { packet.ox, packet.oy, packet.oz };
+        const float* inverses[3] = { packet.ix, packet.iy, packet.iz };
+
+        for (int32 axis = 0; axis < 3; ++axis)
+        {
+            omin[axis] = imin[axis] = +MAX_FLT;
+            omax[axis] = imax[axis] = -MAX_FLT;
+        }
+
+        for (int32 lane = 0; lane < N; ++lane)
+        {
+            if (packet.tmax[lane] < 0.0f)
+            {
+                continue;
+            }
+
+            tmax = MMath::Max(tmax, packet.tmax[lane]);
+            for (int32 axis = 0; axis < 3; ++axis)
+            {
+                omin[axis] = MMath::Min(omin[axis], origins[axis][lane]);
+                omax[axis] = MMath::Max(omax[axis], origins[axis][lane]);
+                imin[axis] = MMath::Min(imin[axis], inverses[axis][lane]);
+                imax[axis] = MMath::Max(imax[axis], inverses[axis][lane]);
+            }
+        }
+
+        for (int32 axis = 0; axis < 3; ++axis)
+        {
+            valid = valid && (imin[axis] > 0.0f || imax[axis] < 0.0f);
+        }
+    }
+
+    // True when the box is missed by every ray of the packet
+    FORCEINLINE bool Cull(const Vector3& bmin, const Vector3& bmax) const
+    {
+        if (!valid)
+        {
+            return false;
+        }
+
+        float tnear = 0.0f;
+        float tfar  = tmax;
+        for (int32 axis = 0; axis < 3; ++axis)
+        {
+            // Near and far planes are the same for all lanes, (plane - origin) * inverse as intervals
+            bool positive = imin[axis] > 0.0f;
+            float nearPlane = positive ? bmin[axis] : bmax[axis];
+            float farPlane  = positive ? bmax[axis] : bmin[axis];
+
+            float n0 = (nearPlane - omax[axis]) * imin[axis];
+            float n1 = (nearPlane - omax[axis]) * imax[axis];
+            float n2 = (nearPlane - omin[axis]) * imin[axis];
+            float n3 = (nearPlane - omin[axis]) * imax[axis];
+            float f0 = (farPlane - omax[axis]) * imin[axis];
+            float f1 = (farPlane - omax[axis]) * imax[axis];
+            float f2 = (farPlane - omin[axis]) * imin[axis];
+            float f3 = (farPlane - omin[axis]) * imax[axis];
+
+            tnear = MMath::Max(tnear, MMath::Min(MMath::Min(n0, n1), MMath::Min(n2, n3)));
+            tfar  = MMath::Min(tfar, MMath::Max(MMath::Max(f0, f1), MMath::Max(f2, f3)));
+        }
+
+        return tnear > tfar;
+    }
+};
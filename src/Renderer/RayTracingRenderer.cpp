@@ -2,13 +2,22 @@
 
 #include "Core/Scene.h"
 
+#include "Misc/JobManager.h"
+
 void RayTracingRenderer::Init()
 {
-
+    m_PathTracer = new CpuPathTracer();
+    m_PathTracer->SetTaskPool(JobManager::TaskPool());
 }
 
 void RayTracingRenderer::Destroy()
 {
+    if (m_PathTracer)
+    {
+        delete m_PathTracer;
+        m_PathTracer = nullptr;
+    }
+
     m_Scene = nullptr;
 }
 
@@ -19,10 +28,26 @@ void RayTracingRenderer::Update()
 
 void RayTracingRenderer::Render()
 {
-
+    if (m_PathTracer)
+    {
+        m_PathTracer->RenderSample();
+    }
 }
 
 void RayTracingRenderer::SetScene(GLScenePtr scene)
 {
     m_Scene = scene;
+
+    if (m_PathTracer)
+    {
+        m_PathTracer->SetScene(scene);
+    }
+}
+
+void RayTracingRenderer::SetSize(int32 width, int32 height)
+{
+    if (m_PathTracer)
+    {
+        m_PathTracer->Resize(width, height);
+    }
 }
@@ -1,6 +1,7 @@
 ﻿#pragma once
 
 #include "Base/Renderer.h"
+#include "Renderer/CpuPathTracer.h"
 
 #include <vector>
 
@@ -10,6 +11,7 @@ public:
 
     RayTracingRenderer()
         : m_Scene(nullptr)
+        , m_PathTracer(nullptr)
     {
 
     }
@@ -34,7 +36,16 @@ public:
 
     void SetScene(GLScenePtr scene) override;
 
+    // Size of the framebuffer the cpu backend renders
+    void SetSize(int32 width, int32 height);
+
+    FORCEINLINE CpuPathTracer* PathTracer() const
+    {
+        return m_PathTracer;
+    }
+
 private:
 
-    GLScenePtr  m_Scene;
+    GLScenePtr      m_Scene;
+    CpuPathTracer*  m_PathTracer;
 };
@@ -0,0 +1,261 @@
+﻿#pragma once
+
+#include "Common/Common.h"
+
+#include "Math/Math.h"
+#include "Math/Vector3.h"
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+    #include <emmintrin.h>
+#endif
+
+// Per ray setup of the watertight test (Woop, Benthin, Wald 2013).
+// kz is the dominant axis of the direction, the shear maps the ray onto +z.
+struct WatertightRay
+{
+    int32   kx;
+    int32   ky;
+    int32   kz;
+    float   sx;
+    float   sy;
+    float   sz;
+
+    FORCEINLINE void Init(const Vector3& direction)
+    {
+        const Vector3 absDir = direction.GetAbs();
+        kz = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+
+        // Keeps the winding of the triangles
+        if (direction[kz] < 0.0f)
+        {
+            int32 swap = kx;
+            kx = ky;
+            ky = swap;
+        }
+
+        sx = direction[kx] / direction[kz];
+        sy = direction[ky] / direction[kz];
+        sz = 1.0f / direction[kz];
+    }
+};
+
+// Watertight ray triangle test, both faces. The vertices are moved to the ray origin and sheared
+// so the ray runs along +z, then the 2D edge functions decide. Each sheared vertex only depends on
+// the vertex itself, so triangles sharing an edge or a vertex agree on the side a ray passes, and
+// rays through shared edges and vertices hit at least one of the triangles.
+// u and v weight p1 and p2, t is the distance along the unnormalized direction.
+static FORCEINLINE bool WatertightTriangle(const Vector3& p0, const Vector3& p1, const Vector3& p2, const Vector3& origin, const WatertightRay& ray, float tmax, float& t, float& u, float& v)
+{
+    const Vector3 a = p0 - origin;
+    const Vector3 b = p1 - origin;
+    const Vector3 c = p2 - origin;
+
+    const float ax = a[ray.kx] - ray.sx * a[ray.kz];
+    const float ay = a[ray.ky] - ray.sy * a[ray.kz];
+    const float bx = b[ray.kx] - ray.sx * b[ray.kz];
+    const float by = b[ray.ky] - ray.sy * b[ray.kz];
+    const float cx = c[ray.kx] - ray.sx * c[ray.kz];
+    const float cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+    // Each edge function is the weight of the opposite vertex scaled by det
+    float e0 = cx * by - cy * bx;
+    float e1 = ax * cy - ay * cx;
+    float e2 = bx * ay - by * ax;
+
+    // Exactly on an edge, float products can not tell the side, decide in double
+    if (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)
+    {
+        e0 = (float)((double)cx * (double)by - (double)cy * (double)bx);
+        e1 = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+        e2 = (float)((double)bx * (double)ay - (double)by * (double)ax);
+    }
+
+    if ((e0 < 0.0f || e1 < 0.0f || e2 < 0.0f) && (e0 > 0.0f || e1 > 0.0f || e2 > 0.0f))
+    {
+        return false;
+    }
+
+    const float det = e0 + e1 + e2;
+    if (det == 0.0f)
+    {
+        return false;
+    }
+
+    // Range test without dividing, t is only computed for hits
+    const float tScaled = e0 * (ray.sz * a[ray.kz]) + e1 * (ray.sz * b[ray.kz]) + e2 * (ray.sz * c[ray.kz]);
+    const float tSigned = det < 0.0f ? -tScaled : tScaled;
+    if (!(tSigned > 0.0f && tSigned < tmax * MMath::Abs(det)))
+    {
+        return false;
+    }
+
+    const float invDet = 1.0f / det;
+    t = tScaled * invDet;
+    u = e1 * invDet;
+    v = e2 * invDet;
+    return true;
+}
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+
+// Four lanes of WatertightTriangle on the ray relative, unsheared vertex components along kx, ky, kz.
+// Bit identical to it, except that lanes with a zero edge function are returned in needsDouble
+// and have to be redone with WatertightTriangle. Returns the accept mask, t, u, v are only
+// written when a lane was accepted.
+static FORCEINLINE __m128 WatertightTriangle4(
+    __m128 akx, __m128 aky, __m128 akz, __m128 bkx, __m128 bky, __m128 bkz, __m128 ckx, __m128 cky, __m128 ckz,
+    __m128 sx, __m128 sy, __m128 sz, __m128 tmax, __m128& t, __m128& u, __m128& v, int32& needsDouble)
+{
+    const __m128 zero = _mm_setzero_ps();
+
+    __m128 ax = _mm_sub_ps(akx, _mm_mul_ps(sx, akz));
+    __m128 ay = _mm_sub_ps(aky, _mm_mul_ps(sy, akz));
+    __m128 bx = _mm_sub_ps(bkx, _mm_mul_ps(sx, bkz));
+    __m128 by = _mm_sub_ps(bky, _mm_mul_ps(sy, bkz));
+    __m128 cx = _mm_sub_ps(ckx, _mm_mul_ps(sx, ckz));
+    __m128 cy = _mm_sub_ps(cky, _mm_mul_ps(sy, ckz));
+
+    __m128 e0 = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    __m128 e1 = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    __m128 e2 = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+    needsDouble = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(e0, zero), _mm_cmpeq_ps(e1, zero)), _mm_cmpeq_ps(e2, zero)));
+
+    __m128 anyNegative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+    __m128 anyPositive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+    __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+
+    // Most tests end here, no lane is inside all three edges
+    __m128 accept = _mm_andnot_ps(_mm_and_ps(anyNegative, anyPositive), _mm_cmpneq_ps(det, zero));
+    if (_mm_movemask_ps(accept) == 0)
+    {
+        return accept;
+    }
+
+    const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+    __m128 tScaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, _mm_mul_ps(sz, akz)), _mm_mul_ps(e1, _mm_mul_ps(sz, bkz))), _mm_mul_ps(e2, _mm_mul_ps(sz, ckz)));
+    __m128 tSigned = _mm_xor_ps(tScaled, _mm_and_ps(det, signMask));
+    accept = _mm_and_ps(accept, _mm_cmpgt_ps(tSigned, zero));
+    accept = _mm_and_ps(accept, _mm_cmplt_ps(tSigned, _mm_mul_ps(tmax, _mm_andnot_ps(signMask, det))));
+    if (_mm_movemask_ps(accept) == 0)
+    {
+        return accept;
+    }
+
+    __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    t = _mm_mul_ps(tScaled, invDet);
+    u = _mm_mul_ps(e1, invDet);
+    v = _mm_mul_ps(e2, invDet);
+    return accept;
+}
+
+#endif
+
+// N triangles in SoA layout, one cache line aligned block per N consecutive triangles of the
+// BLAS leaf order. A leaf reads its vertices from one or two blocks instead of going through
+// the index and position tables. Lanes past the last triangle are degenerate and never hit.
+template <int32 N>
+struct alignas(64) TriangleBlock
+{
+    // Vertex i, axis k is p[i * 3 + k][lane]
+    float   p[9][N];
+
+    FORCEINLINE void Set(int32 lane, const Vector3& p0, const Vector3& p1, const Vector3& p2)
+    {
+        for (int32 k = 0; k < 3; ++k)
+        {
+            p[0 + k][lane] = p0[k];
+            p[3 + k][lane] = p1[k];
+            p[6 + k][lane] = p2[k];
+        }
+    }
+
+    FORCEINLINE Vector3 P0(int32 lane) const
+    {
+        return Vector3(p[0][lane], p[1][lane], p[2][lane]);
+    }
+
+    FORCEINLINE Vector3 P1(int32 lane) const
+    {
+        return Vector3(p[3][lane], p[4][lane], p[5][lane]);
+    }
+
+    FORCEINLINE Vector3 P2(int32 lane) const
+    {
+        return Vector3(p[6][lane], p[7][lane], p[8][lane]);
+    }
+
+    // One ray against the lanes of laneMask, lanes with a hit closer than tmax get their t, u, v.
+    // Returns the mask of those lanes.
+    FORCEINLINE uint32 Intersect(const Vector3& origin, const WatertightRay& ray, float tmax, uint32 laneMask, float t[N], float u[N], float v[N]) const
+    {
+        uint32 mask = 0;
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS
+        if (N % 4 == 0)
+        {
+            const __m128 okx  = _mm_set1_ps(origin[ray.kx]);
+            const __m128 oky  = _mm_set1_ps(origin[ray.ky]);
+            const __m128 okz  = _mm_set1_ps(origin[ray.kz]);
+            const __m128 sx   = _mm_set1_ps(ray.sx);
+            const __m128 sy   = _mm_set1_ps(ray.sy);
+            const __m128 sz   = _mm_set1_ps(ray.sz);
+            const __m128 tfar = _mm_set1_ps(tmax);
+
+            for (int32 lane = 0; lane < N; lane += 4)
+            {
+                if (((laneMask >> lane) & 0xF) == 0)
+                {
+                    continue;
+                }
+
+                __m128 tt;
+                __m128 uu;
+                __m128 vv;
+                int32 needsDouble;
+                __m128 accept = WatertightTriangle4(
+                    _mm_sub_ps(_mm_load_ps(p[0 + ray.kx] + lane), okx), _mm_sub_ps(_mm_load_ps(p[0 + ray.ky] + lane), oky), _mm_sub_ps(_mm_load_ps(p[0 + ray.kz] + lane), okz),
+                    _mm_sub_ps(_mm_load_ps(p[3 + ray.kx] + lane), okx), _mm_sub_ps(_mm_load_ps(p[3 + ray.ky] + lane), oky), _mm_sub_ps(_mm_load_ps(p[3 + ray.kz] + lane), okz),
+                    _mm_sub_ps(_mm_load_ps(p[6 + ray.kx] + lane), okx), _mm_sub_ps(_mm_load_ps(p[6 + ray.ky] + lane), oky), _mm_sub_ps(_mm_load_ps(p[6 + ray.kz] + lane), okz),
+                    sx, sy, sz, tfar, tt, uu, vv, needsDouble
+                );
+
+                uint32 accepted = (uint32)_mm_movemask_ps(accept);
+                if (accepted != 0)
+                {
+                    _mm_storeu_ps(t + lane, tt);
+                    _mm_storeu_ps(u + lane, uu);
+                    _mm_storeu_ps(v + lane, vv);
+                }
+
+                needsDouble &= laneMask >> lane;
+                for (int32 i = 0; needsDouble != 0; ++i, needsDouble >>= 1)
+                {
+                    if ((needsDouble & 1) != 0)
+                    {
+                        bool hit = WatertightTriangle(P0(lane + i), P1(lane + i), P2(lane + i), origin, ray, tmax, t[lane + i], u[lane + i], v[lane + i]);
+                        accepted = hit ? (accepted | (1u << i)) : (accepted & ~(1u << i));
+                    }
+                }
+
+                mask |= accepted << lane;
+            }
+            return mask & laneMask;
+        }
+#endif
+
+        for (int32 lane = 0; lane < N; ++lane)
+        {
+            if ((laneMask & (1u << lane)) == 0)
+            {
+                continue;
+            }
+
+            bool accept = WatertightTriangle(P0(lane), P1(lane), P2(lane), origin, ray, tmax, t[lane], u[lane], v[lane]);
+            mask |= (accept ? 1u : 0u) << lane;
+        }
+        return mask;
+    }
+};
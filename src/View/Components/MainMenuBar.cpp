@@ -102,6 +102,10 @@ void MainMenuBar::Draw()
                 std::string fileName = WindowsMisc::OpenFile("GLTF Files\0*.gltf;*.glb\0\0");
                 if (!fileName.empty())
                 {
+                    // Loads still running belong to the scene that is replaced now
+                    JobManager::CancelJobs([](const ThreadTask* job) -> bool {
+                        return dynamic_cast<const LoadGLTFJob*>(job) != nullptr;
+                    });
                     m_Scene->Free();
 
                     LoadGLTFJob* gltfJob = new LoadGLTFJob(fileName);
@@ -109,7 +113,11 @@ void MainMenuBar::Draw()
                     {
                         m_Scene->AddScene(gltfJob->GetScene());
                         m_Scene->GetCamera()->SetAspect(m_UIView->Window()->FrameWidth() * 1.0f / m_UIView->Window()->FrameHeight());
-                        m_Scene->Build();
+                        if (!m_Scene->Build())
+                        {
+                            LOGE("GLTF scene can't be built : %s\n", fileName.c_str());
+                            return;
+                        }
                         LOGI("GLTF load complete : %s\n", fileName.c_str());
                     };
                     
@@ -128,7 +136,11 @@ void MainMenuBar::Draw()
                     {
                         m_Scene->AddScene(gltfJob->GetScene());
                         m_Scene->GetCamera()->SetAspect(m_UIView->Window()->FrameWidth() * 1.0f / m_UIView->Window()->FrameHeight());
-                        m_Scene->Build();
+                        if (!m_Scene->Build())
+                        {
+                            LOGE("GLTF scene can't be built : %s\n", fileName.c_str());
+                            return;
+                        }
                         LOGI("GLTF load complete : %s\n", fileName.c_str());
                     };
 
@@ -149,7 +161,7 @@ void MainMenuBar::Draw()
                         LOGI("HDR load complete : %s\n", fileName.c_str());
                     };
 
-                    JobManager::AddJob(hdrJob);
+                    JobManager::AddJob(hdrJob, TaskPriority::Background);
                     LOGI("Loading HDR file : %s\n", fileName.c_str());
                 }
             }
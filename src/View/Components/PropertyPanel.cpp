@@ -295,7 +295,7 @@ void PropertyPanel::DrawPropertyMesh(const MeshArray& meshes)
         {
             // vertex count
             {
-                int32 vertexCount = (int32)(meshes[0]->positions.size());
+                int32 vertexCount = meshes[0]->NumVertices();
                 ImGui::PropertyLabel("Vertex Count");
                 ImGui::SameLine();
                 ImGui::DragInt("##MeshVertexCount", &vertexCount, 0.0f, vertexCount, vertexCount);
@@ -303,7 +303,7 @@ void PropertyPanel::DrawPropertyMesh(const MeshArray& meshes)
 
             // triangles
             {
-                int32 faceCount = (int32)(meshes[0]->indices.size()) / 3;
+                int32 faceCount = meshes[0]->NumIndices() / 3;
                 ImGui::PropertyLabel("Face Count");
                 ImGui::SameLine();
                 ImGui::DragInt("##MeshFaceCount", &faceCount, 0.0f, faceCount, faceCount);
@@ -316,8 +316,8 @@ void PropertyPanel::DrawPropertyMesh(const MeshArray& meshes)
             int32 subMeshCount     = (int32)(meshes.size());
             for (int32 subMesh = 0; subMesh < subMeshCount; ++subMesh)
             {
-                int32 vertexCount = (int32)(meshes[subMesh]->positions.size());
-                int32 indexCount  = (int32)(meshes[subMesh]->indices.size());
+                int32 vertexCount = meshes[subMesh]->NumVertices();
+                int32 indexCount  = meshes[subMesh]->NumIndices();
                 totalVertexCount += vertexCount;
                 totalFaceCount   += indexCount / 3;
             }